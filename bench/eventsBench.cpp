@@ -0,0 +1,87 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include "events.h"
+
+// Прежняя реализация диспетчера: линейный поиск и передача события по значению
+class legacyDispatcher
+{
+public:
+    std::vector<eventHandler> handlers;
+    long findHandler(std::string eventType)
+    {
+        for(size_t i = 0; i < handlers.size(); i++)
+        {
+            if(handlers[i].type == eventType)
+            {
+                return static_cast<long>(i);
+            }
+        }
+        return -1;
+    }
+    void registerHandler(std::string type, void(*function)(void*))
+    {
+        handlers.push_back(eventHandler(type, function));
+    }
+    void dispatchEvent(event Event)
+    {
+        long pos = findHandler(Event.type);
+        if (pos != -1)
+        {
+            handlers[pos].handler(Event.data);
+        }
+    }
+};
+
+static void countHandler(void* data)
+{
+    ++*static_cast<unsigned long long*>(data);
+}
+
+template <typename Dispatch>
+double measure(size_t dispatches, Dispatch dispatch)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < dispatches; i++)
+    {
+        dispatch(i);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / dispatches;
+}
+
+int main()
+{
+    const size_t dispatches = 2000000;
+    std::cout << "types,legacy_ns_per_dispatch,indexed_ns_per_dispatch,indexed_by_id_ns_per_dispatch" << std::endl;
+    for (size_t typeCount : {10, 100, 300, 1000})
+    {
+        legacyDispatcher legacy;
+        eventDispatcher indexed;
+        std::vector<event> events;
+        std::vector<eventTypeId> ids;
+        for (size_t i = 0; i < typeCount; i++)
+        {
+            std::string type = "benchEventType" + std::to_string(i);
+            legacy.registerHandler(type, countHandler);
+            indexed.registerHandler(type, countHandler);
+        }
+        unsigned long long counter = 0;
+        for (size_t i = 0; i < typeCount; i++)
+        {
+            events.emplace_back("benchEventType" + std::to_string(i), &counter);
+            ids.push_back(events.back().typeId);
+        }
+        double legacyNs = measure(dispatches, [&](size_t i) { legacy.dispatchEvent(events[i % typeCount]); });
+        double indexedNs = measure(dispatches, [&](size_t i) { indexed.dispatchEvent(events[i % typeCount]); });
+        double byIdNs = measure(dispatches, [&](size_t i) { indexed.dispatchEvent(ids[i % typeCount], &counter); });
+        if (counter != dispatches * 3)
+        {
+            std::cerr << "dispatch count mismatch" << std::endl;
+            return 1;
+        }
+        std::cout << typeCount << "," << legacyNs << "," << indexedNs << "," << byIdNs << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,288 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sqlite3.h>
+#include "events.h"
+#include "SQL/BaseSQL.h"
+#include "SQL/TgSQL.h"
+
+// Воспроизводимые замеры Log, getUserPrivilege, addUser и dispatchEvent.
+// Запуск: sql_bench [--format csv|json] [--out file] [--quick]
+
+static const unsigned BENCH_SEED = 20240601;
+static const char* WAL_DATABASE = "sqlBench.db";
+
+struct benchResult
+{
+    std::string name;
+    std::string kind;    // micro - одна операция, macro - смешанный запрос
+    std::string storage; // memory, wal или none
+    size_t users;
+    size_t ops;
+    size_t batch;        // операций в одном замере, задержка делится на batch
+    double opsPerSec;
+    double p50Us;
+    double p99Us;
+    double meanUs;
+};
+
+struct benchConfig
+{
+    bool json = false;
+    bool quick = false;
+    std::string out;
+};
+
+// Каждая выборка - время batch операций подряд; перцентили считаются по задержке одной операции
+template <typename Operation>
+benchResult measure(const std::string& name, const std::string& kind, const std::string& storage, size_t users,
+    size_t samples, size_t batch, Operation operation)
+{
+    std::vector<double> latencies;
+    latencies.reserve(samples);
+    size_t op = 0;
+    auto started = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < samples; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t j = 0; j < batch; j++)
+        {
+            operation(op++);
+        }
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+        latencies.push_back(elapsed.count() / batch);
+    }
+    std::chrono::duration<double> total = std::chrono::steady_clock::now() - started;
+    std::sort(latencies.begin(), latencies.end());
+    double sum = 0;
+    for (double latency : latencies)
+    {
+        sum += latency;
+    }
+    benchResult result;
+    result.name = name;
+    result.kind = kind;
+    result.storage = storage;
+    result.users = users;
+    result.ops = samples * batch;
+    result.batch = batch;
+    result.opsPerSec = result.ops / total.count();
+    result.p50Us = latencies[latencies.size() / 2];
+    result.p99Us = latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)];
+    result.meanUs = sum / latencies.size();
+    return result;
+}
+
+static void removeDatabase(const std::string& name)
+{
+    for (const char* suffix : {"", "-wal", "-shm"})
+    {
+        std::remove((name + suffix).c_str());
+    }
+}
+
+static sqlite3* openDatabase(const std::string& storage)
+{
+    sqlite3* db = nullptr;
+    std::string name = storage == "wal" ? WAL_DATABASE : ":memory:";
+    if (storage == "wal")
+    {
+        removeDatabase(name);
+    }
+    connectionOptions options; // WAL и synchronous = NORMAL по умолчанию
+    if (initBaseSQL(&db, name, options, nullptr) != 0 || initTgSQL(db, nullptr) != 0)
+    {
+        std::cerr << "cannot open the " << storage << " database" << std::endl;
+        return nullptr;
+    }
+    sqlite3_exec(db, "INSERT INTO users(userID, privilege) VALUES('benchAdmin', 200)", nullptr, nullptr, nullptr);
+    return db;
+}
+
+static bool fillUsers(sqlite3* db, size_t count)
+{
+    std::vector<userRecord> users;
+    users.reserve(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        users.push_back({"user" + std::to_string(i), static_cast<int>(i % 100)});
+    }
+    return importUsers(db, users, "benchAdmin", nullptr, nullptr) == static_cast<int>(count);
+}
+
+static void countHandler(void* data)
+{
+    ++*static_cast<unsigned long long*>(data);
+}
+
+static void runStorage(const std::string& storage, size_t users, const benchConfig& config, std::vector<benchResult>* results)
+{
+    sqlite3* db = openDatabase(storage);
+    if (db == nullptr || !fillUsers(db, users))
+    {
+        std::cerr << "cannot fill " << users << " users" << std::endl;
+        closeBaseSQL(db, nullptr);
+        return;
+    }
+    std::mt19937 random(BENCH_SEED);
+    std::uniform_int_distribution<size_t> anyUser(0, users - 1);
+    size_t scale = config.quick ? 1 : 5;
+    std::vector<std::string> lookups;
+    for (size_t i = 0; i < 4000 * scale; i++)
+    {
+        lookups.push_back("user" + std::to_string(anyUser(random)));
+    }
+
+    results->push_back(measure("Log", "micro", storage, users, 4000 * scale, 1, [&](size_t i) {
+        Log(db, "benchEvent", "USER:" + lookups[i % lookups.size()], "benchAdmin", i % 10 ? "OK" : "FAIL:bench", nullptr);
+    }));
+    results->push_back(measure("getUserPrivilege", "micro", storage, users, 4000 * scale, 1, [&](size_t i) {
+        getUserPrivilege(db, lookups[i % lookups.size()], nullptr);
+    }));
+    results->push_back(measure("addUser", "micro", storage, users, 400 * scale, 1, [&](size_t i) {
+        addUser(db, "added" + std::to_string(i), "benchAdmin", static_cast<int>(i % 100), nullptr);
+    }));
+
+    // Запрос бота: проверка прав, событие, запись в лог; каждый двадцатый меняет права
+    eventDispatcher dispatcher;
+    unsigned long long handled = 0;
+    dispatcher.registerHandler("benchRequest", countHandler);
+    event request("benchRequest", &handled);
+    results->push_back(measure("request", "macro", storage, users, 2000 * scale, 1, [&](size_t i) {
+        const std::string& user = lookups[i % lookups.size()];
+        if (getUserPrivilege(db, user, nullptr) >= 0)
+        {
+            dispatcher.dispatchEvent(request);
+        }
+        if (i % 20 == 0)
+        {
+            modUser(db, user, "benchAdmin", static_cast<int>(i % 100), nullptr);
+        }
+        else
+        {
+            Log(db, "benchRequest", "USER:" + user, user, "OK", nullptr);
+        }
+    }));
+    closeBaseSQL(db, nullptr);
+    if (storage == "wal")
+    {
+        removeDatabase(WAL_DATABASE);
+    }
+}
+
+static void runEvents(const benchConfig& config, std::vector<benchResult>* results)
+{
+    const size_t typeCount = 100;
+    eventDispatcher dispatcher;
+    unsigned long long counter = 0;
+    std::vector<event> events;
+    for (size_t i = 0; i < typeCount; i++)
+    {
+        dispatcher.registerHandler("benchEventType" + std::to_string(i), countHandler);
+    }
+    for (size_t i = 0; i < typeCount; i++)
+    {
+        events.emplace_back("benchEventType" + std::to_string(i), &counter);
+    }
+    size_t samples = config.quick ? 2000 : 20000; // 100 типов событий, пользователей нет
+    // Одна диспетчеризация быстрее вызова часов, поэтому замер идет пачками по 64
+    results->push_back(measure("dispatchEvent", "micro", "none", 0, samples, 64, [&](size_t i) {
+        dispatcher.dispatchEvent(events[i % typeCount]);
+    }));
+    results->push_back(measure("dispatchEventById", "micro", "none", 0, samples, 64, [&](size_t i) {
+        dispatcher.dispatchEvent(events[i % typeCount].typeId, &counter);
+    }));
+}
+
+static void writeCsv(std::ostream& out, const std::vector<benchResult>& results)
+{
+    out << "name,kind,storage,users,ops,batch,ops_per_sec,p50_us,p99_us,mean_us" << std::endl;
+    for (const benchResult& r : results)
+    {
+        out << r.name << "," << r.kind << "," << r.storage << "," << r.users << "," << r.ops << "," << r.batch << ","
+            << r.opsPerSec << "," << r.p50Us << "," << r.p99Us << "," << r.meanUs << std::endl;
+    }
+}
+
+static void writeJson(std::ostream& out, const std::vector<benchResult>& results)
+{
+    out << "{\"seed\": " << BENCH_SEED << ", \"sqlite\": \"" << sqlite3_libversion() << "\", \"results\": [" << std::endl;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const benchResult& r = results[i];
+        out << "  {\"name\": \"" << r.name << "\", \"kind\": \"" << r.kind << "\", \"storage\": \"" << r.storage
+            << "\", \"users\": " << r.users << ", \"ops\": " << r.ops << ", \"batch\": " << r.batch
+            << ", \"ops_per_sec\": " << r.opsPerSec << ", \"p50_us\": " << r.p50Us << ", \"p99_us\": " << r.p99Us
+            << ", \"mean_us\": " << r.meanUs << "}" << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    out << "]}" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    benchConfig config;
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+        {
+            config.json = std::strcmp(argv[++i], "json") == 0;
+        }
+        else if (std::strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+        {
+            config.out = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--quick") == 0)
+        {
+            config.quick = true;
+        }
+        else
+        {
+            std::cerr << "usage: sql_bench [--format csv|json] [--out file] [--quick]" << std::endl;
+            return 2;
+        }
+    }
+    std::vector<size_t> userCounts = config.quick ? std::vector<size_t>{100, 1000} : std::vector<size_t>{100, 10000, 100000};
+    std::vector<benchResult> results;
+    for (const char* storage : {"memory", "wal"})
+    {
+        for (size_t users : userCounts)
+        {
+            runStorage(storage, users, config, &results);
+        }
+    }
+    runEvents(config, &results);
+
+    std::ostringstream text;
+    text << std::fixed;
+    text.precision(3);
+    if (config.json)
+    {
+        writeJson(text, results);
+    }
+    else
+    {
+        writeCsv(text, results);
+    }
+    if (config.out.empty())
+    {
+        std::cout << text.str();
+    }
+    else
+    {
+        std::ofstream file(config.out);
+        file << text.str();
+        if (!file)
+        {
+            std::cerr << "cannot write " << config.out << std::endl;
+            return 1;
+        }
+    }
+    return results.size() == userCounts.size() * 2 * 4 + 2 ? 0 : 1;
+}
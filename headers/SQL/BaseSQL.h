@@ -7,35 +7,161 @@
 #include <ctime>
 #include <vector>
 #include <initializer_list>
+#include <memory>
+#include "SQL/SqlResult.h"
 
 using namespace std;
 
+enum columnConstraint {
+	COLUMN_NONE = 0,
+	COLUMN_PRIMARY_KEY = 1,
+	COLUMN_UNIQUE = 2,
+	COLUMN_NOT_NULL = 4
+};
+
 struct column {
 	string name;
 	string type;
-	column(const string& name, const string& type);
+	int constraints; //columnConstraint flags
+	column(const string& name, const string& type, int constraints = COLUMN_NONE);
+};
+
+struct tableIndex {
+	string name;
+	vector<string> columns;
+	bool unique;
+	tableIndex(const string& name, const initializer_list<string>& cols, bool unique = false);
 };
 
 struct tableInfo {
 	string name;
 	vector<column> columns;
+	vector<tableIndex> indexes;
 	tableInfo(const string& tableName, const initializer_list<column>& cols);
 	tableInfo(const string& tableName, const vector<column>& cols);
+	tableInfo(const string& tableName, const initializer_list<column>& cols, const initializer_list<tableIndex>& idxs);
+};
+
+enum journalMode {
+	JOURNAL_DEFAULT, //leave the mode the database file already has
+	JOURNAL_DELETE,
+	JOURNAL_TRUNCATE,
+	JOURNAL_PERSIST,
+	JOURNAL_MEMORY,
+	JOURNAL_WAL,
+	JOURNAL_OFF
 };
 
-void textLog(sqlite3 *db, string eventName, string object, string subject, string eventStatus);
+enum synchronousLevel {
+	SYNCHRONOUS_OFF = 0,
+	SYNCHRONOUS_NORMAL = 1, //with WAL loses at most the last commits on power failure, never corrupts
+	SYNCHRONOUS_FULL = 2,
+	SYNCHRONOUS_EXTRA = 3
+};
+
+enum tempStoreMode {
+	TEMP_STORE_DEFAULT = 0,
+	TEMP_STORE_FILE = 1,
+	TEMP_STORE_MEMORY = 2
+};
+
+struct connectionOptions {
+	journalMode journal = JOURNAL_WAL;
+	synchronousLevel synchronous = SYNCHRONOUS_NORMAL;
+	int cacheSizeKiB = 16384;             //page cache per connection
+	long long mmapSize = 268435456;       //bytes of the file read through mmap, 0 - disabled
+	int busyTimeoutMs = 5000;             //how long to wait for a lock before SQLITE_BUSY
+	tempStoreMode tempStore = TEMP_STORE_MEMORY;
+	int busyRetries = 3;                  //immediateTransaction retries after SQLITE_BUSY...
+	int busyRetryBackoffMs = 10;          //...waiting this long, doubled on every retry
+};
+
+// Fallback record for events the Log table could not take, see TextLog.h
+void textLog(sqlite3 *db, const string& eventName, const string& object, const string& subject, const string& eventStatus);
+
+int Log(sqlite3 *db, string eventName, string object, string subject, string eventStatus, resultSink err);
+
+int checkTable(sqlite3 *db, string tableName, vector<column> columns, resultSink err);
 
-int Log(sqlite3 *db, string eventName, string object, string subject, string eventStatus, string *errString);
+// 0 - matches, 1 - does not exist, >1 - mismatch. Tables that matched before are
+// validated by their fingerprint in schemaRegistry, see SchemaRegistry.h
+int checkTable(sqlite3 *db, tableInfo table, resultSink err);
 
-int checkTable(sqlite3 *db, string tableName, vector<column> columns, string *errString);
+// checkTable for many tables with one query when none of them has changed.
+// results[i] is checkTable of tables[i]; returns the number of mismatched tables.
+int checkTables(sqlite3 *db, const vector<tableInfo>& tables, vector<int> *results, resultSink err);
 
-int checkTable(sqlite3 *db, tableInfo table, string *errString);
+int initBaseSQL(sqlite3 **db, string databaseName, resultSink err);
+
+int initBaseSQL(sqlite3 **db, string databaseName, const connectionOptions& options, resultSink err);
+
+// Applies options to an open connection; initBaseSQL remembers them for the connections it opens later
+int configureConnection(sqlite3 *db, const connectionOptions& options, resultSink err);
+
+shared_ptr<const connectionOptions> getConnectionOptions(sqlite3 *db);
+
+int createTable(sqlite3 *db, string tableName, vector<column> columns, resultSink err);
+
+int createTable(sqlite3 *db, tableInfo table, resultSink err);
+
+int dropTable(sqlite3 *db, string tableName, resultSink err);
+
+int createIndexes(sqlite3 *db, tableInfo table, resultSink err);
+
+// Recreates the table with the current definition and fills it from source (a SELECT)
+int rebuildTable(sqlite3 *db, tableInfo table, string source, resultSink err);
+
+struct migrationProgress {
+	string table;
+	long long copiedRows;
+	long long lastRowid;              //rows of the old table up to this rowid are copied
+	long long maxRowid;               //last rowid of the old table, lastRowid / maxRowid estimates the progress
+	unsigned long long batches;
+};
+
+struct migrationOptions {
+	size_t batchRows = 10000;         //rows copied per transaction, other connections write between batches
+	// Called after every batch; returning false pauses the migration and the next migrateTable resumes it
+	bool (*progress)(const migrationProgress& progress, void *context) = nullptr;
+	void *context = nullptr;
+};
+
+// Brings an existing table to the definition without losing rows. New plain columns at
+// the end are added with ALTER TABLE; any other change copies the rows by name (removed
+// columns are dropped, new ones are NULL) in batches into a new table that replaces the
+// old one. Triggers record the rows of already copied batches that are changed meanwhile,
+// and the last transaction copies just those again together with the appended rows.
+// 0 - done, 1 - paused by the progress callback.
+int migrateTable(sqlite3 *db, tableInfo table, const migrationOptions& options, resultSink err);
+
+// Write transaction that takes the database lock with BEGIN IMMEDIATE, so nothing it
+// has read can be changed by another connection before it writes. SQLITE_BUSY is retried
+// as the connection's options say. Inside an open transaction it becomes a savepoint
+// of that transaction. Rolled back on destruction unless committed.
+class immediateTransaction {
+	sqlite3 *db;
+	bool nested;
+public:
+	immediateTransaction();
+	~immediateTransaction();
+	immediateTransaction(const immediateTransaction&) = delete;
+	immediateTransaction& operator=(const immediateTransaction&) = delete;
+	// -1 still busy after the retries, -2 SQLite error, -3 already begun
+	int begin(sqlite3 *db, resultSink err);
+	// -1 still busy after the retries, -2 SQLite error, -3 not begun, -4 rolled back by SQLite;
+	// the transaction is rolled back when the commit fails
+	int commit(resultSink err);
+	void rollback();
+	bool active() const;
+};
 
-int initBaseSQL(sqlite3 **db, string databaseName, string *errString);
+int closeBaseSQL(sqlite3 *db, resultSink err);
 
-int createTable(sqlite3 *db, string tableName, vector<column> columns, string *errString);
+// Objects attached to a connection by optional modules, released by closeBaseSQL
+void setConnectionData(sqlite3 *db, const string& key, shared_ptr<void> data);
 
-int createTable(sqlite3 *db, tableInfo table, string *errString);
+shared_ptr<void> getConnectionData(sqlite3 *db, const string& key);
 
-int dropTable(sqlite3 *db, string tableName, string *errString);
+// Changes whenever connection data is set or released, so a module may keep what it looked up until then
+unsigned connectionDataVersion();
 #endif
@@ -0,0 +1,44 @@
+#if !defined COMPACT_LOG_H
+#define COMPACT_LOG_H
+
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include <utility>
+#include "SQL/SqlResult.h"
+
+using namespace std;
+
+struct compactLogOptions {
+	bool compressDetails = false;     //zlib for long status details; readers then need logDetail(), see below
+};
+
+// Strings added to the dictionary inside a transaction, remembered once it commits
+typedef vector<pair<string, long long>> compactLogStrings;
+
+// Converts the Log table of db into the compact format and moves its records there:
+// LogCompact keeps eventName, subject and the status up to its first ':' as ids into
+// the LogStrings dictionary, the rest of the status as a detail, and the time in
+// microseconds. Log becomes a view with the old columns, so readers do not change.
+// 1 - Log is already compact. Cannot be combined with log partitions.
+int enableCompactLog(sqlite3 *db, const compactLogOptions& options, resultSink err);
+
+// Used by initBaseSQL and Log(): 1 - Log of db is compact and db now writes it that way,
+// 0 - Log is a table, <0 - error
+int attachCompactLog(sqlite3 *db, resultSink err);
+
+bool hasCompactLog(sqlite3 *db);
+
+// Used by Log() and the log writer: writes a record of db through conn.
+// 1 - db is not compact, 0 - written, <0 - error. Dictionary strings added inside
+// a transaction go to learned (when given) instead of the cache.
+int compactLogInsert(sqlite3 *db, sqlite3 *conn, const string& eventName, const string& object, const string& subject,
+	const string& eventStatus, long long whenMicros, compactLogStrings *learned);
+
+// Called after the transaction that added learned has committed
+void compactLogRemember(sqlite3 *db, const compactLogStrings& learned);
+
+// SQL function logDetail(detail) used by the view of a compact Log with compressed details;
+// configureConnection registers it on every connection it sets up
+int registerCompactLogFunctions(sqlite3 *conn);
+#endif
@@ -0,0 +1,76 @@
+#if !defined CONNECTION_POOL_H
+#define CONNECTION_POOL_H
+
+#include <sqlite3.h>
+#include <string>
+#include <memory>
+#include "SQL/BaseSQL.h"
+#include "SQL/LogWriter.h"
+
+using namespace std;
+
+struct connectionPool;
+
+enum connectionKind {
+	CONNECTION_READ,  //read-only connection, WAL lets readers run next to the writer; its Log() records are queued
+	CONNECTION_WRITE
+};
+
+struct connectionPoolOptions {
+	size_t readers = 4;
+	size_t writers = 1;             //SQLite has one writer at a time, more only queue on the database lock
+	int checkoutTimeoutMs = 5000;   //-1 waits forever
+	connectionOptions connection;
+	logWriterOptions readerLog;     //the log writer that takes the Log() records of the readers
+};
+
+struct connectionKindStats {
+	size_t size;
+	size_t inUse;
+	size_t peakInUse;
+	unsigned long long checkouts;
+	unsigned long long waited;      //checkouts that found no idle connection
+	unsigned long long timeouts;
+	double waitMs;                  //total time spent waiting for a connection
+	double maxWaitMs;
+	double busyMs;                  //total time connections spent checked out
+};
+
+struct connectionPoolStats {
+	connectionKindStats readers;
+	connectionKindStats writers;
+	double uptimeMs;                //utilization of a kind is busyMs / (uptimeMs * size)
+};
+
+// Connection borrowed from a pool, returned to it on destruction. Every pooled
+// connection has its own statement cache like any other sqlite3 handle.
+class pooledConnection {
+	shared_ptr<connectionPool> pool;
+	sqlite3 *db;
+	connectionKind kind;
+	double checkedOutAt;
+public:
+	pooledConnection();
+	~pooledConnection();
+	pooledConnection(const pooledConnection&) = delete;
+	pooledConnection& operator=(const pooledConnection&) = delete;
+	operator sqlite3*() const;
+	sqlite3 *get() const;
+	void release();
+	friend int checkoutConnection(const shared_ptr<connectionPool>& pool, connectionKind kind, pooledConnection *conn, resultSink err);
+};
+
+// Opens the writers (the first one through initBaseSQL) and then the readers, which share
+// one log writer: flushLogWriter on a reader waits until its Log records are in Log.
+// The pool needs a database file: every ":memory:" connection is a database of its own.
+int openConnectionPool(string databaseName, const connectionPoolOptions& options, shared_ptr<connectionPool> *pool, resultSink err);
+
+// Reader checkouts fall back to writers when the pool has no readers
+int checkoutConnection(const shared_ptr<connectionPool>& pool, connectionKind kind, pooledConnection *conn, resultSink err);
+
+// Closes idle connections now and checked out ones when they are returned; the log
+// writer of the readers stops with the last of them
+int closeConnectionPool(const shared_ptr<connectionPool>& pool, resultSink err);
+
+connectionPoolStats getConnectionPoolStats(const shared_ptr<connectionPool>& pool);
+#endif
@@ -0,0 +1,93 @@
+#if !defined DEVICE_STORE_H
+#define DEVICE_STORE_H
+
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include "SQL/SqlResult.h"
+#include "events.h"
+
+using namespace std;
+
+struct deviceCapability {
+	string name;        //"power", "brightness", ...
+	string valueType;   //bool, int, real or text; setDeviceState checks values against it
+};
+
+struct deviceInfo {
+	string deviceID;
+	string name;
+	string kind;        //"lamp", "thermostat", ...
+	vector<deviceCapability> capabilities;
+};
+
+// Published through the dispatcher of deviceStateOptions for every value that changes
+struct deviceStateChanged {
+	string deviceID;
+	string capability;
+	string value;
+	string previous;     //empty if the capability had no value
+	long long changedAtMicros;
+	unsigned long long version;   //grows with every change of the capability; events of concurrent
+	                              //changes may arrive out of order, the highest version is the current value
+};
+
+struct deviceStateOptions {
+	eventDispatcher *events = nullptr;   //must outlive the store; nullptr - no events
+	bool asyncEvents = false;            //publishAsync to the dispatcher's workers instead of publish in the caller's thread
+	size_t batchSize = 256;              //write back as soon as this many values are dirty
+	unsigned flushIntervalMs = 200;      //...or when this much time has passed
+};
+
+struct deviceStateStats {
+	unsigned long long updates;          //values changed by setDeviceState
+	unsigned long long unchanged;        //setDeviceState with the current value
+	unsigned long long written;
+	unsigned long long failed;           //write-backs that failed, the values stay dirty
+	unsigned long long batches;
+	unsigned long long eventsDropped;    //publishAsync found the queue full
+	size_t values;
+	size_t dirty;
+};
+
+// Creates the devices, capabilities and deviceState tables. 1 - a table in an unexpected way
+int initDeviceSQL(sqlite3 *db, resultSink err);
+
+// -1 - empty deviceID or a capability without a name, repeated or with an unknown type,
+// -2 - the deviceID is already in use
+int addDevice(sqlite3 *db, const deviceInfo& device, resultSink err);
+
+// Removes the device with its capabilities and state. -1 - not found
+int removeDevice(sqlite3 *db, const string& deviceID, resultSink err);
+
+// 0 - found, -1 - not found, -2 - SQLite error
+int lookupDevice(sqlite3 *db, const string& deviceID, deviceInfo *device, resultSink err);
+
+// Loads every capability of db with its last value into memory. From then on the state of
+// db is read and written there and a background thread writes changed values back in
+// batches on a connection of its own. An in-memory database has no second connection:
+// its values are written back on db by flushDeviceState and stopDeviceState only.
+// One store per database file: another connection to the file joins the running store and
+// its options are ignored. The store stops after the last write-back once no connection
+// uses it any more, through stopDeviceState or closeBaseSQL. -2 - db already uses a store
+int startDeviceState(sqlite3 *db, const deviceStateOptions& options, resultSink err);
+
+// Detaches db from the store, which keeps running while another connection uses it.
+// -1 - the store is not running, -2 - it stopped with values that are not written back
+int stopDeviceState(sqlite3 *db, resultSink err);
+
+// Waits until every value changed so far is written back. -1 - the store is not running,
+// -2 - a write-back failed (or the store stopped first), the values stay dirty for the next one,
+// -3 - in-memory database with a transaction open, nothing is written
+int flushDeviceState(sqlite3 *db);
+
+// 0 - changed, 1 - the value was already current (no write, no event), -1 - the store is
+// not running, -2 - unknown device or capability, -3 - the value does not fit its type
+int setDeviceState(sqlite3 *db, const string& deviceID, const string& capability, const string& value, resultSink err);
+
+// Served from memory when the store is running, otherwise read from deviceState.
+// 0 - found, 1 - the capability has no value yet, -2 - unknown device or capability
+int getDeviceState(sqlite3 *db, const string& deviceID, const string& capability, string *value, resultSink err);
+
+deviceStateStats getDeviceStateStats(sqlite3 *db);
+#endif
@@ -0,0 +1,88 @@
+#if !defined LOG_PARTITIONS_H
+#define LOG_PARTITIONS_H
+
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include <ctime>
+#include <climits>
+#include "SQL/SqlResult.h"
+
+using namespace std;
+
+struct logPartitionOptions {
+	unsigned retentionDays = 30;      //partitions older than this are dropped when a new day starts, 0 - keep all
+	unsigned vacuumIntervalMs = 0;    //background PRAGMA incremental_vacuum, 0 - off; file databases only
+	unsigned vacuumPages = 256;       //freed pages returned to the file system per step
+};
+
+struct logPartitionStats {
+	unsigned long long created;
+	unsigned long long dropped;
+	unsigned long long vacuumSteps;
+	unsigned long long vacuumedPages;
+};
+
+struct logEntry {
+	long long rowid;
+	string eventName;
+	string object;
+	string subject;
+	string eventStatus;
+	long long eventDateTime; //seconds since the epoch
+};
+
+// Empty strings match anything; the time range is inclusive. subject and object
+// filters use the LogBySubject / LogByObject indexes, the others LogByTime.
+struct logQuery {
+	string eventName;
+	string object;
+	string subject;
+	string eventStatus;
+	long long from = 0;
+	long long to = LLONG_MAX;
+	size_t limit = 0;                 //records per page, 0 - all of them
+};
+
+// Position after the last record returned, the next page starts there.
+// Pages stay stable while records are written and partitions are dropped.
+struct logCursor {
+	string table;                     //empty - the first page
+	long long eventDateTime = 0;
+	long long rowid = 0;
+};
+
+// Routes the Log() records of db (and of its log writer) into one table per local day,
+// Log_YYYYMMDD, created on first use. Retention drops whole tables instead of deleting
+// rows. With vacuumIntervalMs a thread on its own connection gives the freed pages back,
+// converting the file to auto_vacuum = INCREMENTAL with one VACUUM if needed.
+// The Log table itself is left as it is and is read by queryLog before the partitions.
+int enableLogPartitions(sqlite3 *db, const logPartitionOptions& options, resultSink err);
+
+int disableLogPartitions(sqlite3 *db, resultSink err);
+
+bool hasLogPartitions(sqlite3 *db);
+
+logPartitionStats getLogPartitionStats(sqlite3 *db);
+
+// Used by Log() and the log writer: table for a record of db written at when through conn.
+// 1 - db is not partitioned (the table is "Log"), 0 - partition, <0 - it cannot be created
+int logPartitionTable(sqlite3 *db, sqlite3 *conn, time_t when, string *table);
+
+// Used when an insert into a known partition fails: it may have been rolled back or dropped
+void forgetLogPartition(sqlite3 *db, const string& table);
+
+// Drops the partitions of days before now - retentionDays, returns how many
+int applyLogRetention(sqlite3 *db, time_t now, resultSink err);
+
+// Log and the partitions of the local days from..to, oldest first
+int listLogPartitions(sqlite3 *db, time_t from, time_t to, vector<string> *tables, resultSink err);
+
+// Streams one page of the records matching query, ordered by time, wherever they are stored,
+// and moves cursor past them. callback returns false to stop early. Returns the number of
+// records passed to callback; fewer than query.limit means there are no more pages.
+int queryLog(sqlite3 *db, const logQuery& query, logCursor *cursor, bool (*callback)(const logEntry& entry, void *context), void *context, resultSink err);
+
+// All the records logged from..to
+int queryLog(sqlite3 *db, time_t from, time_t to, bool (*callback)(const logEntry& entry, void *context), void *context, resultSink err);
+#endif
@@ -0,0 +1,51 @@
+#if !defined LOG_WRITER_H
+#define LOG_WRITER_H
+
+#include <sqlite3.h>
+#include <string>
+#include <ctime>
+#include "SQL/SqlResult.h"
+
+using namespace std;
+
+enum logOverflowPolicy {
+	LOG_OVERFLOW_BLOCK, //Log() waits until the writer frees space in the queue
+	LOG_OVERFLOW_DROP   //Log() drops the event and returns an error
+};
+
+struct logWriterOptions {
+	size_t queueCapacity = 4096;
+	size_t batchSize = 256;          //flush as soon as this many events are queued
+	unsigned flushIntervalMs = 100;  //...or when this much time has passed
+	logOverflowPolicy overflow = LOG_OVERFLOW_BLOCK;
+};
+
+struct logWriterStats {
+	unsigned long long queued;
+	unsigned long long written;
+	unsigned long long dropped;
+	unsigned long long failed;
+	unsigned long long batches;
+};
+
+// Moves Log() inserts for db to a background thread that commits them in batches on a
+// connection of its own. -4 - db has no file (in-memory), its Log() stays synchronous
+int startLogWriter(sqlite3 *db, const logWriterOptions& options, resultSink err);
+
+// Stops the writer once no other connection shares it. While others do, the batches take
+// the Log configuration (partitions, compact Log) of one of them instead of db's.
+int stopLogWriter(sqlite3 *db, resultSink err);
+
+// Sends the Log() records of db to the writer of source, e.g. for read-only connections.
+// -1 - source has no writer, -2 - db already has one
+int shareLogWriter(sqlite3 *db, sqlite3 *source, resultSink err);
+
+int flushLogWriter(sqlite3 *db);
+
+bool hasLogWriter(sqlite3 *db);
+
+logWriterStats getLogWriterStats(sqlite3 *db);
+
+// Used by Log(): 1 - no writer for db, 0 - queued, -1 - dropped (queue is full)
+int queueLog(sqlite3 *db, string&& eventName, string&& object, string&& subject, string&& eventStatus, long long whenMicros);
+#endif
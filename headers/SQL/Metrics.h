@@ -0,0 +1,100 @@
+#if !defined SQL_METRICS_H
+#define SQL_METRICS_H
+
+#include <string>
+#include <vector>
+#include "SQL/SqlResult.h"
+
+using namespace std;
+
+// Where the time of a public BaseSQL/TgSQL call goes. TOTAL is the whole call,
+// the others are the time spent in prepareCached, sqlite3_bind_*, sqlite3_step
+// (transaction BEGIN/COMMIT included) and Log() while the call was running.
+enum sqlPhase {
+	SQL_PHASE_TOTAL = 0,
+	SQL_PHASE_PREPARE,
+	SQL_PHASE_BIND,
+	SQL_PHASE_STEP,
+	SQL_PHASE_LOG,
+	SQL_PHASE_COUNT
+};
+
+#define SQL_METRICS_MAX_FUNCTIONS 64
+// Bucket 0 is below 256 ns, bucket i is below 2^(i + 8) ns, the last one has no bound
+#define SQL_METRIC_BUCKETS 24
+
+struct sqlPhaseMetrics {
+	unsigned long long count = 0;
+	unsigned long long totalNs = 0;
+	unsigned long long buckets[SQL_METRIC_BUCKETS] = {};   //not cumulative
+};
+
+struct sqlFunctionMetrics {
+	string name;
+	sqlPhaseMetrics phases[SQL_PHASE_COUNT];
+};
+
+struct sqlMetricsSnapshot {
+	vector<sqlFunctionMetrics> functions;   //in the order of the first call
+	size_t threads = 0;                     //threads that have called an instrumented function and are still running
+};
+
+const char *sqlPhaseName(int phase);
+
+// Upper bound of a bucket in seconds, infinity for the last one
+double sqlMetricBucketSeconds(int bucket);
+
+// Sums the counters of all threads, finished ones included. -1 - metrics are compiled out.
+int getSqlMetrics(sqlMetricsSnapshot *snapshot);
+
+// Counters are written by their own thread without locking, calls running during
+// the reset may survive it
+void resetSqlMetrics();
+
+// Prometheus text format: histogram sql_function_seconds{function, phase} and gauge sql_metrics_threads
+string formatSqlMetrics(const sqlMetricsSnapshot& snapshot);
+
+// Writes formatSqlMetrics to fileName through a temporary file, so a scraper never reads half of it
+int dumpSqlMetrics(const string& fileName, resultSink err);
+
+#if defined SQL_METRICS
+#include <chrono>
+
+// Returns the id of a function name, -1 when SQL_METRICS_MAX_FUNCTIONS are taken
+int registerSqlFunction(const char *name);
+
+// Times one call of a function and makes it the current one of the thread. Calls nest:
+// the phases are added to every function on the stack, so modUser includes its lookupUsers.
+class sqlMetricScope {
+public:
+	explicit sqlMetricScope(int id);
+	~sqlMetricScope();
+	sqlMetricScope(const sqlMetricScope&) = delete;
+	sqlMetricScope& operator=(const sqlMetricScope&) = delete;
+private:
+	int id;
+	chrono::steady_clock::time_point start;
+};
+
+// Times a phase of the current functions; does nothing outside of them and inside
+// another phase (prepare and step of Log() are its log time)
+class sqlPhaseTimer {
+public:
+	explicit sqlPhaseTimer(sqlPhase phase);
+	~sqlPhaseTimer();
+	sqlPhaseTimer(const sqlPhaseTimer&) = delete;
+	sqlPhaseTimer& operator=(const sqlPhaseTimer&) = delete;
+private:
+	int phase;
+	chrono::steady_clock::time_point start;
+};
+
+#define SQL_METRIC_SCOPE(name) static const int sqlMetricId = registerSqlFunction(name); sqlMetricScope sqlMetricScopeGuard(sqlMetricId)
+#define SQL_METRIC_PHASE(phase) sqlPhaseTimer sqlMetricPhaseGuard(phase)
+#define SQL_TIMED(phase, call) (sqlPhaseTimer(phase), (call))
+#else
+#define SQL_METRIC_SCOPE(name)
+#define SQL_METRIC_PHASE(phase)
+#define SQL_TIMED(phase, call) (call)
+#endif
+#endif
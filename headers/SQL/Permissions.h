@@ -0,0 +1,94 @@
+#if !defined PERMISSIONS_H
+#define PERMISSIONS_H
+
+#include <sqlite3.h>
+#include <string>
+#include <initializer_list>
+#include "SQL/SqlResult.h"
+
+using namespace std;
+
+// Actions guarded by a minimum users.privilege. The built-in ones are checked by
+// TgSQL, applications add their own with registerAction.
+enum userAction {
+	ACTION_ADD_USER = 0,
+	ACTION_MOD_USER,
+	ACTION_DELETE_USER,
+	ACTION_IMPORT_USERS,
+	ACTION_EXPORT_USERS,
+	ACTION_BUILTIN_COUNT
+};
+
+#define MAX_USER_ACTIONS 64
+#define DEFAULT_MIN_PRIVILEGE 100
+
+// Bit i is set when the user may do action i
+typedef unsigned long long permissionSet;
+
+inline permissionSet permissionMask(initializer_list<int> actions)
+{
+	permissionSet mask = 0;
+	for(int action : actions)
+		mask |= permissionSet(1) << action;
+	return mask;
+}
+
+inline bool hasPermissions(permissionSet granted, permissionSet required)
+{
+	return (granted & required) == required;
+}
+
+// Id of a named action, the same one for the same name; -1 when MAX_USER_ACTIONS are taken.
+// Register actions before initTgSQL so that their rows of the permissions table are loaded.
+int registerAction(const string& name, int defaultMinPrivilege);
+
+int findAction(const string& name);
+
+string actionName(int action);
+
+// Thresholds fixed at build time (-DADD_USER_MIN_PRIVILEGE=100 and so on) do not read
+// the permissions table and compile to a plain comparison in hasPermission<>
+template <int action> struct fixedThreshold { static const int value = -1; };
+#if defined ADD_USER_MIN_PRIVILEGE
+template <> struct fixedThreshold<ACTION_ADD_USER> { static const int value = ADD_USER_MIN_PRIVILEGE; };
+#endif
+#if defined MOD_USER_MIN_PRIVILEGE
+template <> struct fixedThreshold<ACTION_MOD_USER> { static const int value = MOD_USER_MIN_PRIVILEGE; };
+#endif
+#if defined DELETE_USER_MIN_PRIVILEGE
+template <> struct fixedThreshold<ACTION_DELETE_USER> { static const int value = DELETE_USER_MIN_PRIVILEGE; };
+#endif
+#if defined IMPORT_USERS_MIN_PRIVILEGE
+template <> struct fixedThreshold<ACTION_IMPORT_USERS> { static const int value = IMPORT_USERS_MIN_PRIVILEGE; };
+#endif
+#if defined EXPORT_USERS_MIN_PRIVILEGE
+template <> struct fixedThreshold<ACTION_EXPORT_USERS> { static const int value = EXPORT_USERS_MIN_PRIVILEGE; };
+#endif
+
+// Creates the permissions table (action, minPrivilege) with a row for every registered
+// action that has none, then reads the thresholds. Connections to the same database
+// file share them. Called by initTgSQL; without it the defaults are used.
+int loadPermissions(sqlite3 *db, resultSink err);
+
+// Writes the threshold of an action and reloads the thresholds, which drops the
+// permission sets cached for the old ones. -1 - the threshold is fixed at build time.
+int setActionThreshold(sqlite3 *db, int action, int minPrivilege, resultSink err);
+
+// Minimum privilege of an action: fixed, loaded or the default of registerAction; -1 - unknown action
+int actionThreshold(sqlite3 *db, int action);
+
+template <int action> bool hasPermission(sqlite3 *db, int privilege)
+{
+	if constexpr(fixedThreshold<action>::value >= 0)
+		return privilege >= fixedThreshold<action>::value;
+	else
+		return privilege >= actionThreshold(db, action);
+}
+
+// All actions a privilege allows, one comparison per registered action
+permissionSet evaluatePermissions(sqlite3 *db, int privilege);
+
+// Permission set of a user, cached next to the privilege in the privilege cache.
+// 0 - OK, -1 - not found, -2 - duplicates, -4 - lookupUser failed
+int getUserPermissions(sqlite3 *db, const string& userID, permissionSet *permissions, resultSink err);
+#endif
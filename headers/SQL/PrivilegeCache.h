@@ -0,0 +1,49 @@
+#if !defined PRIVILEGE_CACHE_H
+#define PRIVILEGE_CACHE_H
+
+#include <sqlite3.h>
+#include <string>
+#include "SQL/SqlResult.h"
+
+using namespace std;
+
+struct privilegeCacheStats {
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+	size_t size;
+	size_t capacity;
+};
+
+// LRU cache userID -> privilege in front of getUserPrivilege. Connections to the
+// same database file share one cache, so TgSQL writes on any of them keep it valid.
+int enablePrivilegeCache(sqlite3 *db, size_t capacity, resultSink err);
+
+void disablePrivilegeCache(sqlite3 *db);
+
+privilegeCacheStats getPrivilegeCacheStats(sqlite3 *db);
+
+// Used by TgSQL: 1 - found, 0 - not cached (or the cache is disabled)
+int cachedPrivilege(sqlite3 *db, const string& userID, int *privilege);
+
+// Changes with every storePrivilege and invalidation, which follow committed mutations. A
+// privilege read from the table is stored only if the generation taken before the read is
+// still current, so a read that raced a mutation cannot bring back the old value.
+unsigned long long privilegeCacheGeneration(sqlite3 *db);
+
+// A committed privilege of a mutation
+void storePrivilege(sqlite3 *db, const string& userID, int privilege);
+
+// A privilege read from the table after privilegeCacheGeneration returned generation
+void storeReadPrivilege(sqlite3 *db, const string& userID, int privilege, unsigned long long generation);
+
+// Used by Permissions: 1 - found with a permission set evaluated for the thresholds of version
+int cachedPermissions(sqlite3 *db, const string& userID, unsigned version, unsigned long long *permissions);
+
+// Stores the privilege read after generation with its permission set; storePrivilege drops the set when the privilege changes
+void storePermissions(sqlite3 *db, const string& userID, int privilege, unsigned version, unsigned long long permissions, unsigned long long generation);
+
+void invalidatePrivilege(sqlite3 *db, const string& userID);
+
+void invalidateAllPrivileges(sqlite3 *db);
+#endif
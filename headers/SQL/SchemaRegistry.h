@@ -0,0 +1,24 @@
+#if !defined SCHEMA_REGISTRY_H
+#define SCHEMA_REGISTRY_H
+
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include "SQL/BaseSQL.h"
+
+using namespace std;
+
+// Table schemas that passed checkTable are remembered in the schemaRegistry table:
+// a hash of the tableInfo definition and a hash of the table's CREATE statements from
+// sqlite_master. While both still match, checkTable skips the column-by-column diff.
+// Changes made around BaseSQL (ALTER TABLE, CREATE INDEX, ...) change the second hash.
+
+unsigned long long tableFingerprint(const tableInfo& table);
+
+// Used by checkTable: one query for all tables, valid[i] - tables[i] is registered and unchanged.
+// Databases without the registry have nothing registered.
+int matchSchemaFingerprints(sqlite3 *db, const vector<tableInfo>& tables, vector<bool> *valid);
+
+// Used by checkTable after a successful diff, fails quietly on read-only connections
+int storeSchemaFingerprint(sqlite3 *db, const tableInfo& table);
+#endif
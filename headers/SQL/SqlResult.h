@@ -0,0 +1,71 @@
+#if !defined SQL_RESULT_H
+#define SQL_RESULT_H
+
+#include <sqlite3.h>
+#include <string>
+#include <cstddef>
+
+using namespace std;
+
+enum sqlResultCode {
+	RESULT_OK = 0,
+	RESULT_WARN,             //succeeded, detail tells what was unusual
+	RESULT_SQLITE_ERROR,     //a SQLite call failed, see sqliteRc
+	RESULT_CALL_FAILED,      //a nested BaseSQL/TgSQL call failed, see callee and calleeRc
+	RESULT_NOT_FOUND,
+	RESULT_DUPLICATE,        //a few users with the same userID
+	RESULT_NO_PRIVILEGE,
+	RESULT_CONFLICT,         //already exists, already running...
+	RESULT_SCHEMA_MISMATCH,  //table differs from its tableInfo
+	RESULT_INVALID_ARGUMENT,
+	RESULT_UNAVAILABLE,      //queue is full, pool is closed...
+	RESULT_TIMEOUT
+};
+
+// Outcome of the last BaseSQL/TgSQL call. Filling it never allocates: where, detail
+// and callee point to string literals, variable text is truncated into text.
+struct sqlResult {
+	sqlResultCode code = RESULT_OK;
+	int sqliteRc = SQLITE_OK;        //extended result code of the failed SQLite call
+	const char *where = nullptr;     //reporting function, e.g. "_userCount"
+	const char *detail = nullptr;
+	const char *callee = nullptr;
+	int calleeRc = 0;
+	char text[96] = "";              //SQLite message or the variable part of detail
+
+	bool ok() const { return code == RESULT_OK || code == RESULT_WARN; }
+	string message() const;          //the text the errString trace got for this outcome
+};
+
+// SQLite error of a connection, taken before anything else runs on it
+struct sqliteError {
+	int rc;
+	string message;
+	explicit sqliteError(sqlite3 *db);
+};
+
+// Where a call reports its outcome: the caller-owned errString trace, a sqlResult,
+// both or neither. Converts from either pointer, so f(..., &errString) keeps
+// working, and the trace text is only built when a trace string was passed.
+class resultSink {
+	string *trace;
+	sqlResult *result;
+public:
+	resultSink(string *trace) : trace(trace), result(nullptr) {}
+	resultSink(sqlResult *result) : trace(nullptr), result(result) {}
+	resultSink(nullptr_t) : trace(nullptr), result(nullptr) {}
+	resultSink(string *trace, sqlResult *result) : trace(trace), result(result) {}
+
+	// For calls made on the side (Log records): they extend the trace but not the result
+	resultSink traceOnly() const { return resultSink(trace); }
+	bool tracing() const { return trace != nullptr; }
+
+	void ok(const char *where, const char *note = nullptr);
+	void warn(const char *where, const char *detail, const char *extra = nullptr);
+	void fail(sqlResultCode code, const char *where, const char *detail, const char *extra = nullptr);
+	void sqliteFail(const char *where, sqlite3 *db);
+	void sqliteFail(const char *where, const sqliteError& error);
+	// Keeps the code and SQLite rc the nested call reported
+	void callFailed(const char *where, const char *callee, int rc);
+};
+#endif
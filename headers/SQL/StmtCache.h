@@ -0,0 +1,44 @@
+#if !defined STMT_CACHE_H
+#define STMT_CACHE_H
+
+#include <sqlite3.h>
+#include <string>
+#include <memory>
+
+using namespace std;
+
+struct stmtCache;
+struct cacheEntry;
+
+struct stmtCacheStats {
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;   //least recently used statements dropped to keep the cache bounded
+	size_t size;
+};
+
+// Statement borrowed from the per-connection cache. It is handed out reset with
+// cleared bindings and goes back to the cache (reset again) on destruction.
+class cachedStmt {
+	sqlite3_stmt *stmt;
+	shared_ptr<stmtCache> cache;
+	cacheEntry *entry;
+public:
+	cachedStmt();
+	~cachedStmt();
+	cachedStmt(const cachedStmt&) = delete;
+	cachedStmt& operator=(const cachedStmt&) = delete;
+	operator sqlite3_stmt*() const;
+	void release();
+	friend int prepareCached(sqlite3 *db, const char *sql, cachedStmt *stmt);
+};
+
+// The cache of a connection is finalized by closeBaseSQL. A plain sqlite3_close returns
+// SQLITE_BUSY and leaves the connection open while it has cached statements, unless
+// clearStmtCache is called first.
+int prepareCached(sqlite3 *db, const char *sql, cachedStmt *stmt);
+
+stmtCacheStats getStmtCacheStats(sqlite3 *db);
+
+void clearStmtCache(sqlite3 *db);
+#endif
@@ -0,0 +1,40 @@
+#if !defined TEXT_LOG_H
+#define TEXT_LOG_H
+
+#include <string>
+#include <ctime>
+#include "SQL/SqlResult.h"
+
+using namespace std;
+
+struct textLogOptions {
+	string path = "textLog";
+	size_t bufferSize = 65536;            //ring buffer, textLog() waits for the flusher when it is full
+	unsigned flushIntervalMs = 200;
+	size_t maxFileSize = 10485760;        //rotate once the file is this big, 0 - never
+	unsigned rotateIntervalSec = 86400;   //rotate once the file is this old, 0 - never
+	unsigned keepFiles = 5;               //rotated files path.1 (newest) ... path.N
+};
+
+struct textLogStats {
+	unsigned long long records;
+	unsigned long long bytes;             //written to files
+	unsigned long long flushes;
+	unsigned long long waits;             //textLog() calls that found the buffer full
+	unsigned long long rotations;
+};
+
+// Fallback sink of textLog(): one line per record, tab-separated
+// "YYYY-MM-DD HH:MM:SS.mmm eventName object subject eventStatus".
+// Until it is opened textLog() writes to stderr; initBaseSQL opens it with the defaults.
+int openTextLog(const textLogOptions& options, resultSink err);
+
+int closeTextLog(resultSink err);
+
+bool hasTextLog();
+
+// Waits until everything logged so far is in the file
+int flushTextLog();
+
+textLogStats getTextLogStats();
+#endif
@@ -2,15 +2,56 @@
 #define TG_SQL_H
 #include "SQL/BaseSQL.h"
 
-int userCount(sqlite3 * db, string userID, string *errString);
+struct userLookup {
+	string userID;
+	int count;     //rows with this userID: 0 - not found, >1 - duplicates
+	int privilege; //-1 if the user is not found
+};
 
-int getUserPrivilege(sqlite3 *db, string object, string *errString);
+// Existence, duplicates and privilege of every userID with a single statement
+int lookupUsers(sqlite3 *db, const vector<string>& userIDs, vector<userLookup> *result, resultSink err);
 
-int modUser(sqlite3 *db, string object, string subject, int newPrivilege, string *errString);
+int lookupUser(sqlite3 *db, const string& userID, userLookup *result, resultSink err);
 
-int addUser(sqlite3 *db, string object, string subject, int privilege, string *errString);
+int userCount(sqlite3 * db, string userID, resultSink err);
 
-int deleteUser(sqlite3 *db, string object, string subject, string *errString);
+int getUserPrivilege(sqlite3 *db, string object, resultSink err);
 
-int initTgSQL(sqlite3 *db, string *errString);
+// Mutations check the privileges, write and Log in one immediateTransaction,
+// so the checked rows cannot change before the write. A refused mutation is
+// committed too, with its Log record.
+int modUser(sqlite3 *db, string object, string subject, int newPrivilege, resultSink err);
+
+int addUser(sqlite3 *db, string object, string subject, int privilege, resultSink err);
+
+int deleteUser(sqlite3 *db, string object, string subject, resultSink err);
+
+struct userRecord {
+	string userID;
+	int privilege;
+};
+
+enum userImportStatus {
+	IMPORT_IN_USE,        //the userID exists already or repeats an earlier row of the batch
+	IMPORT_NO_PRIVILEGE,  //privilege is higher than the subject's
+	IMPORT_INVALID        //empty userID
+};
+
+struct userImportConflict {
+	size_t row;
+	userImportStatus status;
+};
+
+// addUser for many users: the subject is checked once, the rows are inserted in one
+// transaction with one statement and a single Log record. Conflicting rows are skipped
+// and reported in conflicts. Returns the number of inserted users.
+int importUsers(sqlite3 *db, const userRecord *users, size_t count, string subject, vector<userImportConflict> *conflicts, resultSink err);
+
+int importUsers(sqlite3 *db, const vector<userRecord>& users, string subject, vector<userImportConflict> *conflicts, resultSink err);
+
+// Streams the users in insertion order to callback without loading them all,
+// callback returns false to stop. Returns the number of exported users.
+int exportUsers(sqlite3 *db, string subject, bool (*callback)(const userRecord& user, void *context), void *context, resultSink err);
+
+int initTgSQL(sqlite3 *db, resultSink err);
 #endif
@@ -0,0 +1,68 @@
+#if !defined TIME_SERIES_H
+#define TIME_SERIES_H
+
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include "SQL/SqlResult.h"
+
+using namespace std;
+
+struct timeSeriesOptions {
+	size_t chunkSize = 1024;                 //readings of a sensor per chunk at most
+	long long bucketMicros = 3600000000LL;   //a chunk never crosses a bucket; stored with the first chunks of a database
+};
+
+struct sensorReading {
+	long long timeMicros;
+	double value;
+};
+
+// Readings of [windowStart, windowStart + windowMicros); windows without readings are left out
+struct windowStats {
+	long long windowStart;
+	size_t count;
+	double min;
+	double max;
+	double avg;
+};
+
+struct timeSeriesStats {
+	unsigned long long readings;
+	unsigned long long chunks;
+	unsigned long long encodedBytes;     //time and value columns of the written chunks
+	unsigned long long rejected;         //readings older than the last one of their sensor
+	size_t buffered;
+};
+
+// Creates the sensorChunks table and keeps the readings of db in memory per sensor. A sensor's
+// readings are flushed as one row per chunk, keyed by sensor and time / bucketMicros:
+// the times as bit-packed deltas, the values as bit-packed XORs of consecutive doubles,
+// with count, min, max and sum next to them. closeBaseSQL flushes what is left. The first
+// enableTimeSeries of a database stores bucketMicros, queries without a store read it from there.
+// -5 - the database is keyed with another bucketMicros, -6 - SQLite error
+int enableTimeSeries(sqlite3 *db, const timeSeriesOptions& options, resultSink err);
+
+// Readings of a sensor come in time order. -1 - time series are not enabled, -2 - older than
+// the sensor's last reading, buffered or written before, -3 - SQLite error, a chunk could not
+// be written (the readings stay buffered), -4 - empty sensor. While db has a transaction
+// open, full chunks stay buffered too until a chunk is written or flushed outside of it.
+int recordReading(sqlite3 *db, const string& sensor, long long timeMicros, double value, resultSink err);
+
+int recordReadings(sqlite3 *db, const string& sensor, const sensorReading *readings, size_t count, resultSink err);
+
+// Writes every buffered reading in one transaction; the readings leave the buffers once it
+// commits. -3 - a chunk could not be written, nothing is and the readings stay buffered,
+// -4 - the commit failed, -5 - db has a transaction open, nothing is written
+int flushTimeSeries(sqlite3 *db, resultSink err);
+
+// Readings of [from, to) in time order, written chunks and buffered ones.
+// -1 - empty range, -2 - SQLite error, -3 - a chunk that does not decode
+int queryReadings(sqlite3 *db, const string& sensor, long long from, long long to, vector<sensorReading> *readings, resultSink err);
+
+// min/max/avg per window of [from, to), windows start at from. Chunks that lie in one
+// window are taken from their stored aggregates without decoding.
+int downsampleReadings(sqlite3 *db, const string& sensor, long long from, long long to, long long windowMicros, vector<windowStats> *windows, resultSink err);
+
+timeSeriesStats getTimeSeriesStats(sqlite3 *db);
+#endif
@@ -3,16 +3,356 @@
 
 #include <vector>
 #include <string>
+#include <utility>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <cstddef>
+#include <type_traits>
+#include <typeinfo>
+
+typedef unsigned int eventTypeId;
+
+const eventTypeId NO_EVENT_TYPE = static_cast<eventTypeId>(-1);
+
+// Dense process-wide id of an event type name; the same name always gets the same id
+eventTypeId internEventType(const std::string& type);
+
+// Id of an already interned name or NO_EVENT_TYPE, never registers a new one
+eventTypeId findEventType(const std::string& type);
+
+const std::string& eventTypeName(eventTypeId id);
+
+// Event type of a typed payload: every payload type T is an event type of its own
+template <typename T>
+eventTypeId payloadEventType()
+{
+    static const eventTypeId id = internEventType(std::string("payload:") + typeid(T).name());
+    return id;
+}
+
+namespace eventsDetail
+{
+    template <typename T, size_t Size>
+    constexpr bool fitsInline()
+    {
+        return sizeof(T) <= Size && alignof(T) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible<T>::value;
+    }
+}
+
+// Type-erased bool(void*) callable. Function pointers and lambdas capturing a few
+// values are stored inside the object, so copying the handler table and calling
+// a handler never allocate; bigger callables are boxed once when registered.
+// Returns true to stop propagation, a callable returning void never stops it.
+class eventCallback
+{
+public:
+    static const size_t inlineSize = 4 * sizeof(void*);
+
+    eventCallback() : ops(nullptr) {}
+
+    template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, eventCallback>::value>::type>
+    eventCallback(F&& function) : ops(&model<typename std::decay<F>::type>::table)
+    {
+        model<typename std::decay<F>::type>::create(storage, std::forward<F>(function));
+    }
+
+    eventCallback(const eventCallback& other) : ops(other.ops)
+    {
+        if (ops != nullptr)
+        {
+            ops->copy(storage, other.storage);
+        }
+    }
+
+    eventCallback(eventCallback&& other) noexcept : ops(other.ops)
+    {
+        if (ops != nullptr)
+        {
+            ops->move(storage, other.storage);
+            other.ops = nullptr;
+        }
+    }
+
+    eventCallback& operator=(const eventCallback& other)
+    {
+        if (this != &other)
+        {
+            eventCallback copy(other);
+            *this = std::move(copy);
+        }
+        return *this;
+    }
+
+    eventCallback& operator=(eventCallback&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            ops = other.ops;
+            if (ops != nullptr)
+            {
+                ops->move(storage, other.storage);
+                other.ops = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    ~eventCallback()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        if (ops != nullptr)
+        {
+            ops->destroy(storage);
+            ops = nullptr;
+        }
+    }
+
+    explicit operator bool() const
+    {
+        return ops != nullptr;
+    }
+
+    bool storedInline() const
+    {
+        return ops != nullptr && ops->inlined;
+    }
+
+    bool operator()(void* data) const
+    {
+        return ops->invoke(storage, data);
+    }
+
+private:
+    struct callbackOps
+    {
+        bool(*invoke)(void* storage, void* data);
+        void(*copy)(void* to, const void* from);
+        void(*move)(void* to, void* from); //leaves from destroyed
+        void(*destroy)(void* storage);
+        bool inlined;
+    };
+
+    template <typename F>
+    struct model
+    {
+        static_assert(std::is_copy_constructible<F>::value, "event handlers are copied into the handler table");
+        static constexpr bool inlined = eventsDetail::fitsInline<F, inlineSize>();
+
+        static F& get(void* storage)
+        {
+            if constexpr (inlined)
+            {
+                return *std::launder(reinterpret_cast<F*>(storage));
+            }
+            else
+            {
+                return **reinterpret_cast<F**>(storage);
+            }
+        }
+
+        template <typename A>
+        static void create(void* storage, A&& function)
+        {
+            if constexpr (inlined)
+            {
+                new (storage) F(std::forward<A>(function));
+            }
+            else
+            {
+                *reinterpret_cast<F**>(storage) = new F(std::forward<A>(function));
+            }
+        }
+
+        static bool invoke(void* storage, void* data)
+        {
+            if constexpr (std::is_void<decltype(get(storage)(data))>::value)
+            {
+                get(storage)(data);
+                return false;
+            }
+            else
+            {
+                return static_cast<bool>(get(storage)(data));
+            }
+        }
+
+        static void copy(void* to, const void* from)
+        {
+            create(to, get(const_cast<void*>(from)));
+        }
+
+        static void move(void* to, void* from)
+        {
+            if constexpr (inlined)
+            {
+                new (to) F(std::move(get(from)));
+                get(from).~F();
+            }
+            else
+            {
+                *reinterpret_cast<F**>(to) = *reinterpret_cast<F**>(from);
+            }
+        }
+
+        static void destroy(void* storage)
+        {
+            if constexpr (inlined)
+            {
+                get(storage).~F();
+            }
+            else
+            {
+                delete *reinterpret_cast<F**>(storage);
+            }
+        }
+
+        static constexpr callbackOps table = {invoke, copy, move, destroy, inlined};
+    };
+
+    alignas(std::max_align_t) mutable unsigned char storage[inlineSize];
+    const callbackOps* ops;
+};
+
+// Event data owned by a queued event. Small nothrow-movable values are stored
+// inline, others are boxed; a payload made from a bare void* only carries it.
+class eventPayload
+{
+public:
+    static const size_t inlineSize = 6 * sizeof(void*);
+
+    eventPayload() : ops(nullptr), pointer(nullptr) {}
+
+    explicit eventPayload(void* data) : ops(nullptr), pointer(data) {}
+
+    template <typename T>
+    static eventPayload of(T&& value)
+    {
+        typedef typename std::decay<T>::type V;
+        eventPayload payload;
+        payload.ops = &model<V>::table;
+        if constexpr (model<V>::table.inlined)
+        {
+            new (payload.storage) V(std::forward<T>(value));
+        }
+        else
+        {
+            payload.pointer = new V(std::forward<T>(value));
+        }
+        return payload;
+    }
+
+    eventPayload(eventPayload&& other) noexcept : ops(nullptr), pointer(nullptr)
+    {
+        *this = std::move(other);
+    }
+
+    eventPayload& operator=(eventPayload&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            ops = other.ops;
+            pointer = other.pointer;
+            if (ops != nullptr && ops->inlined)
+            {
+                ops->move(storage, other.storage);
+            }
+            other.ops = nullptr;
+            other.pointer = nullptr;
+        }
+        return *this;
+    }
+
+    eventPayload(const eventPayload&) = delete;
+    eventPayload& operator=(const eventPayload&) = delete;
+
+    ~eventPayload()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        if (ops != nullptr)
+        {
+            ops->destroy(ops->inlined ? static_cast<void*>(storage) : pointer);
+        }
+        ops = nullptr;
+        pointer = nullptr;
+    }
+
+    void* data()
+    {
+        return ops != nullptr && ops->inlined ? static_cast<void*>(storage) : pointer;
+    }
+
+    // Stored value or nullptr if the payload holds something else
+    template <typename T>
+    T* get()
+    {
+        return ops == &model<T>::table ? static_cast<T*>(data()) : nullptr;
+    }
+
+    bool storedInline() const
+    {
+        return ops != nullptr && ops->inlined;
+    }
+
+private:
+    struct payloadOps
+    {
+        void(*move)(void* to, void* from); //inline values only, leaves from destroyed
+        void(*destroy)(void* value);
+        bool inlined;
+    };
+
+    template <typename T>
+    struct model
+    {
+        static void move(void* to, void* from)
+        {
+            T* value = std::launder(reinterpret_cast<T*>(from));
+            new (to) T(std::move(*value));
+            value->~T();
+        }
+
+        static void destroy(void* value)
+        {
+            if constexpr (eventsDetail::fitsInline<T, inlineSize>())
+            {
+                std::launder(reinterpret_cast<T*>(value))->~T();
+            }
+            else
+            {
+                delete static_cast<T*>(value);
+            }
+        }
+
+        static constexpr payloadOps table = {move, destroy, eventsDetail::fitsInline<T, inlineSize>()};
+    };
+
+    alignas(std::max_align_t) unsigned char storage[inlineSize];
+    const payloadOps* ops;
+    void* pointer;
+};
 
 class event
 {
 public:
     std::string type;
     void* data;
+    eventTypeId typeId;
     event(std::string type, void* data)
     {
-        this->type = type;
+        this->type = std::move(type);
         this->data = data;
+        typeId = internEventType(this->type);
     }
 };
 
@@ -21,23 +361,107 @@ class eventHandler
 public:
     std::string type;
     void(*handler)(void*);
-    eventHandler(std::string type, void(*function)(void*))
+    bool(*stoppingHandler)(void*); //returns true to stop propagation to lower priority handlers
+    eventCallback callback;        //what dispatch calls, also set for the two function pointer forms
+    int priority;                  //higher runs first, equal priorities run in registration order
+    eventTypeId typeId;
+    eventHandler(std::string type, void(*function)(void*), int priority = 0) : callback(function)
     {
-        this->type = type;
+        this->type = std::move(type);
         handler = function;
+        stoppingHandler = nullptr;
+        this->priority = priority;
+        typeId = internEventType(this->type);
+    }
+    eventHandler(std::string type, bool(*function)(void*), int priority = 0) : callback(function)
+    {
+        this->type = std::move(type);
+        handler = nullptr;
+        stoppingHandler = function;
+        this->priority = priority;
+        typeId = internEventType(this->type);
+    }
+    eventHandler(eventTypeId typeId, eventCallback callback, int priority = 0) : callback(std::move(callback))
+    {
+        type = eventTypeName(typeId);
+        handler = nullptr;
+        stoppingHandler = nullptr;
+        this->priority = priority;
+        this->typeId = typeId;
     }
 };
 
+// Compact copy of a handler kept in the per-type lists that dispatch walks
+struct handlerSlot
+{
+    eventCallback callback;
+    int priority;
+    long position; //index in eventDispatcher::handlers
+};
+
+typedef std::vector<std::vector<handlerSlot>> handlerTable; //eventTypeId -> handlers sorted by priority
+
+struct dispatcherWorkers;
+
+// Handlers may be registered from any thread, also while events are being dispatched:
+// registration publishes a new handlerTable and dispatch walks the snapshot it loaded.
 class eventDispatcher
 {
 public:
     std::vector<eventHandler> handlers;
-    long findHandler(std::string eventType);
-    long findHandler(event Event);
+    std::shared_ptr<const handlerTable> handlersByType;
+    eventDispatcher();
+    ~eventDispatcher();
+    eventDispatcher(const eventDispatcher&) = delete;
+    eventDispatcher& operator=(const eventDispatcher&) = delete;
+    long findHandler(eventTypeId typeId) const;
+    long findHandler(const std::string& eventType) const;
+    long findHandler(const event& Event) const;
+    size_t handlerCount(eventTypeId typeId) const;
 public:
-    void registerHandler(eventHandler handler);
-    void registerHandler(std::string type, void(*function)(void*));
-    void dispatchEvent(event Event);
+    void registerHandler(const eventHandler& handler);
+    void registerHandler(const std::string& type, void(*function)(void*), int priority = 0);
+    void registerHandler(const std::string& type, bool(*function)(void*), int priority = 0);
+    size_t dispatchEvent(const event& Event);
+    size_t dispatchEvent(eventTypeId typeId, void* data);
+    // Asynchronous mode: post() enqueues and returns at once, the worker pool dispatches.
+    // startWorkers must not race with post(); after shutdown() post() returns false.
+    bool startWorkers(size_t threadCount, size_t queueCapacity = 1024);
+    bool post(const event& Event);
+    bool post(eventTypeId typeId, void* data); //false if the queue is full or workers are not running
+    bool post(eventTypeId typeId, eventPayload&& payload); //the payload is destroyed once it has been handled
+    void drain();    //waits until every posted event has been handled
+    void shutdown(); //drains and stops the workers; every post() that returned true is dispatched before it returns
+
+    // Typed events: handlers take const T& and may return bool to stop propagation.
+    // Capturing lambdas are accepted; publish() and publishAsync() of small payloads do not allocate.
+    template <typename T, typename F>
+    void subscribe(F&& function, int priority = 0)
+    {
+        typedef typename std::decay<F>::type callable;
+        registerHandler(eventHandler(payloadEventType<T>(), eventCallback(
+            [function = callable(std::forward<F>(function))](void* data) mutable {
+                return function(*static_cast<const T*>(data));
+            }), priority));
+    }
+
+    template <typename T>
+    size_t publish(const T& payload)
+    {
+        return dispatchEvent(payloadEventType<T>(), const_cast<void*>(static_cast<const void*>(&payload)));
+    }
+
+    // Same as post(): false and the payload is dropped if the queue is full or workers are not running
+    template <typename T>
+    bool publishAsync(T&& payload)
+    {
+        return post(payloadEventType<typename std::decay<T>::type>(), eventPayload::of(std::forward<T>(payload)));
+    }
+private:
+    std::mutex registerLock;
+    std::unique_ptr<dispatcherWorkers> workers;
+    std::shared_ptr<const handlerTable> snapshot() const;
+    static size_t dispatchTo(const std::vector<handlerSlot>& list, void* data);
 };
 
 #endif
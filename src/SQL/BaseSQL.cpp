@@ -4,108 +4,188 @@
 #include <ctime>
 #include <vector>
 #include <initializer_list>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <map>
+#include <unordered_map>
+#include <thread>
+#include <chrono>
 #include "SQL/BaseSQL.h"
+#include "SQL/StmtCache.h"
+#include "SQL/LogWriter.h"
+#include "SQL/TextLog.h"
+#include "SQL/SchemaRegistry.h"
+#include "SQL/LogPartitions.h"
+#include "SQL/CompactLog.h"
+#include "SQL/Metrics.h"
 
 using namespace std;
 
-FILE* textLogFile; //for future use by the textLog function
+static mutex connectionDataLock;
+static unordered_map<sqlite3*, map<string, shared_ptr<void>>> connectionData;
+static atomic<unsigned> dataVersion(1);
 
-column::column(const string& name, const string& type) : name(name), type(type) {}
+column::column(const string& name, const string& type, int constraints) : name(name), type(type), constraints(constraints) {}
+
+tableIndex::tableIndex(const string& name, const initializer_list<string>& cols, bool unique) : name(name), columns(cols), unique(unique) {}
 
 tableInfo::tableInfo(const string& tableName, const initializer_list<column>& cols) : name(tableName), columns(cols) {}
 tableInfo::tableInfo(const string& tableName, const vector<column>& cols) : name(tableName), columns(cols) {}
+tableInfo::tableInfo(const string& tableName, const initializer_list<column>& cols, const initializer_list<tableIndex>& idxs) : name(tableName), columns(cols), indexes(idxs) {}
 
-void textLog(sqlite3 *db, string eventName, string object, string subject, string eventStatus)
-{
-	time_t now = time(0);
-	fprintf(textLogFile, "Data: {\neventName = %s\nobject = %s\nsubject = %s\neventStatus = %s\neventDateTime = %s}\n", eventName.c_str(), object.c_str(), subject.c_str(), eventStatus.c_str(),ctime(&now));
-}
+#define LOG_INSERT_VALUES "(eventName, object, subject, eventStatus, eventDateTime) VALUES(?, ?, ?, ?, ?)"
 
-int Log(sqlite3 *db, string eventName, string object, string subject, string eventStatus, string *errString)
+int Log(sqlite3 *db, string eventName, string object, string subject, string eventStatus, resultSink err)
 {
-	sqlite3_stmt *res;
-	int rc = sqlite3_prepare_v2(db, "INSERT INTO Log(eventName, object, subject, eventStatus, eventDateTime) VALUES(?, ?, ?, ?, ?)", -1, &res, 0);
+	SQL_METRIC_PHASE(SQL_PHASE_LOG); //log time of the caller
+	SQL_METRIC_SCOPE("Log");
+	long long micros = chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+	time_t now = micros / 1000000;
+	int qrc = queueLog(db, move(eventName), move(object), move(subject), move(eventStatus), micros);
+	if(qrc == 0) //OK
+	{
+		err.ok("_Log", "QUEUED");
+		return 0;
+	}
+	if(qrc < 0) //OK
+	{
+		err.fail(RESULT_UNAVAILABLE, "_Log", "log queue is full");
+		return -3;
+	}
+	int crc = compactLogInsert(db, db, eventName, object, subject, eventStatus, micros, nullptr);
+	if(crc == 0) //OK
+	{
+		err.ok("_Log", "COMPACT");
+		return 0;
+	}
+	string table;
+	int prc = crc == 1 ? logPartitionTable(db, db, now, &table) : -1;
+	cachedStmt res;
+	int rc = SQLITE_ERROR;
+	if(prc == 1)
+		rc = prepareCached(db, "INSERT INTO Log" LOG_INSERT_VALUES, &res);
+	else if(prc == 0)
+	{
+		rc = prepareCached(db, ("INSERT INTO " + table + LOG_INSERT_VALUES).c_str(), &res);
+		if(rc != SQLITE_OK)
+			forgetLogPartition(db, table);
+	}
 	if(rc != SQLITE_OK) //OK
 	{
+		sqliteError error(db);
+		// Log may have been made compact by another connection
+		if(prc == 1 && attachCompactLog(db, nullptr) == 1 &&
+		compactLogInsert(db, db, eventName, object, subject, eventStatus, micros, nullptr) == 0)
+		{
+			err.ok("_Log", "COMPACT");
+			return 0;
+		}
 		textLog(db, eventName, object, subject, eventStatus);
-		errString->append("_Log-FAIL_ERROR-SQLite:" + string(sqlite3_errmsg(db)));
-		sqlite3_finalize(res);
+		err.sqliteFail("_Log", error);
 		return -1;
 	}
-	time_t now = time(0);
-	char time[30];
-	strftime(time, 30, "%Y-%m-%d %H:%M:%S", localtime(&now));
-	if((sqlite3_bind_text(res, 1, eventName.c_str(), -1, SQLITE_STATIC) == SQLITE_OK) &&
+	if(SQL_TIMED(SQL_PHASE_BIND, (sqlite3_bind_text(res, 1, eventName.c_str(), -1, SQLITE_STATIC) == SQLITE_OK) &&
 	(sqlite3_bind_text(res, 2, object.c_str(), -1, SQLITE_STATIC) == SQLITE_OK) &&
 	(sqlite3_bind_text(res, 3, subject.c_str(), -1, SQLITE_STATIC) == SQLITE_OK) &&
 	(sqlite3_bind_text(res, 4, eventStatus.c_str(), -1, SQLITE_STATIC) == SQLITE_OK) &&
-	(sqlite3_bind_text(res, 5, time, -1, SQLITE_STATIC)) == SQLITE_OK) //OK
+	(sqlite3_bind_int64(res, 5, now)) == SQLITE_OK)) //OK
 	{
-		if(sqlite3_step(res) == SQLITE_DONE)
+		if(SQL_TIMED(SQL_PHASE_STEP, sqlite3_step(res)) == SQLITE_DONE)
 		{
-			errString->append("_Log-OK");
-			sqlite3_finalize(res);
+			err.ok("_Log");
 			return 0;
 		}
 	}
-	errString->append("_Log-FAIL_ERROR-SQLite:" + string(sqlite3_errmsg(db)));
+	err.sqliteFail("_Log", db);
 	textLog(db, eventName, object, subject, eventStatus);
-	sqlite3_finalize(res);
 	return -2;
 }
 
-int dropTable(sqlite3 *db, string tableName, string *errString)
+int dropTable(sqlite3 *db, string tableName, resultSink err)
 {
+	SQL_METRIC_SCOPE("dropTable");
 	string sql = "DROP TABLE IF EXISTS " + tableName;
 
 	sqlite3_stmt *stmt;
 	int rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
 	if (rc != SQLITE_OK) {
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "dropTable", "TABLE:" + tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-		errString->append("_dropTable-FAIL_ERROR-SQLite:" + string(errmsg));
+		sqliteError error(db);
+		Log(db, "dropTable", "TABLE:" + tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_dropTable", error);
 		sqlite3_finalize(stmt);
 		return -1;
 	}
 
 	rc = sqlite3_step(stmt);
 	if (rc != SQLITE_DONE) {
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "dropTable", "TABLE:" + tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-		errString->append("_dropTable-FAIL_ERROR-SQLite:" + string(errmsg));
+		sqliteError error(db);
+		Log(db, "dropTable", "TABLE:" + tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_dropTable", error);
 		sqlite3_finalize(stmt);
 		return -2;
 	}
 
-	Log(db, "dropTable", "TABLE:" + tableName, "SYSTEM", "OK", errString);
-	errString->append("_dropTable-OK");
+	Log(db, "dropTable", "TABLE:" + tableName, "SYSTEM", "OK", err.traceOnly());
+	err.ok("_dropTable");
 	sqlite3_finalize(stmt);
 	return 0;
 }
 
-int dropTable(sqlite3 *db, tableInfo table, string *errString)
+int dropTable(sqlite3 *db, tableInfo table, resultSink err)
 {
-	return dropTable(db, table.name, errString);
+	return dropTable(db, table.name, err);
 }
 
-int checkTable(sqlite3 *db, string tableName, vector<column> columns, string *errString)
+// Индексы таблицы: имя, уникальность и колонки в порядке индекса
+static int readIndexes(sqlite3 *db, const string& tableName, vector<tableIndex> *indexes)
 {
-	sqlite3_stmt *res;
-	int rc = sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM sqlite_master WHERE type='table' AND name=?", -1, &res, 0);
+	cachedStmt res;
+	int rc = prepareCached(db, "SELECT il.name, il.\"unique\", ii.name FROM pragma_index_list(?) AS il, pragma_index_info(il.name) AS ii ORDER BY il.name, ii.seqno", &res);
+	if(rc != SQLITE_OK)
+		return -1;
+	if(sqlite3_bind_text(res, 1, tableName.c_str(), -1, SQLITE_STATIC) != SQLITE_OK)
+		return -2;
+	while((rc = sqlite3_step(res)) == SQLITE_ROW)
+	{
+		string name = reinterpret_cast<const char*>(sqlite3_column_text(res, 0));
+		if(indexes->empty() || indexes->back().name != name)
+			indexes->push_back(tableIndex(name, {}, sqlite3_column_int(res, 1) != 0));
+		indexes->back().columns.push_back(reinterpret_cast<const char*>(sqlite3_column_text(res, 2)));
+	}
+	return rc == SQLITE_DONE ? 0 : -3;
+}
+
+static bool hasIndex(const vector<tableIndex>& indexes, const vector<string>& columns, bool unique, const string& name)
+{
+	for(const tableIndex& index : indexes)
+	{
+		if((name.empty() || index.name == name) && index.columns == columns && (index.unique || !unique))
+			return true;
+	}
+	return false;
+}
+
+// Column-by-column comparison with the database, the slow path of checkTable
+static int diffTable(sqlite3 *db, const tableInfo& table, resultSink err)
+{
+	const string& tableName = table.name;
+	const vector<column>& columns = table.columns;
+	cachedStmt res;
+	int rc = prepareCached(db, "SELECT COUNT(*) FROM sqlite_master WHERE type='table' AND name=?", &res);
 	if (rc != SQLITE_OK) {
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-		errString->append("_checkTable-FAIL_ERROR-SQLite:" + string(errmsg));
-		sqlite3_finalize(res);
+		sqliteError error(db);
+		Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_checkTable", error);
 		return -1;
 	}
 
 	rc = sqlite3_bind_text(res, 1, tableName.c_str(), -1, SQLITE_STATIC);
 	if (rc != SQLITE_OK) {
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-		errString->append("_checkTable-FAIL_ERROR-SQLite:" + string(errmsg));
-		sqlite3_finalize(res);
+		sqliteError error(db);
+		Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_checkTable", error);
 		return -2;
 	}
 
@@ -113,35 +193,30 @@ int checkTable(sqlite3 *db, string tableName, vector<column> columns, string *er
 	if (rc == SQLITE_ROW) {
 		int count = sqlite3_column_int(res, 0);
 		if (count == 0) {
-			Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "OK(WARN):table does not exist", errString);
-			errString->append("_checkTable-OK(WARN):table does not exist");
-			sqlite3_finalize(res);
+			Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "OK(WARN):table does not exist", err.traceOnly());
+			err.warn("_checkTable", "table does not exist");
 			return 1;
 		}
 	} else {
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-		errString->append("_checkTable-FAIL_ERROR-SQLite:" + string(errmsg));
-		sqlite3_finalize(res);
+		sqliteError error(db);
+		Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_checkTable", error);
 		return -3;
 	}
-	sqlite3_finalize(res);
-	rc = sqlite3_prepare_v2(db, "SELECT name, type FROM pragma_table_info(?)", -1, &res, 0);
+	rc = prepareCached(db, "SELECT name, type, pk, \"notnull\" FROM pragma_table_info(?)", &res);
 	if(rc != SQLITE_OK) //OK
 	{
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "checkTable", "TABLE:"+ tableName, "SYSTEM", "FAIL_ERROR:SQLite:" + string(errmsg), errString);
-		errString->append("_checkTable-FAIL_ERROR-SQLite:" + string(errmsg));
-		sqlite3_finalize(res);
+		sqliteError error(db);
+		Log(db, "checkTable", "TABLE:"+ tableName, "SYSTEM", "FAIL_ERROR:SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_checkTable", error);
 		return -4;
 	}
 	rc = sqlite3_bind_text(res, 1, tableName.c_str(), -1, SQLITE_STATIC);
 	if(rc != SQLITE_OK) //TODO
 	{
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "checkTable", "TABLE:"+ tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-		errString->append("_checkTable-FAIL_ERROR-SQLite:" + string(errmsg));
-		sqlite3_finalize(res);
+		sqliteError error(db);
+		Log(db, "checkTable", "TABLE:"+ tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_checkTable", error);
 		return -5;
 	}
 	for(int i = 0; i < columns.size(); i++)
@@ -151,177 +226,993 @@ int checkTable(sqlite3 *db, string tableName, vector<column> columns, string *er
 		{
 			if(string(reinterpret_cast<const char*>(sqlite3_column_text(res, 0))) != columns[i].name) //OK
 			{
-				Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "FAIL:column name is not equal to expected(\"" +
-				string(reinterpret_cast<const char*>(sqlite3_column_text(res, 0))) + "\" != \"" + columns[i].name + "\")", errString);
-				errString->append("_checkTable-FAIL:column name is not equal to expected(\"" +
-				string(reinterpret_cast<const char*>(sqlite3_column_text(res, 0))) + "\" != \"" + columns[i].name + "\")");
-				sqlite3_finalize(res);
+				string mismatch = "(\"" + string(reinterpret_cast<const char*>(sqlite3_column_text(res, 0))) + "\" != \"" + columns[i].name + "\")";
+				Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "FAIL:column name is not equal to expected" + mismatch, err.traceOnly());
+				err.fail(RESULT_SCHEMA_MISMATCH, "_checkTable", "column name is not equal to expected", mismatch.c_str());
 				return 2;
 			}
 			if(string(reinterpret_cast<const char*>(sqlite3_column_text(res, 1))) != columns[i].type) //OK
 			{
-				Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "FAIL:column type is not equal to expected(\"" +
-				string(reinterpret_cast<const char*>(sqlite3_column_text(res, 1))) + "\" != \"" + columns[i].type + "\")", errString);
-				errString->append("_checkTable-FAIL:column type is not equal to expected(\"" +
-				string(reinterpret_cast<const char*>(sqlite3_column_text(res, 1))) + "\" != \"" + columns[i].type + "\")");
-				sqlite3_finalize(res);
+				string mismatch = "(\"" + string(reinterpret_cast<const char*>(sqlite3_column_text(res, 1))) + "\" != \"" + columns[i].type + "\")";
+				Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "FAIL:column type is not equal to expected" + mismatch, err.traceOnly());
+				err.fail(RESULT_SCHEMA_MISMATCH, "_checkTable", "column type is not equal to expected", mismatch.c_str());
 				return 3;
 			}
+			if((sqlite3_column_int(res, 2) > 0) != ((columns[i].constraints & COLUMN_PRIMARY_KEY) != 0) ||
+			(sqlite3_column_int(res, 3) != 0) != ((columns[i].constraints & COLUMN_NOT_NULL) != 0)) //OK
+			{
+				string mismatch = "(\"" + columns[i].name + "\")";
+				Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "FAIL:column constraints are not equal to expected" + mismatch, err.traceOnly());
+				err.fail(RESULT_SCHEMA_MISMATCH, "_checkTable", "column constraints are not equal to expected", mismatch.c_str());
+				return 6;
+			}
 		}
 		else if(rc == SQLITE_DONE) //OK
 		{
-			Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "FAIL:the number of columns is lesser than expected", errString);
-			errString->append("_checkTable-FAIL:the number of columns is lesser than expected");
-			sqlite3_finalize(res);
+			Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "FAIL:the number of columns is lesser than expected", err.traceOnly());
+			err.fail(RESULT_SCHEMA_MISMATCH, "_checkTable", "the number of columns is lesser than expected");
 			return 4;
 		}
 		else
 		{
-			const char *errmsg = sqlite3_errmsg(db);
-			Log(db, "checkTable", "TABLE:"+ tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-			errString->append("_checkTable-FAIL_ERROR-SQLite:" + string(errmsg));
-			sqlite3_finalize(res);
+			sqliteError error(db);
+			Log(db, "checkTable", "TABLE:"+ tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+			err.sqliteFail("_checkTable", error);
 			return -6; //TODO
 		}
 	}
 	rc = sqlite3_step(res);
+	if(rc == SQLITE_DONE && (table.indexes.size() > 0 || any_of(columns.begin(), columns.end(), [](const column& col) { return (col.constraints & COLUMN_UNIQUE) != 0; })))
+	{
+		res.release();
+		vector<tableIndex> indexes;
+		int irc = readIndexes(db, tableName, &indexes);
+		if(irc < 0) //OK
+		{
+			sqliteError error(db);
+			Log(db, "checkTable", "TABLE:"+ tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+			err.sqliteFail("_checkTable", error);
+			return -8;
+		}
+		for(const column& col : columns)
+		{
+			if((col.constraints & COLUMN_UNIQUE) && !hasIndex(indexes, {col.name}, true, "")) //OK
+			{
+				string mismatch = "(\"" + col.name + "\")";
+				Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "FAIL:column is not unique" + mismatch, err.traceOnly());
+				err.fail(RESULT_SCHEMA_MISMATCH, "_checkTable", "column is not unique", mismatch.c_str());
+				return 6;
+			}
+		}
+		for(const tableIndex& index : table.indexes)
+		{
+			if(!hasIndex(indexes, index.columns, index.unique, index.name)) //OK
+			{
+				string mismatch = "(\"" + index.name + "\")";
+				Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "FAIL:index does not exist" + mismatch, err.traceOnly());
+				err.fail(RESULT_SCHEMA_MISMATCH, "_checkTable", "index does not exist", mismatch.c_str());
+				return 7;
+			}
+		}
+	}
 	if(rc == SQLITE_DONE) //OK
 	{
-		Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "OK", errString);
-		errString->append("_checkTable-OK");
-		sqlite3_finalize(res);
+		Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "OK", err.traceOnly());
+		err.ok("_checkTable");
 		return 0;
 	}
 	if(rc == SQLITE_ROW) //OK
 	{
-		Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "FAIL:the number of columns is greater than expected", errString);
-		errString->append("_checkTable-FAIL:the number of columns is greater than expected");
-		sqlite3_finalize(res);
+		Log(db, "checkTable", "TABLE:" + tableName, "SYSTEM", "FAIL:the number of columns is greater than expected", err.traceOnly());
+		err.fail(RESULT_SCHEMA_MISMATCH, "_checkTable", "the number of columns is greater than expected");
 		return 5;
 	}
-	const char *errmsg = sqlite3_errmsg(db);
-	Log(db, "checkTable", "TABLE:"+ tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-	errString->append("_checkTable-FAIL_ERROR-SQLite:" + string(errmsg));
-	sqlite3_finalize(res);
+	sqliteError error(db);
+	Log(db, "checkTable", "TABLE:"+ tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+	err.sqliteFail("_checkTable", error);
 	return -7; //TODO
 }
 
-int checkTable(sqlite3 *db, tableInfo table, string *errString)
+int checkTable(sqlite3 *db, tableInfo table, resultSink err)
 {
-	return checkTable(db, table.name, table.columns, errString);
+	SQL_METRIC_SCOPE("checkTable");
+	vector<bool> valid;
+	if(matchSchemaFingerprints(db, {table}, &valid) == 0 && valid[0])
+	{
+		err.ok("_checkTable", "FINGERPRINT");
+		return 0;
+	}
+	int rc = diffTable(db, table, err);
+	if(rc == 0)
+		storeSchemaFingerprint(db, table);
+	return rc;
 }
 
-tableInfo LogInfo("Log", {column("id", "INTEGER"), column("eventName", "TEXT"), column("object", "TEXT"), column("subject", "TEXT"), column("eventStatus", "TEXT"), column("eventDateTime", "TEXT")});
-
-int createTable(sqlite3 *db, string tableName, vector<column> columns, string *errString)
+int checkTables(sqlite3 *db, const vector<tableInfo>& tables, vector<int> *results, resultSink err)
 {
-	int rc = checkTable(db, tableName, columns, errString);
-	if(rc == 0)
+	SQL_METRIC_SCOPE("checkTables");
+	vector<bool> valid;
+	matchSchemaFingerprints(db, tables, &valid);
+	results->assign(tables.size(), 0);
+	int mismatched = 0;
+	for(size_t i = 0; i < tables.size(); i++)
 	{
-		Log(db, "createTable", "TABLE:" + tableName, "SYSTEM", "OK", errString);
-		errString->append("_createTable-OK");
-		return 0;
+		if(valid[i])
+			continue;
+		int rc = diffTable(db, tables[i], err.traceOnly());
+		(*results)[i] = rc;
+		if(rc < 0) //OK
+		{
+			err.callFailed("_checkTables", "checkTable", rc);
+			return -1;
+		}
+		if(rc == 0)
+			storeSchemaFingerprint(db, tables[i]);
+		else
+			mismatched++;
 	}
-	if(rc > 1)
+	if(mismatched > 0)
 	{
-		dropTable(db, tableName, errString);
+		string count = to_string(mismatched);
+		err.warn("_checkTables", "tables do not match: ", count.c_str());
 	}
-	if(rc < 0)
-	{
-		Log(db, "createTable", "TABLE:" + tableName, "SYSTEM", "FAIL_ERROR-checkTable:" + to_string(rc), errString);
-		errString->append("_createTable-FAIL_ERROR-checkTable:" + to_string(rc));
+	else
+		err.ok("_checkTables");
+	return mismatched;
+}
+
+int checkTable(sqlite3 *db, string tableName, vector<column> columns, resultSink err)
+{
+	return checkTable(db, tableInfo(tableName, columns), err);
+}
+
+// eventDateTime is seconds since the epoch; every index ends with it, so queryLog reads a time range in order
+tableInfo LogInfo("Log", {column("id", "INTEGER"), column("eventName", "TEXT"), column("object", "TEXT"), column("subject", "TEXT"), column("eventStatus", "TEXT"), column("eventDateTime", "INTEGER")},
+	{tableIndex("LogByTime", {"eventDateTime"}), tableIndex("LogBySubject", {"subject", "eventDateTime"}), tableIndex("LogByObject", {"object", "eventDateTime"})});
+
+static int execSQL(sqlite3 *db, const string& sql)
+{
+	return sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr);
+}
+
+static string createTableSQL(const string& tableName, const vector<column>& columns)
+{
+	vector<string> primaryKey;
+	for (const column& col : columns) {
+		if (col.constraints & COLUMN_PRIMARY_KEY) {
+			primaryKey.push_back(col.name);
+		}
 	}
-	// Формируем SQL-запрос для создания таблицы
 	string sql = "CREATE TABLE " + tableName + " (";
 	for (size_t i = 0; i < columns.size(); ++i) {
 		sql += columns[i].name + " " + columns[i].type;
+		if ((columns[i].constraints & COLUMN_PRIMARY_KEY) && primaryKey.size() == 1) {
+			sql += " PRIMARY KEY";
+		}
+		if (columns[i].constraints & COLUMN_NOT_NULL) {
+			sql += " NOT NULL";
+		}
+		if (columns[i].constraints & COLUMN_UNIQUE) {
+			sql += " UNIQUE";
+		}
 		if (i < columns.size() - 1) {
 			sql += ", ";
 		}
 	}
+	if (primaryKey.size() > 1) {
+		sql += ", PRIMARY KEY(";
+		for (size_t i = 0; i < primaryKey.size(); ++i) {
+			sql += (i > 0 ? ", " : "") + primaryKey[i];
+		}
+		sql += ")";
+	}
 	sql += ")";
+	return sql;
+}
+
+int createIndexes(sqlite3 *db, tableInfo table, resultSink err)
+{
+	SQL_METRIC_SCOPE("createIndexes");
+	for(const tableIndex& index : table.indexes)
+	{
+		string sql = string(index.unique ? "CREATE UNIQUE INDEX" : "CREATE INDEX") + " IF NOT EXISTS " + index.name + " ON " + table.name + "(";
+		for(size_t i = 0; i < index.columns.size(); i++)
+		{
+			sql += (i > 0 ? ", " : "") + index.columns[i];
+		}
+		sql += ")";
+		if(execSQL(db, sql) != SQLITE_OK) //OK
+		{
+			sqliteError error(db);
+			Log(db, "createIndexes", "TABLE:" + table.name, "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+			err.sqliteFail("_createIndexes", error);
+			return -1;
+		}
+	}
+	err.ok("_createIndexes");
+	return 0;
+}
+
+int rebuildTable(sqlite3 *db, tableInfo table, string source, resultSink err)
+{
+	SQL_METRIC_SCOPE("rebuildTable");
+	string tempName = table.name + "_rebuild";
+	if(execSQL(db, "SAVEPOINT rebuildTable") != SQLITE_OK) //OK
+	{
+		sqliteError error(db);
+		Log(db, "rebuildTable", "TABLE:" + table.name, "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_rebuildTable", error);
+		return -1;
+	}
+	// Новая таблица заполняется из source и занимает место старой в одной транзакции
+	int rc = SQLITE_OK;
+	const string steps[] = {
+		"DROP TABLE IF EXISTS " + tempName,
+		createTableSQL(tempName, table.columns),
+		"INSERT INTO " + tempName + " " + source,
+		"DROP TABLE " + table.name,
+		"ALTER TABLE " + tempName + " RENAME TO " + table.name
+	};
+	for(const string& step : steps)
+	{
+		rc = execSQL(db, step);
+		if(rc != SQLITE_OK)
+			break;
+	}
+	if(rc != SQLITE_OK) //OK
+	{
+		sqliteError error(db);
+		execSQL(db, "ROLLBACK TO rebuildTable");
+		execSQL(db, "RELEASE rebuildTable");
+		Log(db, "rebuildTable", "TABLE:" + table.name, "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_rebuildTable", error);
+		return -2;
+	}
+	rc = createIndexes(db, table, err);
+	if(rc < 0) //OK
+	{
+		execSQL(db, "ROLLBACK TO rebuildTable");
+		execSQL(db, "RELEASE rebuildTable");
+		Log(db, "rebuildTable", "TABLE:" + table.name, "SYSTEM", "FAIL_ERROR-createIndexes:" + to_string(rc), err.traceOnly());
+		err.callFailed("_rebuildTable", "createIndexes", rc);
+		return -3;
+	}
+	if(execSQL(db, "RELEASE rebuildTable") != SQLITE_OK) //OK
+	{
+		sqliteError error(db);
+		Log(db, "rebuildTable", "TABLE:" + table.name, "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_rebuildTable", error);
+		return -4;
+	}
+	storeSchemaFingerprint(db, table);
+	Log(db, "rebuildTable", "TABLE:" + table.name, "SYSTEM", "OK", err.traceOnly());
+	err.ok("_rebuildTable");
+	return 0;
+}
+
+struct existingColumn {
+	string name;
+	string type;
+	bool primaryKey;
+	bool notNull;
+};
+
+static int readColumns(sqlite3 *db, const string& tableName, vector<existingColumn> *columns)
+{
+	cachedStmt res;
+	if(prepareCached(db, "SELECT name, type, pk, \"notnull\" FROM pragma_table_info(?)", &res) != SQLITE_OK)
+		return -1;
+	if(sqlite3_bind_text(res, 1, tableName.c_str(), -1, SQLITE_STATIC) != SQLITE_OK)
+		return -2;
+	int rc;
+	while((rc = sqlite3_step(res)) == SQLITE_ROW)
+	{
+		columns->push_back(existingColumn{reinterpret_cast<const char*>(sqlite3_column_text(res, 0)),
+			reinterpret_cast<const char*>(sqlite3_column_text(res, 1)), sqlite3_column_int(res, 2) > 0, sqlite3_column_int(res, 3) != 0});
+	}
+	return rc == SQLITE_DONE ? 0 : -3;
+}
+
+// ALTER TABLE can only append columns without keys, UNIQUE or NOT NULL (there are no defaults)
+static bool onlyAddsColumns(const vector<existingColumn>& current, const vector<column>& target)
+{
+	if(current.size() > target.size())
+		return false;
+	for(size_t i = 0; i < target.size(); i++)
+	{
+		const column& col = target[i];
+		if(i >= current.size())
+		{
+			if(col.constraints != COLUMN_NONE)
+				return false;
+			continue;
+		}
+		if(current[i].name != col.name || current[i].type != col.type ||
+		current[i].primaryKey != ((col.constraints & COLUMN_PRIMARY_KEY) != 0) || current[i].notNull != ((col.constraints & COLUMN_NOT_NULL) != 0))
+			return false;
+	}
+	return true;
+}
+
+static int migrationFailed(sqlite3 *db, immediateTransaction *transaction, const string& tableName, int code, resultSink err)
+{
+	sqliteError error(db);
+	transaction->rollback();
+	Log(db, "migrateTable", "TABLE:" + tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+	err.sqliteFail("_migrateTable", error);
+	return code;
+}
+
+// 0 - done, 1 - the table needs a copy after all (missing UNIQUE and the like)
+static int addColumns(sqlite3 *db, const tableInfo& table, size_t from, resultSink err)
+{
+	immediateTransaction transaction;
+	if(transaction.begin(db, err) < 0)
+		return migrationFailed(db, &transaction, table.name, -5, err);
+	for(size_t i = from; i < table.columns.size(); i++)
+	{
+		if(execSQL(db, "ALTER TABLE " + table.name + " ADD COLUMN " + table.columns[i].name + " " + table.columns[i].type) != SQLITE_OK) //OK
+			return migrationFailed(db, &transaction, table.name, -5, err);
+	}
+	if(createIndexes(db, table, err.traceOnly()) < 0) //OK
+		return migrationFailed(db, &transaction, table.name, -5, err);
+	if(diffTable(db, table, err.traceOnly()) != 0)
+		return 1; //rolled back by transaction
+	if(transaction.commit(err.traceOnly()) < 0) //OK
+		return migrationFailed(db, &transaction, table.name, -5, err);
+	return 0;
+}
+
+// Progress of an interrupted copy: 1 - found, 0 - none
+static int readMigration(sqlite3 *db, migrationProgress *progress)
+{
+	cachedStmt res;
+	if(prepareCached(db, "SELECT lastRowid, copiedRows, batches FROM schemaMigrations WHERE tableName = ?", &res) != SQLITE_OK)
+		return -1;
+	if(sqlite3_bind_text(res, 1, progress->table.c_str(), -1, SQLITE_STATIC) != SQLITE_OK)
+		return -2;
+	int rc = sqlite3_step(res);
+	if(rc == SQLITE_DONE)
+		return 0;
+	if(rc != SQLITE_ROW)
+		return -3;
+	progress->lastRowid = sqlite3_column_int64(res, 0);
+	progress->copiedRows = sqlite3_column_int64(res, 1);
+	progress->batches = sqlite3_column_int64(res, 2);
+	return 1;
+}
+
+static int writeMigration(sqlite3 *db, const migrationProgress& progress)
+{
+	cachedStmt res;
+	if(prepareCached(db, "INSERT INTO schemaMigrations(tableName, lastRowid, copiedRows, batches) VALUES(?, ?, ?, ?) "
+		"ON CONFLICT(tableName) DO UPDATE SET lastRowid = excluded.lastRowid, copiedRows = excluded.copiedRows, batches = excluded.batches", &res) != SQLITE_OK)
+		return -1;
+	if(sqlite3_bind_text(res, 1, progress.table.c_str(), -1, SQLITE_STATIC) != SQLITE_OK ||
+	sqlite3_bind_int64(res, 2, progress.lastRowid) != SQLITE_OK ||
+	sqlite3_bind_int64(res, 3, progress.copiedRows) != SQLITE_OK ||
+	sqlite3_bind_int64(res, 4, static_cast<sqlite3_int64>(progress.batches)) != SQLITE_OK)
+		return -2;
+	return sqlite3_step(res) == SQLITE_DONE ? 0 : -3;
+}
+
+// Copies again the rows of the copied part whose keys the triggers of copyTable recorded in
+// schemaMigrationRows: their copies go and the rows that still exist are copied anew. A NULL
+// key has no copy to find, then everything is copied again by the batch that follows.
+static int recopyChanged(sqlite3 *db, const string& tableName, const string& key, const string& columns, migrationProgress *progress)
+{
+	string tempName = tableName + "_migrate";
+	string changed = "SELECT rowKey FROM schemaMigrationRows WHERE tableName = '" + tableName + "'";
+	long long recorded = 0, keyed = 0;
+	{
+		cachedStmt res;
+		if(prepareCached(db, "SELECT COUNT(*), COUNT(rowKey) FROM schemaMigrationRows WHERE tableName = ?", &res) != SQLITE_OK ||
+		sqlite3_bind_text(res, 1, tableName.c_str(), -1, SQLITE_STATIC) != SQLITE_OK || sqlite3_step(res) != SQLITE_ROW)
+			return -1;
+		recorded = sqlite3_column_int64(res, 0);
+		keyed = sqlite3_column_int64(res, 1);
+	}
+	if(recorded == 0)
+		return 0;
+	if(keyed < recorded)
+	{
+		if(execSQL(db, "DELETE FROM " + tempName) != SQLITE_OK)
+			return -1;
+		progress->lastRowid = 0;
+		progress->copiedRows = 0;
+		return 0;
+	}
+	if(execSQL(db, "DELETE FROM " + tempName + " WHERE rowid IN (" + changed + ")") != SQLITE_OK)
+		return -1;
+	progress->copiedRows -= sqlite3_changes(db);
+	if(execSQL(db, "INSERT INTO " + tempName + "(" + columns + ") SELECT " + columns + " FROM " + tableName + " WHERE rowid <= " +
+		to_string(progress->lastRowid) + " AND " + key + " IN (" + changed + ") ORDER BY rowid") != SQLITE_OK)
+		return -1;
+	progress->copiedRows += sqlite3_changes(db);
+	return 0;
+}
+
+// Copies table.name into table.name + "_migrate" batch by batch in rowid order. Every batch
+// is its own transaction that also saves the progress in schemaMigrations, so a copy that
+// was paused or interrupted goes on from the last batch. A copied row keeps the rowid of its
+// source row, or takes the value of a column that becomes the INTEGER PRIMARY KEY; triggers
+// on the table record that key for every insert, update and delete of rows that are copied
+// already. The last transaction copies those rows again and what was appended meanwhile,
+// and swaps the tables. 0 - done, 1 - paused.
+static int copyTable(sqlite3 *db, const tableInfo& table, const vector<existingColumn>& current, const migrationOptions& options, migrationProgress *progress, resultSink err)
+{
+	string tempName = table.name + "_migrate";
+	string columns;
+	string key = "rowid";
+	size_t primaryKeys = count_if(table.columns.begin(), table.columns.end(), [](const column& col) { return (col.constraints & COLUMN_PRIMARY_KEY) != 0; });
+	for(const column& col : table.columns)
+	{
+		if(!any_of(current.begin(), current.end(), [&](const existingColumn& old) { return old.name == col.name; }))
+			continue;
+		columns += (columns.empty() ? "" : ", ") + col.name;
+		if(primaryKeys == 1 && (col.constraints & COLUMN_PRIMARY_KEY) && col.type == "INTEGER")
+			key = col.name;
+	}
+	if(key == "rowid")
+		columns = columns.empty() ? "rowid" : "rowid, " + columns;
+	*progress = migrationProgress{table.name, 0, 0, 0, 0};
+	{
+		immediateTransaction transaction;
+		if(transaction.begin(db, err.traceOnly()) < 0 ||
+		execSQL(db, "CREATE TABLE IF NOT EXISTS schemaMigrations (tableName TEXT PRIMARY KEY, lastRowid INTEGER NOT NULL, copiedRows INTEGER NOT NULL, "
+			"batches INTEGER NOT NULL)") != SQLITE_OK ||
+		execSQL(db, "CREATE TABLE IF NOT EXISTS schemaMigrationRows (tableName TEXT NOT NULL, rowKey INTEGER)") != SQLITE_OK)
+			return migrationFailed(db, &transaction, table.name, -6, err);
+		int found = readMigration(db, progress);
+		if(found < 0)
+			return migrationFailed(db, &transaction, table.name, -6, err);
+		// The copy goes on only into a table of the same definition
+		if(found == 0 || diffTable(db, tableInfo(tempName, table.columns), err.traceOnly()) != 0)
+		{
+			*progress = migrationProgress{table.name, 0, 0, 0, 0};
+			if(execSQL(db, "DROP TABLE IF EXISTS " + tempName) != SQLITE_OK || execSQL(db, createTableSQL(tempName, table.columns)) != SQLITE_OK ||
+			execSQL(db, "DELETE FROM schemaMigrations WHERE tableName = '" + table.name + "'") != SQLITE_OK ||
+			execSQL(db, "DELETE FROM schemaMigrationRows WHERE tableName = '" + table.name + "'") != SQLITE_OK || writeMigration(db, *progress) != 0) //OK
+				return migrationFailed(db, &transaction, table.name, -6, err);
+		}
+		// Persistent triggers, so writes of every connection and of a paused copy are recorded
+		string copied = "(SELECT lastRowid FROM schemaMigrations WHERE tableName = '" + table.name + "')";
+		string record = " BEGIN INSERT INTO schemaMigrationRows(tableName, rowKey) VALUES";
+		string name = "('" + table.name + "', ";
+		if(execSQL(db, "CREATE TRIGGER IF NOT EXISTS " + tempName + "_insert AFTER INSERT ON " + table.name + " WHEN NEW.rowid <= " + copied +
+			record + name + "NEW." + key + "); END") != SQLITE_OK ||
+		execSQL(db, "CREATE TRIGGER IF NOT EXISTS " + tempName + "_update AFTER UPDATE ON " + table.name + " WHEN OLD.rowid <= " + copied + " OR NEW.rowid <= " + copied +
+			record + name + "OLD." + key + "), " + name + "NEW." + key + "); END") != SQLITE_OK ||
+		execSQL(db, "CREATE TRIGGER IF NOT EXISTS " + tempName + "_delete AFTER DELETE ON " + table.name + " WHEN OLD.rowid <= " + copied +
+			record + name + "OLD." + key + "); END") != SQLITE_OK)
+			return migrationFailed(db, &transaction, table.name, -6, err);
+		if(transaction.commit(err.traceOnly()) < 0) //OK
+			return migrationFailed(db, &transaction, table.name, -6, err);
+	}
+	string boundsSQL = "SELECT (SELECT rowid FROM " + table.name + " WHERE rowid > ?1 ORDER BY rowid LIMIT 1 OFFSET ?2), (SELECT MAX(rowid) FROM " + table.name + ")";
+	string copySQL = "INSERT INTO " + tempName + "(" + columns + ") SELECT " + columns + " FROM " + table.name + " WHERE rowid > ?1 AND rowid <= ?2 ORDER BY rowid";
+	while(true)
+	{
+		immediateTransaction transaction;
+		if(transaction.begin(db, err.traceOnly()) < 0) //OK
+			return migrationFailed(db, &transaction, table.name, -7, err);
+		long long upto;
+		{
+			cachedStmt res;
+			if(prepareCached(db, boundsSQL.c_str(), &res) != SQLITE_OK || sqlite3_bind_int64(res, 1, progress->lastRowid) != SQLITE_OK ||
+			sqlite3_bind_int64(res, 2, options.batchRows - 1) != SQLITE_OK || sqlite3_step(res) != SQLITE_ROW) //OK
+				return migrationFailed(db, &transaction, table.name, -7, err);
+			progress->maxRowid = sqlite3_column_int64(res, 1);
+			upto = sqlite3_column_type(res, 0) != SQLITE_NULL ? sqlite3_column_int64(res, 0) : progress->maxRowid;
+		}
+		bool last = upto <= progress->lastRowid;
+		if(last)
+		{
+			upto = progress->maxRowid; //nothing left to batch, the write lock keeps it that way until the swap
+			if(recopyChanged(db, table.name, key, columns, progress) < 0)
+				return migrationFailed(db, &transaction, table.name, -8, err);
+		}
+		{
+			cachedStmt res;
+			if(prepareCached(db, copySQL.c_str(), &res) != SQLITE_OK || sqlite3_bind_int64(res, 1, progress->lastRowid) != SQLITE_OK ||
+			sqlite3_bind_int64(res, 2, upto) != SQLITE_OK || sqlite3_step(res) != SQLITE_DONE) //OK
+				return migrationFailed(db, &transaction, table.name, -7, err);
+		}
+		progress->copiedRows += sqlite3_changes(db);
+		if(last)
+		{
+			if(execSQL(db, "DROP TABLE " + table.name) != SQLITE_OK || execSQL(db, "ALTER TABLE " + tempName + " RENAME TO " + table.name) != SQLITE_OK ||
+			createIndexes(db, table, err.traceOnly()) < 0 || execSQL(db, "DELETE FROM schemaMigrations WHERE tableName = '" + table.name + "'") != SQLITE_OK ||
+			execSQL(db, "DELETE FROM schemaMigrationRows WHERE tableName = '" + table.name + "'") != SQLITE_OK) //OK
+				return migrationFailed(db, &transaction, table.name, -8, err);
+			if(transaction.commit(err.traceOnly()) < 0) //OK
+				return migrationFailed(db, &transaction, table.name, -8, err);
+			return 0;
+		}
+		progress->lastRowid = upto;
+		progress->batches++;
+		if(writeMigration(db, *progress) != 0) //OK
+			return migrationFailed(db, &transaction, table.name, -7, err);
+		if(transaction.commit(err.traceOnly()) < 0) //OK
+			return migrationFailed(db, &transaction, table.name, -7, err);
+		if(options.progress != nullptr && !options.progress(*progress, options.context))
+			return 1;
+	}
+}
+
+int migrateTable(sqlite3 *db, tableInfo table, const migrationOptions& options, resultSink err)
+{
+	SQL_METRIC_SCOPE("migrateTable");
+	if(options.batchRows == 0)
+	{
+		err.fail(RESULT_INVALID_ARGUMENT, "_migrateTable", "batchRows must be positive");
+		return -1;
+	}
+	int rc = checkTable(db, table, err.traceOnly());
+	if(rc < 0) //OK
+	{
+		Log(db, "migrateTable", "TABLE:" + table.name, "SYSTEM", "FAIL_ERROR-checkTable:" + to_string(rc), err.traceOnly());
+		err.callFailed("_migrateTable", "checkTable", rc);
+		return -2;
+	}
+	if(rc == 0)
+	{
+		err.ok("_migrateTable");
+		return 0;
+	}
+	if(rc == 1)
+	{
+		rc = createTable(db, table, err);
+		if(rc != 0) //OK
+		{
+			err.callFailed("_migrateTable", "createTable", rc);
+			return -3;
+		}
+		err.ok("_migrateTable", "CREATED");
+		return 0;
+	}
+	vector<existingColumn> current;
+	if(readColumns(db, table.name, &current) < 0) //OK
+	{
+		sqliteError error(db);
+		Log(db, "migrateTable", "TABLE:" + table.name, "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_migrateTable", error);
+		return -4;
+	}
+	if(onlyAddsColumns(current, table.columns))
+	{
+		rc = addColumns(db, table, current.size(), err);
+		if(rc < 0)
+			return rc;
+		if(rc == 0)
+		{
+			storeSchemaFingerprint(db, table);
+			Log(db, "migrateTable", "TABLE:" + table.name, "SYSTEM", "OK(ALTER)", err.traceOnly());
+			err.ok("_migrateTable", "ALTER");
+			return 0;
+		}
+	}
+	migrationProgress progress;
+	rc = copyTable(db, table, current, options, &progress, err);
+	if(rc < 0)
+		return rc;
+	string copied = to_string(progress.copiedRows) + " rows copied";
+	if(rc == 1)
+	{
+		Log(db, "migrateTable", "TABLE:" + table.name, "SYSTEM", "OK(WARN):paused, " + copied, err.traceOnly());
+		err.warn("_migrateTable", "paused, ", copied.c_str());
+		return 1;
+	}
+	storeSchemaFingerprint(db, table);
+	Log(db, "migrateTable", "TABLE:" + table.name, "SYSTEM", "OK(COPY)", err.traceOnly());
+	err.ok("_migrateTable", "COPY");
+	return 0;
+}
+
+int createTable(sqlite3 *db, tableInfo table, resultSink err)
+{
+	SQL_METRIC_SCOPE("createTable");
+	const string& tableName = table.name;
+	int rc = checkTable(db, table, err);
+	if(rc == 0)
+	{
+		Log(db, "createTable", "TABLE:" + tableName, "SYSTEM", "OK", err.traceOnly());
+		err.ok("_createTable");
+		return 0;
+	}
+	if(rc == 7) //не хватает только индексов, таблицу можно не пересоздавать
+	{
+		rc = createIndexes(db, table, err);
+		if(rc < 0)
+		{
+			Log(db, "createTable", "TABLE:" + tableName, "SYSTEM", "FAIL_ERROR-createIndexes:" + to_string(rc), err.traceOnly());
+			err.callFailed("_createTable", "createIndexes", rc);
+			return -3;
+		}
+		storeSchemaFingerprint(db, table);
+		Log(db, "createTable", "TABLE:" + tableName, "SYSTEM", "OK", err.traceOnly());
+		err.ok("_createTable");
+		return 0;
+	}
+	if(rc > 1) //таблица устарела: данные переносятся, а не удаляются
+	{
+		rc = migrateTable(db, table, migrationOptions(), err);
+		if(rc != 0)
+		{
+			Log(db, "createTable", "TABLE:" + tableName, "SYSTEM", "FAIL_ERROR-migrateTable:" + to_string(rc), err.traceOnly());
+			err.callFailed("_createTable", "migrateTable", rc);
+			return -4;
+		}
+		Log(db, "createTable", "TABLE:" + tableName, "SYSTEM", "OK", err.traceOnly());
+		err.ok("_createTable");
+		return 0;
+	}
+	if(rc < 0)
+	{
+		Log(db, "createTable", "TABLE:" + tableName, "SYSTEM", "FAIL_ERROR-checkTable:" + to_string(rc), err.traceOnly());
+		err.callFailed("_createTable", "checkTable", rc);
+	}
+	// Формируем SQL-запрос для создания таблицы
+	string sql = createTableSQL(tableName, table.columns);
 
 	// Подготовка и выполнение запроса
 	sqlite3_stmt *res;
 	rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &res, nullptr);
 	if (rc != SQLITE_OK) {
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "createTable", "TABLE:" + tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-		errString->append("_createTable-FAIL_ERROR-SQLite:" + string(errmsg));
+		sqliteError error(db);
+		Log(db, "createTable", "TABLE:" + tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_createTable", error);
 		sqlite3_finalize(res);
 		return -1;
 	}
 
 	rc = sqlite3_step(res);
 	if (rc != SQLITE_DONE) {
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "createTable", "TABLE:" + tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-		errString->append("_createTable-FAIL_ERROR-SQLite:" + string(errmsg));
+		sqliteError error(db);
+		Log(db, "createTable", "TABLE:" + tableName, "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_createTable", error);
 		sqlite3_finalize(res);
 		return -2;
 	}
 
-	// Успешное создание
-	Log(db, "createTable", "TABLE:" + tableName, "SYSTEM", "OK", errString);
-	errString->append("_createTable-OK");
 	sqlite3_finalize(res);
+	rc = createIndexes(db, table, err);
+	if (rc < 0) {
+		Log(db, "createTable", "TABLE:" + tableName, "SYSTEM", "FAIL_ERROR-createIndexes:" + to_string(rc), err.traceOnly());
+		err.callFailed("_createTable", "createIndexes", rc);
+		return -3;
+	}
+
+	// Успешное создание, следующая проверка пройдёт по отпечатку
+	storeSchemaFingerprint(db, table);
+	Log(db, "createTable", "TABLE:" + tableName, "SYSTEM", "OK", err.traceOnly());
+	err.ok("_createTable");
+	return 0;
+}
+
+int createTable(sqlite3 *db, string tableName, vector<column> columns, resultSink err)
+{
+	return createTable(db, tableInfo(tableName, columns), err);
+}
+
+
+
+static const char *journalModeName(journalMode mode)
+{
+	switch(mode)
+	{
+		case JOURNAL_DELETE: return "delete";
+		case JOURNAL_TRUNCATE: return "truncate";
+		case JOURNAL_PERSIST: return "persist";
+		case JOURNAL_MEMORY: return "memory";
+		case JOURNAL_WAL: return "wal";
+		case JOURNAL_OFF: return "off";
+		default: return nullptr;
+	}
+}
+
+static const char *invalidOption(const connectionOptions& options)
+{
+	if(options.journal != JOURNAL_DEFAULT && journalModeName(options.journal) == nullptr)
+		return "journal";
+	if(options.synchronous < SYNCHRONOUS_OFF || options.synchronous > SYNCHRONOUS_EXTRA)
+		return "synchronous";
+	if(options.cacheSizeKiB <= 0)
+		return "cacheSizeKiB";
+	if(options.mmapSize < 0)
+		return "mmapSize";
+	if(options.busyTimeoutMs < 0)
+		return "busyTimeoutMs";
+	if(options.tempStore < TEMP_STORE_DEFAULT || options.tempStore > TEMP_STORE_MEMORY)
+		return "tempStore";
+	if(options.busyRetries < 0)
+		return "busyRetries";
+	if(options.busyRetryBackoffMs < 0)
+		return "busyRetryBackoffMs";
+	return nullptr;
+}
+
+// Runs a pragma and returns the value it reports back, pragmas ignore values they cannot apply
+static int pragma(sqlite3 *db, const string& sql, string *result)
+{
+	sqlite3_stmt *res;
+	if(sqlite3_prepare_v2(db, sql.c_str(), -1, &res, 0) != SQLITE_OK)
+		return -1;
+	int rc = sqlite3_step(res);
+	if(rc == SQLITE_ROW && sqlite3_column_text(res, 0) != nullptr)
+		result->assign(reinterpret_cast<const char*>(sqlite3_column_text(res, 0)));
+	sqlite3_finalize(res);
+	return rc == SQLITE_ROW || rc == SQLITE_DONE ? 0 : -2;
+}
+
+int configureConnection(sqlite3 *db, const connectionOptions& options, resultSink err)
+{
+	SQL_METRIC_SCOPE("configureConnection");
+	const char *invalid = invalidOption(options);
+	if(invalid != nullptr)
+	{
+		err.fail(RESULT_INVALID_ARGUMENT, "_configureConnection", "invalid option ", invalid);
+		return -1;
+	}
+	if(sqlite3_busy_timeout(db, options.busyTimeoutMs) != SQLITE_OK || registerCompactLogFunctions(db) < 0)
+	{
+		err.sqliteFail("_configureConnection", db);
+		return -2;
+	}
+	string result;
+	string journal;
+	if(options.journal != JOURNAL_DEFAULT)
+	{
+		const char *mode = journalModeName(options.journal);
+		if(pragma(db, "PRAGMA journal_mode = " + string(mode), &journal) != 0)
+		{
+			err.sqliteFail("_configureConnection", db);
+			return -2;
+		}
+		if(journal == mode)
+			journal.clear();
+	}
+	string pragmas[] = {
+		"PRAGMA synchronous = " + to_string(options.synchronous),
+		"PRAGMA cache_size = -" + to_string(options.cacheSizeKiB),
+		"PRAGMA mmap_size = " + to_string(options.mmapSize),
+		"PRAGMA temp_store = " + to_string(options.tempStore)
+	};
+	for(const string& sql : pragmas)
+	{
+		if(pragma(db, sql, &result) != 0)
+		{
+			err.sqliteFail("_configureConnection", db);
+			return -2;
+		}
+	}
+	if(!journal.empty()) //in-memory databases only have memory or off
+		err.warn("_configureConnection", "journal_mode is ", journal.c_str());
+	else
+		err.ok("_configureConnection");
+	return 0;
+}
+
+shared_ptr<const connectionOptions> getConnectionOptions(sqlite3 *db)
+{
+	return static_pointer_cast<const connectionOptions>(getConnectionData(db, "connectionOptions"));
+}
+
+// The busy handler has already waited busyTimeoutMs, the retries back off on top of it
+static int execRetryingBusy(sqlite3 *db, const char *sql)
+{
+	shared_ptr<const connectionOptions> options = getConnectionOptions(db);
+	connectionOptions defaults;
+	int retries = options != nullptr ? options->busyRetries : defaults.busyRetries;
+	int backoffMs = options != nullptr ? options->busyRetryBackoffMs : defaults.busyRetryBackoffMs;
+	int rc = execSQL(db, sql);
+	for(int attempt = 0; (rc & 0xff) == SQLITE_BUSY && attempt < retries; attempt++)
+	{
+		this_thread::sleep_for(chrono::milliseconds(backoffMs << min(attempt, 10)));
+		rc = execSQL(db, sql);
+	}
+	return rc;
+}
+
+immediateTransaction::immediateTransaction() : db(nullptr), nested(false) {}
+
+immediateTransaction::~immediateTransaction()
+{
+	rollback();
+}
+
+int immediateTransaction::begin(sqlite3 *conn, resultSink err)
+{
+	if(db != nullptr)
+	{
+		err.fail(RESULT_CONFLICT, "_beginTransaction", "transaction is already begun");
+		return -3;
+	}
+	bool inside = sqlite3_get_autocommit(conn) == 0;
+	int rc = SQL_TIMED(SQL_PHASE_STEP, execRetryingBusy(conn, inside ? "SAVEPOINT immediateTransaction" : "BEGIN IMMEDIATE"));
+	if(rc != SQLITE_OK) //OK
+	{
+		err.sqliteFail("_beginTransaction", conn);
+		return (rc & 0xff) == SQLITE_BUSY ? -1 : -2;
+	}
+	db = conn;
+	nested = inside;
+	err.ok("_beginTransaction");
+	return 0;
+}
+
+int immediateTransaction::commit(resultSink err)
+{
+	if(db == nullptr)
+	{
+		err.fail(RESULT_CONFLICT, "_commitTransaction", "transaction is not begun");
+		return -3;
+	}
+	// Some errors (SQLITE_FULL, SQLITE_IOERR, ...) make SQLite roll back the whole transaction
+	if(!nested && sqlite3_get_autocommit(db) != 0)
+	{
+		db = nullptr;
+		err.fail(RESULT_CONFLICT, "_commitTransaction", "transaction has been rolled back");
+		return -4;
+	}
+	int rc = SQL_TIMED(SQL_PHASE_STEP, execRetryingBusy(db, nested ? "RELEASE immediateTransaction" : "COMMIT"));
+	if(rc != SQLITE_OK) //OK
+	{
+		sqliteError error(db);
+		rollback();
+		err.sqliteFail("_commitTransaction", error);
+		return (rc & 0xff) == SQLITE_BUSY ? -1 : -2;
+	}
+	db = nullptr;
+	err.ok("_commitTransaction");
 	return 0;
 }
 
-int createTable(sqlite3 *db, tableInfo table, string *errString)
+void immediateTransaction::rollback()
 {
-	return createTable(db, table.name, table.columns, errString);
+	if(db == nullptr)
+		return;
+	if(nested)
+	{
+		execSQL(db, "ROLLBACK TO immediateTransaction");
+		execSQL(db, "RELEASE immediateTransaction");
+	}
+	else if(sqlite3_get_autocommit(db) == 0)
+		execSQL(db, "ROLLBACK");
+	db = nullptr;
 }
 
+bool immediateTransaction::active() const
+{
+	return db != nullptr;
+}
 
+int initBaseSQL(sqlite3 **db, string databaseName, resultSink err)
+{
+	return initBaseSQL(db, databaseName, connectionOptions(), err);
+}
 
-int initBaseSQL(sqlite3 **db, string databaseName, string *errString)
+int initBaseSQL(sqlite3 **db, string databaseName, const connectionOptions& options, resultSink err)
 {
-	textLogFile = fopen("textLog", "a");
-	if(textLogFile == NULL)
+	SQL_METRIC_SCOPE("initBaseSQL");
+	int rc;
+	if(!hasTextLog() && openTextLog(textLogOptions(), err.traceOnly()) < 0 && !hasTextLog()) //another thread may have opened it
 	{
 		printf("ERROR:Disabble to open file\n");
+		err.fail(RESULT_UNAVAILABLE, "_initBaseSQL", "cannot open textLog");
 		return -1;
 	}
 	if (sqlite3_open(databaseName.c_str(), db) != SQLITE_OK)
 	{
 		textLog(*db, "initBaseSQL", "DATABASE", "SYSTEM", "FAIL_ERROR-SQLite");
-		errString->append("_initBaseSQL-FAIL_ERROR-SQLite");
+		err.sqliteFail("_initBaseSQL", *db);
 		return -2;
 	}
-	int rc = checkTable(*db, LogInfo, errString);
+	rc = configureConnection(*db, options, err);
+	if(rc < 0)
+	{
+		textLog(*db, "initBaseSQL", "DATABASE", "SYSTEM", "FAIL_ERROR-configureConnection:" + to_string(rc));
+		err.callFailed("_initBaseSQL", "configureConnection", rc);
+		return -6;
+	}
+	setConnectionData(*db, "connectionOptions", make_shared<connectionOptions>(options));
+	rc = attachCompactLog(*db, err.traceOnly());
+	if(rc < 0)
+	{
+		textLog(*db, "initBaseSQL", "TABLE:Log", "SYSTEM", "FAIL_ERROR-attachCompactLog:" + to_string(rc));
+		err.callFailed("_initBaseSQL", "attachCompactLog", rc);
+		return -7;
+	}
+	if(rc == 1) //Log is a view over LogCompact, see CompactLog.h
+	{
+		Log(*db, "initBaseSQL", "DATABASE", "SYSTEM", "OK", err.traceOnly());
+		err.ok("_initBaseSQL", "COMPACT");
+		return 0;
+	}
+	rc = checkTable(*db, LogInfo, err);
 	if(rc > 0)
 	{
 		textLog(*db, "initBaseSQL", "TABLE:Log", "SYSTEM", "OK(WARN):table in an unexpected way");
-		errString->append("_initBaseSQL-OK(WARN):table in an unexpected way");
-		if (rc != 1)
-		{
-			int rrc = dropTable(*db, LogInfo, errString);
-			if(rrc < 0)
-			{
-				textLog(*db, "initBaseSQL", "TABLE:Log", "SYSTEM", "FAIL_ERROR-dropTable:" + to_string(rrc));
-				errString->append("_initBaseSQL-FAIL_ERROR-dropTable:" + to_string(rrc));
-				return -3;
-			}
-		}
-		rc = createTable(*db, LogInfo, errString);
+		err.warn("_initBaseSQL", "table in an unexpected way");
+		bool existed = rc != 1;
+		rc = createTable(*db, LogInfo, err); //an outdated Log is migrated with its records
 		if(rc != 0)
 		{
 			textLog(*db, "initBaseSQL", "TABLE:Log", "SYSTEM", "FAIL_ERROR-createTable:" + to_string(rc));
-			errString->append("_initBaseSQL-FAIL_ERROR-createTable:" + to_string(rc));
+			err.callFailed("_initBaseSQL", "createTable", rc);
 			return -4;
 		}
-		Log(*db, "initBaseSQL", "DATABASE", "SYSTEM", "OK(WARN):the table has been overwritten", errString);
-		errString->append("_initBaseSQL-OK(WARN):the table has been overwritten");
+		// Records written before eventDateTime became an integer keep their local time text
+		if(existed && execSQL(*db, "UPDATE Log SET eventDateTime = CAST(strftime('%s', eventDateTime, 'utc') AS INTEGER) "
+			"WHERE typeof(eventDateTime) = 'text'") != SQLITE_OK)
+		{
+			textLog(*db, "initBaseSQL", "TABLE:Log", "SYSTEM", "OK(WARN):eventDateTime has not been converted");
+			err.warn("_initBaseSQL", "eventDateTime has not been converted");
+		}
+		const char *done = existed ? "the table has been migrated" : "the table has been created";
+		Log(*db, "initBaseSQL", "DATABASE", "SYSTEM", string("OK(WARN):") + done, err.traceOnly());
+		err.warn("_initBaseSQL", done);
 		return 0;
 	}
 	if(rc < 0)
 	{
 		textLog(*db, "initBaseSQL", "TABLE:Log", "SYSTEM", "FAIL_ERROR-checkTable:" + to_string(rc));
-		errString->append("_initBaseSQL-FAIL_ERROR:" + to_string(rc));
+		err.callFailed("_initBaseSQL", "checkTable", rc);
 		return -5;
 	}
-	Log(*db, "initBaseSQL", "DATABASE", "SYSTEM", "OK", errString);
-	errString->append("_initBaseSQL-OK");
+	Log(*db, "initBaseSQL", "DATABASE", "SYSTEM", "OK", err.traceOnly());
+	err.ok("_initBaseSQL");
+	return 0;
+}
+
+void setConnectionData(sqlite3 *db, const string& key, shared_ptr<void> data)
+{
+	lock_guard<mutex> guard(connectionDataLock);
+	if(data == nullptr)
+		connectionData[db].erase(key);
+	else
+		connectionData[db][key] = data;
+	dataVersion++;
+}
+
+unsigned connectionDataVersion()
+{
+	return dataVersion.load(memory_order_acquire);
+}
+
+shared_ptr<void> getConnectionData(sqlite3 *db, const string& key)
+{
+	lock_guard<mutex> guard(connectionDataLock);
+	auto it = connectionData.find(db);
+	if(it == connectionData.end())
+		return nullptr;
+	auto data = it->second.find(key);
+	return data == it->second.end() ? nullptr : data->second;
+}
+
+int closeBaseSQL(sqlite3 *db, resultSink err)
+{
+	SQL_METRIC_SCOPE("closeBaseSQL");
+	if(hasLogWriter(db))
+		stopLogWriter(db, err);
+	map<string, shared_ptr<void>> data;
+	{
+		lock_guard<mutex> guard(connectionDataLock);
+		auto it = connectionData.find(db);
+		if(it != connectionData.end())
+		{
+			data.swap(it->second);
+			connectionData.erase(it);
+			dataVersion++;
+		}
+	}
+	data.clear(); //destructors may touch connection data themselves
+	clearStmtCache(db);
+	if(sqlite3_close(db) != SQLITE_OK)
+	{
+		err.sqliteFail("_closeBaseSQL", db);
+		return -1;
+	}
+	err.ok("_closeBaseSQL");
 	return 0;
 }
@@ -0,0 +1,413 @@
+#include <sqlite3.h>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
+#if defined LOG_DETAIL_ZLIB
+#include <zlib.h>
+#endif
+#include "SQL/BaseSQL.h"
+#include "SQL/StmtCache.h"
+#include "SQL/LogPartitions.h"
+#include "SQL/Metrics.h"
+#include "SQL/CompactLog.h"
+
+using namespace std;
+
+#define COMPACT_LOG_CACHE_SIZE 4096     //dictionary ids kept in memory, the cache starts over when it is full
+#define COMPACT_LOG_COMPRESS_BYTES 128  //shorter details are stored as text
+
+static atomic<size_t> compactDatabases(0); //lets Log() skip the lookup when no Log is compact
+
+struct compactLogState {
+	mutex lock;
+	unordered_map<string, long long> ids; //strings whose dictionary rows are committed
+	unordered_set<string> uncommitted;    //strings added inside a transaction that has not been seen to commit
+	bool compressDetails = false;
+
+	compactLogState();
+	~compactLogState();
+};
+
+static const string COMPACT_LOG_KEY = "compactLog";
+
+compactLogState::compactLogState()
+{
+	compactDatabases.fetch_add(1, memory_order_release);
+}
+
+compactLogState::~compactLogState()
+{
+	compactDatabases.fetch_sub(1, memory_order_release);
+}
+
+static shared_ptr<compactLogState> findCompact(sqlite3 *db)
+{
+	if(compactDatabases.load(memory_order_acquire) == 0)
+		return nullptr;
+	return static_pointer_cast<compactLogState>(getConnectionData(db, COMPACT_LOG_KEY));
+}
+
+static void rememberString(compactLogState *state, const string& value, long long id)
+{
+	lock_guard<mutex> guard(state->lock);
+	if(state->ids.size() >= COMPACT_LOG_CACHE_SIZE)
+		state->ids.clear();
+	state->ids[value] = id;
+	state->uncommitted.erase(value);
+}
+
+// The lock is not held while the dictionary is read, another connection may be waiting for it
+static int readStringId(sqlite3 *conn, compactLogState *state, const string& value, long long *id, compactLogStrings *learned)
+{
+	cachedStmt res;
+	if(prepareCached(conn, "SELECT id FROM LogStrings WHERE value = ?", &res) != SQLITE_OK ||
+	sqlite3_bind_text(res, 1, value.c_str(), -1, SQLITE_STATIC) != SQLITE_OK)
+		return -1;
+	int rc = sqlite3_step(res);
+	bool inTransaction = sqlite3_get_autocommit(conn) == 0;
+	if(rc == SQLITE_ROW)
+	{
+		// A row another transaction committed is safe to remember, one this connection
+		// added inside its open transaction may still be rolled back
+		*id = sqlite3_column_int64(res, 0);
+		bool committed;
+		{
+			lock_guard<mutex> guard(state->lock);
+			committed = !inTransaction || state->uncommitted.count(value) == 0;
+		}
+		if(committed)
+			rememberString(state, value, *id);
+		return 0;
+	}
+	if(rc != SQLITE_DONE)
+		return -1;
+	res.release();
+	if(prepareCached(conn, "INSERT INTO LogStrings(value) VALUES(?)", &res) != SQLITE_OK ||
+	sqlite3_bind_text(res, 1, value.c_str(), -1, SQLITE_STATIC) != SQLITE_OK || sqlite3_step(res) != SQLITE_DONE)
+		return -2;
+	*id = sqlite3_last_insert_rowid(conn);
+	if(!inTransaction)
+		rememberString(state, value, *id);
+	else
+	{
+		{
+			lock_guard<mutex> guard(state->lock);
+			state->uncommitted.insert(value);
+		}
+		if(learned != nullptr)
+			learned->push_back(make_pair(value, *id));
+	}
+	return 0;
+}
+
+// ids of eventName, subject and the status; NULL strings get no id
+static int stringIds(sqlite3 *conn, compactLogState *state, const string *values[3], long long ids[3], compactLogStrings *learned)
+{
+	bool missing[3] = {false, false, false};
+	{
+		lock_guard<mutex> guard(state->lock);
+		for(int i = 0; i < 3; i++)
+		{
+			if(values[i] == nullptr)
+				continue;
+			auto found = state->ids.find(*values[i]);
+			if(found != state->ids.end())
+				ids[i] = found->second;
+			else
+				missing[i] = true;
+		}
+	}
+	for(int i = 0; i < 3; i++)
+	{
+		if(missing[i] && readStringId(conn, state, *values[i], &ids[i], learned) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+#if defined LOG_DETAIL_ZLIB
+// The blob is the length of the text (4 bytes, little endian) followed by its deflate stream
+static bool compressDetail(const char *detail, size_t length, string *blob)
+{
+	uLongf size = compressBound(length);
+	blob->resize(4 + size);
+	for(int i = 0; i < 4; i++)
+		(*blob)[i] = static_cast<char>((length >> (8 * i)) & 0xff);
+	if(compress2(reinterpret_cast<Bytef*>(&(*blob)[4]), &size, reinterpret_cast<const Bytef*>(detail), length, Z_DEFAULT_COMPRESSION) != Z_OK)
+		return false;
+	blob->resize(4 + size);
+	return blob->size() < length;
+}
+#endif
+
+// fields are eventName, object, subject and eventStatus, any of them may be NULL
+static int insertRecord(sqlite3 *conn, compactLogState *state, const string *fields[4], bool hasTime, long long whenMicros, compactLogStrings *learned)
+{
+	string status;
+	const char *detail = nullptr;
+	size_t length = 0;
+	if(fields[3] != nullptr)
+	{
+		size_t colon = fields[3]->find(':');
+		status.assign(*fields[3], 0, colon);
+		if(colon != string::npos)
+		{
+			detail = fields[3]->c_str() + colon + 1;
+			length = fields[3]->size() - colon - 1;
+		}
+	}
+	const string *values[3] = {fields[0], fields[2], fields[3] != nullptr ? &status : nullptr};
+	long long ids[3];
+	if(stringIds(conn, state, values, ids, learned) < 0)
+		return -1;
+	cachedStmt res;
+	if(prepareCached(conn, "INSERT INTO LogCompact(eventName, object, subject, eventStatus, eventTime, detail) VALUES(?, ?, ?, ?, ?, ?)", &res) != SQLITE_OK)
+		return -2;
+	const int idColumns[3] = {1, 3, 4};
+	for(int i = 0; i < 3; i++)
+	{
+		if(values[i] != nullptr)
+			sqlite3_bind_int64(res, idColumns[i], ids[i]);
+	}
+	if(fields[1] != nullptr)
+		sqlite3_bind_text(res, 2, fields[1]->c_str(), fields[1]->size(), SQLITE_STATIC);
+	if(hasTime)
+		sqlite3_bind_int64(res, 5, whenMicros);
+	string blob;
+	if(detail != nullptr)
+	{
+#if defined LOG_DETAIL_ZLIB
+		if(state->compressDetails && length >= COMPACT_LOG_COMPRESS_BYTES && compressDetail(detail, length, &blob))
+			sqlite3_bind_blob(res, 6, blob.data(), blob.size(), SQLITE_STATIC);
+		else
+#endif
+			sqlite3_bind_text(res, 6, detail, length, SQLITE_STATIC);
+	}
+	return SQL_TIMED(SQL_PHASE_STEP, sqlite3_step(res)) == SQLITE_DONE ? 0 : -2;
+}
+
+int compactLogInsert(sqlite3 *db, sqlite3 *conn, const string& eventName, const string& object, const string& subject,
+	const string& eventStatus, long long whenMicros, compactLogStrings *learned)
+{
+	shared_ptr<compactLogState> state = findCompact(db);
+	if(state == nullptr)
+		return 1;
+	const string *fields[4] = {&eventName, &object, &subject, &eventStatus};
+	return insertRecord(conn, state.get(), fields, true, whenMicros, learned);
+}
+
+void compactLogRemember(sqlite3 *db, const compactLogStrings& learned)
+{
+	shared_ptr<compactLogState> state = findCompact(db);
+	if(state == nullptr)
+		return;
+	for(const pair<string, long long>& entry : learned)
+		rememberString(state.get(), entry.first, entry.second);
+}
+
+static void logDetail(sqlite3_context *context, int, sqlite3_value **args)
+{
+	if(sqlite3_value_type(args[0]) != SQLITE_BLOB)
+	{
+		sqlite3_result_value(context, args[0]);
+		return;
+	}
+#if defined LOG_DETAIL_ZLIB
+	const unsigned char *blob = static_cast<const unsigned char*>(sqlite3_value_blob(args[0]));
+	int size = sqlite3_value_bytes(args[0]);
+	if(size >= 4)
+	{
+		uLongf length = 0;
+		for(int i = 0; i < 4; i++)
+			length |= static_cast<uLongf>(blob[i]) << (8 * i);
+		string text(length, '\0');
+		if(uncompress(reinterpret_cast<Bytef*>(&text[0]), &length, blob + 4, size - 4) == Z_OK)
+		{
+			sqlite3_result_text(context, text.data(), length, SQLITE_TRANSIENT);
+			return;
+		}
+	}
+#endif
+	sqlite3_result_null(context);
+}
+
+int registerCompactLogFunctions(sqlite3 *conn)
+{
+	return sqlite3_create_function(conn, "logDetail", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, logDetail, nullptr, nullptr) == SQLITE_OK ? 0 : -1;
+}
+
+// Every index ends with the time in seconds, the eventDateTime of the view, so queryLog reads it in order
+static const char *COMPACT_LOG_TABLES[] = {
+	"CREATE TABLE IF NOT EXISTS LogStrings (id INTEGER PRIMARY KEY, value TEXT NOT NULL UNIQUE)",
+	"CREATE TABLE IF NOT EXISTS LogCompact (id INTEGER PRIMARY KEY, eventName INTEGER, object TEXT, subject INTEGER, eventStatus INTEGER, eventTime INTEGER, detail BLOB)",
+	"CREATE INDEX IF NOT EXISTS LogCompactByTime ON LogCompact(eventTime / 1000000)",
+	"CREATE INDEX IF NOT EXISTS LogCompactBySubject ON LogCompact(subject, eventTime / 1000000)",
+	"CREATE INDEX IF NOT EXISTS LogCompactByObject ON LogCompact(object, eventTime / 1000000)"
+};
+
+static string compactLogView(bool compressDetails)
+{
+	return string("CREATE VIEW Log(id, eventName, object, subject, eventStatus, eventDateTime) AS "
+		"SELECT c.id, e.value, c.object, s.value, CASE WHEN c.detail IS NULL THEN t.value ELSE t.value || ':' || ") +
+		(compressDetails ? "logDetail(c.detail)" : "c.detail") + " END, c.eventTime / 1000000 FROM LogCompact AS c "
+		"LEFT JOIN LogStrings AS e ON e.id = c.eventName LEFT JOIN LogStrings AS s ON s.id = c.subject "
+		"LEFT JOIN LogStrings AS t ON t.id = c.eventStatus";
+}
+
+int attachCompactLog(sqlite3 *db, resultSink err)
+{
+	if(findCompact(db) != nullptr)
+	{
+		err.ok("_attachCompactLog");
+		return 1;
+	}
+	cachedStmt res;
+	if(prepareCached(db, "SELECT sql FROM sqlite_master WHERE type = 'view' AND name = 'Log'", &res) != SQLITE_OK) //OK
+	{
+		err.sqliteFail("_attachCompactLog", db);
+		return -1;
+	}
+	int rc = sqlite3_step(res);
+	if(rc == SQLITE_DONE)
+	{
+		err.ok("_attachCompactLog");
+		return 0;
+	}
+	if(rc != SQLITE_ROW) //OK
+	{
+		err.sqliteFail("_attachCompactLog", db);
+		return -1;
+	}
+	shared_ptr<compactLogState> state = make_shared<compactLogState>();
+	state->compressDetails = strstr(reinterpret_cast<const char*>(sqlite3_column_text(res, 0)), "logDetail(") != nullptr;
+	res.release();
+	registerCompactLogFunctions(db);
+	setConnectionData(db, COMPACT_LOG_KEY, state);
+	err.ok("_attachCompactLog");
+	return 1;
+}
+
+bool hasCompactLog(sqlite3 *db)
+{
+	return findCompact(db) != nullptr;
+}
+
+// Moves the records of the Log table into LogCompact, oldest first; returns how many
+static long long convertLogTable(sqlite3 *db, compactLogState *state, compactLogStrings *learned)
+{
+	sqlite3_stmt *res;
+	if(sqlite3_prepare_v2(db, "SELECT eventName, object, subject, eventStatus, eventDateTime FROM Log ORDER BY rowid", -1, &res, 0) != SQLITE_OK)
+		return -1;
+	long long count = 0;
+	int rc;
+	while((rc = sqlite3_step(res)) == SQLITE_ROW)
+	{
+		string values[4];
+		const string *fields[4];
+		for(int i = 0; i < 4; i++)
+		{
+			const unsigned char *text = sqlite3_column_text(res, i);
+			if(text != nullptr)
+				values[i].assign(reinterpret_cast<const char*>(text));
+			fields[i] = text != nullptr ? &values[i] : nullptr;
+		}
+		bool hasTime = sqlite3_column_type(res, 4) == SQLITE_INTEGER;
+		if(insertRecord(db, state, fields, hasTime, hasTime ? sqlite3_column_int64(res, 4) * 1000000 : 0, learned) < 0)
+		{
+			sqlite3_finalize(res);
+			return -2;
+		}
+		count++;
+	}
+	sqlite3_finalize(res);
+	return rc == SQLITE_DONE ? count : -1;
+}
+
+int enableCompactLog(sqlite3 *db, const compactLogOptions& options, resultSink err)
+{
+	if(hasLogPartitions(db))
+	{
+		err.fail(RESULT_CONFLICT, "_enableCompactLog", "log partitions are enabled");
+		return -1;
+	}
+#if !defined LOG_DETAIL_ZLIB
+	if(options.compressDetails)
+	{
+		err.fail(RESULT_UNAVAILABLE, "_enableCompactLog", "built without zlib");
+		return -2;
+	}
+#endif
+	int rc = attachCompactLog(db, err.traceOnly());
+	if(rc < 0) //OK
+	{
+		err.callFailed("_enableCompactLog", "attachCompactLog", rc);
+		return -3;
+	}
+	if(rc == 1)
+	{
+		err.warn("_enableCompactLog", "Log is already compact");
+		return 1;
+	}
+	if(registerCompactLogFunctions(db) < 0) //OK
+	{
+		err.sqliteFail("_enableCompactLog", db);
+		return -3;
+	}
+	immediateTransaction transaction;
+	rc = transaction.begin(db, err.traceOnly());
+	if(rc < 0) //OK
+	{
+		err.callFailed("_enableCompactLog", "immediateTransaction::begin", rc);
+		return -4;
+	}
+	for(const char *sql : COMPACT_LOG_TABLES)
+	{
+		if(sqlite3_exec(db, sql, nullptr, nullptr, nullptr) != SQLITE_OK) //OK
+		{
+			err.sqliteFail("_enableCompactLog", db);
+			return -5;
+		}
+	}
+	shared_ptr<compactLogState> state = make_shared<compactLogState>();
+	state->compressDetails = options.compressDetails;
+	compactLogStrings learned;
+	long long converted = 0;
+	cachedStmt res;
+	if(prepareCached(db, "SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = 'Log'", &res) != SQLITE_OK || sqlite3_step(res) != SQLITE_ROW) //OK
+	{
+		err.sqliteFail("_enableCompactLog", db);
+		return -6;
+	}
+	bool hasTable = sqlite3_column_int(res, 0) > 0;
+	res.release();
+	if(hasTable)
+	{
+		converted = convertLogTable(db, state.get(), &learned);
+		if(converted < 0 || sqlite3_exec(db, "DROP TABLE Log", nullptr, nullptr, nullptr) != SQLITE_OK) //OK
+		{
+			err.sqliteFail("_enableCompactLog", db);
+			return -6;
+		}
+	}
+	if(sqlite3_exec(db, compactLogView(options.compressDetails).c_str(), nullptr, nullptr, nullptr) != SQLITE_OK) //OK
+	{
+		err.sqliteFail("_enableCompactLog", db);
+		return -6;
+	}
+	rc = transaction.commit(err.traceOnly());
+	if(rc < 0) //OK
+	{
+		err.callFailed("_enableCompactLog", "immediateTransaction::commit", rc);
+		return -7;
+	}
+	setConnectionData(db, COMPACT_LOG_KEY, state);
+	compactLogRemember(db, learned);
+	Log(db, "enableCompactLog", "TABLE:Log", "SYSTEM", "OK:" + to_string(converted) + " records converted", err.traceOnly());
+	err.ok("_enableCompactLog");
+	return 0;
+}
@@ -0,0 +1,240 @@
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <condition_variable>
+#include "SQL/BaseSQL.h"
+#include "SQL/ConnectionPool.h"
+
+using namespace std;
+
+struct connectionPool {
+	mutex lock;
+	condition_variable returned;
+	bool closed = false;
+	int checkoutTimeoutMs;
+	chrono::steady_clock::time_point openedAt;
+	vector<sqlite3*> idle[2];    //indexed by connectionKind
+	sqlite3 *logConn = nullptr;  //runs the log writer that the read-only readers share
+	connectionKindStats stats[2] = {};
+
+	double now() const
+	{
+		return chrono::duration<double, milli>(chrono::steady_clock::now() - openedAt).count();
+	}
+	void closeIdle();
+	void closeLogConn();
+	~connectionPool();
+};
+
+void connectionPool::closeIdle()
+{
+	for(vector<sqlite3*>& connections : idle)
+	{
+		for(sqlite3 *db : connections)
+			closeBaseSQL(db, nullptr);
+		connections.clear();
+	}
+}
+
+// Called with the lock held once the pool is closed: the log writer goes with the last reader
+void connectionPool::closeLogConn()
+{
+	if(logConn == nullptr || stats[CONNECTION_READ].inUse > 0)
+		return;
+	closeBaseSQL(logConn, nullptr);
+	logConn = nullptr;
+}
+
+// Checked out connections hold the pool, so every reader is closed before the log writer
+connectionPool::~connectionPool()
+{
+	closeIdle();
+	closeLogConn();
+}
+
+pooledConnection::pooledConnection() : db(nullptr), kind(CONNECTION_READ), checkedOutAt(0) {}
+
+pooledConnection::~pooledConnection()
+{
+	release();
+}
+
+pooledConnection::operator sqlite3*() const
+{
+	return db;
+}
+
+sqlite3 *pooledConnection::get() const
+{
+	return db;
+}
+
+void pooledConnection::release()
+{
+	if(db == nullptr)
+		return;
+	{
+		lock_guard<mutex> guard(pool->lock);
+		connectionKindStats& stats = pool->stats[kind];
+		stats.inUse--;
+		stats.busyMs += pool->now() - checkedOutAt;
+		if(pool->closed)
+		{
+			stats.size--;
+			closeBaseSQL(db, nullptr);
+			pool->closeLogConn();
+		}
+		else
+			pool->idle[kind].push_back(db);
+	}
+	pool->returned.notify_all(); //readers may wait on writers, so every waiter rechecks
+	db = nullptr;
+	pool.reset();
+}
+
+static int openPooled(sqlite3 **db, const string& databaseName, connectionKind kind, connectionOptions options, resultSink err)
+{
+	int flags = kind == CONNECTION_READ ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE;
+	if(sqlite3_open_v2(databaseName.c_str(), db, flags, nullptr) != SQLITE_OK)
+	{
+		err.sqliteFail("_openConnectionPool", *db);
+		return -1;
+	}
+	options.journal = JOURNAL_DEFAULT; //already set by the first writer, a read-only connection cannot change it
+	if(configureConnection(*db, options, err) < 0)
+		return -2;
+	setConnectionData(*db, "connectionOptions", make_shared<connectionOptions>(options));
+	return 0;
+}
+
+int openConnectionPool(string databaseName, const connectionPoolOptions& options, shared_ptr<connectionPool> *pool, resultSink err)
+{
+	if(options.writers == 0)
+	{
+		err.fail(RESULT_INVALID_ARGUMENT, "_openConnectionPool", "the pool needs at least one writer");
+		return -1;
+	}
+	if(databaseName.empty() || databaseName == ":memory:" || databaseName.find("mode=memory") != string::npos)
+	{
+		err.fail(RESULT_INVALID_ARGUMENT, "_openConnectionPool", "the pool needs a database file");
+		return -1;
+	}
+	shared_ptr<connectionPool> created = make_shared<connectionPool>();
+	created->checkoutTimeoutMs = options.checkoutTimeoutMs;
+	created->openedAt = chrono::steady_clock::now();
+	size_t counts[2] = {options.readers, options.writers};
+	for(int kind : {CONNECTION_WRITE, CONNECTION_READ})
+	{
+		for(size_t i = 0; i < counts[kind]; i++)
+		{
+			sqlite3 *db = nullptr;
+			int rc;
+			if(kind == CONNECTION_WRITE && i == 0)
+				rc = initBaseSQL(&db, databaseName, options.connection, err); //creates the Log table, switches to WAL
+			else
+				rc = openPooled(&db, databaseName, static_cast<connectionKind>(kind), options.connection, err);
+			if(rc != 0)
+			{
+				if(db != nullptr)
+					closeBaseSQL(db, err.traceOnly());
+				err.callFailed("_openConnectionPool", kind == CONNECTION_WRITE && i == 0 ? "initBaseSQL" : "openConnection", rc);
+				return -2; //created closes the connections opened so far
+			}
+			created->idle[kind].push_back(db);
+			created->stats[kind].size++;
+		}
+	}
+	// Readers cannot write their Log records, a writer thread on a connection of its own does
+	if(!created->idle[CONNECTION_READ].empty())
+	{
+		int rc = openPooled(&created->logConn, databaseName, CONNECTION_WRITE, options.connection, err);
+		if(rc == 0)
+			rc = startLogWriter(created->logConn, options.readerLog, err);
+		for(size_t i = 0; rc == 0 && i < created->idle[CONNECTION_READ].size(); i++)
+			rc = shareLogWriter(created->idle[CONNECTION_READ][i], created->logConn, err);
+		if(rc != 0)
+		{
+			err.callFailed("_openConnectionPool", "startLogWriter", rc);
+			return -2;
+		}
+	}
+	*pool = created;
+	err.ok("_openConnectionPool");
+	return 0;
+}
+
+int checkoutConnection(const shared_ptr<connectionPool>& pool, connectionKind kind, pooledConnection *conn, resultSink err)
+{
+	conn->release();
+	unique_lock<mutex> guard(pool->lock);
+	if(kind == CONNECTION_READ && pool->stats[CONNECTION_READ].size == 0 && !pool->closed)
+		kind = CONNECTION_WRITE;
+	connectionKindStats& stats = pool->stats[kind];
+	double start = pool->now();
+	if(pool->idle[kind].empty() && !pool->closed)
+	{
+		stats.waited++;
+		auto ready = [&] { return !pool->idle[kind].empty() || pool->closed; };
+		if(pool->checkoutTimeoutMs < 0)
+			pool->returned.wait(guard, ready);
+		else if(!pool->returned.wait_for(guard, chrono::milliseconds(pool->checkoutTimeoutMs), ready))
+		{
+			stats.timeouts++;
+			stats.waitMs += pool->now() - start;
+			err.fail(RESULT_TIMEOUT, "_checkoutConnection", "timed out");
+			return -2;
+		}
+	}
+	if(pool->closed)
+	{
+		err.fail(RESULT_UNAVAILABLE, "_checkoutConnection", "pool is closed");
+		return -1;
+	}
+	double waited = pool->now() - start;
+	stats.waitMs += waited;
+	stats.maxWaitMs = max(stats.maxWaitMs, waited);
+	stats.checkouts++;
+	stats.inUse++;
+	stats.peakInUse = max(stats.peakInUse, stats.inUse);
+	conn->pool = pool;
+	conn->db = pool->idle[kind].back();
+	conn->kind = kind;
+	conn->checkedOutAt = start + waited;
+	pool->idle[kind].pop_back();
+	err.ok("_checkoutConnection");
+	return 0;
+}
+
+int closeConnectionPool(const shared_ptr<connectionPool>& pool, resultSink err)
+{
+	{
+		lock_guard<mutex> guard(pool->lock);
+		if(pool->closed)
+		{
+			err.fail(RESULT_CONFLICT, "_closeConnectionPool", "pool is already closed");
+			return -1;
+		}
+		pool->closed = true;
+		for(connectionKindStats& stats : pool->stats)
+			stats.size = stats.inUse;
+		pool->closeIdle();
+		pool->closeLogConn();
+	}
+	pool->returned.notify_all();
+	err.ok("_closeConnectionPool");
+	return 0;
+}
+
+connectionPoolStats getConnectionPoolStats(const shared_ptr<connectionPool>& pool)
+{
+	lock_guard<mutex> guard(pool->lock);
+	connectionPoolStats stats;
+	stats.readers = pool->stats[CONNECTION_READ];
+	stats.writers = pool->stats[CONNECTION_WRITE];
+	stats.uptimeMs = pool->now();
+	return stats;
+}
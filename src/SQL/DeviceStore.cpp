@@ -0,0 +1,754 @@
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+#include <condition_variable>
+#include <unordered_map>
+#include <algorithm>
+#include "SQL/BaseSQL.h"
+#include "SQL/StmtCache.h"
+#include "SQL/DeviceStore.h"
+#include "SQL/Metrics.h"
+
+using namespace std;
+
+tableInfo devicesInfo("devices", {column("id", "INTEGER", COLUMN_PRIMARY_KEY), column("deviceID", "TEXT", COLUMN_UNIQUE | COLUMN_NOT_NULL),
+	column("name", "TEXT"), column("kind", "TEXT"), column("addedAt", "INTEGER")});
+tableInfo capabilitiesInfo("capabilities", {column("id", "INTEGER", COLUMN_PRIMARY_KEY), column("deviceID", "TEXT", COLUMN_NOT_NULL),
+	column("capability", "TEXT", COLUMN_NOT_NULL), column("valueType", "TEXT", COLUMN_NOT_NULL)},
+	{tableIndex("capabilitiesByDevice", {"deviceID", "capability"}, true)});
+tableInfo deviceStateInfo("deviceState", {column("id", "INTEGER", COLUMN_PRIMARY_KEY), column("deviceID", "TEXT", COLUMN_NOT_NULL),
+	column("capability", "TEXT", COLUMN_NOT_NULL), column("value", "TEXT"), column("updatedAt", "INTEGER")},
+	{tableIndex("deviceStateByDevice", {"deviceID", "capability"}, true)});
+
+static long long nowMicros()
+{
+	return chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// deviceID and capability in one key of the in-memory state
+static string stateKey(const string& deviceID, const string& capability)
+{
+	string key;
+	key.reserve(deviceID.size() + capability.size() + 1);
+	key.append(deviceID).push_back('\0');
+	key.append(capability);
+	return key;
+}
+
+static bool knownValueType(const string& valueType)
+{
+	return valueType == "bool" || valueType == "int" || valueType == "real" || valueType == "text";
+}
+
+static bool validValue(const string& valueType, const string& value)
+{
+	char *end = nullptr;
+	if(valueType == "bool")
+		return value == "0" || value == "1" || value == "true" || value == "false";
+	if(valueType == "int")
+	{
+		strtoll(value.c_str(), &end, 10);
+		return !value.empty() && *end == '\0';
+	}
+	if(valueType == "real")
+	{
+		strtod(value.c_str(), &end);
+		return !value.empty() && *end == '\0';
+	}
+	return valueType == "text";
+}
+
+struct stateValue {
+	string deviceID;
+	string capability;
+	string valueType;
+	string value;
+	long long updatedAtMicros = 0;
+	unsigned long long version = 0;   //of the last deviceStateChanged
+	bool hasValue = false;
+	bool dirty = false;
+};
+
+struct stateRecord {
+	string deviceID;
+	string capability;
+	string value;
+	long long updatedAtMicros;
+};
+
+struct deviceStore {
+	sqlite3 *db;
+	sqlite3 *conn;     //connection used by the writer thread
+	bool ownConnection;   //false for in-memory databases: no thread, the caller writes back on db
+	deviceStateOptions options;
+
+	mutex lock;
+	condition_variable wakeWriter;
+	condition_variable flushed;
+	unordered_map<string, stateValue> values;
+	vector<string> dirtyKeys;
+	bool stopping = false;
+	bool flushRequested = false;
+	bool writing = false;              //two callers of an in-memory store write back one after the other
+	unsigned long long dirtySeq = 0;   //values marked dirty so far
+	unsigned long long doneSeq = 0;    //...and written back or superseded by a newer marking
+	deviceStateStats stats = {0, 0, 0, 0, 0, 0, 0, 0};
+	thread worker;
+
+	~deviceStore();
+	void stop();
+	bool writeBatch(const vector<stateRecord>& batch);
+	bool writeDirty(unique_lock<mutex>& guard);
+	void run();
+};
+
+static const string DEVICE_STORE_KEY = "deviceStore";
+
+// Stores of file databases, shared by all connections to the same file
+static mutex sharedLock;
+static unordered_map<string, weak_ptr<deviceStore>> sharedStores;
+
+static shared_ptr<deviceStore> findStore(sqlite3 *db)
+{
+	return static_pointer_cast<deviceStore>(getConnectionData(db, DEVICE_STORE_KEY));
+}
+
+// Called with the lock held
+static void markDirty(deviceStore *store, const string& key, stateValue *state)
+{
+	if(state->dirty)
+		return;
+	state->dirty = true;
+	store->dirtyKeys.push_back(key);
+	store->dirtySeq++;
+	if(store->dirtyKeys.size() == store->options.batchSize)
+		store->wakeWriter.notify_one();
+}
+
+// Values of removed capabilities are skipped, so a late write-back cannot bring them back
+bool deviceStore::writeBatch(const vector<stateRecord>& batch)
+{
+	bool transaction = sqlite3_exec(conn, "BEGIN", nullptr, nullptr, nullptr) == SQLITE_OK;
+	cachedStmt res;
+	bool ok = prepareCached(conn, "INSERT INTO deviceState(deviceID, capability, value, updatedAt) SELECT ?1, ?2, ?3, ?4 "
+		"WHERE EXISTS (SELECT 1 FROM capabilities WHERE deviceID = ?1 AND capability = ?2) "
+		"ON CONFLICT(deviceID, capability) DO UPDATE SET value = excluded.value, updatedAt = excluded.updatedAt", &res) == SQLITE_OK;
+	for(size_t i = 0; ok && i < batch.size(); i++)
+	{
+		const stateRecord& record = batch[i];
+		sqlite3_reset(res);
+		sqlite3_bind_text(res, 1, record.deviceID.c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_text(res, 2, record.capability.c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_text(res, 3, record.value.c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_int64(res, 4, record.updatedAtMicros);
+		ok = sqlite3_step(res) == SQLITE_DONE;
+	}
+	res.release();
+	if(transaction)
+	{
+		if(ok && sqlite3_exec(conn, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK)
+			ok = false;
+		if(!ok)
+			sqlite3_exec(conn, "ROLLBACK", nullptr, nullptr, nullptr);
+	}
+	return ok;
+}
+
+// Writes the dirty values back once, called with the lock held
+bool deviceStore::writeDirty(unique_lock<mutex>& guard)
+{
+	flushed.wait(guard, [this] { return !writing; });
+	if(dirtyKeys.empty())
+		return true;
+	writing = true;
+	// The values are copied as they are now; changes made during the write mark them dirty again
+	vector<string> keys;
+	keys.swap(dirtyKeys);
+	vector<stateRecord> batch;
+	for(const string& key : keys)
+	{
+		auto it = values.find(key);
+		if(it == values.end() || !it->second.dirty)
+			continue;
+		it->second.dirty = false;
+		batch.push_back(stateRecord{it->second.deviceID, it->second.capability, it->second.value, it->second.updatedAtMicros});
+	}
+	unsigned long long count = keys.size();
+	guard.unlock();
+
+	bool ok = batch.empty() || writeBatch(batch);
+
+	guard.lock();
+	writing = false;
+	if(ok)
+	{
+		stats.written += batch.size();
+		doneSeq += count;
+	}
+	else
+	{
+		// A value that is dirty again has a marking of its own, the others keep theirs.
+		// A device removed and added again during the write has no value to bring back.
+		stats.failed++;
+		for(const string& key : keys)
+		{
+			auto it = values.find(key);
+			if(it == values.end() || it->second.dirty || !it->second.hasValue)
+				doneSeq++;
+			else
+			{
+				it->second.dirty = true;
+				dirtyKeys.push_back(key);
+			}
+		}
+	}
+	stats.batches++;
+	flushed.notify_all();
+	return ok;
+}
+
+void deviceStore::run()
+{
+	unique_lock<mutex> guard(lock);
+	while(true)
+	{
+		wakeWriter.wait_for(guard, chrono::milliseconds(options.flushIntervalMs), [this] {
+			return stopping || flushRequested || dirtyKeys.size() >= options.batchSize;
+		});
+		flushRequested = false;
+		if(dirtyKeys.empty())
+		{
+			if(stopping)
+				break;
+			continue;
+		}
+		if(!writeDirty(guard) && stopping) //nothing to retry with
+			break;
+	}
+}
+
+void deviceStore::stop()
+{
+	{
+		lock_guard<mutex> guard(lock);
+		if(stopping)
+			return;
+		stopping = true;
+	}
+	wakeWriter.notify_one();
+	if(worker.joinable())
+		worker.join();
+	if(ownConnection)
+		closeBaseSQL(conn, nullptr);
+	unique_lock<mutex> guard(lock);
+	if(!ownConnection && !dirtyKeys.empty() && sqlite3_get_autocommit(db))
+		writeDirty(guard);
+	flushed.notify_all();
+}
+
+// closeBaseSQL drops the connection data, the last values are written back here
+deviceStore::~deviceStore()
+{
+	stop();
+}
+
+int initDeviceSQL(sqlite3 *db, resultSink err)
+{
+	SQL_METRIC_SCOPE("initDeviceSQL");
+	vector<tableInfo*> tables = {&devicesInfo, &capabilitiesInfo, &deviceStateInfo};
+	vector<int> checked;
+	checkTables(db, {devicesInfo, capabilitiesInfo, deviceStateInfo}, &checked, err); //one query while all of them match
+	for(size_t i = 0; i < tables.size(); i++)
+	{
+		tableInfo *table = tables[i];
+		int rc = checked[i];
+		if(rc == 1 || rc == 7)
+		{
+			rc = createTable(db, *table, err);
+			if(rc != 0)
+			{
+				textLog(db, "initDeviceSQL", "TABLE:" + table->name, "SYSTEM", "FAIL_ERROR-createTable:" + to_string(rc));
+				err.callFailed("_initDeviceSQL", "createTable", rc);
+				return -2;
+			}
+		}
+		else if(rc > 0)
+		{
+			textLog(db, "initDeviceSQL", "TABLE:" + table->name, "SYSTEM", "FAIL:table in an unexpected way");
+			err.fail(RESULT_SCHEMA_MISMATCH, "_initDeviceSQL", "table in an unexpected way");
+			return 1;
+		}
+		else if(rc < 0)
+		{
+			textLog(db, "initDeviceSQL", "TABLE:" + table->name, "SYSTEM", "FAIL_ERROR-checkTable:" + to_string(rc));
+			err.callFailed("_initDeviceSQL", "checkTable", rc);
+			return -1;
+		}
+	}
+	Log(db, "initDeviceSQL", "DATABASE", "SYSTEM", "OK", err.traceOnly());
+	err.ok("_initDeviceSQL");
+	return 0;
+}
+
+static int insertDevice(sqlite3 *db, const deviceInfo& device)
+{
+	cachedStmt res;
+	if(prepareCached(db, "INSERT INTO devices(deviceID, name, kind, addedAt) VALUES(?, ?, ?, ?)", &res) != SQLITE_OK ||
+	sqlite3_bind_text(res, 1, device.deviceID.c_str(), -1, SQLITE_STATIC) != SQLITE_OK ||
+	sqlite3_bind_text(res, 2, device.name.c_str(), -1, SQLITE_STATIC) != SQLITE_OK ||
+	sqlite3_bind_text(res, 3, device.kind.c_str(), -1, SQLITE_STATIC) != SQLITE_OK ||
+	sqlite3_bind_int64(res, 4, nowMicros() / 1000000) != SQLITE_OK || sqlite3_step(res) != SQLITE_DONE)
+		return -1;
+	res.release();
+	if(prepareCached(db, "INSERT INTO capabilities(deviceID, capability, valueType) VALUES(?, ?, ?)", &res) != SQLITE_OK)
+		return -1;
+	for(const deviceCapability& capability : device.capabilities)
+	{
+		sqlite3_reset(res);
+		if(sqlite3_bind_text(res, 1, device.deviceID.c_str(), -1, SQLITE_STATIC) != SQLITE_OK ||
+		sqlite3_bind_text(res, 2, capability.name.c_str(), -1, SQLITE_STATIC) != SQLITE_OK ||
+		sqlite3_bind_text(res, 3, capability.valueType.c_str(), -1, SQLITE_STATIC) != SQLITE_OK || sqlite3_step(res) != SQLITE_DONE)
+			return -1;
+	}
+	return 0;
+}
+
+int addDevice(sqlite3 *db, const deviceInfo& device, resultSink err)
+{
+	SQL_METRIC_SCOPE("addDevice");
+	string object = "DEVICE:" + device.deviceID;
+	if(device.deviceID.empty()) //OK
+	{
+		err.fail(RESULT_INVALID_ARGUMENT, "_addDevice", "deviceID is empty");
+		return -1;
+	}
+	for(size_t i = 0; i < device.capabilities.size(); i++)
+	{
+		const deviceCapability& capability = device.capabilities[i];
+		bool repeated = false;
+		for(size_t j = 0; j < i; j++)
+			repeated = repeated || device.capabilities[j].name == capability.name;
+		if(capability.name.empty() || repeated || !knownValueType(capability.valueType)) //OK
+		{
+			err.fail(RESULT_INVALID_ARGUMENT, "_addDevice", "invalid capability ", capability.name.c_str());
+			return -1;
+		}
+	}
+	immediateTransaction transaction;
+	int rc = transaction.begin(db, err);
+	if(rc < 0) //OK
+	{
+		Log(db, "addDevice", object, "SYSTEM", "FAIL_ERROR-beginTransaction:" + to_string(rc), err.traceOnly());
+		err.callFailed("_addDevice", "beginTransaction", rc);
+		return -3;
+	}
+	if(insertDevice(db, device) < 0) //OK
+	{
+		sqliteError error(db);
+		transaction.rollback();
+		bool duplicate = (error.rc & 0xff) == SQLITE_CONSTRAINT;
+		Log(db, "addDevice", object, "SYSTEM", duplicate ? "FAIL:this deviceID is already in use" : "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		if(duplicate)
+			err.fail(RESULT_CONFLICT, "_addDevice", "this deviceID is already in use");
+		else
+			err.sqliteFail("_addDevice", error);
+		return duplicate ? -2 : -4;
+	}
+	Log(db, "addDevice", object, "SYSTEM", "OK", err.traceOnly());
+	rc = transaction.commit(err);
+	if(rc < 0) //OK
+	{
+		Log(db, "addDevice", object, "SYSTEM", "FAIL_ERROR-commitTransaction:" + to_string(rc), err.traceOnly());
+		err.callFailed("_addDevice", "commitTransaction", rc);
+		return -5;
+	}
+	shared_ptr<deviceStore> store = findStore(db);
+	if(store != nullptr)
+	{
+		lock_guard<mutex> guard(store->lock);
+		for(const deviceCapability& capability : device.capabilities)
+		{
+			stateValue& state = store->values[stateKey(device.deviceID, capability.name)];
+			state.deviceID = device.deviceID;
+			state.capability = capability.name;
+			state.valueType = capability.valueType;
+		}
+	}
+	err.ok("_addDevice");
+	return 0;
+}
+
+int removeDevice(sqlite3 *db, const string& deviceID, resultSink err)
+{
+	SQL_METRIC_SCOPE("removeDevice");
+	string object = "DEVICE:" + deviceID;
+	immediateTransaction transaction;
+	int rc = transaction.begin(db, err);
+	if(rc < 0) //OK
+	{
+		Log(db, "removeDevice", object, "SYSTEM", "FAIL_ERROR-beginTransaction:" + to_string(rc), err.traceOnly());
+		err.callFailed("_removeDevice", "beginTransaction", rc);
+		return -3;
+	}
+	int removed = 0;
+	for(const char *sql : {"DELETE FROM deviceState WHERE deviceID = ?", "DELETE FROM capabilities WHERE deviceID = ?", "DELETE FROM devices WHERE deviceID = ?"})
+	{
+		cachedStmt res;
+		if(prepareCached(db, sql, &res) != SQLITE_OK || sqlite3_bind_text(res, 1, deviceID.c_str(), -1, SQLITE_STATIC) != SQLITE_OK ||
+		sqlite3_step(res) != SQLITE_DONE) //OK
+		{
+			sqliteError error(db);
+			transaction.rollback();
+			Log(db, "removeDevice", object, "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+			err.sqliteFail("_removeDevice", error);
+			return -4;
+		}
+		removed = sqlite3_changes(db);
+	}
+	if(removed == 0) //OK
+	{
+		transaction.rollback();
+		Log(db, "removeDevice", object, "SYSTEM", "FAIL:device not found", err.traceOnly());
+		err.fail(RESULT_NOT_FOUND, "_removeDevice", "device not found");
+		return -1;
+	}
+	Log(db, "removeDevice", object, "SYSTEM", "OK", err.traceOnly());
+	rc = transaction.commit(err);
+	if(rc < 0) //OK
+	{
+		Log(db, "removeDevice", object, "SYSTEM", "FAIL_ERROR-commitTransaction:" + to_string(rc), err.traceOnly());
+		err.callFailed("_removeDevice", "commitTransaction", rc);
+		return -5;
+	}
+	shared_ptr<deviceStore> store = findStore(db);
+	if(store != nullptr)
+	{
+		lock_guard<mutex> guard(store->lock);
+		string prefix = stateKey(deviceID, "");
+		auto ofDevice = [&](const string& key) { return key.compare(0, prefix.size(), prefix) == 0; };
+		for(auto it = store->values.begin(); it != store->values.end();)
+		{
+			if(ofDevice(it->first))
+				it = store->values.erase(it);
+			else
+				++it;
+		}
+		// Their markings are done: addDevice with the same deviceID must not write them back
+		auto removedKeys = remove_if(store->dirtyKeys.begin(), store->dirtyKeys.end(), ofDevice);
+		store->doneSeq += store->dirtyKeys.end() - removedKeys;
+		store->dirtyKeys.erase(removedKeys, store->dirtyKeys.end());
+		store->flushed.notify_all();
+	}
+	err.ok("_removeDevice");
+	return 0;
+}
+
+int lookupDevice(sqlite3 *db, const string& deviceID, deviceInfo *device, resultSink err)
+{
+	SQL_METRIC_SCOPE("lookupDevice");
+	*device = deviceInfo();
+	cachedStmt res;
+	if(prepareCached(db, "SELECT name, kind FROM devices WHERE deviceID = ?", &res) != SQLITE_OK ||
+	SQL_TIMED(SQL_PHASE_BIND, sqlite3_bind_text(res, 1, deviceID.c_str(), -1, SQLITE_STATIC)) != SQLITE_OK) //OK
+	{
+		err.sqliteFail("_lookupDevice", db);
+		return -2;
+	}
+	int rc = SQL_TIMED(SQL_PHASE_STEP, sqlite3_step(res));
+	if(rc == SQLITE_DONE) //OK
+	{
+		err.fail(RESULT_NOT_FOUND, "_lookupDevice", "device not found");
+		return -1;
+	}
+	if(rc != SQLITE_ROW) //OK
+	{
+		err.sqliteFail("_lookupDevice", db);
+		return -2;
+	}
+	const unsigned char *name = sqlite3_column_text(res, 0);
+	const unsigned char *kind = sqlite3_column_text(res, 1);
+	device->deviceID = deviceID;
+	device->name = name != nullptr ? reinterpret_cast<const char*>(name) : "";
+	device->kind = kind != nullptr ? reinterpret_cast<const char*>(kind) : "";
+	res.release();
+	if(prepareCached(db, "SELECT capability, valueType FROM capabilities WHERE deviceID = ? ORDER BY id", &res) != SQLITE_OK ||
+	SQL_TIMED(SQL_PHASE_BIND, sqlite3_bind_text(res, 1, deviceID.c_str(), -1, SQLITE_STATIC)) != SQLITE_OK) //OK
+	{
+		err.sqliteFail("_lookupDevice", db);
+		return -2;
+	}
+	while((rc = SQL_TIMED(SQL_PHASE_STEP, sqlite3_step(res))) == SQLITE_ROW)
+	{
+		device->capabilities.push_back(deviceCapability{reinterpret_cast<const char*>(sqlite3_column_text(res, 0)),
+			reinterpret_cast<const char*>(sqlite3_column_text(res, 1))});
+	}
+	if(rc != SQLITE_DONE) //OK
+	{
+		err.sqliteFail("_lookupDevice", db);
+		return -2;
+	}
+	err.ok("_lookupDevice");
+	return 0;
+}
+
+static int loadState(sqlite3 *db, deviceStore *store)
+{
+	cachedStmt res;
+	if(prepareCached(db, "SELECT c.deviceID, c.capability, c.valueType, s.value, s.updatedAt FROM capabilities AS c "
+		"LEFT JOIN deviceState AS s ON s.deviceID = c.deviceID AND s.capability = c.capability", &res) != SQLITE_OK)
+		return -1;
+	int rc;
+	while((rc = sqlite3_step(res)) == SQLITE_ROW)
+	{
+		stateValue state;
+		state.deviceID = reinterpret_cast<const char*>(sqlite3_column_text(res, 0));
+		state.capability = reinterpret_cast<const char*>(sqlite3_column_text(res, 1));
+		state.valueType = reinterpret_cast<const char*>(sqlite3_column_text(res, 2));
+		state.hasValue = sqlite3_column_type(res, 3) != SQLITE_NULL;
+		if(state.hasValue)
+			state.value = reinterpret_cast<const char*>(sqlite3_column_text(res, 3));
+		state.updatedAtMicros = sqlite3_column_int64(res, 4);
+		string key = stateKey(state.deviceID, state.capability);
+		store->values.emplace(move(key), move(state));
+	}
+	return rc == SQLITE_DONE ? 0 : -2;
+}
+
+int startDeviceState(sqlite3 *db, const deviceStateOptions& options, resultSink err)
+{
+	SQL_METRIC_SCOPE("startDeviceState");
+	if(options.batchSize == 0)
+	{
+		err.fail(RESULT_INVALID_ARGUMENT, "_startDeviceState", "batchSize must be positive");
+		return -1;
+	}
+	if(findStore(db) != nullptr)
+	{
+		err.fail(RESULT_CONFLICT, "_startDeviceState", "device state store is already running");
+		return -2;
+	}
+	const char *fileName = sqlite3_db_filename(db, "main");
+	bool inFile = fileName != nullptr && fileName[0] != '\0';
+	unique_lock<mutex> shared(sharedLock, defer_lock);
+	if(inFile)
+	{
+		shared.lock();
+		shared_ptr<deviceStore> running = sharedStores[fileName].lock();
+		if(running != nullptr)
+		{
+			setConnectionData(db, DEVICE_STORE_KEY, running);
+			err.ok("_startDeviceState", "SHARED");
+			return 0;
+		}
+	}
+	shared_ptr<deviceStore> store = make_shared<deviceStore>();
+	store->db = db;
+	store->conn = db;
+	store->ownConnection = false;
+	store->options = options;
+	if(loadState(db, store.get()) < 0)
+	{
+		err.sqliteFail("_startDeviceState", db);
+		return -4;
+	}
+	if(inFile)
+	{
+		if(sqlite3_open_v2(fileName, &store->conn, SQLITE_OPEN_READWRITE, nullptr) != SQLITE_OK)
+		{
+			err.sqliteFail("_startDeviceState", store->conn);
+			sqlite3_close(store->conn);
+			return -3;
+		}
+		shared_ptr<const connectionOptions> connOptions = getConnectionOptions(db);
+		if(connOptions != nullptr)
+			configureConnection(store->conn, *connOptions, nullptr);
+		else
+			sqlite3_busy_timeout(store->conn, 5000);
+		store->ownConnection = true;
+		store->worker = thread(&deviceStore::run, store.get());
+		sharedStores[fileName] = store;
+	}
+	setConnectionData(db, DEVICE_STORE_KEY, store);
+	err.ok("_startDeviceState");
+	return 0;
+}
+
+int stopDeviceState(sqlite3 *db, resultSink err)
+{
+	SQL_METRIC_SCOPE("stopDeviceState");
+	shared_ptr<deviceStore> store = findStore(db);
+	if(store == nullptr)
+	{
+		err.fail(RESULT_UNAVAILABLE, "_stopDeviceState", "device state store is not running");
+		return -1;
+	}
+	setConnectionData(db, DEVICE_STORE_KEY, nullptr);
+	if(store.use_count() > 1) //another connection to the file still uses it
+	{
+		err.ok("_stopDeviceState", "SHARED");
+		return 0;
+	}
+	store->stop();
+	lock_guard<mutex> guard(store->lock);
+	if(!store->dirtyKeys.empty())
+	{
+		err.fail(RESULT_UNAVAILABLE, "_stopDeviceState", "some values are not written back");
+		return -2;
+	}
+	err.ok("_stopDeviceState");
+	return 0;
+}
+
+int flushDeviceState(sqlite3 *db)
+{
+	shared_ptr<deviceStore> store = findStore(db);
+	if(store == nullptr)
+		return -1;
+	unique_lock<mutex> guard(store->lock);
+	unsigned long long target = store->dirtySeq;
+	if(!store->ownConnection)
+	{
+		// The write-back would join the caller's transaction and be lost with its rollback
+		if(!sqlite3_get_autocommit(db))
+			return -3;
+		if(!store->dirtyKeys.empty())
+			store->writeDirty(guard);
+		return store->doneSeq >= target ? 0 : -2;
+	}
+	unsigned long long failed = store->stats.failed;
+	store->flushRequested = true;
+	store->wakeWriter.notify_one();
+	store->flushed.wait(guard, [&] { return store->doneSeq >= target || store->stats.failed != failed || store->stopping; });
+	return store->doneSeq >= target ? 0 : -2;
+}
+
+int setDeviceState(sqlite3 *db, const string& deviceID, const string& capability, const string& value, resultSink err)
+{
+	SQL_METRIC_SCOPE("setDeviceState");
+	shared_ptr<deviceStore> store = findStore(db);
+	if(store == nullptr) //OK
+	{
+		err.fail(RESULT_UNAVAILABLE, "_setDeviceState", "device state store is not running");
+		return -1;
+	}
+	deviceStateChanged change;
+	{
+		lock_guard<mutex> guard(store->lock);
+		string key = stateKey(deviceID, capability);
+		auto it = store->values.find(key);
+		if(it == store->values.end()) //OK
+		{
+			err.fail(RESULT_NOT_FOUND, "_setDeviceState", "unknown device or capability");
+			return -2;
+		}
+		stateValue& state = it->second;
+		if(!validValue(state.valueType, value)) //OK
+		{
+			err.fail(RESULT_INVALID_ARGUMENT, "_setDeviceState", "the value does not fit ", state.valueType.c_str());
+			return -3;
+		}
+		if(state.hasValue && state.value == value)
+		{
+			store->stats.unchanged++;
+			err.ok("_setDeviceState", "UNCHANGED");
+			return 1;
+		}
+		change.previous = state.value;
+		state.value = value;
+		state.hasValue = true;
+		state.updatedAtMicros = nowMicros();
+		change.changedAtMicros = state.updatedAtMicros;
+		change.version = ++state.version;
+		markDirty(store.get(), key, &state);
+		store->stats.updates++;
+	}
+	eventDispatcher *events = store->options.events;
+	if(events != nullptr)
+	{
+		change.deviceID = deviceID;
+		change.capability = capability;
+		change.value = value;
+		if(!store->options.asyncEvents)
+			events->publish(change);
+		else if(!events->publishAsync(move(change)))
+		{
+			lock_guard<mutex> guard(store->lock);
+			store->stats.eventsDropped++;
+		}
+	}
+	err.ok("_setDeviceState");
+	return 0;
+}
+
+static int readStoredState(sqlite3 *db, const string& deviceID, const string& capability, string *value, resultSink err)
+{
+	cachedStmt res;
+	if(prepareCached(db, "SELECT s.value FROM capabilities AS c LEFT JOIN deviceState AS s ON s.deviceID = c.deviceID AND s.capability = c.capability "
+		"WHERE c.deviceID = ? AND c.capability = ?", &res) != SQLITE_OK ||
+	!SQL_TIMED(SQL_PHASE_BIND, sqlite3_bind_text(res, 1, deviceID.c_str(), -1, SQLITE_STATIC) == SQLITE_OK &&
+	sqlite3_bind_text(res, 2, capability.c_str(), -1, SQLITE_STATIC) == SQLITE_OK)) //OK
+	{
+		err.sqliteFail("_getDeviceState", db);
+		return -4;
+	}
+	int rc = SQL_TIMED(SQL_PHASE_STEP, sqlite3_step(res));
+	if(rc == SQLITE_DONE) //OK
+	{
+		err.fail(RESULT_NOT_FOUND, "_getDeviceState", "unknown device or capability");
+		return -2;
+	}
+	if(rc != SQLITE_ROW) //OK
+	{
+		err.sqliteFail("_getDeviceState", db);
+		return -4;
+	}
+	if(sqlite3_column_type(res, 0) == SQLITE_NULL)
+	{
+		err.ok("_getDeviceState", "NO_VALUE");
+		return 1;
+	}
+	*value = reinterpret_cast<const char*>(sqlite3_column_text(res, 0));
+	err.ok("_getDeviceState");
+	return 0;
+}
+
+int getDeviceState(sqlite3 *db, const string& deviceID, const string& capability, string *value, resultSink err)
+{
+	SQL_METRIC_SCOPE("getDeviceState");
+	value->clear();
+	shared_ptr<deviceStore> store = findStore(db);
+	if(store == nullptr)
+		return readStoredState(db, deviceID, capability, value, err);
+	lock_guard<mutex> guard(store->lock);
+	auto it = store->values.find(stateKey(deviceID, capability));
+	if(it == store->values.end()) //OK
+	{
+		err.fail(RESULT_NOT_FOUND, "_getDeviceState", "unknown device or capability");
+		return -2;
+	}
+	if(!it->second.hasValue)
+	{
+		err.ok("_getDeviceState", "NO_VALUE");
+		return 1;
+	}
+	*value = it->second.value;
+	err.ok("_getDeviceState", "MEMORY");
+	return 0;
+}
+
+deviceStateStats getDeviceStateStats(sqlite3 *db)
+{
+	shared_ptr<deviceStore> store = findStore(db);
+	if(store == nullptr)
+		return deviceStateStats{0, 0, 0, 0, 0, 0, 0, 0};
+	lock_guard<mutex> guard(store->lock);
+	deviceStateStats stats = store->stats;
+	stats.values = store->values.size();
+	stats.dirty = store->dirtyKeys.size();
+	return stats;
+}
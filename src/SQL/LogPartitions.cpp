@@ -0,0 +1,472 @@
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include "SQL/BaseSQL.h"
+#include "SQL/StmtCache.h"
+#include "SQL/LogPartitions.h"
+#include "SQL/CompactLog.h"
+#include "SQL/Metrics.h"
+
+using namespace std;
+
+extern tableInfo LogInfo;
+
+static atomic<size_t> partitionedDatabases(0); //lets Log() skip the lookup when nothing is partitioned
+
+struct logPartitionSet {
+	mutex lock;
+	logPartitionOptions options;
+	set<string> known;     //partitions that exist outside of any transaction
+	string lastDay;        //retention runs when the partition of a newer day appears
+	logPartitionStats stats = {0, 0, 0, 0};
+
+	sqlite3 *vacuumConn = nullptr;
+	condition_variable wakeVacuum;
+	bool stopping = false;
+	thread vacuum;
+
+	logPartitionSet();
+	~logPartitionSet();
+	void runVacuum();
+};
+
+static const string LOG_PARTITIONS_KEY = "logPartitions";
+
+logPartitionSet::logPartitionSet()
+{
+	partitionedDatabases.fetch_add(1, memory_order_release);
+}
+
+logPartitionSet::~logPartitionSet()
+{
+	if(vacuum.joinable())
+	{
+		{
+			lock_guard<mutex> guard(lock);
+			stopping = true;
+		}
+		wakeVacuum.notify_one();
+		vacuum.join();
+	}
+	if(vacuumConn != nullptr)
+		closeBaseSQL(vacuumConn, nullptr);
+	partitionedDatabases.fetch_sub(1, memory_order_release);
+}
+
+static shared_ptr<logPartitionSet> findPartitions(sqlite3 *db)
+{
+	if(partitionedDatabases.load(memory_order_acquire) == 0)
+		return nullptr;
+	return static_pointer_cast<logPartitionSet>(getConnectionData(db, LOG_PARTITIONS_KEY));
+}
+
+static int pragmaInt(sqlite3 *db, const char *sql)
+{
+	sqlite3_stmt *res;
+	if(sqlite3_prepare_v2(db, sql, -1, &res, 0) != SQLITE_OK)
+		return -1;
+	int value = sqlite3_step(res) == SQLITE_ROW ? sqlite3_column_int(res, 0) : -1;
+	sqlite3_finalize(res);
+	return value;
+}
+
+void logPartitionSet::runVacuum()
+{
+	string step = "PRAGMA incremental_vacuum(" + to_string(options.vacuumPages) + ")";
+	unique_lock<mutex> guard(lock);
+	while(true)
+	{
+		wakeVacuum.wait_for(guard, chrono::milliseconds(options.vacuumIntervalMs), [this] { return stopping; });
+		if(stopping)
+			break;
+		guard.unlock();
+		int before = pragmaInt(vacuumConn, "PRAGMA freelist_count");
+		if(before > 0)
+			sqlite3_exec(vacuumConn, step.c_str(), nullptr, nullptr, nullptr);
+		int after = pragmaInt(vacuumConn, "PRAGMA freelist_count");
+		guard.lock();
+		stats.vacuumSteps++;
+		if(before > after && after >= 0)
+			stats.vacuumedPages += before - after;
+	}
+}
+
+static string localDay(time_t when)
+{
+	struct tm local;
+	char day[16];
+	if(localtime_r(&when, &local) == nullptr)
+		return when < 0 ? "00000000" : "99999999";
+	strftime(day, sizeof(day), "%Y%m%d", &local);
+	return day;
+}
+
+// Partitions have the columns and the indexes of LogInfo; index names get the day
+static int createPartition(sqlite3 *conn, const string& table, const string& day)
+{
+	string sql = "CREATE TABLE IF NOT EXISTS " + table + " (";
+	for(size_t i = 0; i < LogInfo.columns.size(); i++)
+		sql += (i > 0 ? ", " : "") + LogInfo.columns[i].name + " " + LogInfo.columns[i].type;
+	sql += ")";
+	if(sqlite3_exec(conn, sql.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK)
+		return -1;
+	for(const tableIndex& index : LogInfo.indexes)
+	{
+		sql = string(index.unique ? "CREATE UNIQUE INDEX" : "CREATE INDEX") + " IF NOT EXISTS " + index.name + "_" + day + " ON " + table + "(";
+		for(size_t i = 0; i < index.columns.size(); i++)
+			sql += (i > 0 ? ", " : "") + index.columns[i];
+		sql += ")";
+		if(sqlite3_exec(conn, sql.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK)
+			return -2;
+	}
+	return 0;
+}
+
+static int readPartitions(sqlite3 *db, vector<string> *tables)
+{
+	cachedStmt res;
+	if(prepareCached(db, "SELECT name FROM sqlite_master WHERE type = 'table' AND name GLOB 'Log_[0-9][0-9][0-9][0-9][0-9][0-9][0-9][0-9]' ORDER BY name", &res) != SQLITE_OK)
+		return -1;
+	int rc;
+	while((rc = sqlite3_step(res)) == SQLITE_ROW)
+		tables->push_back(reinterpret_cast<const char*>(sqlite3_column_text(res, 0)));
+	return rc == SQLITE_DONE ? 0 : -2;
+}
+
+static int tableExists(sqlite3 *db, const string& table)
+{
+	cachedStmt res;
+	if(prepareCached(db, "SELECT COUNT(*) FROM sqlite_master WHERE type IN ('table', 'view') AND name = ?", &res) != SQLITE_OK ||
+	sqlite3_bind_text(res, 1, table.c_str(), -1, SQLITE_STATIC) != SQLITE_OK || sqlite3_step(res) != SQLITE_ROW)
+		return -1;
+	return sqlite3_column_int(res, 0) > 0 ? 1 : 0;
+}
+
+// Called with the lock held. Whole tables are dropped, no row is deleted one by one.
+static int dropOldPartitions(sqlite3 *conn, logPartitionSet *partitions, time_t now)
+{
+	if(partitions->options.retentionDays == 0)
+		return 0;
+	string oldest = "Log_" + localDay(now - static_cast<time_t>(partitions->options.retentionDays) * 86400);
+	vector<string> tables;
+	if(readPartitions(conn, &tables) < 0)
+		return -1;
+	int dropped = 0;
+	for(const string& table : tables)
+	{
+		if(table >= oldest)
+			break;
+		if(sqlite3_exec(conn, ("DROP TABLE " + table).c_str(), nullptr, nullptr, nullptr) != SQLITE_OK)
+			return -2;
+		partitions->known.erase(table);
+		partitions->stats.dropped++;
+		dropped++;
+	}
+	return dropped;
+}
+
+int logPartitionTable(sqlite3 *db, sqlite3 *conn, time_t when, string *table)
+{
+	shared_ptr<logPartitionSet> partitions = findPartitions(db);
+	if(partitions == nullptr)
+	{
+		*table = "Log";
+		return 1;
+	}
+	string day = localDay(when);
+	*table = "Log_" + day;
+	lock_guard<mutex> guard(partitions->lock);
+	if(partitions->known.count(*table) > 0)
+		return 0;
+	int exists = tableExists(conn, *table);
+	if(exists < 0)
+		return -1;
+	if(exists == 0)
+	{
+		if(createPartition(conn, *table, day) < 0)
+			return -2;
+		partitions->stats.created++;
+		// A partition created inside a transaction may still be rolled back with it
+		if(sqlite3_get_autocommit(conn) == 0)
+			return 0;
+	}
+	partitions->known.insert(*table);
+	if(day > partitions->lastDay && sqlite3_get_autocommit(conn) != 0)
+	{
+		partitions->lastDay = day;
+		dropOldPartitions(conn, partitions.get(), when);
+	}
+	return 0;
+}
+
+void forgetLogPartition(sqlite3 *db, const string& table)
+{
+	shared_ptr<logPartitionSet> partitions = findPartitions(db);
+	if(partitions == nullptr)
+		return;
+	lock_guard<mutex> guard(partitions->lock);
+	partitions->known.erase(table);
+}
+
+int enableLogPartitions(sqlite3 *db, const logPartitionOptions& options, resultSink err)
+{
+	if(options.vacuumIntervalMs > 0 && options.vacuumPages == 0)
+	{
+		err.fail(RESULT_INVALID_ARGUMENT, "_enableLogPartitions", "vacuumPages must be positive");
+		return -1;
+	}
+	if(findPartitions(db) != nullptr)
+	{
+		err.fail(RESULT_CONFLICT, "_enableLogPartitions", "log partitions are already enabled");
+		return -2;
+	}
+	if(attachCompactLog(db, nullptr) != 0)
+	{
+		err.fail(RESULT_CONFLICT, "_enableLogPartitions", "Log is compact");
+		return -6;
+	}
+	shared_ptr<logPartitionSet> created = make_shared<logPartitionSet>();
+	created->options = options;
+	const char *fileName = sqlite3_db_filename(db, "main");
+	bool inFile = fileName != nullptr && fileName[0] != '\0';
+	if(options.vacuumIntervalMs > 0 && inFile)
+	{
+		if(sqlite3_open_v2(fileName, &created->vacuumConn, SQLITE_OPEN_READWRITE, nullptr) != SQLITE_OK)
+		{
+			err.sqliteFail("_enableLogPartitions", created->vacuumConn);
+			sqlite3_close(created->vacuumConn);
+			created->vacuumConn = nullptr;
+			return -3;
+		}
+		shared_ptr<const connectionOptions> connOptions = getConnectionOptions(db);
+		if(connOptions != nullptr)
+			configureConnection(created->vacuumConn, *connOptions, nullptr);
+		else
+			sqlite3_busy_timeout(created->vacuumConn, 5000);
+		// auto_vacuum of a file with tables changes only with VACUUM
+		if(pragmaInt(created->vacuumConn, "PRAGMA auto_vacuum") != 2 &&
+		sqlite3_exec(created->vacuumConn, "PRAGMA auto_vacuum = INCREMENTAL; VACUUM", nullptr, nullptr, nullptr) != SQLITE_OK)
+		{
+			err.sqliteFail("_enableLogPartitions", created->vacuumConn);
+			return -4;
+		}
+		created->vacuum = thread(&logPartitionSet::runVacuum, created.get());
+	}
+	setConnectionData(db, LOG_PARTITIONS_KEY, created);
+	string table;
+	if(logPartitionTable(db, db, time(nullptr), &table) < 0)
+	{
+		sqliteError error(db);
+		shared_ptr<void> held = getConnectionData(db, LOG_PARTITIONS_KEY);
+		setConnectionData(db, LOG_PARTITIONS_KEY, nullptr);
+		held.reset(); //the vacuum thread stops outside of the connection data lock
+		err.sqliteFail("_enableLogPartitions", error);
+		return -5;
+	}
+	Log(db, "enableLogPartitions", "TABLE:" + table, "SYSTEM", "OK", err.traceOnly());
+	if(options.vacuumIntervalMs > 0 && !inFile)
+		err.warn("_enableLogPartitions", "in-memory databases are not vacuumed");
+	else
+		err.ok("_enableLogPartitions");
+	return 0;
+}
+
+int disableLogPartitions(sqlite3 *db, resultSink err)
+{
+	shared_ptr<void> held = findPartitions(db);
+	if(held == nullptr)
+	{
+		err.fail(RESULT_UNAVAILABLE, "_disableLogPartitions", "log partitions are not enabled");
+		return -1;
+	}
+	setConnectionData(db, LOG_PARTITIONS_KEY, nullptr);
+	held.reset();
+	err.ok("_disableLogPartitions");
+	return 0;
+}
+
+bool hasLogPartitions(sqlite3 *db)
+{
+	return findPartitions(db) != nullptr;
+}
+
+logPartitionStats getLogPartitionStats(sqlite3 *db)
+{
+	shared_ptr<logPartitionSet> partitions = findPartitions(db);
+	if(partitions == nullptr)
+		return logPartitionStats{0, 0, 0, 0};
+	lock_guard<mutex> guard(partitions->lock);
+	return partitions->stats;
+}
+
+int applyLogRetention(sqlite3 *db, time_t now, resultSink err)
+{
+	shared_ptr<logPartitionSet> partitions = findPartitions(db);
+	if(partitions == nullptr)
+	{
+		err.fail(RESULT_UNAVAILABLE, "_applyLogRetention", "log partitions are not enabled");
+		return -1;
+	}
+	int dropped;
+	{
+		lock_guard<mutex> guard(partitions->lock);
+		dropped = dropOldPartitions(db, partitions.get(), now);
+	}
+	if(dropped < 0) //OK
+	{
+		sqliteError error(db);
+		Log(db, "applyLogRetention", "TABLE:Log", "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_applyLogRetention", error);
+		return -2;
+	}
+	Log(db, "applyLogRetention", "TABLE:Log", "SYSTEM", "OK:" + to_string(dropped) + " partitions dropped", err.traceOnly());
+	err.ok("_applyLogRetention");
+	return dropped;
+}
+
+int listLogPartitions(sqlite3 *db, time_t from, time_t to, vector<string> *tables, resultSink err)
+{
+	tables->clear();
+	int exists = tableExists(db, "Log");
+	vector<string> partitions;
+	if(exists < 0 || readPartitions(db, &partitions) < 0) //OK
+	{
+		err.sqliteFail("_listLogPartitions", db);
+		return -1;
+	}
+	if(exists > 0)
+		tables->push_back("Log");
+	string first = from > 0 ? "Log_" + localDay(from) : "Log_";
+	string last = to < LLONG_MAX ? "Log_" + localDay(to) : "Log_99999999";
+	for(const string& table : partitions)
+	{
+		if(table >= first && table <= last)
+			tables->push_back(table);
+	}
+	err.ok("_listLogPartitions");
+	return 0;
+}
+
+static const char *columnText(sqlite3_stmt *res, int i)
+{
+	const unsigned char *text = sqlite3_column_text(res, i);
+	return text != nullptr ? reinterpret_cast<const char*>(text) : "";
+}
+
+// Streams the matching records of one table after cursor, at most limit of them (0 - all).
+// Returns the number passed to callback, *stopped when callback asked to stop.
+static int queryTable(sqlite3 *db, const string& table, const logQuery& query, logCursor *cursor, size_t limit,
+	bool (*callback)(const logEntry& entry, void *context), void *context, bool *stopped)
+{
+	bool after = cursor->table == table;
+	string key = table == "Log" && hasCompactLog(db) ? "id" : "rowid"; //a compact Log is a view, its id is the rowid of LogCompact
+	string sql = "SELECT " + key + ", eventName, object, subject, eventStatus, eventDateTime FROM " + table +
+		" WHERE eventDateTime BETWEEN ?1 AND ?2";
+	if(!query.subject.empty())
+		sql += " AND subject = ?3";
+	if(!query.object.empty())
+		sql += " AND object = ?4";
+	if(!query.eventName.empty())
+		sql += " AND eventName = ?5";
+	if(!query.eventStatus.empty())
+		sql += " AND eventStatus = ?6";
+	if(after)
+		sql += " AND (eventDateTime, " + key + ") > (?7, ?8)";
+	sql += " ORDER BY eventDateTime, " + key;
+	if(limit > 0)
+		sql += " LIMIT ?9";
+	cachedStmt res;
+	if(prepareCached(db, sql.c_str(), &res) != SQLITE_OK)
+		return -1;
+	sqlite3_bind_int64(res, 1, query.from);
+	sqlite3_bind_int64(res, 2, query.to);
+	if(!query.subject.empty())
+		sqlite3_bind_text(res, 3, query.subject.c_str(), -1, SQLITE_STATIC);
+	if(!query.object.empty())
+		sqlite3_bind_text(res, 4, query.object.c_str(), -1, SQLITE_STATIC);
+	if(!query.eventName.empty())
+		sqlite3_bind_text(res, 5, query.eventName.c_str(), -1, SQLITE_STATIC);
+	if(!query.eventStatus.empty())
+		sqlite3_bind_text(res, 6, query.eventStatus.c_str(), -1, SQLITE_STATIC);
+	if(after)
+	{
+		sqlite3_bind_int64(res, 7, cursor->eventDateTime);
+		sqlite3_bind_int64(res, 8, cursor->rowid);
+	}
+	if(limit > 0)
+		sqlite3_bind_int64(res, 9, static_cast<sqlite3_int64>(limit));
+	logEntry entry;
+	int count = 0;
+	int rc;
+	while((rc = sqlite3_step(res)) == SQLITE_ROW)
+	{
+		entry.rowid = sqlite3_column_int64(res, 0);
+		entry.eventName.assign(columnText(res, 1));
+		entry.object.assign(columnText(res, 2));
+		entry.subject.assign(columnText(res, 3));
+		entry.eventStatus.assign(columnText(res, 4));
+		entry.eventDateTime = sqlite3_column_int64(res, 5);
+		cursor->table = table;
+		cursor->eventDateTime = entry.eventDateTime;
+		cursor->rowid = entry.rowid;
+		count++;
+		if(!callback(entry, context))
+		{
+			*stopped = true;
+			return count;
+		}
+	}
+	return rc == SQLITE_DONE ? count : -2;
+}
+
+int queryLog(sqlite3 *db, const logQuery& query, logCursor *cursor, bool (*callback)(const logEntry& entry, void *context), void *context, resultSink err)
+{
+	SQL_METRIC_SCOPE("queryLog");
+	if(query.from > query.to)
+	{
+		err.fail(RESULT_INVALID_ARGUMENT, "_queryLog", "from is after to");
+		return -1;
+	}
+	vector<string> tables;
+	int rc = listLogPartitions(db, static_cast<time_t>(query.from), static_cast<time_t>(query.to), &tables, err);
+	if(rc < 0) //OK
+	{
+		err.callFailed("_queryLog", "listLogPartitions", rc);
+		return -2;
+	}
+	int count = 0;
+	bool stopped = false;
+	for(const string& table : tables)
+	{
+		if(table < cursor->table) //tables are listed in the order of their names, so pages resume where they stopped
+			continue;
+		rc = queryTable(db, table, query, cursor, query.limit > 0 ? query.limit - count : 0, callback, context, &stopped);
+		if(rc < 0) //OK
+		{
+			err.sqliteFail("_queryLog", db);
+			return -3;
+		}
+		count += rc;
+		if(stopped || (query.limit > 0 && static_cast<size_t>(count) >= query.limit))
+			break;
+	}
+	err.ok("_queryLog");
+	return count;
+}
+
+int queryLog(sqlite3 *db, time_t from, time_t to, bool (*callback)(const logEntry& entry, void *context), void *context, resultSink err)
+{
+	logQuery query;
+	query.from = from;
+	query.to = to;
+	logCursor cursor;
+	return queryLog(db, query, &cursor, callback, context, err);
+}
@@ -0,0 +1,345 @@
+#include <sqlite3.h>
+#include <string>
+#include <ctime>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <unordered_map>
+#include "SQL/BaseSQL.h"
+#include "SQL/StmtCache.h"
+#include "SQL/LogWriter.h"
+#include "SQL/LogPartitions.h"
+#include "SQL/CompactLog.h"
+
+using namespace std;
+
+struct logRecord {
+	string eventName;
+	string object;
+	string subject;
+	string eventStatus;
+	long long whenMicros;
+};
+
+struct logWriter {
+	sqlite3 *db;       //a connection of the writer whose Log configuration the batches follow, guarded by lock
+	sqlite3 *conn;     //connection of the writer thread, never shared with the caller
+	logWriterOptions options;
+
+	mutex lock;
+	condition_variable wakeWriter;
+	condition_variable wakeProducers;
+	vector<logRecord> pending;
+	bool stopping = false;
+	bool flushRequested = false;
+	unsigned long long queuedSeq = 0;
+	unsigned long long doneSeq = 0;
+	logWriterStats stats = {0, 0, 0, 0, 0};
+	size_t users = 1;  //connections whose Log() it takes, guarded by registryLock
+	sqlite3 *writingFor = nullptr;  //db of the batch being written
+	thread worker;
+
+	void writeBatch(logRecord *batch, size_t count);
+	void run();
+};
+
+static mutex registryLock;
+static unordered_map<sqlite3*, shared_ptr<logWriter>> registry;
+static atomic<size_t> activeWriters(0); //lets Log() skip the registry when nothing is running
+
+static shared_ptr<logWriter> findWriter(sqlite3 *db)
+{
+	if(activeWriters.load(memory_order_acquire) == 0)
+		return nullptr;
+	lock_guard<mutex> guard(registryLock);
+	auto it = registry.find(db);
+	if(it == registry.end())
+		return nullptr;
+	return it->second;
+}
+
+void logWriter::writeBatch(logRecord *batch, size_t count)
+{
+	sqlite3 *source;
+	{
+		lock_guard<mutex> guard(lock);
+		source = db;
+		writingFor = source;
+	}
+	// The partition of the first record is resolved before BEGIN, so a new day's
+	// partition is created (and retention applied) outside of the batch transaction
+	bool compact = hasCompactLog(source);
+	string table;
+	if(!compact)
+		logPartitionTable(source, conn, batch[0].whenMicros / 1000000, &table);
+	bool transaction = sqlite3_exec(conn, "BEGIN", nullptr, nullptr, nullptr) == SQLITE_OK;
+	cachedStmt res;
+	string current;
+	compactLogStrings learned;
+	time_t resolved = batch[0].whenMicros / 1000000;
+	size_t written = 0;
+	for(; written < count; written++)
+	{
+		logRecord& record = batch[written];
+		if(compact)
+		{
+			if(compactLogInsert(source, conn, record.eventName, record.object, record.subject, record.eventStatus,
+				record.whenMicros, transaction ? &learned : nullptr) != 0)
+				break;
+			continue;
+		}
+		time_t when = record.whenMicros / 1000000;
+		if(when != resolved && logPartitionTable(source, conn, when, &table) < 0) //records of one second share a partition
+			break;
+		resolved = when;
+		if(table != current)
+		{
+			res.release();
+			if(prepareCached(conn, ("INSERT INTO " + table + "(eventName, object, subject, eventStatus, eventDateTime) VALUES(?, ?, ?, ?, ?)").c_str(), &res) != SQLITE_OK)
+			{
+				forgetLogPartition(source, table);
+				break;
+			}
+			current = table;
+		}
+		sqlite3_bind_text(res, 1, record.eventName.c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_text(res, 2, record.object.c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_text(res, 3, record.subject.c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_text(res, 4, record.eventStatus.c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_int64(res, 5, when);
+		if(sqlite3_step(res) != SQLITE_DONE)
+			break;
+		sqlite3_reset(res);
+	}
+	res.release();
+	if(transaction)
+	{
+		if(written == count && sqlite3_exec(conn, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK)
+			written = 0;
+		if(written != count)
+		{
+			sqlite3_exec(conn, "ROLLBACK", nullptr, nullptr, nullptr);
+			written = 0;
+		}
+		else
+			compactLogRemember(source, learned);
+	}
+	for(size_t i = written; i < count; i++)
+		textLog(conn, batch[i].eventName, batch[i].object, batch[i].subject, batch[i].eventStatus);
+
+	lock_guard<mutex> guard(lock);
+	stats.written += written;
+	stats.failed += count - written;
+	stats.batches++;
+	writingFor = nullptr;
+	wakeProducers.notify_all();
+}
+
+void logWriter::run()
+{
+	vector<logRecord> batch;
+	batch.reserve(options.queueCapacity);
+	unique_lock<mutex> guard(lock);
+	while(true)
+	{
+		wakeWriter.wait_for(guard, chrono::milliseconds(options.flushIntervalMs), [this] {
+			return stopping || flushRequested || pending.size() >= options.batchSize;
+		});
+		flushRequested = false;
+		if(pending.empty())
+		{
+			if(stopping)
+				break;
+			continue;
+		}
+		pending.swap(batch); //double buffering, producers get the whole queue back at once
+		wakeProducers.notify_all();
+		guard.unlock();
+
+		for(size_t first = 0; first < batch.size(); first += options.batchSize)
+			writeBatch(batch.data() + first, min(options.batchSize, batch.size() - first));
+		size_t count = batch.size();
+		batch.clear();
+
+		guard.lock();
+		doneSeq += count;
+		wakeProducers.notify_all();
+	}
+}
+
+int startLogWriter(sqlite3 *db, const logWriterOptions& options, resultSink err)
+{
+	if(options.queueCapacity == 0 || options.batchSize == 0)
+	{
+		err.fail(RESULT_INVALID_ARGUMENT, "_startLogWriter", "queueCapacity and batchSize must be positive");
+		return -1;
+	}
+	lock_guard<mutex> guard(registryLock);
+	if(registry.find(db) != registry.end())
+	{
+		err.fail(RESULT_CONFLICT, "_startLogWriter", "log writer is already running");
+		return -2;
+	}
+	// The writer thread needs a connection of its own: on the caller's one its inserts
+	// would join the caller's transactions and overwrite sqlite3_changes and errors
+	const char *fileName = sqlite3_db_filename(db, "main");
+	if(fileName == nullptr || fileName[0] == '\0')
+	{
+		err.fail(RESULT_UNAVAILABLE, "_startLogWriter", "in-memory databases are logged synchronously");
+		return -4;
+	}
+	shared_ptr<logWriter> writer = make_shared<logWriter>();
+	writer->db = db;
+	writer->options = options;
+	if(sqlite3_open_v2(fileName, &writer->conn, SQLITE_OPEN_READWRITE, nullptr) != SQLITE_OK)
+	{
+		err.sqliteFail("_startLogWriter", writer->conn);
+		sqlite3_close(writer->conn);
+		return -3;
+	}
+	shared_ptr<const connectionOptions> connOptions = getConnectionOptions(db);
+	if(connOptions != nullptr)
+	{
+		configureConnection(writer->conn, *connOptions, nullptr);
+	}
+	else
+		sqlite3_busy_timeout(writer->conn, 5000);
+	writer->pending.reserve(options.queueCapacity);
+	writer->worker = thread(&logWriter::run, writer.get());
+	registry.emplace(db, writer);
+	activeWriters.fetch_add(1, memory_order_release);
+	err.ok("_startLogWriter");
+	return 0;
+}
+
+int stopLogWriter(sqlite3 *db, resultSink err)
+{
+	shared_ptr<logWriter> writer;
+	sqlite3 *next = nullptr;
+	{
+		lock_guard<mutex> guard(registryLock);
+		auto it = registry.find(db);
+		if(it == registry.end())
+		{
+			err.fail(RESULT_UNAVAILABLE, "_stopLogWriter", "log writer is not running");
+			return -1;
+		}
+		writer = it->second;
+		registry.erase(it);
+		activeWriters.fetch_sub(1, memory_order_release);
+		if(--writer->users > 0)
+		{
+			for(auto& shared : registry)
+			{
+				if(shared.second == writer)
+				{
+					next = shared.first;
+					break;
+				}
+			}
+		}
+	}
+	if(next != nullptr) //still used by other connections, db's records are written with theirs
+	{
+		// db may be closed next: the batches follow a remaining connection from now on
+		unique_lock<mutex> guard(writer->lock);
+		if(writer->db == db)
+			writer->db = next;
+		writer->wakeProducers.wait(guard, [&] { return writer->writingFor != db; });
+		err.ok("_stopLogWriter");
+		return 0;
+	}
+	{
+		lock_guard<mutex> guard(writer->lock);
+		writer->stopping = true;
+	}
+	writer->wakeWriter.notify_one();
+	writer->wakeProducers.notify_all();
+	writer->worker.join();
+	closeBaseSQL(writer->conn, err);
+	err.ok("_stopLogWriter");
+	return 0;
+}
+
+int shareLogWriter(sqlite3 *db, sqlite3 *source, resultSink err)
+{
+	lock_guard<mutex> guard(registryLock);
+	auto it = registry.find(source);
+	if(it == registry.end())
+	{
+		err.fail(RESULT_UNAVAILABLE, "_shareLogWriter", "log writer is not running");
+		return -1;
+	}
+	if(registry.find(db) != registry.end())
+	{
+		err.fail(RESULT_CONFLICT, "_shareLogWriter", "log writer is already running");
+		return -2;
+	}
+	shared_ptr<logWriter> writer = it->second;
+	writer->users++;
+	registry.emplace(db, writer);
+	activeWriters.fetch_add(1, memory_order_release);
+	err.ok("_shareLogWriter");
+	return 0;
+}
+
+int flushLogWriter(sqlite3 *db)
+{
+	shared_ptr<logWriter> writer = findWriter(db);
+	if(writer == nullptr)
+		return -1;
+	unique_lock<mutex> guard(writer->lock);
+	unsigned long long target = writer->queuedSeq;
+	writer->flushRequested = true;
+	writer->wakeWriter.notify_one();
+	writer->wakeProducers.wait(guard, [&] { return writer->doneSeq >= target || writer->stopping; });
+	return 0;
+}
+
+bool hasLogWriter(sqlite3 *db)
+{
+	return findWriter(db) != nullptr;
+}
+
+logWriterStats getLogWriterStats(sqlite3 *db)
+{
+	shared_ptr<logWriter> writer = findWriter(db);
+	if(writer == nullptr)
+		return logWriterStats{0, 0, 0, 0, 0};
+	lock_guard<mutex> guard(writer->lock);
+	return writer->stats;
+}
+
+int queueLog(sqlite3 *db, string&& eventName, string&& object, string&& subject, string&& eventStatus, long long whenMicros)
+{
+	shared_ptr<logWriter> writer = findWriter(db);
+	if(writer == nullptr)
+		return 1;
+	unique_lock<mutex> guard(writer->lock);
+	if(writer->stopping)
+		return 1;
+	if(writer->pending.size() >= writer->options.queueCapacity)
+	{
+		if(writer->options.overflow == LOG_OVERFLOW_DROP)
+		{
+			writer->stats.dropped++;
+			return -1;
+		}
+		writer->wakeWriter.notify_one();
+		writer->wakeProducers.wait(guard, [&] {
+			return writer->pending.size() < writer->options.queueCapacity || writer->stopping;
+		});
+		if(writer->stopping)
+			return 1;
+	}
+	writer->pending.push_back(logRecord{move(eventName), move(object), move(subject), move(eventStatus), whenMicros});
+	writer->queuedSeq++;
+	writer->stats.queued++;
+	if(writer->pending.size() == writer->options.batchSize)
+		writer->wakeWriter.notify_one();
+	return 0;
+}
@@ -0,0 +1,304 @@
+#include <string>
+#include <vector>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <sstream>
+#include <algorithm>
+#include "SQL/Metrics.h"
+
+using namespace std;
+
+const char *sqlPhaseName(int phase)
+{
+	static const char *names[SQL_PHASE_COUNT] = {"total", "prepare", "bind", "step", "log"};
+	return phase >= 0 && phase < SQL_PHASE_COUNT ? names[phase] : "unknown";
+}
+
+double sqlMetricBucketSeconds(int bucket)
+{
+	if(bucket >= SQL_METRIC_BUCKETS - 1)
+		return numeric_limits<double>::infinity();
+	return ldexp(1.0, bucket + 8) / 1e9;
+}
+
+string formatSqlMetrics(const sqlMetricsSnapshot& snapshot)
+{
+	ostringstream out;
+	out.precision(9);
+	out << "# HELP sql_function_seconds Time of BaseSQL/TgSQL calls by phase\n";
+	out << "# TYPE sql_function_seconds histogram\n";
+	for(const sqlFunctionMetrics& function : snapshot.functions)
+	{
+		for(int phase = 0; phase < SQL_PHASE_COUNT; phase++)
+		{
+			const sqlPhaseMetrics& metrics = function.phases[phase];
+			if(metrics.count == 0)
+				continue;
+			string labels = "function=\"" + function.name + "\",phase=\"" + sqlPhaseName(phase) + "\"";
+			unsigned long long cumulative = 0;
+			for(int bucket = 0; bucket < SQL_METRIC_BUCKETS; bucket++)
+			{
+				cumulative += metrics.buckets[bucket];
+				out << "sql_function_seconds_bucket{" << labels << ",le=\"";
+				if(bucket == SQL_METRIC_BUCKETS - 1)
+					out << "+Inf";
+				else
+					out << sqlMetricBucketSeconds(bucket);
+				out << "\"} " << cumulative << "\n";
+			}
+			out << "sql_function_seconds_sum{" << labels << "} " << metrics.totalNs / 1e9 << "\n";
+			out << "sql_function_seconds_count{" << labels << "} " << metrics.count << "\n";
+		}
+	}
+	out << "# HELP sql_metrics_threads Running threads with SQL metrics\n";
+	out << "# TYPE sql_metrics_threads gauge\n";
+	out << "sql_metrics_threads " << snapshot.threads << "\n";
+	return out.str();
+}
+
+int dumpSqlMetrics(const string& fileName, resultSink err)
+{
+	sqlMetricsSnapshot snapshot;
+	if(getSqlMetrics(&snapshot) < 0) //OK
+	{
+		err.fail(RESULT_UNAVAILABLE, "_dumpSqlMetrics", "metrics are compiled out");
+		return -1;
+	}
+	string text = formatSqlMetrics(snapshot);
+	string temporary = fileName + ".tmp";
+	FILE *file = fopen(temporary.c_str(), "w");
+	if(file == nullptr) //OK
+	{
+		err.fail(RESULT_UNAVAILABLE, "_dumpSqlMetrics", "cannot open ", temporary.c_str());
+		return -2;
+	}
+	bool written = fwrite(text.data(), 1, text.size(), file) == text.size();
+	written = fclose(file) == 0 && written;
+	if(!written) //OK
+	{
+		remove(temporary.c_str());
+		err.fail(RESULT_UNAVAILABLE, "_dumpSqlMetrics", "cannot write ", temporary.c_str());
+		return -2;
+	}
+	if(rename(temporary.c_str(), fileName.c_str()) != 0) //OK
+	{
+		remove(temporary.c_str());
+		err.fail(RESULT_UNAVAILABLE, "_dumpSqlMetrics", "cannot rename to ", fileName.c_str());
+		return -3;
+	}
+	err.ok("_dumpSqlMetrics");
+	return 0;
+}
+
+#if defined SQL_METRICS
+
+#define SQL_METRIC_DEPTH 8
+
+// Written only by the owning thread, read by snapshots: relaxed atomics, no locking
+struct phaseCounters {
+	atomic<unsigned long long> count;
+	atomic<unsigned long long> totalNs;
+	atomic<unsigned long long> buckets[SQL_METRIC_BUCKETS];
+};
+
+struct threadMetrics {
+	phaseCounters counters[SQL_METRICS_MAX_FUNCTIONS][SQL_PHASE_COUNT];
+	int stack[SQL_METRIC_DEPTH];   //ids of the running functions, outermost first
+	int depth;
+	bool inPhase;
+};
+
+struct metricsRegistry {
+	mutex lock;
+	vector<string> names;
+	set<threadMetrics*> threads;
+	sqlPhaseMetrics retired[SQL_METRICS_MAX_FUNCTIONS][SQL_PHASE_COUNT];   //finished threads
+};
+
+// Never destroyed: threads may still finish after the static objects are gone
+static metricsRegistry& registry()
+{
+	static metricsRegistry *instance = new metricsRegistry();
+	return *instance;
+}
+
+static void addCounters(sqlPhaseMetrics *to, const phaseCounters& from)
+{
+	to->count += from.count.load(memory_order_relaxed);
+	to->totalNs += from.totalNs.load(memory_order_relaxed);
+	for(int i = 0; i < SQL_METRIC_BUCKETS; i++)
+		to->buckets[i] += from.buckets[i].load(memory_order_relaxed);
+}
+
+static void clearCounters(phaseCounters *counters)
+{
+	counters->count.store(0, memory_order_relaxed);
+	counters->totalNs.store(0, memory_order_relaxed);
+	for(int i = 0; i < SQL_METRIC_BUCKETS; i++)
+		counters->buckets[i].store(0, memory_order_relaxed);
+}
+
+// The counters of a thread move to the retired ones when it finishes
+struct threadSlot {
+	threadMetrics *metrics = nullptr;
+	~threadSlot()
+	{
+		if(metrics == nullptr)
+			return;
+		metricsRegistry& r = registry();
+		lock_guard<mutex> guard(r.lock);
+		for(int id = 0; id < SQL_METRICS_MAX_FUNCTIONS; id++)
+			for(int phase = 0; phase < SQL_PHASE_COUNT; phase++)
+				addCounters(&r.retired[id][phase], metrics->counters[id][phase]);
+		r.threads.erase(metrics);
+		delete metrics;
+	}
+};
+
+static thread_local threadSlot slot;
+
+static threadMetrics *currentThread()
+{
+	if(slot.metrics == nullptr)
+	{
+		threadMetrics *metrics = new threadMetrics();   //value-initialized: counters start at zero
+		metricsRegistry& r = registry();
+		lock_guard<mutex> guard(r.lock);
+		r.threads.insert(metrics);
+		slot.metrics = metrics;
+	}
+	return slot.metrics;
+}
+
+static int bucketOf(unsigned long long ns)
+{
+	if(ns < 256)
+		return 0;
+	return min(63 - __builtin_clzll(ns) - 7, SQL_METRIC_BUCKETS - 1);
+}
+
+static void addSample(phaseCounters *counters, unsigned long long ns)
+{
+	// Only this thread writes: a load and a store instead of a locked add
+	counters->count.store(counters->count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+	counters->totalNs.store(counters->totalNs.load(memory_order_relaxed) + ns, memory_order_relaxed);
+	atomic<unsigned long long>& bucket = counters->buckets[bucketOf(ns)];
+	bucket.store(bucket.load(memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+static unsigned long long elapsedNs(chrono::steady_clock::time_point start)
+{
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+int registerSqlFunction(const char *name)
+{
+	metricsRegistry& r = registry();
+	lock_guard<mutex> guard(r.lock);
+	for(size_t i = 0; i < r.names.size(); i++)
+		if(r.names[i] == name)
+			return i;
+	if(r.names.size() >= SQL_METRICS_MAX_FUNCTIONS)
+		return -1;
+	r.names.push_back(name);
+	return r.names.size() - 1;
+}
+
+sqlMetricScope::sqlMetricScope(int id) : id(id)
+{
+	if(id < 0)
+		return;
+	threadMetrics *metrics = currentThread();
+	if(metrics->depth < SQL_METRIC_DEPTH)
+		metrics->stack[metrics->depth] = id;
+	metrics->depth++;
+	start = chrono::steady_clock::now();
+}
+
+sqlMetricScope::~sqlMetricScope()
+{
+	if(id < 0)
+		return;
+	unsigned long long ns = elapsedNs(start);
+	threadMetrics *metrics = slot.metrics;
+	metrics->depth--;
+	addSample(&metrics->counters[id][SQL_PHASE_TOTAL], ns);
+}
+
+sqlPhaseTimer::sqlPhaseTimer(sqlPhase phase) : phase(-1)
+{
+	threadMetrics *metrics = slot.metrics;
+	if(metrics == nullptr || metrics->depth == 0 || metrics->inPhase)
+		return;
+	metrics->inPhase = true;
+	this->phase = phase;
+	start = chrono::steady_clock::now();
+}
+
+sqlPhaseTimer::~sqlPhaseTimer()
+{
+	if(phase < 0)
+		return;
+	unsigned long long ns = elapsedNs(start);
+	threadMetrics *metrics = slot.metrics;
+	metrics->inPhase = false;
+	int depth = min(metrics->depth, SQL_METRIC_DEPTH);
+	for(int i = 0; i < depth; i++)
+	{
+		int id = metrics->stack[i];
+		if(find(metrics->stack, metrics->stack + i, id) == metrics->stack + i)   //recursive calls count once
+			addSample(&metrics->counters[id][phase], ns);
+	}
+}
+
+int getSqlMetrics(sqlMetricsSnapshot *snapshot)
+{
+	metricsRegistry& r = registry();
+	lock_guard<mutex> guard(r.lock);
+	snapshot->functions.assign(r.names.size(), sqlFunctionMetrics());
+	for(size_t id = 0; id < r.names.size(); id++)
+	{
+		sqlFunctionMetrics& function = snapshot->functions[id];
+		function.name = r.names[id];
+		for(int phase = 0; phase < SQL_PHASE_COUNT; phase++)
+		{
+			function.phases[phase] = r.retired[id][phase];
+			for(threadMetrics *metrics : r.threads)
+				addCounters(&function.phases[phase], metrics->counters[id][phase]);
+		}
+	}
+	snapshot->threads = r.threads.size();
+	return 0;
+}
+
+void resetSqlMetrics()
+{
+	metricsRegistry& r = registry();
+	lock_guard<mutex> guard(r.lock);
+	for(int id = 0; id < SQL_METRICS_MAX_FUNCTIONS; id++)
+	{
+		for(int phase = 0; phase < SQL_PHASE_COUNT; phase++)
+		{
+			r.retired[id][phase] = sqlPhaseMetrics();
+			for(threadMetrics *metrics : r.threads)
+				clearCounters(&metrics->counters[id][phase]);
+		}
+	}
+}
+
+#else
+
+int getSqlMetrics(sqlMetricsSnapshot *snapshot)
+{
+	*snapshot = sqlMetricsSnapshot();
+	return -1;
+}
+
+void resetSqlMetrics() {}
+
+#endif
@@ -0,0 +1,409 @@
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include "SQL/BaseSQL.h"
+#include "SQL/TgSQL.h"
+#include "SQL/StmtCache.h"
+#include "SQL/PrivilegeCache.h"
+#include "SQL/Permissions.h"
+#include "SQL/Metrics.h"
+
+using namespace std;
+
+struct actionInfo {
+	string name;
+	int defaultMinPrivilege;
+};
+
+struct actionRegistry {
+	mutex lock;
+	vector<actionInfo> actions;
+	atomic<int> count;
+
+	actionRegistry() : actions{{"addUser", DEFAULT_MIN_PRIVILEGE}, {"modUser", DEFAULT_MIN_PRIVILEGE},
+		{"deleteUser", DEFAULT_MIN_PRIVILEGE}, {"importUsers", DEFAULT_MIN_PRIVILEGE}, {"exportUsers", DEFAULT_MIN_PRIVILEGE}},
+		count(ACTION_BUILTIN_COUNT) {}
+};
+
+// Function-local, so actions can be registered from static initializers
+static actionRegistry& registry()
+{
+	static actionRegistry instance;
+	return instance;
+}
+
+// Thresholds read by one loadPermissions, never changed afterwards
+struct permissionThresholds {
+	unsigned version;
+	vector<int> minPrivilege;   //by action id; actions registered later use their default
+};
+
+struct permissionState {
+	shared_ptr<const permissionThresholds> current;   //accessed with atomic_load/atomic_store
+	atomic<unsigned> version{0};                      //of current, stored after it
+};
+
+// The state and thresholds last used by this thread, so a privilege check on the same
+// connection takes neither the connection data lock nor the shared_ptr one
+struct thresholdSlot {
+	sqlite3 *db = nullptr;
+	unsigned dataVersion = 0;
+	shared_ptr<permissionState> state;
+	unsigned version = 0;
+	shared_ptr<const permissionThresholds> loaded;
+};
+
+static const string PERMISSIONS_KEY = "permissions";
+static atomic<unsigned> nextVersion(1);
+
+// Thresholds of file databases, shared by all connections to the same file
+static mutex sharedLock;
+static unordered_map<string, weak_ptr<permissionState>> sharedStates;
+
+tableInfo permissionsInfo("permissions", {column("action", "TEXT", COLUMN_PRIMARY_KEY), column("minPrivilege", "INTEGER", COLUMN_NOT_NULL)});
+
+int registerAction(const string& name, int defaultMinPrivilege)
+{
+	actionRegistry& r = registry();
+	lock_guard<mutex> guard(r.lock);
+	for(size_t i = 0; i < r.actions.size(); i++)
+		if(r.actions[i].name == name)
+			return i;
+	if(r.actions.size() >= MAX_USER_ACTIONS)
+		return -1;
+	r.actions.push_back({name, defaultMinPrivilege});
+	r.count.store(r.actions.size());
+	return r.actions.size() - 1;
+}
+
+int findAction(const string& name)
+{
+	actionRegistry& r = registry();
+	lock_guard<mutex> guard(r.lock);
+	for(size_t i = 0; i < r.actions.size(); i++)
+		if(r.actions[i].name == name)
+			return i;
+	return -1;
+}
+
+string actionName(int action)
+{
+	actionRegistry& r = registry();
+	lock_guard<mutex> guard(r.lock);
+	return action >= 0 && action < static_cast<int>(r.actions.size()) ? r.actions[action].name : "";
+}
+
+static int defaultThreshold(int action)
+{
+	actionRegistry& r = registry();
+	lock_guard<mutex> guard(r.lock);
+	return action < static_cast<int>(r.actions.size()) ? r.actions[action].defaultMinPrivilege : -1;
+}
+
+static int fixedThresholdOf(int action)
+{
+	switch(action)
+	{
+	case ACTION_ADD_USER: return fixedThreshold<ACTION_ADD_USER>::value;
+	case ACTION_MOD_USER: return fixedThreshold<ACTION_MOD_USER>::value;
+	case ACTION_DELETE_USER: return fixedThreshold<ACTION_DELETE_USER>::value;
+	case ACTION_IMPORT_USERS: return fixedThreshold<ACTION_IMPORT_USERS>::value;
+	case ACTION_EXPORT_USERS: return fixedThreshold<ACTION_EXPORT_USERS>::value;
+	default: return -1;
+	}
+}
+
+static shared_ptr<const permissionThresholds> loadedThresholds(sqlite3 *db)
+{
+	shared_ptr<permissionState> state = static_pointer_cast<permissionState>(getConnectionData(db, PERMISSIONS_KEY));
+	return state != nullptr ? atomic_load(&state->current) : nullptr;
+}
+
+// Valid until the next call on this thread
+static const permissionThresholds *slotThresholds(sqlite3 *db)
+{
+	thread_local thresholdSlot slot;
+	unsigned dataVersion = connectionDataVersion();
+	if(slot.db != db || slot.dataVersion != dataVersion)
+	{
+		slot.state = static_pointer_cast<permissionState>(getConnectionData(db, PERMISSIONS_KEY));
+		slot.db = db;
+		slot.dataVersion = dataVersion;
+		slot.version = 0;
+		slot.loaded = nullptr;
+	}
+	if(slot.state == nullptr)
+		return nullptr;
+	unsigned version = slot.state->version.load(memory_order_acquire);
+	if(version != slot.version)
+	{
+		slot.loaded = atomic_load(&slot.state->current);
+		slot.version = version;
+	}
+	return slot.loaded.get();
+}
+
+static int thresholdOf(const permissionThresholds *loaded, int action)
+{
+	int fixed = fixedThresholdOf(action);
+	if(fixed >= 0)
+		return fixed;
+	if(loaded != nullptr && action < static_cast<int>(loaded->minPrivilege.size()))
+		return loaded->minPrivilege[action];
+	return defaultThreshold(action);
+}
+
+// Key of the cached permission sets: changes with every load and every newly registered action
+static unsigned cacheVersion(const permissionThresholds *loaded, int count)
+{
+	return (loaded != nullptr ? loaded->version : 0) << 7 | count;
+}
+
+static permissionSet evaluate(const permissionThresholds *loaded, int count, int privilege)
+{
+	permissionSet permissions = 0;
+	for(int action = 0; action < count; action++)
+	{
+		if(privilege >= thresholdOf(loaded, action))
+			permissions |= permissionSet(1) << action;
+	}
+	return permissions;
+}
+
+int actionThreshold(sqlite3 *db, int action)
+{
+	if(action < 0 || action >= registry().count.load())
+		return -1;
+	int fixed = fixedThresholdOf(action);
+	if(fixed >= 0)
+		return fixed;
+	return thresholdOf(slotThresholds(db), action);
+}
+
+permissionSet evaluatePermissions(sqlite3 *db, int privilege)
+{
+	return evaluate(loadedThresholds(db).get(), registry().count.load(), privilege);
+}
+
+static shared_ptr<permissionState> attachState(sqlite3 *db)
+{
+	shared_ptr<permissionState> state = static_pointer_cast<permissionState>(getConnectionData(db, PERMISSIONS_KEY));
+	if(state != nullptr)
+		return state;
+	const char *fileName = sqlite3_db_filename(db, "main");
+	if(fileName != nullptr && fileName[0] != '\0')
+	{
+		lock_guard<mutex> guard(sharedLock);
+		state = sharedStates[fileName].lock();
+		if(state == nullptr)
+		{
+			state = make_shared<permissionState>();
+			sharedStates[fileName] = state;
+		}
+	}
+	else
+		state = make_shared<permissionState>();
+	setConnectionData(db, PERMISSIONS_KEY, state);
+	return state;
+}
+
+static int seedPermissions(sqlite3 *db, const vector<actionInfo>& actions)
+{
+	cachedStmt res;
+	if(prepareCached(db, "INSERT OR IGNORE INTO permissions(action, minPrivilege) VALUES(?, ?)", &res) != SQLITE_OK)
+		return -1;
+	for(const actionInfo& action : actions)
+	{
+		sqlite3_reset(res);
+		if(sqlite3_bind_text(res, 1, action.name.c_str(), -1, SQLITE_STATIC) != SQLITE_OK ||
+		sqlite3_bind_int(res, 2, action.defaultMinPrivilege) != SQLITE_OK || sqlite3_step(res) != SQLITE_DONE)
+			return -2;
+	}
+	return 0;
+}
+
+static int readPermissions(sqlite3 *db, const vector<actionInfo>& actions, vector<int> *minPrivilege)
+{
+	minPrivilege->clear();
+	for(const actionInfo& action : actions)
+		minPrivilege->push_back(action.defaultMinPrivilege);
+	cachedStmt res;
+	if(prepareCached(db, "SELECT action, minPrivilege FROM permissions", &res) != SQLITE_OK)
+		return -1;
+	int rc;
+	while((rc = sqlite3_step(res)) == SQLITE_ROW)
+	{
+		const char *name = reinterpret_cast<const char*>(sqlite3_column_text(res, 0));
+		for(size_t i = 0; name != nullptr && i < actions.size(); i++)
+		{
+			if(actions[i].name == name)
+				(*minPrivilege)[i] = sqlite3_column_int(res, 1);
+		}
+	}
+	return rc == SQLITE_DONE ? 0 : -2;
+}
+
+int loadPermissions(sqlite3 *db, resultSink err)
+{
+	SQL_METRIC_SCOPE("loadPermissions");
+	int rc = checkTable(db, permissionsInfo, err);
+	if(rc == 1)
+	{
+		rc = createTable(db, permissionsInfo, err);
+		if(rc != 0) //OK
+		{
+			Log(db, "loadPermissions", "TABLE:permissions", "SYSTEM", "FAIL_ERROR-createTable:" + to_string(rc), err.traceOnly());
+			err.callFailed("_loadPermissions", "createTable", rc);
+			return -1;
+		}
+	}
+	else if(rc < 0) //OK
+	{
+		Log(db, "loadPermissions", "TABLE:permissions", "SYSTEM", "FAIL_ERROR-checkTable:" + to_string(rc), err.traceOnly());
+		err.callFailed("_loadPermissions", "checkTable", rc);
+		return -1;
+	}
+	else if(rc > 1) //OK
+	{
+		Log(db, "loadPermissions", "TABLE:permissions", "SYSTEM", "FAIL:table in an unexpected way", err.traceOnly());
+		err.fail(RESULT_SCHEMA_MISMATCH, "_loadPermissions", "table in an unexpected way");
+		return -2;
+	}
+	vector<actionInfo> actions;
+	{
+		actionRegistry& r = registry();
+		lock_guard<mutex> guard(r.lock);
+		actions = r.actions;
+	}
+	immediateTransaction transaction;
+	rc = transaction.begin(db, err);
+	if(rc < 0) //OK
+	{
+		Log(db, "loadPermissions", "TABLE:permissions", "SYSTEM", "FAIL_ERROR-beginTransaction:" + to_string(rc), err.traceOnly());
+		err.callFailed("_loadPermissions", "beginTransaction", rc);
+		return -3;
+	}
+	if(seedPermissions(db, actions) < 0) //OK
+	{
+		sqliteError error(db);
+		transaction.rollback();
+		Log(db, "loadPermissions", "TABLE:permissions", "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_loadPermissions", error);
+		return -4;
+	}
+	shared_ptr<permissionThresholds> loaded = make_shared<permissionThresholds>();
+	if(readPermissions(db, actions, &loaded->minPrivilege) < 0) //OK
+	{
+		sqliteError error(db);
+		transaction.rollback();
+		Log(db, "loadPermissions", "TABLE:permissions", "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_loadPermissions", error);
+		return -5;
+	}
+	rc = transaction.commit(err);
+	if(rc < 0) //OK
+	{
+		Log(db, "loadPermissions", "TABLE:permissions", "SYSTEM", "FAIL_ERROR-commitTransaction:" + to_string(rc), err.traceOnly());
+		err.callFailed("_loadPermissions", "commitTransaction", rc);
+		return -6;
+	}
+	loaded->version = nextVersion++;
+	shared_ptr<permissionState> state = attachState(db);
+	atomic_store(&state->current, shared_ptr<const permissionThresholds>(loaded));
+	state->version.store(loaded->version, memory_order_release);
+	err.ok("_loadPermissions");
+	return 0;
+}
+
+int setActionThreshold(sqlite3 *db, int action, int minPrivilege, resultSink err)
+{
+	SQL_METRIC_SCOPE("setActionThreshold");
+	string name = actionName(action);
+	if(fixedThresholdOf(action) >= 0) //OK
+	{
+		err.fail(RESULT_CONFLICT, "_setActionThreshold", "the threshold is fixed at build time");
+		return -1;
+	}
+	if(name.empty()) //OK
+	{
+		err.fail(RESULT_INVALID_ARGUMENT, "_setActionThreshold", "unknown action");
+		return -2;
+	}
+	cachedStmt res;
+	int rc = prepareCached(db, "INSERT INTO permissions(action, minPrivilege) VALUES(?, ?) "
+		"ON CONFLICT(action) DO UPDATE SET minPrivilege = excluded.minPrivilege", &res);
+	if(rc == SQLITE_OK)
+	{
+		if(SQL_TIMED(SQL_PHASE_BIND, sqlite3_bind_text(res, 1, name.c_str(), -1, SQLITE_STATIC) == SQLITE_OK &&
+		sqlite3_bind_int(res, 2, minPrivilege) == SQLITE_OK))
+			rc = SQL_TIMED(SQL_PHASE_STEP, sqlite3_step(res));
+		else
+			rc = SQLITE_ERROR;
+	}
+	if(rc != SQLITE_DONE) //OK
+	{
+		sqliteError error(db);
+		Log(db, "setActionThreshold", "ACTION:" + name, "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_setActionThreshold", error);
+		return -3;
+	}
+	res.release();
+	rc = loadPermissions(db, err);
+	if(rc < 0) //OK
+	{
+		Log(db, "setActionThreshold", "ACTION:" + name, "SYSTEM", "FAIL_ERROR-loadPermissions:" + to_string(rc), err.traceOnly());
+		err.callFailed("_setActionThreshold", "loadPermissions", rc);
+		return -4;
+	}
+	Log(db, "setActionThreshold", "ACTION:" + name, "SYSTEM", "OK:" + to_string(minPrivilege), err.traceOnly());
+	err.ok("_setActionThreshold");
+	return 0;
+}
+
+int getUserPermissions(sqlite3 *db, const string& userID, permissionSet *permissions, resultSink err)
+{
+	SQL_METRIC_SCOPE("getUserPermissions");
+	// Taken before both reads: a mutation committed meanwhile changes it and the result is not
+	// cached; a threshold reload meanwhile changes the version the entry is keyed by.
+	unsigned long long generation = privilegeCacheGeneration(db);
+	shared_ptr<const permissionThresholds> loaded = loadedThresholds(db);
+	int count = registry().count.load();
+	unsigned version = cacheVersion(loaded.get(), count);
+	if(cachedPermissions(db, userID, version, permissions) == 1) //OK
+	{
+		Log(db, "getUserPermissions", userID, "", "OK", err.traceOnly());
+		err.ok("_getUserPermissions", "CACHED");
+		return 0;
+	}
+	*permissions = 0;
+	userLookup user;
+	int rc = lookupUser(db, userID, &user, err);
+	if(rc < 0) //OK
+	{
+		Log(db, "getUserPermissions", userID, "", "FAIL_ERROR-lookupUser:" + to_string(rc), err.traceOnly());
+		err.callFailed("_getUserPermissions", "lookupUser", rc);
+		return -4;
+	}
+	if(user.count == 0) //OK
+	{
+		Log(db, "getUserPermissions", userID, "", "FAIL:user not found", err.traceOnly());
+		err.fail(RESULT_NOT_FOUND, "_getUserPermissions", "user not found");
+		return -1;
+	}
+	if(user.count > 1) //OK
+	{
+		Log(db, "getUserPermissions", userID, "", "FAIL:there are a few users with that userID", err.traceOnly());
+		err.fail(RESULT_DUPLICATE, "_getUserPermissions", "there are a few users with that userID");
+		return -2;
+	}
+	*permissions = evaluate(loaded.get(), count, user.privilege);
+	if(sqlite3_get_autocommit(db)) //inside a transaction the row may not be committed yet
+		storePermissions(db, userID, user.privilege, version, *permissions, generation);
+	Log(db, "getUserPermissions", userID, "", "OK", err.traceOnly());
+	err.ok("_getUserPermissions");
+	return 0;
+}
@@ -0,0 +1,209 @@
+#include <sqlite3.h>
+#include <string>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "SQL/BaseSQL.h"
+#include "SQL/PrivilegeCache.h"
+
+using namespace std;
+
+struct privilegeEntry {
+	string userID;
+	int privilege;
+	unsigned long long permissions;
+	unsigned permissionsVersion; //thresholds the permissions were evaluated for, 0 - not evaluated
+};
+
+struct privilegeCache {
+	mutex lock;
+	size_t capacity;
+	list<privilegeEntry> entries; //most recently used first
+	unordered_map<string, list<privilegeEntry>::iterator> index;
+	unsigned long long hits = 0;
+	unsigned long long misses = 0;
+	unsigned long long evictions = 0;
+	unsigned long long generation = 0;   //changes with every store or invalidation after a mutation
+
+	explicit privilegeCache(size_t capacity) : capacity(capacity) {}
+};
+
+static const string PRIVILEGE_CACHE_KEY = "privilegeCache";
+
+// Caches of file databases, shared by all connections to the same file
+static mutex sharedLock;
+static unordered_map<string, weak_ptr<privilegeCache>> sharedCaches;
+
+static shared_ptr<privilegeCache> findCache(sqlite3 *db)
+{
+	return static_pointer_cast<privilegeCache>(getConnectionData(db, PRIVILEGE_CACHE_KEY));
+}
+
+int enablePrivilegeCache(sqlite3 *db, size_t capacity, resultSink err)
+{
+	if(capacity == 0)
+	{
+		err.fail(RESULT_INVALID_ARGUMENT, "_enablePrivilegeCache", "capacity must be positive");
+		return -1;
+	}
+	shared_ptr<privilegeCache> cache;
+	const char *fileName = sqlite3_db_filename(db, "main");
+	if(fileName != nullptr && fileName[0] != '\0')
+	{
+		lock_guard<mutex> guard(sharedLock);
+		cache = sharedCaches[fileName].lock();
+		if(cache == nullptr)
+		{
+			cache = make_shared<privilegeCache>(capacity);
+			sharedCaches[fileName] = cache;
+		}
+	}
+	else
+	{
+		cache = make_shared<privilegeCache>(capacity);
+	}
+	setConnectionData(db, PRIVILEGE_CACHE_KEY, cache);
+	err.ok("_enablePrivilegeCache");
+	return 0;
+}
+
+void disablePrivilegeCache(sqlite3 *db)
+{
+	setConnectionData(db, PRIVILEGE_CACHE_KEY, nullptr);
+}
+
+privilegeCacheStats getPrivilegeCacheStats(sqlite3 *db)
+{
+	shared_ptr<privilegeCache> cache = findCache(db);
+	if(cache == nullptr)
+		return privilegeCacheStats{0, 0, 0, 0, 0};
+	lock_guard<mutex> guard(cache->lock);
+	return privilegeCacheStats{cache->hits, cache->misses, cache->evictions, cache->index.size(), cache->capacity};
+}
+
+int cachedPrivilege(sqlite3 *db, const string& userID, int *privilege)
+{
+	shared_ptr<privilegeCache> cache = findCache(db);
+	if(cache == nullptr)
+		return 0;
+	lock_guard<mutex> guard(cache->lock);
+	auto it = cache->index.find(userID);
+	if(it == cache->index.end())
+	{
+		cache->misses++;
+		return 0;
+	}
+	cache->hits++;
+	cache->entries.splice(cache->entries.begin(), cache->entries, it->second);
+	*privilege = it->second->privilege;
+	return 1;
+}
+
+int cachedPermissions(sqlite3 *db, const string& userID, unsigned version, unsigned long long *permissions)
+{
+	shared_ptr<privilegeCache> cache = findCache(db);
+	if(cache == nullptr)
+		return 0;
+	lock_guard<mutex> guard(cache->lock);
+	auto it = cache->index.find(userID);
+	if(it == cache->index.end() || it->second->permissionsVersion != version)
+	{
+		cache->misses++;
+		return 0;
+	}
+	cache->hits++;
+	cache->entries.splice(cache->entries.begin(), cache->entries, it->second);
+	*permissions = it->second->permissions;
+	return 1;
+}
+
+// Called with the lock held: the entry of userID, most recently used, created if needed
+static privilegeEntry& useEntry(privilegeCache *cache, const string& userID, int privilege)
+{
+	auto it = cache->index.find(userID);
+	if(it != cache->index.end())
+	{
+		cache->entries.splice(cache->entries.begin(), cache->entries, it->second);
+		if(it->second->privilege != privilege)
+			it->second->permissionsVersion = 0;
+		it->second->privilege = privilege;
+		return *it->second;
+	}
+	if(cache->index.size() >= cache->capacity)
+	{
+		cache->index.erase(cache->entries.back().userID);
+		cache->entries.pop_back();
+		cache->evictions++;
+	}
+	cache->entries.push_front(privilegeEntry{userID, privilege, 0, 0});
+	cache->index.emplace(userID, cache->entries.begin());
+	return cache->entries.front();
+}
+
+unsigned long long privilegeCacheGeneration(sqlite3 *db)
+{
+	shared_ptr<privilegeCache> cache = findCache(db);
+	if(cache == nullptr)
+		return 0;
+	lock_guard<mutex> guard(cache->lock);
+	return cache->generation;
+}
+
+void storePrivilege(sqlite3 *db, const string& userID, int privilege)
+{
+	shared_ptr<privilegeCache> cache = findCache(db);
+	if(cache == nullptr)
+		return;
+	lock_guard<mutex> guard(cache->lock);
+	cache->generation++;
+	useEntry(cache.get(), userID, privilege);
+}
+
+void storeReadPrivilege(sqlite3 *db, const string& userID, int privilege, unsigned long long generation)
+{
+	shared_ptr<privilegeCache> cache = findCache(db);
+	if(cache == nullptr)
+		return;
+	lock_guard<mutex> guard(cache->lock);
+	if(cache->generation == generation)
+		useEntry(cache.get(), userID, privilege);
+}
+
+void storePermissions(sqlite3 *db, const string& userID, int privilege, unsigned version, unsigned long long permissions, unsigned long long generation)
+{
+	shared_ptr<privilegeCache> cache = findCache(db);
+	if(cache == nullptr)
+		return;
+	lock_guard<mutex> guard(cache->lock);
+	if(cache->generation != generation)
+		return;
+	privilegeEntry& entry = useEntry(cache.get(), userID, privilege);
+	entry.permissions = permissions;
+	entry.permissionsVersion = version;
+}
+
+void invalidatePrivilege(sqlite3 *db, const string& userID)
+{
+	shared_ptr<privilegeCache> cache = findCache(db);
+	if(cache == nullptr)
+		return;
+	lock_guard<mutex> guard(cache->lock);
+	cache->generation++;
+	auto it = cache->index.find(userID);
+	if(it == cache->index.end())
+		return;
+	cache->entries.erase(it->second);
+	cache->index.erase(it);
+}
+
+void invalidateAllPrivileges(sqlite3 *db)
+{
+	shared_ptr<privilegeCache> cache = findCache(db);
+	if(cache == nullptr)
+		return;
+	lock_guard<mutex> guard(cache->lock);
+	cache->generation++;
+	cache->entries.clear();
+	cache->index.clear();
+}
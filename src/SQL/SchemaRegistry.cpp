@@ -0,0 +1,134 @@
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include "SQL/BaseSQL.h"
+#include "SQL/StmtCache.h"
+#include "SQL/SchemaRegistry.h"
+
+using namespace std;
+
+// Bumped when the definition hash changes, so old registries fall back to the diff once
+#define SCHEMA_FINGERPRINT_FORMAT "1"
+
+// FNV-1a, every field is followed by a separator so "ab","c" and "a","bc" differ
+static void hashField(unsigned long long *hash, const string& field)
+{
+	for(unsigned char c : field)
+	{
+		*hash ^= c;
+		*hash *= 1099511628211ULL;
+	}
+	*hash ^= 0x1f;
+	*hash *= 1099511628211ULL;
+}
+
+static const unsigned long long FNV_OFFSET = 14695981039346656037ULL;
+
+unsigned long long tableFingerprint(const tableInfo& table)
+{
+	unsigned long long hash = FNV_OFFSET;
+	hashField(&hash, SCHEMA_FINGERPRINT_FORMAT);
+	hashField(&hash, table.name);
+	for(const column& col : table.columns)
+	{
+		hashField(&hash, col.name);
+		hashField(&hash, col.type);
+		hashField(&hash, to_string(col.constraints));
+	}
+	for(const tableIndex& index : table.indexes)
+	{
+		hashField(&hash, index.name);
+		hashField(&hash, index.unique ? "UNIQUE" : "");
+		for(const string& col : index.columns)
+			hashField(&hash, col);
+	}
+	return hash;
+}
+
+// Both queries must list the CREATE statements of a table in the same order
+static int ddlFingerprint(sqlite3 *db, const string& tableName, unsigned long long *hash)
+{
+	cachedStmt res;
+	if(prepareCached(db, "SELECT sql FROM sqlite_master WHERE tbl_name = ? AND sql IS NOT NULL ORDER BY type, name", &res) != SQLITE_OK)
+		return -1;
+	if(sqlite3_bind_text(res, 1, tableName.c_str(), -1, SQLITE_STATIC) != SQLITE_OK)
+		return -2;
+	*hash = FNV_OFFSET;
+	int rc;
+	while((rc = sqlite3_step(res)) == SQLITE_ROW)
+		hashField(hash, reinterpret_cast<const char*>(sqlite3_column_text(res, 0)));
+	return rc == SQLITE_DONE ? 0 : -3;
+}
+
+int matchSchemaFingerprints(sqlite3 *db, const vector<tableInfo>& tables, vector<bool> *valid)
+{
+	valid->assign(tables.size(), false);
+	if(tables.empty())
+		return 0;
+	string sql = "SELECT r.tableName, r.definition, r.ddl, m.sql FROM schemaRegistry AS r "
+		"LEFT JOIN sqlite_master AS m ON m.tbl_name = r.tableName AND m.sql IS NOT NULL "
+		"WHERE r.tableName IN (?";
+	for(size_t i = 1; i < tables.size(); i++)
+		sql += ", ?";
+	sql += ") ORDER BY r.tableName, m.type, m.name";
+	cachedStmt res;
+	if(prepareCached(db, sql.c_str(), &res) != SQLITE_OK)
+		return -1; //no registry yet
+	for(size_t i = 0; i < tables.size(); i++)
+	{
+		if(sqlite3_bind_text(res, i + 1, tables[i].name.c_str(), -1, SQLITE_STATIC) != SQLITE_OK)
+			return -2;
+	}
+	// Rows of one table are adjacent: the DDL hash is complete when the next table starts
+	string current;
+	unsigned long long definition = 0, ddl = 0, hash = 0;
+	auto finish = [&]() {
+		if(current.empty() || hash != ddl)
+			return;
+		for(size_t i = 0; i < tables.size(); i++)
+		{
+			if(tables[i].name == current && tableFingerprint(tables[i]) == definition)
+				(*valid)[i] = true;
+		}
+	};
+	int rc;
+	while((rc = sqlite3_step(res)) == SQLITE_ROW)
+	{
+		string tableName = reinterpret_cast<const char*>(sqlite3_column_text(res, 0));
+		if(tableName != current)
+		{
+			finish();
+			current = tableName;
+			definition = static_cast<unsigned long long>(sqlite3_column_int64(res, 1));
+			ddl = static_cast<unsigned long long>(sqlite3_column_int64(res, 2));
+			hash = FNV_OFFSET;
+		}
+		if(sqlite3_column_type(res, 3) != SQLITE_NULL)
+			hashField(&hash, reinterpret_cast<const char*>(sqlite3_column_text(res, 3)));
+	}
+	if(rc != SQLITE_DONE)
+	{
+		valid->assign(tables.size(), false);
+		return -3;
+	}
+	finish();
+	return 0;
+}
+
+int storeSchemaFingerprint(sqlite3 *db, const tableInfo& table)
+{
+	if(sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS schemaRegistry (tableName TEXT PRIMARY KEY, definition INTEGER NOT NULL, ddl INTEGER NOT NULL)", nullptr, nullptr, nullptr) != SQLITE_OK)
+		return -1;
+	unsigned long long ddl;
+	if(ddlFingerprint(db, table.name, &ddl) != 0)
+		return -2;
+	cachedStmt res;
+	if(prepareCached(db, "INSERT INTO schemaRegistry(tableName, definition, ddl) VALUES(?, ?, ?) "
+		"ON CONFLICT(tableName) DO UPDATE SET definition = excluded.definition, ddl = excluded.ddl", &res) != SQLITE_OK)
+		return -3;
+	if(sqlite3_bind_text(res, 1, table.name.c_str(), -1, SQLITE_STATIC) != SQLITE_OK ||
+	sqlite3_bind_int64(res, 2, static_cast<sqlite3_int64>(tableFingerprint(table))) != SQLITE_OK ||
+	sqlite3_bind_int64(res, 3, static_cast<sqlite3_int64>(ddl)) != SQLITE_OK)
+		return -4;
+	return sqlite3_step(res) == SQLITE_DONE ? 0 : -5;
+}
@@ -0,0 +1,128 @@
+#include <sqlite3.h>
+#include <string>
+#include <cstring>
+#include "SQL/SqlResult.h"
+
+using namespace std;
+
+static void setText(sqlResult *result, const char *text)
+{
+	if(text == nullptr)
+		text = "";
+	strncpy(result->text, text, sizeof(result->text) - 1);
+	result->text[sizeof(result->text) - 1] = '\0';
+}
+
+static void set(sqlResult *result, sqlResultCode code, const char *where, const char *detail, const char *text)
+{
+	result->code = code;
+	result->sqliteRc = SQLITE_OK;
+	result->where = where;
+	result->detail = detail;
+	result->callee = nullptr;
+	result->calleeRc = 0;
+	setText(result, text);
+}
+
+string sqlResult::message() const
+{
+	if(where == nullptr)
+		return "";
+	string message = where;
+	switch(code)
+	{
+		case RESULT_OK:
+			message += "-OK";
+			if(detail != nullptr)
+				message += "(" + string(detail) + ")";
+			return message;
+		case RESULT_WARN:
+			return message + "-OK(WARN):" + detail + text;
+		default:
+			break;
+	}
+	if(callee != nullptr)
+		return message + "-FAIL_ERROR-" + callee + ":" + to_string(calleeRc);
+	if(code == RESULT_SQLITE_ERROR)
+		return message + "-FAIL_ERROR-SQLite:" + text;
+	return message + "-FAIL:" + (detail != nullptr ? detail : "") + text;
+}
+
+sqliteError::sqliteError(sqlite3 *db) : rc(sqlite3_extended_errcode(db)), message(sqlite3_errmsg(db)) {}
+
+void resultSink::ok(const char *where, const char *note)
+{
+	if(result != nullptr)
+		set(result, RESULT_OK, where, note, nullptr);
+	if(trace != nullptr)
+	{
+		trace->append(where).append("-OK");
+		if(note != nullptr)
+			trace->append("(").append(note).append(")");
+	}
+}
+
+void resultSink::warn(const char *where, const char *detail, const char *extra)
+{
+	if(result != nullptr)
+		set(result, RESULT_WARN, where, detail, extra);
+	if(trace != nullptr)
+	{
+		trace->append(where).append("-OK(WARN):").append(detail);
+		if(extra != nullptr)
+			trace->append(extra);
+	}
+}
+
+void resultSink::fail(sqlResultCode code, const char *where, const char *detail, const char *extra)
+{
+	if(result != nullptr)
+		set(result, code, where, detail, extra);
+	if(trace != nullptr)
+	{
+		trace->append(where).append("-FAIL:").append(detail);
+		if(extra != nullptr)
+			trace->append(extra);
+	}
+}
+
+void resultSink::sqliteFail(const char *where, sqlite3 *db)
+{
+	if(result != nullptr)
+	{
+		set(result, RESULT_SQLITE_ERROR, where, nullptr, sqlite3_errmsg(db));
+		result->sqliteRc = sqlite3_extended_errcode(db);
+	}
+	if(trace != nullptr)
+		trace->append(where).append("-FAIL_ERROR-SQLite:").append(sqlite3_errmsg(db));
+}
+
+void resultSink::sqliteFail(const char *where, const sqliteError& error)
+{
+	if(result != nullptr)
+	{
+		set(result, RESULT_SQLITE_ERROR, where, nullptr, error.message.c_str());
+		result->sqliteRc = error.rc;
+	}
+	if(trace != nullptr)
+		trace->append(where).append("-FAIL_ERROR-SQLite:").append(error.message);
+}
+
+void resultSink::callFailed(const char *where, const char *callee, int rc)
+{
+	if(result != nullptr)
+	{
+		if(result->ok())
+		{
+			result->code = RESULT_CALL_FAILED;
+			result->sqliteRc = SQLITE_OK;
+			result->detail = nullptr;
+			result->text[0] = '\0';
+		}
+		result->where = where;
+		result->callee = callee;
+		result->calleeRc = rc;
+	}
+	if(trace != nullptr)
+		trace->append(where).append("-FAIL_ERROR-").append(callee).append(":").append(to_string(rc));
+}
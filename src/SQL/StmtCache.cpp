@@ -0,0 +1,203 @@
+#include <sqlite3.h>
+#include <string>
+#include <string_view>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "SQL/StmtCache.h"
+#include "SQL/Metrics.h"
+
+using namespace std;
+
+// Statements of dynamic SQL (queryTable filters, INSERT INTO Log_YYYYMMDD of past days)
+// would otherwise pile up for the lifetime of the connection
+static const size_t STMT_CACHE_CAPACITY = 128;
+
+struct cacheEntry {
+	sqlite3_stmt *stmt;
+	bool inUse;
+	bool detached; //removed from the cache while borrowed, finalized on release
+	unsigned long long lastUse;
+};
+
+struct stmtCache {
+	mutex lock;
+	unordered_map<string_view, cacheEntry*> stmts; //keys view sqlite3_sql() of the statement itself
+	unsigned long long hits = 0;
+	unsigned long long misses = 0;
+	unsigned long long evictions = 0;
+	unsigned long long uses = 0;
+
+	// Called with the lock held when the cache is full: drops the least recently used statement
+	// that is not borrowed. false - every statement is borrowed.
+	bool evictOne()
+	{
+		auto oldest = stmts.end();
+		for(auto it = stmts.begin(); it != stmts.end(); ++it)
+		{
+			if(!it->second->inUse && (oldest == stmts.end() || it->second->lastUse < oldest->second->lastUse))
+				oldest = it;
+		}
+		if(oldest == stmts.end())
+			return false;
+		sqlite3_finalize(oldest->second->stmt);
+		delete oldest->second;
+		stmts.erase(oldest);
+		evictions++;
+		return true;
+	}
+
+	void clear()
+	{
+		lock_guard<mutex> guard(lock);
+		for(auto& it : stmts)
+		{
+			if(it.second->inUse)
+			{
+				it.second->detached = true;
+				continue;
+			}
+			sqlite3_finalize(it.second->stmt);
+			delete it.second;
+		}
+		stmts.clear();
+	}
+
+	~stmtCache()
+	{
+		clear();
+	}
+};
+
+// A connection cannot be freed by sqlite3_close while it still owns prepared
+// statements, so a cached db pointer is never reused by another connection.
+static mutex registryLock;
+static unordered_map<sqlite3*, shared_ptr<stmtCache>> registry;
+
+static shared_ptr<stmtCache> findCache(sqlite3 *db, bool create)
+{
+	lock_guard<mutex> guard(registryLock);
+	auto it = registry.find(db);
+	if(it != registry.end())
+		return it->second;
+	if(!create)
+		return nullptr;
+	shared_ptr<stmtCache> cache = make_shared<stmtCache>();
+	registry.emplace(db, cache);
+	return cache;
+}
+
+cachedStmt::cachedStmt() : stmt(nullptr), cache(nullptr), entry(nullptr) {}
+
+cachedStmt::~cachedStmt()
+{
+	release();
+}
+
+cachedStmt::operator sqlite3_stmt*() const
+{
+	return stmt;
+}
+
+void cachedStmt::release()
+{
+	if(stmt == nullptr)
+		return;
+	if(entry == nullptr) //transient statement, the cached one was busy
+	{
+		sqlite3_finalize(stmt);
+	}
+	else
+	{
+		lock_guard<mutex> guard(cache->lock);
+		if(entry->detached)
+		{
+			sqlite3_finalize(stmt);
+			delete entry;
+		}
+		else
+		{
+			sqlite3_reset(stmt);
+			sqlite3_clear_bindings(stmt);
+			entry->inUse = false;
+		}
+	}
+	stmt = nullptr;
+	entry = nullptr;
+	cache.reset();
+}
+
+int prepareCached(sqlite3 *db, const char *sql, cachedStmt *stmt)
+{
+	SQL_METRIC_PHASE(SQL_PHASE_PREPARE);
+	stmt->release();
+	shared_ptr<stmtCache> cache = findCache(db, true);
+	unique_lock<mutex> guard(cache->lock);
+	auto it = cache->stmts.find(string_view(sql));
+	if(it != cache->stmts.end() && !it->second->inUse)
+	{
+		cache->hits++;
+		it->second->inUse = true;
+		it->second->lastUse = ++cache->uses;
+		stmt->stmt = it->second->stmt;
+		stmt->entry = it->second;
+		stmt->cache = cache;
+		return SQLITE_OK;
+	}
+	cache->misses++;
+	bool cacheable = (it == cache->stmts.end());
+	guard.unlock();
+
+	sqlite3_stmt *res = nullptr;
+	const char *tail = nullptr;
+	int rc = sqlite3_prepare_v3(db, sql, -1, cacheable ? SQLITE_PREPARE_PERSISTENT : 0, &res, &tail);
+	if(rc != SQLITE_OK)
+	{
+		sqlite3_finalize(res);
+		return rc;
+	}
+	stmt->stmt = res;
+	if(!cacheable || (tail != nullptr && *tail != '\0'))
+		return SQLITE_OK;
+
+	guard.lock();
+	if(cache->stmts.size() >= STMT_CACHE_CAPACITY && !cache->evictOne())
+		return SQLITE_OK;
+	cacheEntry *entry = new cacheEntry{res, true, false, ++cache->uses};
+	if(!cache->stmts.emplace(string_view(sqlite3_sql(res)), entry).second) //prepared concurrently by another thread
+	{
+		delete entry;
+		return SQLITE_OK;
+	}
+	stmt->entry = entry;
+	stmt->cache = cache;
+	return SQLITE_OK;
+}
+
+stmtCacheStats getStmtCacheStats(sqlite3 *db)
+{
+	stmtCacheStats stats = {0, 0, 0, 0};
+	shared_ptr<stmtCache> cache = findCache(db, false);
+	if(cache == nullptr)
+		return stats;
+	lock_guard<mutex> guard(cache->lock);
+	stats.hits = cache->hits;
+	stats.misses = cache->misses;
+	stats.evictions = cache->evictions;
+	stats.size = cache->stmts.size();
+	return stats;
+}
+
+void clearStmtCache(sqlite3 *db)
+{
+	shared_ptr<stmtCache> cache;
+	{
+		lock_guard<mutex> guard(registryLock);
+		auto it = registry.find(db);
+		if(it == registry.end())
+			return;
+		cache = it->second;
+		registry.erase(it);
+	}
+	cache->clear();
+}
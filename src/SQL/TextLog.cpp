@@ -0,0 +1,297 @@
+#include <sqlite3.h>
+#include <cstdio>
+#include <string>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <condition_variable>
+#include "SQL/BaseSQL.h"
+#include "SQL/TextLog.h"
+
+using namespace std;
+
+struct textLogSink {
+	textLogOptions options;
+	FILE *file = nullptr;
+	size_t fileSize = 0;
+	time_t fileOpenedAt = 0;
+
+	unique_ptr<char[]> ring;
+	size_t capacity = 0;
+	size_t head = 0;   //positions grow forever, the ring index is position % capacity
+	size_t tail = 0;
+
+	mutex lock;
+	condition_variable wakeFlusher;
+	condition_variable wakeProducers;
+	bool stopping = false;
+	bool flushRequested = false;
+	bool flushing = false;   //the flusher writes or rotates the file without the lock
+	textLogStats stats = {0, 0, 0, 0, 0};
+	thread flusher;
+
+	int openFile();
+	void rotate();
+	void append(const char *data, size_t size);
+	void run();
+	~textLogSink();
+};
+
+static shared_ptr<textLogSink> sink; //accessed with atomic_load/atomic_store
+
+textLogSink::~textLogSink()
+{
+	if(flusher.joinable()) //the sink is still open at exit
+	{
+		{
+			lock_guard<mutex> guard(lock);
+			stopping = true;
+		}
+		wakeFlusher.notify_one();
+		flusher.join();
+	}
+	if(file != nullptr)
+		fclose(file);
+}
+
+int textLogSink::openFile()
+{
+	file = fopen(options.path.c_str(), "a");
+	if(file == nullptr)
+		return -1;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fileSize = size > 0 ? size : 0;
+	fileOpenedAt = time(nullptr);
+	return 0;
+}
+
+// textLog -> textLog.1 -> ... -> textLog.keepFiles, the oldest one is overwritten
+void textLogSink::rotate()
+{
+	fclose(file);
+	file = nullptr;
+	if(options.keepFiles == 0)
+		remove(options.path.c_str());
+	for(unsigned i = options.keepFiles; i > 1; i--)
+		rename((options.path + "." + to_string(i - 1)).c_str(), (options.path + "." + to_string(i)).c_str());
+	if(options.keepFiles > 0)
+		rename(options.path.c_str(), (options.path + ".1").c_str());
+	if(openFile() == 0)
+		stats.rotations++;
+}
+
+// A record bigger than the ring waits until the flusher has written everything before it
+// and goes to the file directly; the flusher needs the lock to start its next pass.
+void textLogSink::append(const char *data, size_t size)
+{
+	bool direct = size > capacity;
+	unique_lock<mutex> guard(lock);
+	if(direct ? tail != head || flushing : capacity - (tail - head) < size)
+	{
+		stats.waits++;
+		wakeFlusher.notify_one();
+		wakeProducers.wait(guard, [&] {
+			return (direct ? tail == head && !flushing : capacity - (tail - head) >= size) || stopping;
+		});
+	}
+	if(stopping)
+	{
+		guard.unlock();
+		fwrite(data, 1, size, stderr);
+		return;
+	}
+	if(direct)
+	{
+		fwrite(data, 1, size, file != nullptr ? file : stderr);
+		if(file != nullptr)
+		{
+			fflush(file);
+			fileSize += size;
+			stats.bytes += size;
+		}
+		stats.records++;
+		return;
+	}
+	size_t start = tail % capacity;
+	size_t first = min(size, capacity - start);
+	copy(data, data + first, ring.get() + start);
+	copy(data + first, data + size, ring.get());
+	tail += size;
+	stats.records++;
+	if(tail - head >= capacity / 2)
+		wakeFlusher.notify_one();
+}
+
+void textLogSink::run()
+{
+	unique_lock<mutex> guard(lock);
+	while(true)
+	{
+		wakeFlusher.wait_for(guard, chrono::milliseconds(options.flushIntervalMs), [this] {
+			return stopping || flushRequested || tail - head >= capacity / 2;
+		});
+		flushRequested = false;
+		size_t from = head;
+		size_t to = tail;
+		flushing = true;
+		guard.unlock();
+
+		// Producers only write outside [from, to), so this part of the ring is read without the lock
+		if(from != to && file != nullptr)
+		{
+			size_t start = from % capacity;
+			size_t first = min(to - from, capacity - start);
+			fwrite(ring.get() + start, 1, first, file);
+			fwrite(ring.get(), 1, to - from - first, file);
+			fflush(file);
+			fileSize += to - from;
+		}
+		bool tooBig = options.maxFileSize > 0 && fileSize >= options.maxFileSize;
+		bool tooOld = options.rotateIntervalSec > 0 && time(nullptr) - fileOpenedAt >= static_cast<time_t>(options.rotateIntervalSec);
+		if(file != nullptr && (tooBig || (tooOld && fileSize > 0)))
+			rotate();
+
+		guard.lock();
+		flushing = false;
+		head = to;
+		if(from != to)
+		{
+			stats.bytes += to - from;
+			stats.flushes++;
+		}
+		wakeProducers.notify_all();
+		if(stopping && head == tail)
+			break;
+	}
+}
+
+int openTextLog(const textLogOptions& options, resultSink err)
+{
+	if(options.bufferSize == 0 || options.path.empty())
+	{
+		err.fail(RESULT_INVALID_ARGUMENT, "_openTextLog", "path and bufferSize must be set");
+		return -1;
+	}
+	shared_ptr<textLogSink> created = make_shared<textLogSink>();
+	created->options = options;
+	if(created->openFile() != 0)
+	{
+		err.fail(RESULT_UNAVAILABLE, "_openTextLog", "cannot open ", options.path.c_str());
+		return -2;
+	}
+	created->capacity = options.bufferSize;
+	created->ring.reset(new char[options.bufferSize]);
+	shared_ptr<textLogSink> expected;
+	if(!atomic_compare_exchange_strong(&sink, &expected, created))
+	{
+		fclose(created->file);
+		err.fail(RESULT_CONFLICT, "_openTextLog", "text log is already open");
+		return -3;
+	}
+	created->flusher = thread(&textLogSink::run, created.get());
+	err.ok("_openTextLog");
+	return 0;
+}
+
+int closeTextLog(resultSink err)
+{
+	shared_ptr<textLogSink> closing = atomic_exchange(&sink, shared_ptr<textLogSink>());
+	if(closing == nullptr)
+	{
+		err.fail(RESULT_UNAVAILABLE, "_closeTextLog", "text log is not open");
+		return -1;
+	}
+	{
+		lock_guard<mutex> guard(closing->lock);
+		closing->stopping = true;
+	}
+	closing->wakeFlusher.notify_one();
+	closing->wakeProducers.notify_all();
+	if(closing->flusher.joinable())
+		closing->flusher.join();
+	if(closing->file != nullptr)
+		fclose(closing->file);
+	closing->file = nullptr;
+	err.ok("_closeTextLog");
+	return 0;
+}
+
+bool hasTextLog()
+{
+	return atomic_load(&sink) != nullptr;
+}
+
+int flushTextLog()
+{
+	shared_ptr<textLogSink> current = atomic_load(&sink);
+	if(current == nullptr)
+		return -1;
+	unique_lock<mutex> guard(current->lock);
+	size_t target = current->tail;
+	current->flushRequested = true;
+	current->wakeFlusher.notify_one();
+	current->wakeProducers.wait(guard, [&] { return current->head >= target || current->stopping; });
+	return 0;
+}
+
+textLogStats getTextLogStats()
+{
+	shared_ptr<textLogSink> current = atomic_load(&sink);
+	if(current == nullptr)
+		return textLogStats{0, 0, 0, 0, 0};
+	lock_guard<mutex> guard(current->lock);
+	return current->stats;
+}
+
+// Tabs and line breaks inside a field would split the record
+static void appendField(string& line, const string& field)
+{
+	line += '\t';
+	for(char c : field)
+	{
+		switch(c)
+		{
+			case '\t': line += "\\t"; break;
+			case '\n': line += "\\n"; break;
+			case '\r': line += "\\r"; break;
+			case '\\': line += "\\\\"; break;
+			default: line += c;
+		}
+	}
+}
+
+// The sink is process-wide, the connection is kept in the signature for the callers
+void textLog(sqlite3 *, const string& eventName, const string& object, const string& subject, const string& eventStatus)
+{
+	// The line and the date of the current second are reused, so a warm thread formats without allocating
+	thread_local string line;
+	thread_local time_t lastSecond = -1;
+	thread_local char date[24];
+	chrono::system_clock::time_point now = chrono::system_clock::now();
+	time_t second = chrono::system_clock::to_time_t(now);
+	if(second != lastSecond)
+	{
+		struct tm local;
+		strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime_r(&second, &local));
+		lastSecond = second;
+	}
+	long millis = chrono::duration_cast<chrono::milliseconds>(now.time_since_epoch()).count() % 1000;
+	char fraction[8];
+	snprintf(fraction, sizeof(fraction), ".%03ld", millis);
+	line.assign(date).append(fraction);
+	appendField(line, eventName);
+	appendField(line, object);
+	appendField(line, subject);
+	appendField(line, eventStatus);
+	line += '\n';
+
+	shared_ptr<textLogSink> current = atomic_load(&sink);
+	if(current == nullptr)
+		fwrite(line.data(), 1, line.size(), stderr);
+	else
+		current->append(line.data(), line.size());
+}
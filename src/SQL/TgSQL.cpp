@@ -7,388 +7,669 @@
 #include "SQL/BaseSQL.h"
 
 #include "SQL/TgSQL.h"
+#include "SQL/StmtCache.h"
+#include "SQL/PrivilegeCache.h"
+#include "SQL/Permissions.h"
+#include "SQL/Metrics.h"
 
 using namespace std;
 
-#define ADD_USER_MIN_PRIVILEGE 100
-#define MOD_USER_MIN_PRIVILEGE 100
-#define DELETE_USER_MIN_PRIVILEGE 100
-
-int getAddUserMinPrivilege()
-{
-	return ADD_USER_MIN_PRIVILEGE;
-}
-
-int getModUserMinPrivilege()
+int userCount(sqlite3 * db, string userID, resultSink err)
 {
-	return MOD_USER_MIN_PRIVILEGE;
-}
-
-int getDeleteUserMinPrivilege()
-{
-	return DELETE_USER_MIN_PRIVILEGE;
-}
-
-int userCount(sqlite3 * db, string userID, string *errString)
-{
-	sqlite3_stmt *res;
-	int rc = sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM users WHERE userID = ?", -1, &res, 0);
+	SQL_METRIC_SCOPE("userCount");
+	cachedStmt res;
+	int rc = prepareCached(db, "SELECT COUNT(*) FROM users WHERE userID = ?", &res);
 	if(rc != SQLITE_OK) //OK
 	{
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "userCount", userID, "", "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-		errString->append("_userCount-FAIL_ERROR-SQLite:" + string(errmsg));
-		sqlite3_finalize(res);
+		sqliteError error(db);
+		Log(db, "userCount", userID, "", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_userCount", error);
 		return -1;
 	}
-	rc = sqlite3_bind_text(res, 1, userID.c_str(), -1, SQLITE_STATIC);
+	rc = SQL_TIMED(SQL_PHASE_BIND, sqlite3_bind_text(res, 1, userID.c_str(), -1, SQLITE_STATIC));
 	if(rc != SQLITE_OK) //OK
 	{
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "userCount", userID, "", "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-		errString->append("_userCount-FAIL_ERROR-SQLite:" + string(errmsg));
-		sqlite3_finalize(res);
+		sqliteError error(db);
+		Log(db, "userCount", userID, "", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_userCount", error);
 		return -2;
 	}
-	rc = sqlite3_step(res);
+	rc = SQL_TIMED(SQL_PHASE_STEP, sqlite3_step(res));
 	if(rc == SQLITE_ROW) //OK
 	{
-		Log(db, "userCount", userID, "", "OK", errString);
-		errString->append("_userCount-OK");
+		Log(db, "userCount", userID, "", "OK", err.traceOnly());
+		err.ok("_userCount");
 		int result = sqlite3_column_int(res,0);
-		sqlite3_finalize(res);
 		return result;
 	}
-	const char *errmsg = sqlite3_errmsg(db); //TODO
-	Log(db, "userCount", userID, "", "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-	errString->append("_userCount-FAIL_ERROR-SQLite:" + string(errmsg));
-	sqlite3_finalize(res);
+	sqliteError error(db); //TODO
+	Log(db, "userCount", userID, "", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+	err.sqliteFail("_userCount", error);
 	return -3;
 }
 
-int getUserPrivilege(sqlite3 *db, string object, string *errString)
+int lookupUsers(sqlite3 *db, const vector<string>& userIDs, vector<userLookup> *result, resultSink err)
 {
-	sqlite3_stmt *res;
-	int privilege;
-	int count = userCount(db, object, errString);
-	if(count == 0) //OK
+	SQL_METRIC_SCOPE("lookupUsers");
+	result->clear();
+	result->reserve(userIDs.size());
+	for(const string& userID : userIDs)
+		result->push_back(userLookup{userID, 0, -1});
+	if(userIDs.empty())
+	{
+		err.ok("_lookupUsers");
+		return 0;
+	}
+	// Одна выборка на все userID: количество строк и привилегия каждого
+	string sql = "SELECT userID, COUNT(*), MAX(privilege) FROM users WHERE userID IN (?";
+	for(size_t i = 1; i < userIDs.size(); i++)
+		sql += ", ?";
+	sql += ") GROUP BY userID";
+	cachedStmt res;
+	int rc = prepareCached(db, sql.c_str(), &res);
+	if(rc != SQLITE_OK) //OK
 	{
-		Log(db, "getUserPrivilege", object, "", "FAIL:user not found", errString);
-		errString->append("_getUserPrivilege-FAIL:user not found");
+		err.sqliteFail("_lookupUsers", db);
 		return -1;
 	}
-	else if(count > 1) //OK
+	for(size_t i = 0; i < userIDs.size(); i++)
 	{
-		Log(db, "getUserPrivilege", object, "", "FAIL:there are a few users with that userID", errString);
-		errString->append("_getUserPrivilege-FAIL:there are a few users with that userID");
-		return -2;
+		if(SQL_TIMED(SQL_PHASE_BIND, sqlite3_bind_text(res, i + 1, userIDs[i].c_str(), -1, SQLITE_STATIC)) != SQLITE_OK) //OK
+		{
+			err.sqliteFail("_lookupUsers", db);
+			return -2;
+		}
 	}
-	else if(count < 0) //OK
+	while((rc = SQL_TIMED(SQL_PHASE_STEP, sqlite3_step(res))) == SQLITE_ROW)
 	{
-		Log(db, "getUserPrivilege", object, "", "FAIL_ERROR-userCount:" + to_string(count), errString);
-		errString->append("_getUserPrivilege-FAIL_ERROR-userCount:" + to_string(count));
-		return -3;
+		const char *userID = reinterpret_cast<const char*>(sqlite3_column_text(res, 0));
+		for(userLookup& user : *result)
+		{
+			if(user.userID == userID)
+			{
+				user.count = sqlite3_column_int(res, 1);
+				user.privilege = sqlite3_column_int(res, 2);
+			}
+		}
 	}
-	int rc = sqlite3_prepare_v2(db, "SELECT userID, privilege FROM users WHERE userID = ?", -1, &res, 0);
-	if(rc != SQLITE_OK) //OK
+	if(rc != SQLITE_DONE) //OK
 	{
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "getUserPrivilege", object, "", "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-		errString->append("_getUserPrivilege-FAIL_ERROR-SQLite:" + string(errmsg));
-		sqlite3_finalize(res);
-		return -4;
+		err.sqliteFail("_lookupUsers", db);
+		return -3;
 	}
-	rc = sqlite3_bind_text(res, 1, object.c_str(), -1, SQLITE_STATIC);
+	err.ok("_lookupUsers");
+	return 0;
+}
+
+int lookupUser(sqlite3 *db, const string& userID, userLookup *result, resultSink err)
+{
+	SQL_METRIC_SCOPE("lookupUser");
+	*result = userLookup{userID, 0, -1};
+	cachedStmt res;
+	int rc = prepareCached(db, "SELECT COUNT(*), MAX(privilege) FROM users WHERE userID = ?", &res);
 	if(rc != SQLITE_OK) //OK
 	{
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "getUserPrivilege", object, "", "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-		errString->append("_getUserPrivilege-FAIL_ERROR-SQLite:" + string(errmsg));
-		sqlite3_finalize(res);
-		return -5;
+		err.sqliteFail("_lookupUser", db);
+		return -1;
 	}
-	rc = sqlite3_step(res);
-	if(rc == SQLITE_ROW) //OK
+	if(SQL_TIMED(SQL_PHASE_BIND, sqlite3_bind_text(res, 1, userID.c_str(), -1, SQLITE_STATIC)) != SQLITE_OK) //OK
 	{
-		privilege = sqlite3_column_int(res, 1);
+		err.sqliteFail("_lookupUser", db);
+		return -2;
 	}
-	else //TODO
+	if(SQL_TIMED(SQL_PHASE_STEP, sqlite3_step(res)) != SQLITE_ROW) //OK
 	{
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "getUserPrivilege", object, "", "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-		errString->append("_getUserPrivilege-FAIL_ERROR-SQLite:" + string(errmsg));
-		sqlite3_finalize(res);
-		return -6;
+		err.sqliteFail("_lookupUser", db);
+		return -3;
 	}
-	rc = sqlite3_step(res);
-	if(rc == SQLITE_DONE) //OK
+	result->count = sqlite3_column_int(res, 0);
+	if(result->count > 0)
+		result->privilege = sqlite3_column_int(res, 1);
+	err.ok("_lookupUser");
+	return 0;
+}
+
+int getUserPrivilege(sqlite3 *db, string object, resultSink err)
+{
+	SQL_METRIC_SCOPE("getUserPrivilege");
+	int privilege;
+	if(cachedPrivilege(db, object, &privilege) == 1) //OK
 	{
-		Log(db, "getUserPrivilege", object, "", "OK", errString);
-		errString->append("_getUserPrivilege-OK");
-		sqlite3_finalize(res);
+		Log(db, "getUserPrivilege", object, "", "OK", err.traceOnly());
+		err.ok("_getUserPrivilege", "CACHED");
 		return privilege;
 	}
-	const char *errmsg = sqlite3_errmsg(db); //TODO
-	Log(db, "getUserPrivilege", object, "", "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-	errString->append("_getUserPrivilege-FAIL_ERROR-SQLite:" + string(errmsg));
-	sqlite3_finalize(res);
-	return -7;
+	unsigned long long generation = privilegeCacheGeneration(db);
+	userLookup user;
+	int rc = lookupUser(db, object, &user, err);
+	if(rc < 0) //OK
+	{
+		Log(db, "getUserPrivilege", object, "", "FAIL_ERROR-lookupUser:" + to_string(rc), err.traceOnly());
+		err.callFailed("_getUserPrivilege", "lookupUser", rc);
+		return -4;
+	}
+	if(user.count == 0) //OK
+	{
+		Log(db, "getUserPrivilege", object, "", "FAIL:user not found", err.traceOnly());
+		err.fail(RESULT_NOT_FOUND, "_getUserPrivilege", "user not found");
+		return -1;
+	}
+	if(user.count > 1) //OK
+	{
+		Log(db, "getUserPrivilege", object, "", "FAIL:there are a few users with that userID", err.traceOnly());
+		err.fail(RESULT_DUPLICATE, "_getUserPrivilege", "there are a few users with that userID");
+		return -2;
+	}
+	if(sqlite3_get_autocommit(db)) //inside a transaction the row may not be committed yet
+		storeReadPrivilege(db, object, user.privilege, generation);
+	Log(db, "getUserPrivilege", object, "", "OK", err.traceOnly());
+	err.ok("_getUserPrivilege");
+	return user.privilege;
 }
 
-int modUser(sqlite3 *db, string object, string subject, int newPrivilege, string *errString)
+// Starts the transaction of a mutation: the checks, the write and the Log record commit together
+static int beginMutation(sqlite3 *db, immediateTransaction *transaction, const char *func, const char *where, const string& object, const string& subject, resultSink err)
 {
-	int subjectPrivilege = getUserPrivilege(db, subject, errString);
-	if(subjectPrivilege < 0) //OK
+	int rc = transaction->begin(db, err);
+	if(rc < 0) //OK
 	{
-		Log(db, "modUser", object, subject, "FAIL_ERROR-getUserPrivilege:" + to_string(subjectPrivilege), errString);
-		errString->append("_modUser-FAIL_ERROR-getUserPrivilege:" + to_string(subjectPrivilege));
-		return -1;
+		Log(db, func, object, subject, "FAIL_ERROR-beginTransaction:" + to_string(rc), err.traceOnly());
+		err.callFailed(where, "beginTransaction", rc);
+	}
+	return rc;
+}
+
+// Refused mutations are committed too, to keep their Log record. A failed commit is rolled
+// back and logged outside of the transaction; the cache is left as it was.
+static int endMutation(sqlite3 *db, immediateTransaction *transaction, const char *func, const char *where, const string& object, const string& subject, resultSink err)
+{
+	int rc = transaction->commit(err.traceOnly());
+	if(rc < 0) //OK
+	{
+		Log(db, func, object, subject, "FAIL_ERROR-commitTransaction:" + to_string(rc), err.traceOnly());
+		err.callFailed(where, "commitTransaction", rc);
 	}
-	int count = userCount(db, object, errString);
-	if(count < 0) //OK
+	return rc;
+}
+
+// The privilege cache is shared by the connections to the file, so it only takes a
+// privilege once it is committed. Inside the caller's transaction, which may still roll
+// back, the entry is dropped instead. privilege -1 - the user was deleted.
+static void privilegeCommitted(sqlite3 *db, const string& userID, int privilege)
+{
+	if(privilege >= 0 && sqlite3_get_autocommit(db))
+		storePrivilege(db, userID, privilege);
+	else
+		invalidatePrivilege(db, userID);
+}
+
+static int modUserLocked(sqlite3 *db, const string& object, const string& subject, int newPrivilege, resultSink err)
+{
+	vector<userLookup> users;
+	int rc = lookupUsers(db, {subject, object}, &users, err);
+	if(rc < 0) //OK
 	{
-		Log(db, "modUser", object, subject, "FAIL_ERROR-userCount:" + to_string(count), errString);
-		errString->append("_modUser-FAIL_ERROR-userCount:" + to_string(count));
+		Log(db, "modUser", object, subject, "FAIL_ERROR-lookupUsers:" + to_string(rc), err.traceOnly());
+		err.callFailed("_modUser", "lookupUsers", rc);
 		return -2;
 	}
-	if(count == 0) //OK
+	const userLookup& subjectUser = users[0];
+	const userLookup& objectUser = users[1];
+	if(subjectUser.count != 1) //OK
 	{
-		Log(db, "modUser", object, subject, "FAIL:user not found" + to_string(subjectPrivilege), errString);
-		errString->append("_modUser-FAIL:user not found");
-		return -3;
+		Log(db, "modUser", object, subject, subjectUser.count == 0 ? "FAIL:user is not exist" : "FAIL:there are a few users with that userID", err.traceOnly());
+		if(subjectUser.count == 0)
+			err.fail(RESULT_NOT_FOUND, "_modUser", "user is not exist");
+		else
+			err.fail(RESULT_DUPLICATE, "_modUser", "there are a few users with that userID");
+		return -1;
 	}
-	if(count > 1) //OK
+	if(objectUser.count == 0) //OK
 	{
-		Log(db, "modUser", object, subject, "FAIL:there are a few users with that userID", errString);
-		errString->append("_modUser-FAIL:there are a few users with that userID");
-		return -4;
+		Log(db, "modUser", object, subject, "FAIL:user not found", err.traceOnly());
+		err.fail(RESULT_NOT_FOUND, "_modUser", "user not found");
+		return -3;
 	}
-	int objectPrivilege = getUserPrivilege(db, object, errString);
-	if(objectPrivilege < 0) //OK
+	if(objectUser.count > 1) //OK
 	{
-		Log(db, "modUser", object, subject, "FAIL_ERROR-getUserPrivilege:" + to_string(objectPrivilege), errString);
-		errString->append("_mod-FAIL_ERROR-userPrivilege:" + to_string(objectPrivilege));
-		return -5;
+		Log(db, "modUser", object, subject, "FAIL:there are a few users with that userID", err.traceOnly());
+		err.fail(RESULT_DUPLICATE, "_modUser", "there are a few users with that userID");
+		return -4;
 	}
-	if(objectPrivilege >= subjectPrivilege && object != subject || subjectPrivilege < getModUserMinPrivilege() || subjectPrivilege < newPrivilege) //OK
+	int subjectPrivilege = subjectUser.privilege;
+	int objectPrivilege = objectUser.privilege;
+	if((objectPrivilege >= subjectPrivilege && object != subject) || !hasPermission<ACTION_MOD_USER>(db, subjectPrivilege) || subjectPrivilege < newPrivilege) //OK
 	{
-		Log(db, "modUser", object, subject, "FAIL:the user does not have enough privileges", errString);
-		errString->append("_modUser-FAIL:the user does not have enough privileges");
+		Log(db, "modUser", object, subject, "FAIL:the user does not have enough privileges", err.traceOnly());
+		err.fail(RESULT_NO_PRIVILEGE, "_modUser", "the user does not have enough privileges");
 		return -6;
 	}
-	sqlite3_stmt *res;
-	int rc = sqlite3_prepare_v2(db, "UPDATE users SET privilege = ? WHERE userID = ?", -1, &res, 0);
+	cachedStmt res;
+	rc = prepareCached(db, "UPDATE users SET privilege = ? WHERE userID = ?", &res);
 	if(rc != SQLITE_OK) //OK
 	{
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "modUser", object, subject, "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-		errString->append("_modUser-FAIL_ERROR-SQLite:" + string(errmsg));
-		sqlite3_finalize(res);
+		sqliteError error(db);
+		Log(db, "modUser", object, subject, "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_modUser", error);
 		return -7;
 	}
-	if(!(sqlite3_bind_int(res, 1, newPrivilege) == SQLITE_OK &&
+	if(!SQL_TIMED(SQL_PHASE_BIND, sqlite3_bind_int(res, 1, newPrivilege) == SQLITE_OK &&
 	sqlite3_bind_text(res, 2, object.c_str(), -1, SQLITE_STATIC) == SQLITE_OK)) //OK
 	{
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "modUser", object, subject, "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-		errString->append("_modUser-FAIL_ERROR-SQLite:" + string(errmsg));
-		sqlite3_finalize(res);
+		sqliteError error(db);
+		Log(db, "modUser", object, subject, "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_modUser", error);
 		return -8;
 	}
-	rc = sqlite3_step(res);
+	rc = SQL_TIMED(SQL_PHASE_STEP, sqlite3_step(res));
 	if(rc == SQLITE_DONE) //OK
 	{
-		Log(db, "modUser", object, subject, "OK", errString);
-		errString->append("_modUser-OK");
-		sqlite3_finalize(res);
+		Log(db, "modUser", object, subject, "OK", err.traceOnly());
+		err.ok("_modUser");
 		return 0;
 	}
-	const char *errmsg = sqlite3_errmsg(db); //OK
-	Log(db, "modUser", object, subject, "FAIL_ERROR:SQLite:" + string(errmsg), errString);
-	errString->append("_modUser-FAIL_ERROR-SQLite:" + string(errmsg));
-	sqlite3_finalize(res);
+	sqliteError error(db); //OK
+	Log(db, "modUser", object, subject, "FAIL_ERROR:SQLite:" + error.message, err.traceOnly());
+	err.sqliteFail("_modUser", error);
 	return -9;
 }
 
-int addUser(sqlite3 *db, string object, string subject, int privilege, string *errString)
+int modUser(sqlite3 *db, string object, string subject, int newPrivilege, resultSink err)
+{
+	SQL_METRIC_SCOPE("modUser");
+	immediateTransaction transaction;
+	if(beginMutation(db, &transaction, "modUser", "_modUser", object, subject, err) < 0)
+		return -10;
+	int rc = modUserLocked(db, object, subject, newPrivilege, err);
+	if(endMutation(db, &transaction, "modUser", "_modUser", object, subject, err) < 0)
+		return -11;
+	if(rc == 0)
+		privilegeCommitted(db, object, newPrivilege);
+	return rc;
+}
+
+static int addUserLocked(sqlite3 *db, const string& object, const string& subject, int privilege, resultSink err)
 {
-	int countSubject = userCount(db, subject, errString);
-	if(countSubject < 0)
+	vector<userLookup> users;
+	int rc = lookupUsers(db, {subject, object}, &users, err);
+	if(rc < 0)
 	{
-		Log(db, "addUser", object, subject, "FAIL_ERROR-userCount:" + to_string(countSubject), errString);
-		errString->append("_addUser-FAIL_ERROR-userCount:" + to_string(countSubject));
+		Log(db, "addUser", object, subject, "FAIL_ERROR-lookupUsers:" + to_string(rc), err.traceOnly());
+		err.callFailed("_addUser", "lookupUsers", rc);
 		return -1;
 	}
-	if(countSubject == 0)
+	const userLookup& subjectUser = users[0];
+	const userLookup& objectUser = users[1];
+	if(subjectUser.count == 0)
 	{
-		Log(db, "addUser", object, subject, "FAIL:user is not exist", errString);
-		errString->append("_addUser-FAIL:user is not exist");
+		Log(db, "addUser", object, subject, "FAIL:user is not exist", err.traceOnly());
+		err.fail(RESULT_NOT_FOUND, "_addUser", "user is not exist");
 		return -2;
 	}
-	if(countSubject > 1)
+	if(subjectUser.count > 1)
 	{
-		Log(db, "addUser", object, subject, "FAIL:there are a few users with that userID", errString);
-		errString->append("_addUser-FAIL:there are a few users with that userID");
+		Log(db, "addUser", object, subject, "FAIL:there are a few users with that userID", err.traceOnly());
+		err.fail(RESULT_DUPLICATE, "_addUser", "there are a few users with that userID");
 		return -3;
 	}
-	int subjectPrivilege = getUserPrivilege(db, subject, errString);
-	if(subjectPrivilege < 0) //OK
-	{
-		Log(db, "addUser", object, subject, "FAIL_ERROR-getUserPrivilege:" + to_string(subjectPrivilege), errString);
-		errString->append("_addUser-FAIL_ERROR-getUserPrivilege:" + to_string(subjectPrivilege));
-		return -4;
-	}
-	if(subjectPrivilege < getAddUserMinPrivilege() || subjectPrivilege < privilege) //OK
+	int subjectPrivilege = subjectUser.privilege;
+	if(!hasPermission<ACTION_ADD_USER>(db, subjectPrivilege) || subjectPrivilege < privilege) //OK
 	{
-		Log(db, "addUser", object, subject, "FAIL:the user does not have enough privileges", errString);
-		errString->append("_addUser-FAIL:the user does not have enough privileges");
+		Log(db, "addUser", object, subject, "FAIL:the user does not have enough privileges", err.traceOnly());
+		err.fail(RESULT_NO_PRIVILEGE, "_addUser", "the user does not have enough privileges");
 		return -5;
 	}
-	int count = userCount(db, object, errString);
-	if(count > 0) //OK
-	{
-		Log(db, "addUser", object, subject, "FAIL:this userID is already in use", errString);
-		errString->append("_addUser-FAIL:this userID is already in use");
-		return -6;
-	}
-	else if(count < 0) //OK
+	if(objectUser.count > 0) //OK
 	{
-		Log(db, "addUser", object, subject, "FAIL_ERROR-userCount:" + to_string(count), errString);
-		errString->append("_addUser-FAIL_ERROR-userCount:" + to_string(count));
+		Log(db, "addUser", object, subject, "FAIL:this userID is already in use", err.traceOnly());
+		err.fail(RESULT_CONFLICT, "_addUser", "this userID is already in use");
 		return -6;
 	}
-	sqlite3_stmt *res;
-	int rc = sqlite3_prepare_v2(db,"INSERT INTO users(userID, privilege) VALUES(?, ?)", -1, &res, 0);
+	cachedStmt res;
+	rc = prepareCached(db, "INSERT INTO users(userID, privilege) VALUES(?, ?)", &res);
 	if(rc != SQLITE_OK) //OK
 	{
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "addUser", object, subject, "FAIL_ERROR:SQLite:" + string(errmsg), errString);
-		errString->append("_addUser-FAIL_ERROR-SQLite:" + string(errmsg));
-		sqlite3_finalize(res);
+		sqliteError error(db);
+		Log(db, "addUser", object, subject, "FAIL_ERROR:SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_addUser", error);
 		return -7;
 	}
-	if(!((sqlite3_bind_text(res, 1, object.c_str(), -1, SQLITE_STATIC) == SQLITE_OK) &&
+	if(!SQL_TIMED(SQL_PHASE_BIND, (sqlite3_bind_text(res, 1, object.c_str(), -1, SQLITE_STATIC) == SQLITE_OK) &&
 	(sqlite3_bind_int(res, 2, privilege) == SQLITE_OK))) //OK
 	{
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "addUser", object, subject, "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-		errString->append("_addUser-FAIL_ERROR-SQLite:" + string(errmsg));
-		sqlite3_finalize(res);
+		sqliteError error(db);
+		Log(db, "addUser", object, subject, "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_addUser", error);
 		return -8;
 	}
-	rc = sqlite3_step(res);
-	if(rc != SQLITE_DONE) //TODO
+	rc = SQL_TIMED(SQL_PHASE_STEP, sqlite3_step(res));
+	if(rc != SQLITE_DONE) //OK
 	{
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "addUser", object, subject, "FAIL_ERROR-SQLite:" + string(errmsg), errString);
-		errString->append("_addUser-FAIL_ERROR-SQLite:" + string(errmsg));
-		sqlite3_finalize(res);
+		sqliteError error(db);
+		Log(db, "addUser", object, subject, "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_addUser", error);
 		return -9;
 	}
-	Log(db, "addUser", object, subject, "OK", errString); //OK
-	errString->append("_addUser-OK");
-	sqlite3_finalize(res);
+	Log(db, "addUser", object, subject, "OK", err.traceOnly()); //OK
+	err.ok("_addUser");
 	return 0;
 }
 
-int deleteUser(sqlite3 *db, string object, string subject, string *errString)
+int addUser(sqlite3 *db, string object, string subject, int privilege, resultSink err)
 {
-	int countSubject = userCount(db, subject, errString);
-	if(countSubject < 0)
+	SQL_METRIC_SCOPE("addUser");
+	immediateTransaction transaction;
+	if(beginMutation(db, &transaction, "addUser", "_addUser", object, subject, err) < 0)
+		return -10;
+	int rc = addUserLocked(db, object, subject, privilege, err);
+	if(endMutation(db, &transaction, "addUser", "_addUser", object, subject, err) < 0)
+		return -11;
+	if(rc == 0)
+		privilegeCommitted(db, object, privilege);
+	return rc;
+}
+
+static int deleteUserLocked(sqlite3 *db, const string& object, const string& subject, resultSink err)
+{
+	vector<userLookup> users;
+	int rc = lookupUsers(db, {subject, object}, &users, err);
+	if(rc < 0)
 	{
-		Log(db, "deleteUser", object, subject, "FAIL_ERROR-userCount:" + to_string(countSubject), errString);
-		errString->append("_deleteUser-FAIL_ERROR-userCount:" + to_string(countSubject));
+		Log(db, "deleteUser", object, subject, "FAIL_ERROR-lookupUsers:" + to_string(rc), err.traceOnly());
+		err.callFailed("_deleteUser", "lookupUsers", rc);
 		return -1;
 	}
-	if(countSubject == 0)
+	const userLookup& subjectUser = users[0];
+	const userLookup& objectUser = users[1];
+	if(subjectUser.count == 0)
 	{
-		Log(db, "deleteUser", object, subject, "FAIL:user is not exist", errString);
-		errString->append("_deleteUser-FAIL:user is not exist");
+		Log(db, "deleteUser", object, subject, "FAIL:user is not exist", err.traceOnly());
+		err.fail(RESULT_NOT_FOUND, "_deleteUser", "user is not exist");
 		return -2;
 	}
-	if(countSubject > 1)
+	if(subjectUser.count > 1)
 	{
-		Log(db, "deleteUser", object, subject, "FAIL:there are a few users with that userID", errString);
-		errString->append("_deleteUser-FAIL:there are a few users with that userID");
+		Log(db, "deleteUser", object, subject, "FAIL:there are a few users with that userID", err.traceOnly());
+		err.fail(RESULT_DUPLICATE, "_deleteUser", "there are a few users with that userID");
 		return -3;
 	}
-	int countObject = userCount(db, object, errString);
-	if(countObject < 0)
-	{
-		Log(db, "deleteUser", object, subject, "FAIL_ERROR-userCount:" + to_string(countSubject), errString);
-		errString->append("_deleteUser-FAIL_ERROR-userCount:" + to_string(countSubject));
-		return -4;
-	}
-	if(countObject == 0)
+	if(objectUser.count == 0)
 	{
-		Log(db, "deleteUser", object, subject, "FAIL:object is not exist", errString);
-		errString->append("_deleteUser-FAIL:object is not exist");
+		Log(db, "deleteUser", object, subject, "FAIL:object is not exist", err.traceOnly());
+		err.fail(RESULT_NOT_FOUND, "_deleteUser", "object is not exist");
 		return -5;
 	}
-	int objectPrivilege = getUserPrivilege(db, object, errString);
-	if(objectPrivilege < 0) //OK
+	if(objectUser.count > 1) //OK
 	{
-		Log(db, "deleteUser", object, subject, "FAIL_ERROR-getUserPrivilege:" + to_string(objectPrivilege), errString);
-		errString->append("_deleteUser-FAIL_ERROR-userPrivilege:" + to_string(objectPrivilege));
+		Log(db, "deleteUser", object, subject, "FAIL:there are a few users with that userID", err.traceOnly());
+		err.fail(RESULT_DUPLICATE, "_deleteUser", "there are a few users with that userID");
 		return -6;
 	}
-	int subjectPrivilege = getUserPrivilege(db, subject, errString);
-	if(subjectPrivilege < 0) //OK
+	int objectPrivilege = objectUser.privilege;
+	int subjectPrivilege = subjectUser.privilege;
+	if(!hasPermission<ACTION_DELETE_USER>(db, subjectPrivilege) || subjectPrivilege < objectPrivilege) //OK
 	{
-		Log(db, "deleteUser", object, subject, "FAIL_ERROR-getUserPrivilege:" + to_string(subjectPrivilege), errString);
-		errString->append("_deleteUser-FAIL_ERROR-getUserPrivilege:" + to_string(subjectPrivilege));
-		return -7;
+		Log(db, "deleteUser", object, subject, "FAIL:the user does not have enough privileges", err.traceOnly());
+		err.fail(RESULT_NO_PRIVILEGE, "_deleteUser", "the user does not have enough privileges");
+		return -6;
 	}
-	if(subjectPrivilege < getDeleteUserMinPrivilege() || subjectPrivilege < objectPrivilege) //OK
+	cachedStmt res;
+	rc = prepareCached(db, "DELETE FROM users WHERE userID = ?", &res);
+	if(rc != SQLITE_OK)
 	{
-		Log(db, "deleteUser", object, subject, "FAIL:the user does not have enough privileges", errString);
-		errString->append("_deleteUser-FAIL:the user does not have enough privileges");
-		return -6;
+		sqliteError error(db);
+		Log(db, "deleteUser", object, subject, "FAIL_ERROR-SQLite:" + error.message, err.traceOnly()); //OK
+		err.sqliteFail("_deleteUser", error);
+		return -8;
 	}
-	sqlite3_stmt *res;
-	int rc = sqlite3_prepare_v2(db,"DELETE FROM users WHERE userID = ?", -1, &res, 0);
-	if(!(sqlite3_bind_text(res, 1, object.c_str(), -1, SQLITE_STATIC) == SQLITE_OK))
+	if(SQL_TIMED(SQL_PHASE_BIND, sqlite3_bind_text(res, 1, object.c_str(), -1, SQLITE_STATIC)) != SQLITE_OK)
 	{
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "deleteUser", object, subject, "FAIL_ERROR-SQLite:" + string(errmsg), errString); //OK
-		errString->append("_deleteUser-FAIL_ERROR-SQLite:" + string(errmsg));
-		sqlite3_finalize(res);
+		sqliteError error(db);
+		Log(db, "deleteUser", object, subject, "FAIL_ERROR-SQLite:" + error.message, err.traceOnly()); //OK
+		err.sqliteFail("_deleteUser", error);
 		return -9;
 	}
-	sqlite3_step(res);
-	if(rc != SQLITE_OK)
+	rc = SQL_TIMED(SQL_PHASE_STEP, sqlite3_step(res));
+	if(rc != SQLITE_DONE)
 	{
-		const char *errmsg = sqlite3_errmsg(db);
-		Log(db, "deleteUser", object, subject, "FAIL_ERROR-SQLite:" + string(errmsg), errString); //OK
-		errString->append("_deleteUser-FAIL_ERROR-SQLite:" + string(errmsg));
-		sqlite3_finalize(res);
+		sqliteError error(db);
+		Log(db, "deleteUser", object, subject, "FAIL_ERROR-SQLite:" + error.message, err.traceOnly()); //OK
+		err.sqliteFail("_deleteUser", error);
 		return -10;
 	}
-	Log(db, "deleteUser", object, subject, "OK", errString); //OK
-	errString->append("_deleteUser-OK");
-	sqlite3_finalize(res);
+	Log(db, "deleteUser", object, subject, "OK", err.traceOnly()); //OK
+	err.ok("_deleteUser");
+	return 0;
+}
+
+int deleteUser(sqlite3 *db, string object, string subject, resultSink err)
+{
+	SQL_METRIC_SCOPE("deleteUser");
+	immediateTransaction transaction;
+	if(beginMutation(db, &transaction, "deleteUser", "_deleteUser", object, subject, err) < 0)
+		return -11;
+	int rc = deleteUserLocked(db, object, subject, err);
+	if(endMutation(db, &transaction, "deleteUser", "_deleteUser", object, subject, err) < 0)
+		return -12;
+	if(rc == 0)
+		privilegeCommitted(db, object, -1);
+	return rc;
+}
+
+tableInfo usersInfo("users", {column("id", "INTEGER", COLUMN_PRIMARY_KEY), column("userID", "TEXT", COLUMN_UNIQUE), column("privilege", "INTEGER")});
+
+// Subject of a bulk operation: exists once and is allowed to do it
+static int checkBulkSubject(sqlite3 *db, const char *func, const char *where, bool (*allowed)(sqlite3*, int), const string& object, const string& subject, int *privilege, resultSink err)
+{
+	userLookup subjectUser;
+	int rc = lookupUser(db, subject, &subjectUser, err);
+	if(rc < 0)
+	{
+		Log(db, func, object, subject, "FAIL_ERROR-lookupUser:" + to_string(rc), err.traceOnly());
+		err.callFailed(where, "lookupUser", rc);
+		return -1;
+	}
+	if(subjectUser.count == 0)
+	{
+		Log(db, func, object, subject, "FAIL:user is not exist", err.traceOnly());
+		err.fail(RESULT_NOT_FOUND, where, "user is not exist");
+		return -2;
+	}
+	if(subjectUser.count > 1)
+	{
+		Log(db, func, object, subject, "FAIL:there are a few users with that userID", err.traceOnly());
+		err.fail(RESULT_DUPLICATE, where, "there are a few users with that userID");
+		return -3;
+	}
+	if(!allowed(db, subjectUser.privilege)) //OK
+	{
+		Log(db, func, object, subject, "FAIL:the user does not have enough privileges", err.traceOnly());
+		err.fail(RESULT_NO_PRIVILEGE, where, "the user does not have enough privileges");
+		return -5;
+	}
+	*privilege = subjectUser.privilege;
 	return 0;
 }
 
-tableInfo usersInfo("users", {column("id", "INTEGER"), column("userID", "TEXT"), column("privilege", "INTEGER")});
+static int importUsersLocked(sqlite3 *db, immediateTransaction *transaction, const userRecord *users, size_t count, const string& object, const string& subject, vector<userImportConflict> *conflicts, resultSink err)
+{
+	int subjectPrivilege;
+	int rc = checkBulkSubject(db, "importUsers", "_importUsers", hasPermission<ACTION_IMPORT_USERS>, object, subject, &subjectPrivilege, err);
+	if(rc < 0)
+		return rc;
+	if(conflicts != nullptr)
+		conflicts->clear();
+	// The userID is checked by the insert itself, so a batch costs one statement per row
+	cachedStmt res;
+	rc = prepareCached(db, "INSERT INTO users(userID, privilege) SELECT ?1, ?2 WHERE NOT EXISTS (SELECT 1 FROM users WHERE userID = ?1)", &res);
+	if(rc != SQLITE_OK) //OK
+	{
+		sqliteError error(db);
+		Log(db, "importUsers", object, subject, "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_importUsers", error);
+		return -7;
+	}
+	int inserted = 0;
+	size_t skipped = 0;
+	for(size_t i = 0; i < count; i++)
+	{
+		const userRecord& user = users[i];
+		if(user.userID.empty() || user.privilege > subjectPrivilege)
+		{
+			if(conflicts != nullptr)
+				conflicts->push_back({i, user.userID.empty() ? IMPORT_INVALID : IMPORT_NO_PRIVILEGE});
+			skipped++;
+			continue;
+		}
+		sqlite3_reset(res);
+		if(SQL_TIMED(SQL_PHASE_BIND, sqlite3_bind_text(res, 1, user.userID.c_str(), -1, SQLITE_STATIC) != SQLITE_OK ||
+		sqlite3_bind_int(res, 2, user.privilege) != SQLITE_OK) || SQL_TIMED(SQL_PHASE_STEP, sqlite3_step(res)) != SQLITE_DONE)
+		{
+			sqliteError error(db);
+			sqlite3_reset(res);
+			transaction->rollback(); //the batch is all or nothing
+			Log(db, "importUsers", object, subject, "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+			err.sqliteFail("_importUsers", error);
+			return -9;
+		}
+		if(sqlite3_changes(db) == 0)
+		{
+			if(conflicts != nullptr)
+				conflicts->push_back({i, IMPORT_IN_USE});
+			skipped++;
+		}
+		else
+			inserted++;
+	}
+	sqlite3_reset(res);
+	// The privilege cache keeps only found users, so new userIDs cannot be stale there
+	string summary = to_string(inserted) + " inserted, " + to_string(skipped) + " skipped";
+	if(skipped > 0)
+	{
+		Log(db, "importUsers", object, subject, "OK(WARN):" + summary, err.traceOnly());
+		err.warn("_importUsers", "some rows are skipped");
+	}
+	else
+	{
+		Log(db, "importUsers", object, subject, "OK:" + summary, err.traceOnly());
+		err.ok("_importUsers");
+	}
+	return inserted;
+}
+
+int importUsers(sqlite3 *db, const userRecord *users, size_t count, string subject, vector<userImportConflict> *conflicts, resultSink err)
+{
+	SQL_METRIC_SCOPE("importUsers");
+	string object = "USERS:" + to_string(count);
+	immediateTransaction transaction;
+	if(beginMutation(db, &transaction, "importUsers", "_importUsers", object, subject, err) < 0)
+		return -8;
+	int rc = importUsersLocked(db, &transaction, users, count, object, subject, conflicts, err);
+	if(transaction.active() && endMutation(db, &transaction, "importUsers", "_importUsers", object, subject, err) < 0)
+		return -10;
+	return rc;
+}
+
+int importUsers(sqlite3 *db, const vector<userRecord>& users, string subject, vector<userImportConflict> *conflicts, resultSink err)
+{
+	return importUsers(db, users.data(), users.size(), subject, conflicts, err);
+}
+
+int exportUsers(sqlite3 *db, string subject, bool (*callback)(const userRecord& user, void *context), void *context, resultSink err)
+{
+	SQL_METRIC_SCOPE("exportUsers");
+	int subjectPrivilege;
+	int rc = checkBulkSubject(db, "exportUsers", "_exportUsers", hasPermission<ACTION_EXPORT_USERS>, "USERS", subject, &subjectPrivilege, err);
+	if(rc < 0)
+		return rc;
+	sqlite3_stmt *res;
+	rc = SQL_TIMED(SQL_PHASE_PREPARE, sqlite3_prepare_v2(db, "SELECT userID, privilege FROM users ORDER BY rowid", -1, &res, 0));
+	if(rc != SQLITE_OK) //OK
+	{
+		sqliteError error(db);
+		Log(db, "exportUsers", "USERS", subject, "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_exportUsers", error);
+		return -7;
+	}
+	// One record is reused for every row, the callback copies what it keeps
+	userRecord user;
+	int exported = 0;
+	while((rc = SQL_TIMED(SQL_PHASE_STEP, sqlite3_step(res))) == SQLITE_ROW)
+	{
+		const unsigned char *userID = sqlite3_column_text(res, 0);
+		user.userID.assign(userID != nullptr ? reinterpret_cast<const char*>(userID) : "");
+		user.privilege = sqlite3_column_int(res, 1);
+		exported++;
+		if(!callback(user, context))
+		{
+			rc = SQLITE_DONE;
+			break;
+		}
+	}
+	if(rc != SQLITE_DONE) //OK
+	{
+		sqliteError error(db);
+		sqlite3_finalize(res);
+		Log(db, "exportUsers", "USERS", subject, "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_exportUsers", error);
+		return -8;
+	}
+	sqlite3_finalize(res);
+	Log(db, "exportUsers", "USERS", subject, "OK:" + to_string(exported) + " exported", err.traceOnly());
+	err.ok("_exportUsers");
+	return exported;
+}
 
-int initTgSQL(sqlite3 *db, string *errString)
+int initTgSQL(sqlite3 *db, resultSink err)
 {
-	int rc = checkTable(db, usersInfo, errString);
-	if(rc > 0)
+	SQL_METRIC_SCOPE("initTgSQL");
+	int rc = checkTable(db, usersInfo, err);
+	if(rc == 1 || rc == 7)
+	{
+		rc = createTable(db, usersInfo, err);
+		if(rc != 0)
+		{
+			textLog(db, "initTgSQL", "TABLE:users", "SYSTEM", "FAIL_ERROR-createTable:" + to_string(rc));
+			err.callFailed("_initTgSQL", "createTable", rc);
+			return -2;
+		}
+	}
+	else if(rc == 6)
+	{
+		// Старая схема без первичного ключа и UNIQUE: переносим данные на месте.
+		// Из дубликатов userID остаётся один, с наименьшей привилегией.
+		invalidateAllPrivileges(db);
+		rc = rebuildTable(db, usersInfo, "SELECT NULL, userID, MIN(privilege) FROM users WHERE userID IS NOT NULL GROUP BY userID ORDER BY MIN(rowid)", err);
+		if(rc != 0)
+		{
+			textLog(db, "initTgSQL", "TABLE:users", "SYSTEM", "FAIL_ERROR-rebuildTable:" + to_string(rc));
+			err.callFailed("_initTgSQL", "rebuildTable", rc);
+			return -3;
+		}
+		Log(db, "initTgSQL", "TABLE:users", "SYSTEM", "OK(WARN):the table has been migrated", err.traceOnly());
+		err.warn("_initTgSQL", "the table has been migrated");
+	}
+	else if(rc > 0)
 	{
 		textLog(db, "initTgSQL", "TABLE:users", "SYSTEM", "FAIL:table in an unexpected way");
-		errString->append("_initTgSQL-FAIL:table in an unexpected way");
+		err.fail(RESULT_SCHEMA_MISMATCH, "_initTgSQL", "table in an unexpected way");
 		return 1;
 	}
 	if(rc < 0)
 	{
 		textLog(db, "initTgSQL", "TABLE:users", "SYSTEM", "FAIL_ERROR-ckeckTable:" + to_string(rc));
-		errString->append("_initTgSQLFAIL_ERROR-ckeckTable:" + to_string(rc));
+		err.callFailed("_initTgSQL", "checkTable", rc);
 		return -1;
 	}
-	Log(db, "initTgSQL", "DATABASE", "SYSTEM", "OK", errString);
-	errString->append("_initTgSQL-OK");
+	rc = loadPermissions(db, err);
+	if(rc < 0)
+	{
+		textLog(db, "initTgSQL", "TABLE:permissions", "SYSTEM", "FAIL_ERROR-loadPermissions:" + to_string(rc));
+		err.callFailed("_initTgSQL", "loadPermissions", rc);
+		return -4;
+	}
+	Log(db, "initTgSQL", "DATABASE", "SYSTEM", "OK", err.traceOnly());
+	err.ok("_initTgSQL");
 	return 0;
 }
 
@@ -397,24 +678,24 @@ int initTgSQL(sqlite3 *db, string *errString)
 	sqlite3 *db;
 	char *err_msg = 0;
 	int rc;
-	string errString;
-	if(initBaseSQL(&db, "db.db", &errString) != 0)
+	string err;
+	if(initBaseSQL(&db, "db.db", &err) != 0)
 	{
-		cout << errString << endl;
+		cout << err << endl;
 		sqlite3_close(db);
 		return 1;
 	}
-	if(initTgSQL(db, &errString) != 0)
+	if(initTgSQL(db, &err) != 0)
 	{
-		cout << errString << endl;
+		cout << err << endl;
 		sqlite3_close(db);
 		return 2;
 	}
 	string creator, userID;
 	int privilege;
 	cin>>creator>>userID;
-	rc = deleteUser(db, userID ,creator, &errString);
-	cout << errString << endl;
+	rc = deleteUser(db, userID ,creator, &err);
+	cout << err << endl;
 	printf("code:%d\n", rc);
 	sqlite3_close(db);
 	return 0;
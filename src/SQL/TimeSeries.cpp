@@ -0,0 +1,774 @@
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include "SQL/BaseSQL.h"
+#include "SQL/StmtCache.h"
+#include "SQL/TimeSeries.h"
+#include "SQL/Metrics.h"
+
+using namespace std;
+
+tableInfo sensorChunksInfo("sensorChunks", {column("id", "INTEGER", COLUMN_PRIMARY_KEY), column("sensor", "TEXT", COLUMN_NOT_NULL),
+	column("bucket", "INTEGER", COLUMN_NOT_NULL), column("firstTime", "INTEGER"), column("lastTime", "INTEGER"), column("count", "INTEGER"),
+	column("minValue", "REAL"), column("maxValue", "REAL"), column("sumValue", "REAL"), column("timeChunk", "BLOB"), column("valueChunk", "BLOB")},
+	{tableIndex("sensorChunksByBucket", {"sensor", "bucket"}, false)});
+tableInfo timeSeriesSettingsInfo("timeSeriesSettings", {column("id", "INTEGER", COLUMN_PRIMARY_KEY), column("bucketMicros", "INTEGER", COLUMN_NOT_NULL)});
+
+typedef unsigned long long word64;
+
+static long long floorDiv(long long a, long long b)
+{
+	long long q = a / b;
+	return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+
+static void putWord(string *out, word64 value)
+{
+	for(int i = 0; i < 8; i++)
+		out->push_back(char(value >> (8 * i)));
+}
+
+static word64 getWord(const unsigned char *in)
+{
+	word64 value = 0;
+	for(int i = 0; i < 8; i++)
+		value |= word64(in[i]) << (8 * i);
+	return value;
+}
+
+static int significantBits(word64 value)
+{
+	return value == 0 ? 0 : 64 - __builtin_clzll(value);
+}
+
+// values[i] takes width bits from bit i * width on; the high part goes to the next word
+// with a double shift, so a value that starts a word needs no branch
+static void packBits(const word64 *values, size_t count, int width, string *out)
+{
+	if(width == 0)
+		return;
+	vector<word64> words((count * width + 63) / 64 + 1, 0);
+	for(size_t i = 0; i < count; i++)
+	{
+		size_t bit = i * width;
+		unsigned offset = bit & 63;
+		words[bit >> 6] |= values[i] << offset;
+		words[(bit >> 6) + 1] |= values[i] >> 1 >> (63 - offset);
+	}
+	for(size_t i = 0; i + 1 < words.size(); i++)
+		putWord(out, words[i]);
+}
+
+static bool unpackBits(const unsigned char *in, size_t bytes, size_t count, int width, word64 *values)
+{
+	if(width < 0 || width > 64)
+		return false;
+	size_t used = (count * width + 63) / 64;
+	if(bytes < used * 8)
+		return false;
+	vector<word64> words(used + 1, 0);
+	for(size_t i = 0; i < used; i++)
+		words[i] = getWord(in + i * 8);
+	word64 mask = width == 64 ? ~word64(0) : (word64(1) << width) - 1;
+	for(size_t i = 0; i < count; i++)
+	{
+		size_t bit = i * width;
+		unsigned offset = bit & 63;
+		values[i] = ((words[bit >> 6] >> offset) | (words[(bit >> 6) + 1] << 1 << (63 - offset))) & mask;
+	}
+	return true;
+}
+
+// first time, smallest delta, width, then every delta minus the smallest one.
+// Regular sampling packs to zero bits per reading.
+static void encodeTimes(const long long *times, size_t count, string *out)
+{
+	vector<word64> residuals(count > 1 ? count - 1 : 0);
+	word64 minDelta = ~word64(0);
+	for(size_t i = 1; i < count; i++)
+		minDelta = min(minDelta, word64(times[i]) - word64(times[i - 1]));
+	word64 used = 0;
+	for(size_t i = 1; i < count; i++)
+	{
+		residuals[i - 1] = word64(times[i]) - word64(times[i - 1]) - minDelta;
+		used |= residuals[i - 1];
+	}
+	int width = significantBits(used);
+	putWord(out, word64(times[0]));
+	putWord(out, count > 1 ? minDelta : 0);
+	out->push_back(char(width));
+	packBits(residuals.data(), residuals.size(), width, out);
+}
+
+static bool decodeTimes(const unsigned char *in, size_t bytes, size_t count, long long *times)
+{
+	if(bytes < 17)
+		return false;
+	word64 minDelta = getWord(in + 8);
+	vector<word64> residuals(count);
+	if(!unpackBits(in + 17, bytes - 17, count - 1, in[16], residuals.data() + 1))
+		return false;
+	word64 time = getWord(in);
+	times[0] = (long long)time;
+	for(size_t i = 1; i < count; i++)
+	{
+		time += minDelta + residuals[i];
+		times[i] = (long long)time;
+	}
+	return true;
+}
+
+// first value, shift and width, then the XOR of every value with the previous one.
+// Close values share sign, exponent and low zero bits, the XORs keep only the bits between.
+static void encodeValues(const double *values, size_t count, string *out)
+{
+	vector<word64> bits(count);
+	memcpy(bits.data(), values, count * sizeof(double));
+	vector<word64> xors(count > 1 ? count - 1 : 0);
+	word64 used = 0;
+	for(size_t i = 1; i < count; i++)
+	{
+		xors[i - 1] = bits[i] ^ bits[i - 1];
+		used |= xors[i - 1];
+	}
+	int shift = used == 0 ? 0 : __builtin_ctzll(used);
+	int width = significantBits(used >> shift);
+	for(word64& x : xors)
+		x >>= shift;
+	putWord(out, bits[0]);
+	out->push_back(char(shift));
+	out->push_back(char(width));
+	packBits(xors.data(), xors.size(), width, out);
+}
+
+static bool decodeValues(const unsigned char *in, size_t bytes, size_t count, double *values)
+{
+	if(bytes < 10 || in[8] > 63)
+		return false;
+	int shift = in[8];
+	vector<word64> bits(count);
+	if(!unpackBits(in + 10, bytes - 10, count - 1, in[9], bits.data() + 1))
+		return false;
+	bits[0] = getWord(in);
+	for(size_t i = 1; i < count; i++)
+		bits[i] = bits[i - 1] ^ (bits[i] << shift);
+	memcpy(values, bits.data(), count * sizeof(double));
+	return true;
+}
+
+// Four independent lanes of sums and branch-free min/max carry no dependency between
+// neighbouring elements, so the compiler can vectorize the loop
+static void reduceValues(const double *values, size_t count, double *minValue, double *maxValue, double *sum)
+{
+	double lo[4] = {values[0], values[0], values[0], values[0]};
+	double hi[4] = {values[0], values[0], values[0], values[0]};
+	double sums[4] = {0, 0, 0, 0};
+	size_t i = 0;
+	for(; i + 4 <= count; i += 4)
+	{
+		for(int lane = 0; lane < 4; lane++)
+		{
+			double value = values[i + lane];
+			sums[lane] += value;
+			lo[lane] = value < lo[lane] ? value : lo[lane];
+			hi[lane] = value > hi[lane] ? value : hi[lane];
+		}
+	}
+	for(; i < count; i++)
+	{
+		sums[0] += values[i];
+		lo[0] = values[i] < lo[0] ? values[i] : lo[0];
+		hi[0] = values[i] > hi[0] ? values[i] : hi[0];
+	}
+	*minValue = min(min(lo[0], lo[1]), min(lo[2], lo[3]));
+	*maxValue = max(max(hi[0], hi[1]), max(hi[2], hi[3]));
+	*sum = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+}
+
+struct readingChunk {
+	long long bucket = 0;
+	vector<long long> times;
+	vector<double> values;
+};
+
+struct sensorBuffer : readingChunk {
+	vector<readingChunk> sealed;   //full chunks held back while the caller has a transaction open
+	long long lastTime = 0;   //of the last reading, buffered or written
+	bool hasLast = false;
+	bool seeded = false;      //lastTime was read from sensorChunks
+};
+
+struct timeSeriesStore {
+	sqlite3 *db;
+	timeSeriesOptions options;
+	mutex lock;
+	unordered_map<string, sensorBuffer> sensors;
+	timeSeriesStats stats = {0, 0, 0, 0, 0};
+
+	~timeSeriesStore();
+	bool insertChunk(const string& sensor, const readingChunk& chunk, size_t *encodedBytes);
+	bool insertBuffer(const string& sensor, const sensorBuffer& buffer, size_t *encodedBytes);
+	void chunkWritten(sensorBuffer *buffer, size_t encodedBytes);
+	bool writeChunk(const string& sensor, sensorBuffer *buffer);
+	bool flushAll(vector<pair<sensorBuffer*, size_t>> *written);
+};
+
+static const string TIME_SERIES_KEY = "timeSeries";
+
+static shared_ptr<timeSeriesStore> findStore(sqlite3 *db)
+{
+	return static_pointer_cast<timeSeriesStore>(getConnectionData(db, TIME_SERIES_KEY));
+}
+
+// Called with the lock held; inserts one chunk and leaves it as it is
+bool timeSeriesStore::insertChunk(const string& sensor, const readingChunk& chunk, size_t *encodedBytes)
+{
+	size_t count = chunk.times.size();
+	string times, values;
+	encodeTimes(chunk.times.data(), count, &times);
+	encodeValues(chunk.values.data(), count, &values);
+	double minValue, maxValue, sum;
+	reduceValues(chunk.values.data(), count, &minValue, &maxValue, &sum);
+	cachedStmt res;
+	if(prepareCached(db, "INSERT INTO sensorChunks(sensor, bucket, firstTime, lastTime, count, minValue, maxValue, "
+		"sumValue, timeChunk, valueChunk) VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", &res) != SQLITE_OK)
+		return false;
+	sqlite3_bind_text(res, 1, sensor.c_str(), -1, SQLITE_STATIC);
+	sqlite3_bind_int64(res, 2, chunk.bucket);
+	sqlite3_bind_int64(res, 3, chunk.times.front());
+	sqlite3_bind_int64(res, 4, chunk.times.back());
+	sqlite3_bind_int64(res, 5, (sqlite3_int64)count);
+	sqlite3_bind_double(res, 6, minValue);
+	sqlite3_bind_double(res, 7, maxValue);
+	sqlite3_bind_double(res, 8, sum);
+	sqlite3_bind_blob(res, 9, times.data(), (int)times.size(), SQLITE_STATIC);
+	sqlite3_bind_blob(res, 10, values.data(), (int)values.size(), SQLITE_STATIC);
+	if(SQL_TIMED(SQL_PHASE_STEP, sqlite3_step(res)) != SQLITE_DONE)
+		return false;
+	*encodedBytes = times.size() + values.size();
+	return true;
+}
+
+// Called with the lock held; inserts the sealed chunks of a sensor, then the open one
+bool timeSeriesStore::insertBuffer(const string& sensor, const sensorBuffer& buffer, size_t *encodedBytes)
+{
+	*encodedBytes = 0;
+	for(const readingChunk& chunk : buffer.sealed)
+	{
+		size_t bytes;
+		if(!insertChunk(sensor, chunk, &bytes))
+			return false;
+		*encodedBytes += bytes;
+	}
+	size_t bytes;
+	if(!buffer.times.empty() && !insertChunk(sensor, buffer, &bytes))
+		return false;
+	*encodedBytes += buffer.times.empty() ? 0 : bytes;
+	return true;
+}
+
+// Called with the lock held once the chunks of the buffer are committed
+void timeSeriesStore::chunkWritten(sensorBuffer *buffer, size_t encodedBytes)
+{
+	stats.chunks += buffer->sealed.size() + (buffer->times.empty() ? 0 : 1);
+	stats.encodedBytes += encodedBytes;
+	for(const readingChunk& chunk : buffer->sealed)
+		stats.buffered -= chunk.times.size();
+	stats.buffered -= buffer->times.size();
+	buffer->sealed.clear();
+	buffer->times.clear();
+	buffer->values.clear();
+}
+
+// Called with the lock held; seals the open chunk of the buffer and writes the sealed ones.
+// Inside a transaction of the caller they stay buffered: its rollback would take them along.
+bool timeSeriesStore::writeChunk(const string& sensor, sensorBuffer *buffer)
+{
+	buffer->sealed.emplace_back();
+	readingChunk& chunk = buffer->sealed.back();
+	chunk.bucket = buffer->bucket;
+	chunk.times.swap(buffer->times);
+	chunk.values.swap(buffer->values);
+	if(!sqlite3_get_autocommit(db))
+		return true;
+	size_t encodedBytes;
+	if(buffer->sealed.size() == 1) //one INSERT commits on its own
+	{
+		if(!insertBuffer(sensor, *buffer, &encodedBytes))
+			return false;
+	}
+	else
+	{
+		immediateTransaction transaction;
+		if(transaction.begin(db, nullptr) < 0 || !insertBuffer(sensor, *buffer, &encodedBytes))
+			return false;
+		if(transaction.commit(nullptr) < 0)
+			return false;
+	}
+	chunkWritten(buffer, encodedBytes);
+	return true;
+}
+
+// Called with the lock held inside a transaction; the buffers are emptied by chunkWritten after the commit
+bool timeSeriesStore::flushAll(vector<pair<sensorBuffer*, size_t>> *written)
+{
+	for(auto& sensor : sensors)
+	{
+		size_t encodedBytes;
+		if(sensor.second.sealed.empty() && sensor.second.times.empty())
+			continue;
+		if(!insertBuffer(sensor.first, sensor.second, &encodedBytes))
+			return false;
+		written->emplace_back(&sensor.second, encodedBytes);
+	}
+	return true;
+}
+
+// closeBaseSQL drops the connection data, the buffered readings are written here, all or none
+timeSeriesStore::~timeSeriesStore()
+{
+	lock_guard<mutex> guard(lock);
+	immediateTransaction transaction;
+	vector<pair<sensorBuffer*, size_t>> written;
+	if(transaction.begin(db, nullptr) == 0 && flushAll(&written))
+		transaction.commit(nullptr);
+}
+
+// bucketMicros the chunks of db are keyed with: 1 - found, 0 - nothing is written yet
+static int storedBucketMicros(sqlite3 *db, long long *bucketMicros)
+{
+	cachedStmt res;
+	if(prepareCached(db, "SELECT bucketMicros FROM timeSeriesSettings WHERE id = 1", &res) != SQLITE_OK)
+		return -1;
+	int rc = SQL_TIMED(SQL_PHASE_STEP, sqlite3_step(res));
+	if(rc == SQLITE_DONE)
+		return 0;
+	if(rc != SQLITE_ROW)
+		return -2;
+	*bucketMicros = sqlite3_column_int64(res, 0);
+	return 1;
+}
+
+// The first connection stores its bucketMicros, the others must use the same one
+static int claimBucketMicros(sqlite3 *db, long long bucketMicros, long long *stored)
+{
+	cachedStmt res;
+	if(prepareCached(db, "INSERT OR IGNORE INTO timeSeriesSettings(id, bucketMicros) VALUES(1, ?)", &res) != SQLITE_OK ||
+	sqlite3_bind_int64(res, 1, bucketMicros) != SQLITE_OK || sqlite3_step(res) != SQLITE_DONE)
+		return -1;
+	res.release();
+	return storedBucketMicros(db, stored) == 1 ? 0 : -2;
+}
+
+int enableTimeSeries(sqlite3 *db, const timeSeriesOptions& options, resultSink err)
+{
+	SQL_METRIC_SCOPE("enableTimeSeries");
+	if(options.chunkSize == 0 || options.bucketMicros <= 0)
+	{
+		err.fail(RESULT_INVALID_ARGUMENT, "_enableTimeSeries", "chunkSize and bucketMicros must be positive");
+		return -1;
+	}
+	if(findStore(db) != nullptr)
+	{
+		err.fail(RESULT_CONFLICT, "_enableTimeSeries", "time series are already enabled");
+		return -2;
+	}
+	vector<tableInfo*> tables = {&sensorChunksInfo, &timeSeriesSettingsInfo};
+	vector<int> checked;
+	checkTables(db, {sensorChunksInfo, timeSeriesSettingsInfo}, &checked, err); //one query while both match
+	for(size_t i = 0; i < tables.size(); i++)
+	{
+		tableInfo *table = tables[i];
+		int rc = checked[i];
+		if(rc == 1 || rc == 7)
+		{
+			rc = createTable(db, *table, err);
+			if(rc != 0)
+			{
+				textLog(db, "enableTimeSeries", "TABLE:" + table->name, "SYSTEM", "FAIL_ERROR-createTable:" + to_string(rc));
+				err.callFailed("_enableTimeSeries", "createTable", rc);
+				return -4;
+			}
+		}
+		else if(rc > 0)
+		{
+			textLog(db, "enableTimeSeries", "TABLE:" + table->name, "SYSTEM", "FAIL:table in an unexpected way");
+			err.fail(RESULT_SCHEMA_MISMATCH, "_enableTimeSeries", "table in an unexpected way");
+			return 1;
+		}
+		else if(rc < 0)
+		{
+			textLog(db, "enableTimeSeries", "TABLE:" + table->name, "SYSTEM", "FAIL_ERROR-checkTable:" + to_string(rc));
+			err.callFailed("_enableTimeSeries", "checkTable", rc);
+			return -3;
+		}
+	}
+	long long stored = 0;
+	if(claimBucketMicros(db, options.bucketMicros, &stored) < 0)
+	{
+		sqliteError error(db);
+		Log(db, "enableTimeSeries", "TABLE:timeSeriesSettings", "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_enableTimeSeries", error);
+		return -6;
+	}
+	if(stored != options.bucketMicros)
+	{
+		Log(db, "enableTimeSeries", "TABLE:timeSeriesSettings", "SYSTEM", "FAIL:bucketMicros differs from " + to_string(stored), err.traceOnly());
+		err.fail(RESULT_CONFLICT, "_enableTimeSeries", "the chunks are keyed with another bucketMicros");
+		return -5;
+	}
+	shared_ptr<timeSeriesStore> store = make_shared<timeSeriesStore>();
+	store->db = db;
+	store->options = options;
+	setConnectionData(db, TIME_SERIES_KEY, store);
+	Log(db, "enableTimeSeries", "TABLE:sensorChunks", "SYSTEM", "OK", err.traceOnly());
+	err.ok("_enableTimeSeries");
+	return 0;
+}
+
+// Time of the last written reading of a sensor: 1 - found, 0 - none. Chunks never cross
+// a bucket, so the last bucket has it.
+static int lastWrittenTime(sqlite3 *db, const string& sensor, long long *lastTime)
+{
+	cachedStmt res;
+	if(prepareCached(db, "SELECT MAX(lastTime) FROM sensorChunks WHERE sensor = ?1 AND bucket = (SELECT MAX(bucket) FROM sensorChunks WHERE sensor = ?1)", &res) != SQLITE_OK ||
+	sqlite3_bind_text(res, 1, sensor.c_str(), -1, SQLITE_STATIC) != SQLITE_OK || SQL_TIMED(SQL_PHASE_STEP, sqlite3_step(res)) != SQLITE_ROW)
+		return -1;
+	if(sqlite3_column_type(res, 0) == SQLITE_NULL)
+		return 0;
+	*lastTime = sqlite3_column_int64(res, 0);
+	return 1;
+}
+
+// Called with the lock held
+static int appendReading(timeSeriesStore *store, const string& sensor, long long timeMicros, double value, resultSink err)
+{
+	sensorBuffer& buffer = store->sensors[sensor];
+	if(!buffer.seeded)
+	{
+		int found = lastWrittenTime(store->db, sensor, &buffer.lastTime);
+		if(found < 0) //OK
+		{
+			err.sqliteFail("_recordReading", store->db);
+			return -3;
+		}
+		buffer.hasLast = found == 1;
+		buffer.seeded = true;
+	}
+	if(buffer.hasLast && timeMicros < buffer.lastTime) //OK
+	{
+		store->stats.rejected++;
+		err.fail(RESULT_INVALID_ARGUMENT, "_recordReading", "older than the last reading of ", sensor.c_str());
+		return -2;
+	}
+	long long bucket = floorDiv(timeMicros, store->options.bucketMicros);
+	if(!buffer.times.empty() && bucket != buffer.bucket && !store->writeChunk(sensor, &buffer)) //OK
+	{
+		err.sqliteFail("_recordReading", store->db);
+		return -3;
+	}
+	buffer.bucket = bucket;
+	buffer.lastTime = timeMicros;
+	buffer.hasLast = true;
+	buffer.times.push_back(timeMicros);
+	buffer.values.push_back(value);
+	store->stats.readings++;
+	store->stats.buffered++;
+	if(buffer.times.size() >= store->options.chunkSize && !store->writeChunk(sensor, &buffer)) //OK
+	{
+		err.sqliteFail("_recordReading", store->db);
+		return -3;
+	}
+	return 0;
+}
+
+int recordReading(sqlite3 *db, const string& sensor, long long timeMicros, double value, resultSink err)
+{
+	sensorReading reading = {timeMicros, value};
+	return recordReadings(db, sensor, &reading, 1, err);
+}
+
+int recordReadings(sqlite3 *db, const string& sensor, const sensorReading *readings, size_t count, resultSink err)
+{
+	SQL_METRIC_SCOPE("recordReadings");
+	shared_ptr<timeSeriesStore> store = findStore(db);
+	if(store == nullptr) //OK
+	{
+		err.fail(RESULT_UNAVAILABLE, "_recordReading", "time series are not enabled");
+		return -1;
+	}
+	if(sensor.empty()) //OK
+	{
+		err.fail(RESULT_INVALID_ARGUMENT, "_recordReading", "sensor is empty");
+		return -4;
+	}
+	lock_guard<mutex> guard(store->lock);
+	for(size_t i = 0; i < count; i++)
+	{
+		int rc = appendReading(store.get(), sensor, readings[i].timeMicros, readings[i].value, err);
+		if(rc < 0)
+			return rc;
+	}
+	err.ok("_recordReading");
+	return 0;
+}
+
+int flushTimeSeries(sqlite3 *db, resultSink err)
+{
+	SQL_METRIC_SCOPE("flushTimeSeries");
+	shared_ptr<timeSeriesStore> store = findStore(db);
+	if(store == nullptr) //OK
+	{
+		err.fail(RESULT_UNAVAILABLE, "_flushTimeSeries", "time series are not enabled");
+		return -1;
+	}
+	if(!sqlite3_get_autocommit(db)) //OK
+	{
+		err.fail(RESULT_CONFLICT, "_flushTimeSeries", "a transaction is open, its rollback would lose the readings");
+		return -5;
+	}
+	lock_guard<mutex> guard(store->lock);
+	immediateTransaction transaction;
+	int rc = transaction.begin(db, err);
+	if(rc < 0) //OK
+	{
+		err.callFailed("_flushTimeSeries", "beginTransaction", rc);
+		return -2;
+	}
+	vector<pair<sensorBuffer*, size_t>> written;
+	if(!store->flushAll(&written)) //OK
+	{
+		sqliteError error(db);
+		transaction.rollback();
+		Log(db, "flushTimeSeries", "TABLE:sensorChunks", "SYSTEM", "FAIL_ERROR-SQLite:" + error.message, err.traceOnly());
+		err.sqliteFail("_flushTimeSeries", error);
+		return -3;
+	}
+	rc = transaction.commit(err);
+	if(rc < 0) //OK
+	{
+		Log(db, "flushTimeSeries", "TABLE:sensorChunks", "SYSTEM", "FAIL_ERROR-commitTransaction:" + to_string(rc), err.traceOnly());
+		err.callFailed("_flushTimeSeries", "commitTransaction", rc);
+		return -4;
+	}
+	for(const pair<sensorBuffer*, size_t>& chunk : written)
+		store->chunkWritten(chunk.first, chunk.second);
+	err.ok("_flushTimeSeries");
+	return 0;
+}
+
+struct windowPart {
+	long long start;
+	size_t count;
+	double min;
+	double max;
+	double sum;
+};
+
+// Readings of [from, to) of sorted arrays, cut at window boundaries
+static void aggregateWindows(const long long *times, const double *values, size_t count, long long from, long long to,
+	long long windowMicros, vector<windowPart> *parts)
+{
+	size_t i = lower_bound(times, times + count, from) - times;
+	size_t end = lower_bound(times + i, times + count, to) - times;
+	while(i < end)
+	{
+		long long start = from + (times[i] - from) / windowMicros * windowMicros;
+		long long windowEnd = to - start > windowMicros ? start + windowMicros : to;
+		size_t j = lower_bound(times + i, times + end, windowEnd) - times;
+		windowPart part = {start, j - i, 0, 0, 0};
+		reduceValues(values + i, j - i, &part.min, &part.max, &part.sum);
+		parts->push_back(part);
+		i = j;
+	}
+}
+
+static void appendRange(const long long *times, const double *values, size_t count, long long from, long long to, vector<sensorReading> *readings)
+{
+	size_t i = lower_bound(times, times + count, from) - times;
+	size_t end = lower_bound(times + i, times + count, to) - times;
+	for(; i < end; i++)
+		readings->push_back(sensorReading{times[i], values[i]});
+}
+
+// bucketMicros of the written chunks, enableTimeSeries has checked the one of the store.
+// 1 - found, 0 - no chunks are written, -2 - SQLite error
+static int chunkBucketMicros(sqlite3 *db, timeSeriesStore *store, long long *bucketMicros, resultSink err, const char *where)
+{
+	if(store != nullptr)
+	{
+		*bucketMicros = store->options.bucketMicros;
+		return 1;
+	}
+	int rc = storedBucketMicros(db, bucketMicros);
+	if(rc < 0)
+	{
+		err.sqliteFail(where, db);
+		return -2;
+	}
+	return rc;
+}
+
+// Reads the chunks of a sensor that overlap [from, to) in time order. A chunk that
+// useStats accepts is passed with its stored aggregates only, the others decoded.
+template <typename StatsFn, typename ChunkFn>
+static int scanChunks(sqlite3 *db, const string& sensor, long long from, long long to, long long bucketMicros,
+	StatsFn useStats, ChunkFn useChunk, resultSink err, const char *where)
+{
+	cachedStmt res;
+	if(prepareCached(db, "SELECT firstTime, lastTime, count, minValue, maxValue, sumValue, timeChunk, valueChunk "
+		"FROM sensorChunks WHERE sensor = ? AND bucket BETWEEN ? AND ? AND lastTime >= ? AND firstTime < ? ORDER BY firstTime, id", &res) != SQLITE_OK ||
+	!SQL_TIMED(SQL_PHASE_BIND, sqlite3_bind_text(res, 1, sensor.c_str(), -1, SQLITE_STATIC) == SQLITE_OK &&
+	sqlite3_bind_int64(res, 2, floorDiv(from, bucketMicros)) == SQLITE_OK && sqlite3_bind_int64(res, 3, floorDiv(to - 1, bucketMicros)) == SQLITE_OK &&
+	sqlite3_bind_int64(res, 4, from) == SQLITE_OK && sqlite3_bind_int64(res, 5, to) == SQLITE_OK)) //OK
+	{
+		err.sqliteFail(where, db);
+		return -2;
+	}
+	vector<long long> times;
+	vector<double> values;
+	int rc;
+	while((rc = SQL_TIMED(SQL_PHASE_STEP, sqlite3_step(res))) == SQLITE_ROW)
+	{
+		long long firstTime = sqlite3_column_int64(res, 0);
+		long long lastTime = sqlite3_column_int64(res, 1);
+		long long count = sqlite3_column_int64(res, 2);
+		if(count <= 0) //OK
+		{
+			err.fail(RESULT_SCHEMA_MISMATCH, where, "corrupt chunk of ", sensor.c_str());
+			return -3;
+		}
+		windowPart stats = {firstTime, size_t(count), sqlite3_column_double(res, 3), sqlite3_column_double(res, 4), sqlite3_column_double(res, 5)};
+		if(useStats(firstTime, lastTime, stats))
+			continue;
+		times.resize(count);
+		values.resize(count);
+		const unsigned char *timeChunk = static_cast<const unsigned char*>(sqlite3_column_blob(res, 6));
+		size_t timeBytes = sqlite3_column_bytes(res, 6);
+		const unsigned char *valueChunk = static_cast<const unsigned char*>(sqlite3_column_blob(res, 7));
+		size_t valueBytes = sqlite3_column_bytes(res, 7);
+		if(timeChunk == nullptr || valueChunk == nullptr || !decodeTimes(timeChunk, timeBytes, count, times.data()) ||
+		!decodeValues(valueChunk, valueBytes, count, values.data())) //OK
+		{
+			err.fail(RESULT_SCHEMA_MISMATCH, where, "corrupt chunk of ", sensor.c_str());
+			return -3;
+		}
+		useChunk(times.data(), values.data(), size_t(count));
+	}
+	if(rc != SQLITE_DONE) //OK
+	{
+		err.sqliteFail(where, db);
+		return -2;
+	}
+	return 0;
+}
+
+int queryReadings(sqlite3 *db, const string& sensor, long long from, long long to, vector<sensorReading> *readings, resultSink err)
+{
+	SQL_METRIC_SCOPE("queryReadings");
+	readings->clear();
+	if(from >= to) //OK
+	{
+		err.fail(RESULT_INVALID_ARGUMENT, "_queryReadings", "empty range");
+		return -1;
+	}
+	shared_ptr<timeSeriesStore> store = findStore(db);
+	unique_lock<mutex> guard;
+	if(store != nullptr) //a flush between the chunks and the buffer would show its readings twice
+		guard = unique_lock<mutex>(store->lock);
+	long long bucketMicros = 0;
+	int rc = chunkBucketMicros(db, store.get(), &bucketMicros, err, "_queryReadings");
+	if(rc < 0)
+		return rc;
+	if(rc == 1)
+		rc = scanChunks(db, sensor, from, to, bucketMicros, [](long long, long long, const windowPart&) { return false; },
+			[&](const long long *times, const double *values, size_t count) { appendRange(times, values, count, from, to, readings); },
+			err, "_queryReadings");
+	if(rc < 0)
+		return rc;
+	if(store != nullptr)
+	{
+		auto it = store->sensors.find(sensor);
+		if(it != store->sensors.end())
+		{
+			for(const readingChunk& chunk : it->second.sealed)
+				appendRange(chunk.times.data(), chunk.values.data(), chunk.times.size(), from, to, readings);
+			appendRange(it->second.times.data(), it->second.values.data(), it->second.times.size(), from, to, readings);
+		}
+	}
+	err.ok("_queryReadings");
+	return 0;
+}
+
+int downsampleReadings(sqlite3 *db, const string& sensor, long long from, long long to, long long windowMicros, vector<windowStats> *windows, resultSink err)
+{
+	SQL_METRIC_SCOPE("downsampleReadings");
+	windows->clear();
+	if(from >= to || windowMicros <= 0) //OK
+	{
+		err.fail(RESULT_INVALID_ARGUMENT, "_downsampleReadings", "empty range or window");
+		return -1;
+	}
+	shared_ptr<timeSeriesStore> store = findStore(db);
+	unique_lock<mutex> guard;
+	if(store != nullptr)
+		guard = unique_lock<mutex>(store->lock);
+	long long bucketMicros = 0;
+	int rc = chunkBucketMicros(db, store.get(), &bucketMicros, err, "_downsampleReadings");
+	if(rc < 0)
+		return rc;
+	vector<windowPart> parts;
+	auto inOneWindow = [&](long long firstTime, long long lastTime, windowPart stats) {
+		if(firstTime < from || lastTime >= to || (firstTime - from) / windowMicros != (lastTime - from) / windowMicros)
+			return false;
+		stats.start = from + (firstTime - from) / windowMicros * windowMicros;
+		parts.push_back(stats);
+		return true;
+	};
+	if(rc == 1)
+		rc = scanChunks(db, sensor, from, to, bucketMicros, inOneWindow,
+			[&](const long long *times, const double *values, size_t count) { aggregateWindows(times, values, count, from, to, windowMicros, &parts); },
+			err, "_downsampleReadings");
+	if(rc < 0)
+		return rc;
+	if(store != nullptr)
+	{
+		auto it = store->sensors.find(sensor);
+		if(it != store->sensors.end())
+		{
+			for(const readingChunk& chunk : it->second.sealed)
+				aggregateWindows(chunk.times.data(), chunk.values.data(), chunk.times.size(), from, to, windowMicros, &parts);
+			aggregateWindows(it->second.times.data(), it->second.values.data(), it->second.times.size(), from, to, windowMicros, &parts);
+		}
+	}
+	// Chunks come in time order, so parts of one window are neighbours unless chunks overlap
+	stable_sort(parts.begin(), parts.end(), [](const windowPart& a, const windowPart& b) { return a.start < b.start; });
+	for(size_t i = 0; i < parts.size();)
+	{
+		windowPart merged = parts[i];
+		for(i++; i < parts.size() && parts[i].start == merged.start; i++)
+		{
+			merged.count += parts[i].count;
+			merged.min = min(merged.min, parts[i].min);
+			merged.max = max(merged.max, parts[i].max);
+			merged.sum += parts[i].sum;
+		}
+		windows->push_back(windowStats{merged.start, merged.count, merged.min, merged.max, merged.sum / merged.count});
+	}
+	err.ok("_downsampleReadings");
+	return 0;
+}
+
+timeSeriesStats getTimeSeriesStats(sqlite3 *db)
+{
+	shared_ptr<timeSeriesStore> store = findStore(db);
+	if(store == nullptr)
+		return timeSeriesStats{0, 0, 0, 0, 0};
+	lock_guard<mutex> guard(store->lock);
+	return store->stats;
+}
@@ -1,42 +1,401 @@
 #include "events.h"
 #include <iostream>
+#include <deque>
+#include <algorithm>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
 
-long eventDispatcher::findHandler(std::string eventType)
+namespace
 {
-    for(size_t i = 0; i < handlers.size(); i++)
+    std::shared_mutex typesLock;
+    std::unordered_map<std::string, eventTypeId> typeIds;
+    std::deque<std::string> typeNames; //deque keeps references returned by eventTypeName valid
+}
+
+eventTypeId internEventType(const std::string& type)
+{
+    {
+        std::shared_lock<std::shared_mutex> guard(typesLock);
+        auto it = typeIds.find(type);
+        if (it != typeIds.end())
+        {
+            return it->second;
+        }
+    }
+    std::unique_lock<std::shared_mutex> guard(typesLock);
+    auto it = typeIds.emplace(type, static_cast<eventTypeId>(typeNames.size()));
+    if (it.second)
+    {
+        typeNames.push_back(type);
+    }
+    return it.first->second;
+}
+
+eventTypeId findEventType(const std::string& type)
+{
+    std::shared_lock<std::shared_mutex> guard(typesLock);
+    auto it = typeIds.find(type);
+    return it == typeIds.end() ? NO_EVENT_TYPE : it->second;
+}
+
+const std::string& eventTypeName(eventTypeId id)
+{
+    static const std::string unknown;
+    std::shared_lock<std::shared_mutex> guard(typesLock);
+    return id < typeNames.size() ? typeNames[id] : unknown;
+}
+
+namespace
+{
+    struct queuedEvent
+    {
+        eventTypeId typeId = NO_EVENT_TYPE;
+        eventPayload payload;
+    };
+
+    // Bounded lock-free MPMC queue (D. Vyukov): each cell carries a sequence number
+    // telling producers and consumers whose turn it is.
+    class eventQueue
     {
-        if(handlers[i].type == eventType)
+        struct cell
+        {
+            std::atomic<size_t> sequence;
+            queuedEvent item;
+        };
+        std::unique_ptr<cell[]> buffer;
+        size_t mask;
+        alignas(64) std::atomic<size_t> enqueuePos;
+        alignas(64) std::atomic<size_t> dequeuePos;
+    public:
+        explicit eventQueue(size_t capacity)
+        {
+            size_t size = 2;
+            while (size < capacity)
+            {
+                size <<= 1;
+            }
+            buffer.reset(new cell[size]);
+            mask = size - 1;
+            for (size_t i = 0; i < size; i++)
+            {
+                buffer[i].sequence.store(i, std::memory_order_relaxed);
+            }
+            enqueuePos.store(0, std::memory_order_relaxed);
+            dequeuePos.store(0, std::memory_order_relaxed);
+        }
+
+        bool push(queuedEvent&& item)
+        {
+            size_t pos = enqueuePos.load(std::memory_order_relaxed);
+            cell* c;
+            while (true)
+            {
+                c = &buffer[pos & mask];
+                size_t seq = c->sequence.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+                if (diff == 0)
+                {
+                    if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false; //full
+                }
+                else
+                {
+                    pos = enqueuePos.load(std::memory_order_relaxed);
+                }
+            }
+            c->item = std::move(item);
+            c->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(queuedEvent& item)
         {
-            return static_cast<long>(i);
+            size_t pos = dequeuePos.load(std::memory_order_relaxed);
+            cell* c;
+            while (true)
+            {
+                c = &buffer[pos & mask];
+                size_t seq = c->sequence.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+                if (diff == 0)
+                {
+                    if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false; //empty
+                }
+                else
+                {
+                    pos = dequeuePos.load(std::memory_order_relaxed);
+                }
+            }
+            item = std::move(c->item);
+            c->sequence.store(pos + mask + 1, std::memory_order_release);
+            return true;
         }
+    };
+}
+
+struct dispatcherWorkers
+{
+    eventQueue queue;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> queued{0};     //pushed but not yet popped
+    std::atomic<size_t> unfinished{0}; //posted but not yet handled
+    std::atomic<size_t> sleeping{0};
+    std::atomic<size_t> posting{0};    //post() calls past their stopping check
+    std::atomic<bool> stopping{false};
+    std::mutex lock;
+    std::condition_variable wakeWorkers;
+    std::condition_variable idle;
+
+    explicit dispatcherWorkers(size_t capacity) : queue(capacity) {}
+};
+
+eventDispatcher::eventDispatcher() : handlersByType(std::make_shared<handlerTable>()) {}
+
+eventDispatcher::~eventDispatcher()
+{
+    shutdown();
+}
+
+std::shared_ptr<const handlerTable> eventDispatcher::snapshot() const
+{
+    return std::atomic_load(&handlersByType);
+}
+
+long eventDispatcher::findHandler(eventTypeId typeId) const
+{
+    std::shared_ptr<const handlerTable> table = snapshot();
+    if (typeId >= table->size() || (*table)[typeId].empty())
+    {
+        return -1;
     }
-    return -1;
+    return (*table)[typeId].front().position;
 }
 
-long eventDispatcher::findHandler(event Event)
+long eventDispatcher::findHandler(const std::string& eventType) const
 {
-    return findHandler(Event.type);
+    return findHandler(findEventType(eventType));
 }
 
-void eventDispatcher::registerHandler(eventHandler handler)
+long eventDispatcher::findHandler(const event& Event) const
 {
+    return findHandler(Event.typeId);
+}
+
+size_t eventDispatcher::handlerCount(eventTypeId typeId) const
+{
+    std::shared_ptr<const handlerTable> table = snapshot();
+    return typeId < table->size() ? (*table)[typeId].size() : 0;
+}
+
+void eventDispatcher::registerHandler(const eventHandler& handler)
+{
+    std::lock_guard<std::mutex> guard(registerLock);
     handlers.push_back(handler);
+    // Копия таблицы: диспетчеризация в других потоках продолжает читать старую
+    std::shared_ptr<handlerTable> table = std::make_shared<handlerTable>(*snapshot());
+    if (handler.typeId >= table->size())
+    {
+        table->resize(handler.typeId + 1);
+    }
+    std::vector<handlerSlot>& list = (*table)[handler.typeId];
+    handlerSlot slot = {handler.callback, handler.priority, static_cast<long>(handlers.size() - 1)};
+    auto pos = std::upper_bound(list.begin(), list.end(), slot, [](const handlerSlot& a, const handlerSlot& b) {
+        return a.priority > b.priority;
+    });
+    list.insert(pos, slot);
+    std::atomic_store(&handlersByType, std::shared_ptr<const handlerTable>(std::move(table)));
+}
+
+void eventDispatcher::registerHandler(const std::string& type, void(*function)(void*), int priority)
+{
+    registerHandler(eventHandler(type, function, priority));
 }
 
-void eventDispatcher::registerHandler(std::string type, void(*function)(void*))
+void eventDispatcher::registerHandler(const std::string& type, bool(*function)(void*), int priority)
 {
-    handlers.push_back(eventHandler(type, function));
+    registerHandler(eventHandler(type, function, priority));
 }
 
-void eventDispatcher::dispatchEvent(event Event)
+size_t eventDispatcher::dispatchTo(const std::vector<handlerSlot>& list, void* data)
 {
-    long pos = findHandler(Event);
-    if (pos != -1)
+    size_t called = 0;
+    for (const handlerSlot& slot : list)
     {
-        handlers[pos].handler(Event.data);
+        called++;
+        if (slot.callback(data))
+        {
+            break;
+        }
     }
-    else
+    return called;
+}
+
+size_t eventDispatcher::dispatchEvent(eventTypeId typeId, void* data)
+{
+    std::shared_ptr<const handlerTable> table = snapshot();
+    if (typeId >= table->size() || (*table)[typeId].empty())
+    {
+        std::cerr << "No handler for event type: " << eventTypeName(typeId) << std::endl;
+        return 0;
+    }
+    return dispatchTo((*table)[typeId], data);
+}
+
+size_t eventDispatcher::dispatchEvent(const event& Event)
+{
+    std::shared_ptr<const handlerTable> table = snapshot();
+    if (Event.typeId >= table->size() || (*table)[Event.typeId].empty())
     {
         std::cerr << "No handler for event type: " << Event.type << std::endl;
+        return 0;
+    }
+    return dispatchTo((*table)[Event.typeId], Event.data);
+}
+
+bool eventDispatcher::startWorkers(size_t threadCount, size_t queueCapacity)
+{
+    std::lock_guard<std::mutex> guard(registerLock);
+    if ((workers != nullptr && !workers->threads.empty()) || threadCount == 0 || queueCapacity == 0)
+    {
+        return false;
+    }
+    workers.reset(new dispatcherWorkers(queueCapacity));
+    dispatcherWorkers* w = workers.get();
+    for (size_t i = 0; i < threadCount; i++)
+    {
+        w->threads.emplace_back([this, w]() {
+            while (true)
+            {
+                queuedEvent item;
+                if (w->queue.pop(item))
+                {
+                    w->queued.fetch_sub(1);
+                    dispatchEvent(item.typeId, item.payload.data());
+                    item.payload.reset(); //the payload dies before drain() can return
+                    if (w->unfinished.fetch_sub(1) == 1)
+                    {
+                        std::lock_guard<std::mutex> lock(w->lock);
+                        w->idle.notify_all();
+                    }
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(w->lock);
+                w->sleeping.fetch_add(1);
+                w->wakeWorkers.wait(lock, [w]() { return w->queued.load() > 0 || w->stopping.load(); });
+                w->sleeping.fetch_sub(1);
+                if (w->stopping.load() && w->queued.load() == 0)
+                {
+                    return;
+                }
+            }
+        });
+    }
+    return true;
+}
+
+bool eventDispatcher::post(eventTypeId typeId, void* data)
+{
+    return post(typeId, eventPayload(data));
+}
+
+bool eventDispatcher::post(eventTypeId typeId, eventPayload&& payload)
+{
+    dispatcherWorkers* w = workers.get();
+    if (w == nullptr)
+    {
+        return false;
+    }
+    // posting и stopping упорядочены seq_cst: либо мы увидим остановку, либо shutdown дождётся нас
+    w->posting.fetch_add(1);
+    bool posted = false;
+    if (!w->stopping.load())
+    {
+        w->unfinished.fetch_add(1);
+        w->queued.fetch_add(1); //до push, иначе fetch_sub воркера может увести счётчик ниже нуля
+        queuedEvent item;
+        item.typeId = typeId;
+        item.payload = std::move(payload);
+        posted = w->queue.push(std::move(item));
+        if (!posted)
+        {
+            w->queued.fetch_sub(1);
+            w->unfinished.fetch_sub(1);
+        }
+        // queued и sleeping упорядочены seq_cst: либо воркер увидит событие, либо мы увидим спящего
+        else if (w->sleeping.load() > 0)
+        {
+            std::lock_guard<std::mutex> lock(w->lock);
+            w->wakeWorkers.notify_one();
+        }
+    }
+    if (w->posting.fetch_sub(1) == 1 && w->stopping.load())
+    {
+        std::lock_guard<std::mutex> lock(w->lock);
+        w->idle.notify_all();
+    }
+    return posted;
+}
+
+bool eventDispatcher::post(const event& Event)
+{
+    return post(Event.typeId, Event.data);
+}
+
+void eventDispatcher::drain()
+{
+    dispatcherWorkers* w = workers.get();
+    if (w == nullptr)
+    {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(w->lock);
+    w->idle.wait(lock, [w]() { return w->unfinished.load() == 0; });
+}
+
+void eventDispatcher::shutdown()
+{
+    dispatcherWorkers* w = workers.get();
+    if (w == nullptr || w->threads.empty())
+    {
+        return;
+    }
+    drain();
+    {
+        std::unique_lock<std::mutex> lock(w->lock);
+        w->stopping.store(true);
+        // post(), уже прошедший проверку stopping, успеет положить событие до финального разбора
+        w->idle.wait(lock, [w]() { return w->posting.load() == 0; });
+    }
+    w->wakeWorkers.notify_all();
+    for (std::thread& thread : w->threads)
+    {
+        thread.join();
+    }
+    w->threads.clear();
+    // Событие, опубликованное одновременно с остановкой, обрабатываем здесь
+    queuedEvent item;
+    while (w->queue.pop(item))
+    {
+        w->queued.fetch_sub(1);
+        dispatchEvent(item.typeId, item.payload.data());
+        item.payload.reset();
+        w->unfinished.fetch_sub(1);
     }
 }
@@ -5,11 +5,30 @@
 #include <iomanip>
 #include <csignal>
 #include <csetjmp>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
 #include <sqlite3.h>
 #include "events.h"
 
 #include "SQL/BaseSQL.h"
 #include "SQL/TgSQL.h"
+#include "SQL/StmtCache.h"
+#include "SQL/LogWriter.h"
+#include "SQL/PrivilegeCache.h"
+#include "SQL/ConnectionPool.h"
+#include "SQL/TextLog.h"
+#include "SQL/LogPartitions.h"
+#include "SQL/CompactLog.h"
+#include "SQL/Metrics.h"
+#include "SQL/Permissions.h"
+#include "SQL/DeviceStore.h"
+#include "SQL/TimeSeries.h"
 
 
 // Коды ANSI для цветов
@@ -38,6 +57,18 @@ bool tableExists(sqlite3* db, const std::string& tableName) {
     return result == SQLITE_ROW;
 }
 
+// Значение, которое возвращает PRAGMA
+std::string pragmaValue(sqlite3* db, const char* sql) {
+    sqlite3_stmt* stmt;
+    std::string value;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return value;
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0) != nullptr) {
+        value = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+    return value;
+}
+
 // Подсчёт записей в таблице Log
 int getLogCount(sqlite3* db) {
     sqlite3_stmt* stmt;
@@ -220,7 +251,7 @@ const char* CREATE_LOG_TABLE =
     "object TEXT, "
     "subject TEXT, "
     "eventStatus TEXT, "
-    "eventDateTime TEXT)";
+    "eventDateTime INTEGER)";
 
 // Тесты для BaseSQL
 void setupBaseSQLTests(TestGroup& baseSQLTests) {
@@ -231,7 +262,7 @@ void setupBaseSQLTests(TestGroup& baseSQLTests) {
         int result = initBaseSQL(&db, ":memory:", &errString);
         bool logTableExists = tableExists(db, "Log");
         bool success = (result == 0 && errString.find("_initBaseSQL-OK") != std::string::npos && logTableExists);
-        if (db) sqlite3_close(db);
+        if (db) closeBaseSQL(db, &errString);
         return success;
     });
 
@@ -242,7 +273,7 @@ void setupBaseSQLTests(TestGroup& baseSQLTests) {
         std::string errString;
         int result = initBaseSQL(&db, ":memory:", &errString);
         bool success = (result == 0); // В памяти всё работает
-        if (db) sqlite3_close(db);
+        if (db) closeBaseSQL(db, &errString);
         return success;
     });
 
@@ -253,7 +284,7 @@ void setupBaseSQLTests(TestGroup& baseSQLTests) {
         int result = initBaseSQL(&db, ":memory:", &errString);
         bool logTableExists = tableExists(db, "Log");
         bool success = (result == 0 && logTableExists);
-        if (db) sqlite3_close(db);
+        if (db) closeBaseSQL(db, &errString);
         return success;
     });
 
@@ -267,7 +298,7 @@ void setupBaseSQLTests(TestGroup& baseSQLTests) {
         int result = createTable(db, "TestTable", cols, &errString);
         bool testTableExists = tableExists(db, "TestTable");
         bool success = (result == 0 && errString.find("_createTable-OK") != std::string::npos && testTableExists);
-        sqlite3_close(db);
+        closeBaseSQL(db, &errString);
         return success;
     });
 
@@ -281,7 +312,7 @@ void setupBaseSQLTests(TestGroup& baseSQLTests) {
         std::vector<column> cols = {{"id", "INTEGER"}, {"name", "TEXT"}};
         int result = checkTable(db, "TestTable", cols, &errString);
         bool success = (result == 0 && errString.find("_checkTable-OK") != std::string::npos);
-        sqlite3_close(db);
+        closeBaseSQL(db, &errString);
         return success;
     });
 
@@ -294,7 +325,7 @@ void setupBaseSQLTests(TestGroup& baseSQLTests) {
         std::vector<column> cols = {{"id", "INTEGER"}};
         int result = checkTable(db, "NonExistentTable", cols, &errString);
         bool success = (result == 1 && errString.find("_checkTable-OK(WARN):table does not exist") != std::string::npos);
-        sqlite3_close(db);
+        closeBaseSQL(db, &errString);
         return success;
     });
 
@@ -308,7 +339,7 @@ void setupBaseSQLTests(TestGroup& baseSQLTests) {
         std::vector<column> checkCols = {{"id", "INTEGER"}, {"name", "TEXT"}};
         int result = checkTable(db, "TestTable", checkCols, &errString);
         bool success = (result == 4 && errString.find("_checkTable-FAIL:the number of columns is lesser than expected") != std::string::npos);
-        sqlite3_close(db);
+        closeBaseSQL(db, &errString);
         return success;
     });
 
@@ -322,7 +353,7 @@ void setupBaseSQLTests(TestGroup& baseSQLTests) {
         int result = dropTable(db, "TestTable", &errString);
         bool testTableExists = tableExists(db, "TestTable");
         bool success = (result == 0 && errString.find("_dropTable-OK") != std::string::npos && !testTableExists);
-        sqlite3_close(db);
+        closeBaseSQL(db, &errString);
         return success;
     });
 
@@ -336,7 +367,7 @@ void setupBaseSQLTests(TestGroup& baseSQLTests) {
         int result = Log(db, "testEvent", "obj", "subj", "OK", &errString);
         int logCountAfter = getLogCount(db);
         bool success = (result == 0 && errString.find("_Log-OK") != std::string::npos && logCountAfter == logCountBefore + 1);
-        sqlite3_close(db);
+        closeBaseSQL(db, &errString);
         return success;
     });
 
@@ -347,7 +378,1435 @@ void setupBaseSQLTests(TestGroup& baseSQLTests) {
         sqlite3_open(":memory:", &db);
         int result = Log(db, "testEvent", "obj", "subj", "FAIL", &errString);
         bool success = (result == -1 && errString.find("_Log-FAIL_ERROR-SQLite") != std::string::npos);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 11: Повторные вызовы Log используют закэшированный запрос
+    baseSQLTests.addTest("prepareCached - Repeated Log reuses prepared statement", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        for (int i = 0; i < 5; i++) {
+            Log(db, "testEvent", "obj", "subj", "OK", &errString);
+        }
+        stmtCacheStats stats = getStmtCacheStats(db);
+        bool success = (stats.misses == 1 && stats.hits == 4 && stats.size == 1 && getLogCount(db) == 5);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 12: Одновременное использование одного запроса даёт отдельный statement
+    baseSQLTests.addTest("prepareCached - Busy statement is not shared", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        cachedStmt first, second;
+        prepareCached(db, "SELECT 1", &first);
+        prepareCached(db, "SELECT 1", &second);
+        bool success = (first != nullptr && second != nullptr && static_cast<sqlite3_stmt*>(first) != static_cast<sqlite3_stmt*>(second));
+        first.release();
+        second.release();
+        stmtCacheStats stats = getStmtCacheStats(db);
+        success = success && stats.size == 1 && stats.misses == 2;
+        return closeBaseSQL(db, &errString) == 0 && success;
+    });
+
+    // Тест 13: closeBaseSQL финализирует кэш и закрывает соединение
+    baseSQLTests.addTest("closeBaseSQL - Finalizes cached statements", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        initBaseSQL(&db, ":memory:", &errString);
+        Log(db, "testEvent", "obj", "subj", "OK", &errString);
+        bool cached = getStmtCacheStats(db).size > 0;
+        int result = closeBaseSQL(db, &errString);
+        bool success = (cached && result == 0 && errString.find("_closeBaseSQL-OK") != std::string::npos && getStmtCacheStats(db).size == 0);
+        return success;
+    });
+
+    // Тест 14: Фоновая запись лога пачками в файловую базу
+    baseSQLTests.addTest("startLogWriter - Batched background Log inserts", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        std::remove("logWriterTest.db");
+        initBaseSQL(&db, "logWriterTest.db", &errString);
+        int logCountBefore = getLogCount(db);
+        logWriterOptions options;
+        options.batchSize = 100;
+        int result = startLogWriter(db, options, &errString);
+        for (int i = 0; i < 1000; i++) {
+            Log(db, "testEvent", "obj" + std::to_string(i), "subj", "OK", &errString);
+        }
+        flushLogWriter(db);
+        logWriterStats stats = getLogWriterStats(db);
+        bool success = (result == 0 && stats.written == 1000 && stats.batches >= 10 && stats.batches < 1000 &&
+            getLogCount(db) == logCountBefore + 1000 && errString.find("_Log-OK(QUEUED)") != std::string::npos);
+        success = closeBaseSQL(db, &errString) == 0 && success;
+        std::remove("logWriterTest.db");
+        return success;
+    });
+
+    // Тест 15: Переполнение очереди лога с политикой DROP
+    baseSQLTests.addTest("startLogWriter - Drop policy when queue is full", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        std::remove("logWriterDrop.db");
+        sqlite3_open("logWriterDrop.db", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        logWriterOptions options;
+        options.queueCapacity = 4;
+        options.batchSize = 1000;
+        options.flushIntervalMs = 60000;
+        options.overflow = LOG_OVERFLOW_DROP;
+        startLogWriter(db, options, &errString);
+        int dropped = 0;
+        for (int i = 0; i < 10; i++) {
+            if (Log(db, "testEvent", "obj", "subj", "OK", &errString) == -3) dropped++;
+        }
+        logWriterStats stats = getLogWriterStats(db);
+        int result = stopLogWriter(db, &errString);
+        bool success = (dropped == 6 && stats.dropped == 6 && result == 0 && getLogCount(db) == 4);
+        closeBaseSQL(db, &errString);
+        std::remove("logWriterDrop.db");
+        return success;
+    });
+
+    // Тест 16: createTable создаёт первичный ключ, UNIQUE и индексы из tableInfo
+    baseSQLTests.addTest("createTable - Primary key, unique and secondary index", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        tableInfo table("Devices", {column("id", "INTEGER", COLUMN_PRIMARY_KEY), column("serial", "TEXT", COLUMN_UNIQUE | COLUMN_NOT_NULL), column("room", "TEXT")},
+            {tableIndex("DevicesByRoom", {"room"})});
+        int result = createTable(db, table, &errString);
+        int checkResult = checkTable(db, table, &errString);
+        int duplicate = sqlite3_exec(db, "INSERT INTO Devices(serial) VALUES('a'); INSERT INTO Devices(serial) VALUES('a')", nullptr, nullptr, nullptr);
+        bool success = (result == 0 && checkResult == 0 && duplicate == SQLITE_CONSTRAINT);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 17: checkTable сообщает об отсутствующем индексе и ограничениях
+    baseSQLTests.addTest("checkTable - Missing index and constraints", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        sqlite3_exec(db, "CREATE TABLE Devices (id INTEGER PRIMARY KEY, room TEXT)", nullptr, nullptr, nullptr);
+        tableInfo indexed("Devices", {column("id", "INTEGER", COLUMN_PRIMARY_KEY), column("room", "TEXT")}, {tableIndex("DevicesByRoom", {"room"})});
+        tableInfo unique("Devices", {column("id", "INTEGER", COLUMN_PRIMARY_KEY), column("room", "TEXT", COLUMN_UNIQUE)});
+        tableInfo plain("Devices", {column("id", "INTEGER"), column("room", "TEXT")});
+        int missingIndex = checkTable(db, indexed, &errString);
+        int notUnique = checkTable(db, unique, &errString);
+        int primaryKey = checkTable(db, plain, &errString);
+        int created = createTable(db, indexed, &errString);
+        bool success = (missingIndex == 7 && notUnique == 6 && primaryKey == 6 && created == 0 && checkTable(db, indexed, &errString) == 0);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 18: Параметры соединения по умолчанию для файловой базы
+    baseSQLTests.addTest("initBaseSQL - Default connection options (WAL)", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        std::remove("connectionOptionsTest.db");
+        int result = initBaseSQL(&db, "connectionOptionsTest.db", &errString);
+        bool success = (result == 0 && errString.find("_configureConnection-OK") != std::string::npos &&
+            pragmaValue(db, "PRAGMA journal_mode") == "wal" && pragmaValue(db, "PRAGMA synchronous") == "1" &&
+            pragmaValue(db, "PRAGMA busy_timeout") == "5000" && pragmaValue(db, "PRAGMA cache_size") == "-16384" &&
+            pragmaValue(db, "PRAGMA temp_store") == "2" && getConnectionOptions(db) != nullptr);
+        closeBaseSQL(db, &errString);
+        std::remove("connectionOptionsTest.db");
+        return success;
+    });
+
+    // Тест 19: Недопустимое значение параметра
+    baseSQLTests.addTest("initBaseSQL - Invalid connection option", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        connectionOptions options;
+        options.busyTimeoutMs = -1;
+        int result = initBaseSQL(&db, ":memory:", options, &errString);
+        bool success = (result == -6 && errString.find("_configureConnection-FAIL:invalid option busyTimeoutMs") != std::string::npos);
+        if (db) closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 20: База в памяти не поддерживает WAL - предупреждение, а не ошибка
+    baseSQLTests.addTest("configureConnection - In-memory journal mode warning", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        connectionOptions options;
+        options.synchronous = SYNCHRONOUS_OFF;
+        options.busyTimeoutMs = 250;
+        int result = configureConnection(db, options, &errString);
+        bool success = (result == 0 && errString.find("_configureConnection-OK(WARN):journal_mode is memory") != std::string::npos &&
+            pragmaValue(db, "PRAGMA synchronous") == "0" && pragmaValue(db, "PRAGMA busy_timeout") == "250");
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 21: Пул соединений - писатель пишет, читатель видит данные и не может писать
+    baseSQLTests.addTest("connectionPool - Separate reader and writer connections", []() {
+        std::string errString;
+        std::remove("connectionPoolTest.db");
+        connectionPoolOptions options;
+        options.readers = 2;
+        std::shared_ptr<connectionPool> pool;
+        int opened = openConnectionPool("connectionPoolTest.db", options, &pool, &errString);
+        bool success = (opened == 0);
+        if (success) {
+            pooledConnection writer, reader;
+            checkoutConnection(pool, CONNECTION_WRITE, &writer, &errString);
+            checkoutConnection(pool, CONNECTION_READ, &reader, &errString);
+            int logCount = getLogCount(reader);
+            Log(writer, "testEvent", "obj", "subj", "OK", &errString);
+            bool readOnly = sqlite3_exec(reader, "DELETE FROM Log", nullptr, nullptr, nullptr) == SQLITE_READONLY;
+            connectionPoolStats stats = getConnectionPoolStats(pool);
+            success = (getLogCount(reader) == logCount + 1 && readOnly && writer.get() != reader.get() &&
+                pragmaValue(reader, "PRAGMA journal_mode") == "wal" && stats.readers.size == 2 && stats.writers.size == 1 &&
+                stats.readers.inUse == 1 && stats.writers.checkouts == 1);
+            reader.release();
+            writer.release();
+            success = success && closeConnectionPool(pool, &errString) == 0;
+        }
+        std::remove("connectionPoolTest.db");
+        return success;
+    });
+
+    // Тест 22: Потоки ждут освобождения единственного писателя
+    baseSQLTests.addTest("connectionPool - Writers are shared between threads", []() {
+        std::string errString;
+        std::remove("connectionPoolTest.db");
+        connectionPoolOptions options;
+        options.readers = 0;
+        options.checkoutTimeoutMs = 50;
+        std::shared_ptr<connectionPool> pool;
+        openConnectionPool("connectionPoolTest.db", options, &pool, &errString);
+        pooledConnection held;
+        checkoutConnection(pool, CONNECTION_WRITE, &held, &errString);
+        pooledConnection blocked;
+        int timedOut = checkoutConnection(pool, CONNECTION_READ, &blocked, &errString); // читателей нет - ждём писателя
+        int logCount = getLogCount(held);
+        held.release();
+        std::vector<std::thread> threads;
+        std::atomic<int> failures(0);
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([&pool, &failures]() {
+                std::string threadErr;
+                for (int i = 0; i < 25; i++) {
+                    pooledConnection conn;
+                    if (checkoutConnection(pool, CONNECTION_WRITE, &conn, &threadErr) != 0 ||
+                        Log(conn, "testEvent", "obj", "subj", "OK", &threadErr) != 0) failures++;
+                }
+            });
+        }
+        for (std::thread& thread : threads) thread.join();
+        pooledConnection check;
+        checkoutConnection(pool, CONNECTION_READ, &check, &errString);
+        connectionPoolStats stats = getConnectionPoolStats(pool);
+        bool success = (timedOut == -2 && errString.find("_checkoutConnection-FAIL:timed out") != std::string::npos &&
+            failures.load() == 0 && getLogCount(check) == logCount + 100 && stats.writers.timeouts == 1 &&
+            stats.writers.checkouts == 102 && stats.writers.peakInUse == 1 && stats.readers.size == 0);
+        check.release();
+        closeConnectionPool(pool, &errString);
+        std::remove("connectionPoolTest.db");
+        return success;
+    });
+
+    // Тест 23: Закрытие пула с выданным соединением
+    baseSQLTests.addTest("connectionPool - Close with checked out connections", []() {
+        std::string errString;
+        std::remove("connectionPoolTest.db");
+        std::shared_ptr<connectionPool> pool;
+        int memory = openConnectionPool(":memory:", connectionPoolOptions(), &pool, &errString);
+        openConnectionPool("connectionPoolTest.db", connectionPoolOptions(), &pool, &errString);
+        pooledConnection conn;
+        checkoutConnection(pool, CONNECTION_READ, &conn, &errString);
+        int closed = closeConnectionPool(pool, &errString);
+        bool stillOpen = getLogCount(conn) >= 0;
+        pooledConnection late;
+        int afterClose = checkoutConnection(pool, CONNECTION_WRITE, &late, &errString);
+        conn.release();
+        connectionPoolStats stats = getConnectionPoolStats(pool);
+        bool success = (memory == -1 && closed == 0 && stillOpen && afterClose == -1 &&
+            stats.readers.size == 0 && stats.writers.size == 0);
+        std::remove("connectionPoolTest.db");
+        std::remove("connectionPoolTest.db-wal"); // последним закрылся читатель, а он не может удалить WAL
+        std::remove("connectionPoolTest.db-shm");
+        return success;
+    });
+
+    // Тест 24: Структурированный результат вместо строки errString
+    baseSQLTests.addTest("sqlResult - Structured outcome without a trace string", []() {
+        sqlite3* db = nullptr;
+        sqlite3_open(":memory:", &db);
+        sqlResult failed;
+        int noTable = Log(db, "testEvent", "obj", "subj", "OK", &failed);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        sqlResult logged;
+        int result = Log(db, "testEvent", "obj", "subj", "OK", &logged);
+        bool success = (noTable == -1 && failed.code == RESULT_SQLITE_ERROR && failed.sqliteRc == SQLITE_ERROR &&
+            failed.message() == "_Log-FAIL_ERROR-SQLite:no such table: Log" && result == 0 && logged.ok() &&
+            logged.message() == "_Log-OK" && Log(db, "testEvent", "obj", "subj", "OK", nullptr) == 0 && getLogCount(db) == 2);
+        closeBaseSQL(db, nullptr);
+        return success;
+    });
+
+    // Тест 25: Строка и структура одновременно дают одинаковый текст
+    baseSQLTests.addTest("sqlResult - Trace and result agree", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlResult result;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        sqlite3_exec(db, "CREATE TABLE Devices (id INTEGER, name TEXT)", nullptr, nullptr, nullptr);
+        int rc = checkTable(db, tableInfo("Devices", {column("id", "INTEGER"), column("room", "TEXT")}), resultSink(&errString, &result));
+        bool success = (rc == 2 && result.code == RESULT_SCHEMA_MISMATCH && !result.ok() &&
+            result.message() == "_checkTable-FAIL:column name is not equal to expected(\"name\" != \"room\")" &&
+            errString.size() >= result.message().size() &&
+            errString.compare(errString.size() - result.message().size(), std::string::npos, result.message()) == 0);
+        closeBaseSQL(db, nullptr);
+        return success;
+    });
+
+    // Тест 26: Однострочные записи textLog в заданный файл
+    baseSQLTests.addTest("textLog - Single-line records in a configured file", []() {
+        closeTextLog(nullptr);
+        std::remove("textLogTest");
+        textLogOptions options;
+        options.path = "textLogTest";
+        int opened = openTextLog(options, nullptr);
+        textLog(nullptr, "testEvent", "obj", "subj", "FAIL:line\nbreak\tand tab");
+        textLog(nullptr, "testEvent", "obj2", "subj", "OK");
+        flushTextLog();
+        std::ifstream file("textLogTest");
+        std::vector<std::string> lines;
+        for (std::string line; std::getline(file, line);) lines.push_back(line);
+        textLogStats stats = getTextLogStats();
+        bool success = (opened == 0 && lines.size() == 2 && lines[0].size() > 24 && lines[0][4] == '-' && lines[0][19] == '.' &&
+            lines[0].substr(23) == "\ttestEvent\tobj\tsubj\tFAIL:line\\nbreak\\tand tab" &&
+            lines[1].substr(23) == "\ttestEvent\tobj2\tsubj\tOK" && stats.records == 2 && stats.bytes > 0);
+        closeTextLog(nullptr);
+        std::remove("textLogTest");
+        return success;
+    });
+
+    // Тест 27: Ротация файла по размеру
+    baseSQLTests.addTest("textLog - Size-based rotation", []() {
+        closeTextLog(nullptr);
+        const char* files[] = {"textLogTest", "textLogTest.1", "textLogTest.2", "textLogTest.3"};
+        for (const char* name : files) std::remove(name);
+        textLogOptions options;
+        options.path = "textLogTest";
+        options.maxFileSize = 200;
+        options.keepFiles = 2;
+        openTextLog(options, nullptr);
+        for (int i = 0; i < 20; i++) {
+            textLog(nullptr, "testEvent", "obj" + std::to_string(i), "subj", "OK");
+            flushTextLog();
+        }
+        textLogStats stats = getTextLogStats();
+        closeTextLog(nullptr);
+        bool success = (stats.rotations >= 3 && std::ifstream("textLogTest.1").good() && std::ifstream("textLogTest.2").good() &&
+            !std::ifstream("textLogTest.3").good());
+        for (const char* name : files) std::remove(name);
+        return success;
+    });
+
+    // Тест 28: Запись из нескольких потоков через маленький кольцевой буфер
+    baseSQLTests.addTest("textLog - Concurrent writers and a small ring buffer", []() {
+        closeTextLog(nullptr);
+        std::remove("textLogTest");
+        textLogOptions options;
+        options.path = "textLogTest";
+        options.bufferSize = 1024;
+        openTextLog(options, nullptr);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([t]() {
+                for (int i = 0; i < 500; i++) textLog(nullptr, "thread" + std::to_string(t), "obj", "subj", "OK");
+            });
+        }
+        for (std::thread& thread : threads) thread.join();
+        flushTextLog();
+        textLogStats stats = getTextLogStats();
+        closeTextLog(nullptr);
+        std::ifstream file("textLogTest");
+        int count = 0;
+        for (std::string line; std::getline(file, line);) {
+            if (line.find("\tobj\tsubj\tOK") != std::string::npos) count++;
+        }
+        bool success = (count == 2000 && stats.records == 2000 && stats.waits > 0 && closeTextLog(nullptr) == -1);
+        std::remove("textLogTest");
+        return success;
+    });
+
+    // Тест 29: BEGIN IMMEDIATE повторяется, пока другой писатель держит блокировку
+    baseSQLTests.addTest("immediateTransaction - Retries SQLITE_BUSY", []() {
+        const char* files[] = {"transactionTest.db", "transactionTest.db-wal", "transactionTest.db-shm"};
+        for (const char* name : files) std::remove(name);
+        sqlite3 *holder = nullptr, *impatient = nullptr, *patient = nullptr;
+        connectionOptions noRetries;
+        noRetries.busyTimeoutMs = 0;
+        noRetries.busyRetries = 0;
+        connectionOptions retries = noRetries;
+        retries.busyRetries = 8;
+        retries.busyRetryBackoffMs = 5;
+        initBaseSQL(&holder, "transactionTest.db", nullptr);
+        initBaseSQL(&impatient, "transactionTest.db", noRetries, nullptr);
+        initBaseSQL(&patient, "transactionTest.db", retries, nullptr);
+        int logCount = getLogCount(holder);
+        sqlite3_exec(holder, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr);
+        immediateTransaction failed;
+        sqlResult busy;
+        int failedRc = failed.begin(impatient, &busy);
+        std::thread release([holder]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            sqlite3_exec(holder, "COMMIT", nullptr, nullptr, nullptr);
+        });
+        immediateTransaction waited;
+        int waitedRc = waited.begin(patient, nullptr);
+        release.join();
+        Log(patient, "testEvent", "obj", "subj", "OK", nullptr);
+        int committed = waited.commit(nullptr);
+        bool success = (failedRc == -1 && !failed.active() && busy.sqliteRc == SQLITE_BUSY && waitedRc == 0 &&
+            committed == 0 && getLogCount(holder) == logCount + 1);
+        closeBaseSQL(patient, nullptr);
+        closeBaseSQL(impatient, nullptr);
+        closeBaseSQL(holder, nullptr);
+        for (const char* name : files) std::remove(name);
+        return success;
+    });
+
+    // Тест 30: Внутри открытой транзакции используется точка сохранения
+    baseSQLTests.addTest("immediateTransaction - Savepoint inside a transaction", []() {
+        sqlite3* db = nullptr;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        sqlite3_exec(db, "BEGIN", nullptr, nullptr, nullptr);
+        Log(db, "outer", "obj", "subj", "OK", nullptr);
+        {
+            immediateTransaction inner;
+            inner.begin(db, nullptr);
+            Log(db, "inner", "obj", "subj", "OK", nullptr);
+        }
+        immediateTransaction kept;
+        int begun = kept.begin(db, nullptr);
+        Log(db, "kept", "obj", "subj", "OK", nullptr);
+        int committed = kept.commit(nullptr);
+        bool stillOpen = sqlite3_get_autocommit(db) == 0;
+        sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr);
+        bool success = (begun == 0 && committed == 0 && stillOpen && getLogCount(db) == 2 && kept.commit(nullptr) == -3);
+        closeBaseSQL(db, nullptr);
+        return success;
+    });
+
+    // Тест 31: Повторная проверка таблицы проходит по отпечатку схемы
+    baseSQLTests.addTest("checkTable - Schema fingerprint fast path", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        tableInfo table("fingerprinted", {column("id", "INTEGER", COLUMN_PRIMARY_KEY), column("name", "TEXT", COLUMN_UNIQUE)},
+            {tableIndex("idx_fingerprinted_name", {"name", "id"})});
+        createTable(db, table, &errString);
+        int logCount = getLogCount(db);
+        std::string fastTrace;
+        int fast = checkTable(db, table, &fastTrace);
+        int fastLogCount = getLogCount(db);
+        sqlite3_exec(db, "ALTER TABLE fingerprinted ADD COLUMN extra TEXT", nullptr, nullptr, nullptr);
+        int altered = checkTable(db, table, &errString);
+        tableInfo changed("fingerprinted", {column("id", "INTEGER", COLUMN_PRIMARY_KEY), column("name", "TEXT", COLUMN_UNIQUE),
+            column("extra", "TEXT")}, {tableIndex("idx_fingerprinted_name", {"name", "id"})});
+        int accepted = checkTable(db, changed, &errString);
+        std::string trace;
+        int cached = checkTable(db, changed, &trace);
+        bool success = (fast == 0 && fastTrace == "_checkTable-OK(FINGERPRINT)" && fastLogCount == logCount &&
+            altered == 5 && accepted == 0 && cached == 0 && trace == "_checkTable-OK(FINGERPRINT)");
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 32: checkTables проверяет все неизменённые таблицы одним запросом
+    baseSQLTests.addTest("checkTables - One query for many registered tables", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        std::vector<tableInfo> tables;
+        for (int i = 0; i < 20; i++) {
+            tables.push_back(tableInfo("t" + std::to_string(i), {column("id", "INTEGER", COLUMN_PRIMARY_KEY), column("value", "TEXT")}));
+            createTable(db, tables.back(), &errString);
+        }
+        int statements = 0;
+        sqlite3_trace_v2(db, SQLITE_TRACE_STMT, [](unsigned, void* counter, void*, void*) {
+            ++*static_cast<int*>(counter);
+            return 0;
+        }, &statements);
+        std::vector<int> results;
+        int fast = checkTables(db, tables, &results, &errString);
+        int fastStatements = statements;
+        sqlite3_trace_v2(db, 0, nullptr, nullptr);
+        tables[7].columns.push_back(column("added", "TEXT"));
+        sqlResult result;
+        int mismatched = checkTables(db, tables, &results, &result);
+        bool success = (fast == 0 && fastStatements == 1 && mismatched == 1 && results[7] == 4 && results[6] == 0 &&
+            result.code == RESULT_WARN);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 33: initBaseSQL дополняет устаревшую таблицу Log колонкой, не теряя записи
+    baseSQLTests.addTest("initBaseSQL - Migrates outdated Log with ALTER TABLE", []() {
+        const char* files[] = {"migrationTest.db", "migrationTest.db-wal", "migrationTest.db-shm"};
+        for (const char* name : files) std::remove(name);
+        sqlite3* db = nullptr;
+        sqlite3_open("migrationTest.db", &db);
+        sqlite3_exec(db, "CREATE TABLE Log (id INTEGER, eventName TEXT, object TEXT, subject TEXT, eventStatus TEXT);"
+            "INSERT INTO Log(eventName) VALUES('old1'), ('old2'), ('old3')", nullptr, nullptr, nullptr);
+        sqlite3_close(db);
+        std::string errString;
+        int result = initBaseSQL(&db, "migrationTest.db", &errString);
+        sqlite3_stmt* stmt;
+        sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM Log WHERE eventName LIKE 'old%' AND eventDateTime IS NULL", -1, &stmt, nullptr);
+        int kept = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : -1;
+        sqlite3_finalize(stmt);
+        bool success = (result == 0 && kept == 3 && errString.find("_migrateTable-OK(ALTER)") != std::string::npos &&
+            errString.find("_initBaseSQL-OK(WARN):the table has been migrated") != std::string::npos && checkTable(db, LogInfo, &errString) == 0);
+        closeBaseSQL(db, &errString);
+        for (const char* name : files) std::remove(name);
+        return success;
+    });
+
+    // Тест 34: Перенос данных пачками с паузой, продолжением и дописанными между пачками строками
+    baseSQLTests.addTest("migrateTable - Batched copy, pause and resume", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        sqlite3_exec(db, "CREATE TABLE Readings (id INTEGER, value TEXT, obsolete TEXT)", nullptr, nullptr, nullptr);
+        sqlite3_exec(db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 250) "
+            "INSERT INTO Readings SELECT i, 'v' || i, 'x' FROM n", nullptr, nullptr, nullptr);
+        tableInfo target("Readings", {column("id", "INTEGER", COLUMN_PRIMARY_KEY), column("value", "TEXT")},
+            {tableIndex("ReadingsByValue", {"value"})});
+        migrationOptions options;
+        options.batchRows = 100;
+        std::vector<migrationProgress> reports;
+        options.context = &reports;
+        options.progress = [](const migrationProgress& progress, void* context) {
+            static_cast<std::vector<migrationProgress>*>(context)->push_back(progress);
+            return false;
+        };
+        sqlResult paused;
+        int first = migrateTable(db, target, options, &paused);
+        sqlite3_exec(db, "INSERT INTO Readings VALUES(251, 'v251', 'x')", nullptr, nullptr, nullptr);
+        options.progress = [](const migrationProgress& progress, void* context) {
+            static_cast<std::vector<migrationProgress>*>(context)->push_back(progress);
+            return true;
+        };
+        int second = migrateTable(db, target, options, &errString);
+        sqlite3_stmt* stmt;
+        sqlite3_prepare_v2(db, "SELECT COUNT(*), SUM(id), (SELECT COUNT(*) FROM schemaMigrations) FROM Readings", -1, &stmt, nullptr);
+        sqlite3_step(stmt);
+        int rows = sqlite3_column_int(stmt, 0);
+        int idSum = sqlite3_column_int(stmt, 1);
+        int pending = sqlite3_column_int(stmt, 2);
+        sqlite3_finalize(stmt);
+        bool success = (first == 1 && paused.code == RESULT_WARN && second == 0 && rows == 251 && idSum == 251 * 252 / 2 &&
+            pending == 0 && reports.size() == 3 && reports[0].copiedRows == 100 && reports[0].maxRowid == 250 &&
+            reports[2].copiedRows == 251 && reports[2].batches == 3 && !tableExists(db, "Readings_migrate") &&
+            checkTable(db, target, &errString) == 0 && errString.find("_migrateTable-OK(COPY)") != std::string::npos);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 35: Записи лога попадают в раздел текущего дня, старые разделы удаляются целиком
+    baseSQLTests.addTest("enableLogPartitions - Routing, retention and queryLog", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        Log(db, "beforePartitions", "obj", "subj", "OK", &errString);
+        logPartitionOptions options;
+        options.retentionDays = 2;
+        int enabled = enableLogPartitions(db, options, &errString);
+        time_t now = time(nullptr);
+        Log(db, "partitioned", "obj", "subj", "OK", &errString);
+        std::string old;
+        logPartitionTable(db, db, now - 5 * 86400, &old);
+        bool oldCreated = tableExists(db, old);
+        int dropped = applyLogRetention(db, now, &errString);
+        std::vector<std::string> tables;
+        listLogPartitions(db, now - 86400, now, &tables, &errString);
+        std::vector<logEntry> entries;
+        int found = queryLog(db, now - 3600, now + 3600, [](const logEntry& entry, void* context) {
+            static_cast<std::vector<logEntry>*>(context)->push_back(entry);
+            return true;
+        }, &entries, &errString);
+        bool sawPartitioned = false;
+        for (const logEntry& entry : entries) {
+            if (entry.eventName == "partitioned") sawPartitioned = true;
+        }
+        logPartitionStats stats = getLogPartitionStats(db);
+        bool success = (enabled == 0 && getLogCount(db) == 1 && oldCreated && dropped == 1 && !tableExists(db, old) &&
+            tables.size() >= 2 && tables[0] == "Log" && found == static_cast<int>(entries.size()) && entries[0].eventName == "beforePartitions" &&
+            sawPartitioned && stats.created >= 2 && stats.dropped == 1 && disableLogPartitions(db, &errString) == 0 && !hasLogPartitions(db));
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 36: Фоновая запись лога в раздел и фоновый incremental_vacuum после удаления раздела
+    baseSQLTests.addTest("enableLogPartitions - Log writer and background vacuum", []() {
+        const char* files[] = {"partitionTest.db", "partitionTest.db-wal", "partitionTest.db-shm"};
+        for (const char* name : files) std::remove(name);
+        sqlite3* db = nullptr;
+        std::string errString;
+        initBaseSQL(&db, "partitionTest.db", &errString);
+        logPartitionOptions options;
+        options.retentionDays = 1;
+        options.vacuumIntervalMs = 10;
+        int enabled = enableLogPartitions(db, options, &errString);
+        time_t now = time(nullptr);
+        std::string old;
+        logPartitionTable(db, db, now - 3 * 86400, &old);
+        sqlite3_exec(db, ("WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 3000) "
+            "INSERT INTO " + old + "(eventName, eventStatus) SELECT 'filler', hex(randomblob(100)) FROM n").c_str(), nullptr, nullptr, nullptr);
+        startLogWriter(db, logWriterOptions(), &errString);
+        for (int i = 0; i < 50; i++) Log(db, "queued", "obj", "subj", "OK", &errString);
+        flushLogWriter(db);
+        int dropped = applyLogRetention(db, now, &errString);
+        logPartitionStats stats = getLogPartitionStats(db);
+        for (int i = 0; i < 200 && stats.vacuumedPages == 0; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            stats = getLogPartitionStats(db);
+        }
+        int queued = 0;
+        queryLog(db, now - 60, now + 60, [](const logEntry& entry, void* context) {
+            if (entry.eventName == "queued") ++*static_cast<int*>(context);
+            return true;
+        }, &queued, &errString);
+        bool success = (enabled == 0 && dropped == 1 && queued == 50 && stats.vacuumedPages > 0 &&
+            pragmaValue(db, "PRAGMA auto_vacuum") == "2");
+        closeBaseSQL(db, &errString);
+        for (const char* name : files) std::remove(name);
+        return success;
+    });
+
+    // Тест 37: Постраничное чтение лога с фильтром по subject, курсор переходит из Log в раздел
+    baseSQLTests.addTest("queryLog - Keyset pages across Log and a partition", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        for (int i = 0; i < 12; i++) {
+            Log(db, "action", "obj", "alice", "OK", &errString);
+            Log(db, "action", "obj", "bob", "OK", &errString);
+        }
+        enableLogPartitions(db, logPartitionOptions(), &errString);
+        for (int i = 0; i < 13; i++) Log(db, "action", "obj", "alice", "OK", &errString);
+        time_t now = time(nullptr);
+        logQuery query;
+        query.subject = "alice";
+        query.from = now - 60;
+        query.limit = 10;
+        logCursor cursor;
+        std::vector<logEntry> entries;
+        std::vector<int> pages;
+        auto collect = [](const logEntry& entry, void* context) {
+            static_cast<std::vector<logEntry>*>(context)->push_back(entry);
+            return true;
+        };
+        int page;
+        while ((page = queryLog(db, query, &cursor, collect, &entries, &errString)) > 0) {
+            pages.push_back(page);
+            if (page < static_cast<int>(query.limit)) break;
+        }
+        bool ordered = true;
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (entries[i].subject != "alice" || entries[i].eventDateTime < now - 60 || entries[i].eventDateTime > now) ordered = false;
+            if (i > 0 && entries[i].eventDateTime < entries[i - 1].eventDateTime) ordered = false;
+        }
+        logQuery inverted;
+        inverted.from = now;
+        inverted.to = now - 1;
+        bool success = (pages == std::vector<int>{10, 10, 5} && entries.size() == 25 && ordered && cursor.table.find("Log_") == 0 &&
+            queryLog(db, inverted, &cursor, collect, &entries, &errString) == -1);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 38: Текстовое время старого лога переводится в epoch, запросы по subject используют индекс
+    baseSQLTests.addTest("initBaseSQL - Integer eventDateTime and Log indexes", []() {
+        const char* files[] = {"logQueryTest.db", "logQueryTest.db-wal", "logQueryTest.db-shm"};
+        for (const char* name : files) std::remove(name);
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open("logQueryTest.db", &db);
+        sqlite3_exec(db, "CREATE TABLE Log (id INTEGER, eventName TEXT, object TEXT, subject TEXT, eventStatus TEXT, eventDateTime TEXT);"
+            "INSERT INTO Log(eventName, subject, eventDateTime) VALUES('old', 'carol', '2024-01-02 03:04:05')", nullptr, nullptr, nullptr);
+        sqlite3_close(db);
+        db = nullptr;
+        initBaseSQL(&db, "logQueryTest.db", &errString);
+        struct tm local = {};
+        local.tm_year = 124;
+        local.tm_mon = 0;
+        local.tm_mday = 2;
+        local.tm_hour = 3;
+        local.tm_min = 4;
+        local.tm_sec = 5;
+        local.tm_isdst = -1;
+        time_t expected = mktime(&local);
+        std::vector<logEntry> entries;
+        logQuery query;
+        query.subject = "carol";
+        logCursor cursor;
+        queryLog(db, query, &cursor, [](const logEntry& entry, void* context) {
+            static_cast<std::vector<logEntry>*>(context)->push_back(entry);
+            return true;
+        }, &entries, &errString);
+        std::string plan;
+        sqlite3_stmt* stmt = nullptr;
+        sqlite3_prepare_v2(db, "EXPLAIN QUERY PLAN SELECT rowid FROM Log WHERE subject = 'carol' AND eventDateTime BETWEEN 0 AND 1 ORDER BY eventDateTime, rowid", -1, &stmt, nullptr);
+        while (sqlite3_step(stmt) == SQLITE_ROW) plan += reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+        sqlite3_finalize(stmt);
+        bool success = (entries.size() == 1 && entries[0].eventName == "old" && entries[0].eventDateTime == expected &&
+            plan.find("LogBySubject") != std::string::npos && plan.find("TEMP B-TREE") == std::string::npos);
+        closeBaseSQL(db, &errString);
+        for (const char* name : files) std::remove(name);
+        return success;
+    });
+
+    // Тест 39: Перевод лога в компактный формат, представление Log возвращает прежние строки
+    baseSQLTests.addTest("enableCompactLog - Dictionary-encoded records behind the Log view", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        Log(db, "addUser", "USER:1", "SYSTEM", "OK", &errString);
+        Log(db, "addUser", "USER:2", "SYSTEM", "FAIL_ERROR-SQLite:no such table: users", &errString);
+        int enabled = enableCompactLog(db, compactLogOptions(), &errString);
+        for (int i = 0; i < 5; i++) Log(db, "modUser", "USER:" + std::to_string(i), "alice", "OK:", &errString);
+        std::vector<std::string> rows;
+        sqlite3_stmt* stmt = nullptr;
+        sqlite3_prepare_v2(db, "SELECT eventName || '|' || object || '|' || subject || '|' || eventStatus FROM Log ORDER BY id", -1, &stmt, nullptr);
+        while (sqlite3_step(stmt) == SQLITE_ROW) rows.push_back(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
+        sqlite3_finalize(stmt);
+        sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM LogStrings", -1, &stmt, nullptr);
+        sqlite3_step(stmt);
+        int strings = sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
+        std::string plan;
+        sqlite3_prepare_v2(db, "EXPLAIN QUERY PLAN SELECT id FROM Log WHERE subject = 'alice' AND eventDateTime BETWEEN 0 AND 1 ORDER BY eventDateTime, id", -1, &stmt, nullptr);
+        while (sqlite3_step(stmt) == SQLITE_ROW) plan += reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+        sqlite3_finalize(stmt);
+        logQuery query;
+        query.subject = "alice";
+        query.limit = 3;
+        logCursor cursor;
+        int counted = 0;
+        auto count = [](const logEntry& entry, void* context) {
+            if (entry.subject == "alice" && entry.eventStatus == "OK:") ++*static_cast<int*>(context);
+            return true;
+        };
+        int first = queryLog(db, query, &cursor, count, &counted, &errString);
+        int second = queryLog(db, query, &cursor, count, &counted, &errString);
+        bool success = (enabled == 0 && hasCompactLog(db) && rows.size() == 8 && rows[0] == "addUser|USER:1|SYSTEM|OK" &&
+            rows[1] == "addUser|USER:2|SYSTEM|FAIL_ERROR-SQLite:no such table: users" && rows[7] == "modUser|USER:4|alice|OK:" &&
+            strings == 7 && plan.find("LogCompactBySubject") != std::string::npos && plan.find("TEMP B-TREE") == std::string::npos &&
+            first == 3 && second == 2 && counted == 5 && enableCompactLog(db, compactLogOptions(), &errString) == 1 &&
+            enableLogPartitions(db, logPartitionOptions(), &errString) == -6);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 40: Компактный лог занимает меньше страниц, сжатые подробности читаются через представление
+    baseSQLTests.addTest("enableCompactLog - Fewer pages per record and compressed details", []() {
+        const char* files[] = {"plainLog.db", "plainLog.db-wal", "plainLog.db-shm", "compactLog.db", "compactLog.db-wal", "compactLog.db-shm"};
+        for (const char* name : files) std::remove(name);
+        std::string errString;
+        sqlite3* plain = nullptr;
+        sqlite3* compact = nullptr;
+        initBaseSQL(&plain, "plainLog.db", &errString);
+        initBaseSQL(&compact, "compactLog.db", &errString);
+        compactLogOptions options;
+        options.compressDetails = true;
+        int enabled = enableCompactLog(compact, options, &errString);
+        std::string detail;
+        for (int i = 0; i < 40; i++) detail += "constraint failed: users.userID; ";
+        const char* statuses[] = {"OK", "FAIL", "OK(WARN):table in an unexpected way"};
+        for (sqlite3* db : {plain, compact}) {
+            sqlite3_exec(db, "BEGIN", nullptr, nullptr, nullptr);
+            for (int i = 0; i < 3000; i++)
+                Log(db, i % 2 ? "getUserPrivilege" : "checkTable", "USER:" + std::to_string(i % 50), "SYSTEM", statuses[i % 3], nullptr);
+            Log(db, "addUser", "USER:1", "SYSTEM", "FAIL_ERROR-SQLite:" + detail, nullptr);
+            sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr);
+        }
+        bool compressed = false;
+        sqlite3_stmt* stmt = nullptr;
+        sqlite3_prepare_v2(compact, "SELECT typeof(detail) = 'blob' AND length(detail) < ?1 FROM LogCompact ORDER BY id DESC LIMIT 1", -1, &stmt, nullptr);
+        sqlite3_bind_int(stmt, 1, static_cast<int>(detail.size()));
+        if (sqlite3_step(stmt) == SQLITE_ROW) compressed = sqlite3_column_int(stmt, 0) != 0;
+        sqlite3_finalize(stmt);
+        closeBaseSQL(compact, &errString);
+        compact = nullptr;
+        sqlResult reopened;
+        initBaseSQL(&compact, "compactLog.db", &reopened);
+        std::string status;
+        sqlite3_prepare_v2(compact, "SELECT eventStatus FROM Log WHERE eventName = 'addUser'", -1, &stmt, nullptr);
+        if (sqlite3_step(stmt) == SQLITE_ROW) status = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        sqlite3_finalize(stmt);
+        int plainPages = std::stoi(pragmaValue(plain, "PRAGMA page_count"));
+        int compactPages = std::stoi(pragmaValue(compact, "PRAGMA page_count"));
+        bool success = (enabled == 0 && compressed && status == "FAIL_ERROR-SQLite:" + detail && reopened.ok() &&
+            hasCompactLog(compact) && compactPages < plainPages);
+        closeBaseSQL(plain, &errString);
+        closeBaseSQL(compact, &errString);
+        for (const char* name : files) std::remove(name);
+        return success;
+    });
+
+    // Тест 41: Состояние устройств читается из памяти, изменения публикуются событиями
+    baseSQLTests.addTest("setDeviceState - In-memory state and change events", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        initBaseSQL(&db, ":memory:", &errString);
+        int initialized = initDeviceSQL(db, &errString);
+        deviceInfo lamp{"lamp1", "Kitchen lamp", "lamp", {{"power", "bool"}, {"brightness", "int"}}};
+        int added = addDevice(db, lamp, &errString);
+        int duplicate = addDevice(db, lamp, nullptr);
+        int invalid = addDevice(db, deviceInfo{"lamp2", "", "lamp", {{"power", "color"}}}, nullptr);
+        eventDispatcher dispatcher;
+        std::vector<deviceStateChanged> changes;
+        dispatcher.subscribe<deviceStateChanged>([&changes](const deviceStateChanged& change) { changes.push_back(change); });
+        deviceStateOptions options;
+        options.events = &dispatcher;
+        int started = startDeviceState(db, options, &errString);
+        int changed = setDeviceState(db, "lamp1", "power", "1", &errString);
+        int same = setDeviceState(db, "lamp1", "power", "1", nullptr);
+        int brightness = setDeviceState(db, "lamp1", "brightness", "80", nullptr);
+        int wrongType = setDeviceState(db, "lamp1", "brightness", "bright", nullptr);
+        int unknown = setDeviceState(db, "lamp1", "color", "red", nullptr);
+        std::string power, noValue;
+        sqlResult read;
+        int readRc = getDeviceState(db, "lamp1", "power", &power, &read);
+        flushDeviceState(db);
+        std::string stored = pragmaValue(db, "SELECT value FROM deviceState WHERE deviceID = 'lamp1' AND capability = 'brightness'");
+        deviceInfo found;
+        int lookedUp = lookupDevice(db, "lamp1", &found, nullptr);
+        deviceStateStats stats = getDeviceStateStats(db);
+        bool success = (initialized == 0 && added == 0 && duplicate == -2 && invalid == -1 && started == 0 && changed == 0 &&
+            same == 1 && brightness == 0 && wrongType == -3 && unknown == -2 && readRc == 0 && power == "1" &&
+            std::string(read.detail ? read.detail : "") == "MEMORY" && stored == "80" && changes.size() == 2 &&
+            changes[0].capability == "power" && changes[0].value == "1" && changes[0].previous.empty() &&
+            lookedUp == 0 && found.kind == "lamp" && found.capabilities.size() == 2 && found.capabilities[1].valueType == "int" &&
+            stats.updates == 2 && stats.unchanged == 1 && stats.written == 2 && stats.dirty == 0);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 42: Изменения пишутся пачками, закрытие дописывает последние значения, удаление устройства убирает состояние
+    baseSQLTests.addTest("startDeviceState - Batched write-back and removal", []() {
+        const char* files[] = {"deviceState.db", "deviceState.db-wal", "deviceState.db-shm"};
+        for (const char* name : files) std::remove(name);
+        sqlite3* db = nullptr;
+        initBaseSQL(&db, "deviceState.db", nullptr);
+        initDeviceSQL(db, nullptr);
+        addDevice(db, deviceInfo{"sensor1", "Hall", "thermostat", {{"temperature", "real"}, {"mode", "text"}}}, nullptr);
+        deviceStateOptions options;
+        options.batchSize = 64;
+        options.flushIntervalMs = 10000;
+        startDeviceState(db, options, nullptr);
+        for (int i = 0; i < 500; i++)
+            setDeviceState(db, "sensor1", "temperature", std::to_string(20 + i % 50) + ".5", nullptr);
+        setDeviceState(db, "sensor1", "mode", "eco", nullptr);
+        deviceStateStats running = getDeviceStateStats(db);
+        closeBaseSQL(db, nullptr);
+
+        initBaseSQL(&db, "deviceState.db", nullptr);
+        std::string temperature, mode;
+        int fromTable = getDeviceState(db, "sensor1", "temperature", &temperature, nullptr);
+        getDeviceState(db, "sensor1", "mode", &mode, nullptr);
+        int removed = removeDevice(db, "sensor1", nullptr);
+        int removedAgain = removeDevice(db, "sensor1", nullptr);
+        std::string gone;
+        int afterRemoval = getDeviceState(db, "sensor1", "temperature", &gone, nullptr);
+        std::string rows = pragmaValue(db, "SELECT COUNT(*) FROM deviceState");
+        bool success = (running.updates == 501 && running.written < 501 && fromTable == 0 && temperature == "69.5" && mode == "eco" &&
+            removed == 0 && removedAgain == -1 && afterRemoval == -2 && rows == "0");
+        closeBaseSQL(db, nullptr);
+        for (const char* name : files) std::remove(name);
+        return success;
+    });
+
+    // Тест 43: Показания датчика сжимаются в чанки и читаются без потерь, старые показания отклоняются
+    baseSQLTests.addTest("recordReading - Compressed chunks decode bit-exact", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        initBaseSQL(&db, ":memory:", &errString);
+        timeSeriesOptions options;
+        options.chunkSize = 256;
+        int enabled = enableTimeSeries(db, options, &errString);
+        int again = enableTimeSeries(db, options, nullptr);
+        std::vector<sensorReading> written;
+        long long start = 1700000000000000LL;
+        for (int i = 0; i < 1000; i++)
+        {
+            long long time = start + i * 1000000LL + (i % 7 == 0 ? 1500 : 0);
+            double value = i == 500 ? -0.0 : 21.5 + (i % 10) * 0.25 - (i % 3) * 0.125;
+            written.push_back(sensorReading{time, value});
+        }
+        int recorded = recordReadings(db, "hall.temperature", written.data(), written.size(), &errString);
+        int older = recordReading(db, "hall.temperature", start, 1.0, nullptr);
+        int notEnabled = recordReading(nullptr, "x", 0, 0, nullptr);
+        int flushed = flushTimeSeries(db, &errString);
+        std::vector<sensorReading> read;
+        int queried = queryReadings(db, "hall.temperature", start, start + 1000 * 1000000LL, &read, &errString);
+        bool same = read.size() == written.size();
+        for (size_t i = 0; same && i < read.size(); i++)
+            same = read[i].timeMicros == written[i].timeMicros && std::memcmp(&read[i].value, &written[i].value, sizeof(double)) == 0;
+        std::vector<sensorReading> middle;
+        queryReadings(db, "hall.temperature", written[300].timeMicros, written[310].timeMicros, &middle, nullptr);
+        timeSeriesStats stats = getTimeSeriesStats(db);
+        std::string chunks = pragmaValue(db, "SELECT COUNT(*) FROM sensorChunks WHERE sensor = 'hall.temperature'");
+        bool success = (enabled == 0 && again == -2 && recorded == 0 && older == -2 && notEnabled == -1 && flushed == 0 &&
+            queried == 0 && same && middle.size() == 10 && middle[0].timeMicros == written[300].timeMicros &&
+            stats.readings == 1000 && stats.rejected == 1 && stats.buffered == 0 && chunks == "4" &&
+            stats.encodedBytes * 4 < written.size() * sizeof(sensorReading));
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 44: Прореживание по окнам совпадает с прямым подсчётом, closeBaseSQL дописывает буфер
+    baseSQLTests.addTest("downsampleReadings - Window aggregates over chunks and buffer", []() {
+        const char* files[] = {"timeSeries.db", "timeSeries.db-wal", "timeSeries.db-shm"};
+        for (const char* name : files) std::remove(name);
+        sqlite3* db = nullptr;
+        timeSeriesOptions options;
+        options.chunkSize = 100;
+        options.bucketMicros = 3600LL * 1000000;
+        initBaseSQL(&db, "timeSeries.db", nullptr);
+        enableTimeSeries(db, options, nullptr);
+        std::vector<sensorReading> all;
+        long long start = 36000LL * 1000000;
+        for (int i = 0; i < 1090; i++)
+        {
+            sensorReading reading{start + i * 10000000LL, std::sin(i * 0.05) * 10 + (i % 13)};
+            all.push_back(reading);
+            if (i < 1080)
+                recordReading(db, "hall.humidity", reading.timeMicros, reading.value, nullptr);
+        }
+        closeBaseSQL(db, nullptr);
+
+        initBaseSQL(&db, "timeSeries.db", nullptr);
+        enableTimeSeries(db, options, nullptr);
+        for (int i = 1080; i < 1090; i++)
+            recordReading(db, "hall.humidity", all[i].timeMicros, all[i].value, nullptr);
+        std::string crossing = pragmaValue(db, "SELECT COUNT(*) FROM sensorChunks WHERE bucket != firstTime / 3600000000 OR bucket != lastTime / 3600000000");
+        long long from = start + 123 * 1000000LL, to = start + 1090 * 10000000LL, window = 600LL * 1000000;
+        std::vector<windowStats> windows;
+        int rc = downsampleReadings(db, "hall.humidity", from, to, window, &windows, nullptr);
+        std::vector<windowStats> expected;
+        for (const sensorReading& reading : all)
+        {
+            if (reading.timeMicros < from || reading.timeMicros >= to)
+                continue;
+            long long windowStart = from + (reading.timeMicros - from) / window * window;
+            if (expected.empty() || expected.back().windowStart != windowStart)
+                expected.push_back(windowStats{windowStart, 0, reading.value, reading.value, 0});
+            windowStats& w = expected.back();
+            w.count++;
+            w.min = std::min(w.min, reading.value);
+            w.max = std::max(w.max, reading.value);
+            w.avg += reading.value;
+        }
+        bool same = windows.size() == expected.size();
+        for (size_t i = 0; same && i < windows.size(); i++)
+            same = windows[i].windowStart == expected[i].windowStart && windows[i].count == expected[i].count &&
+                windows[i].min == expected[i].min && windows[i].max == expected[i].max &&
+                std::fabs(windows[i].avg - expected[i].avg / expected[i].count) < 1e-9;
+        int badWindow = downsampleReadings(db, "hall.humidity", from, to, 0, &windows, nullptr);
+        bool success = (rc == 0 && same && expected.size() == 18 && crossing == "0" && badWindow == -1 &&
+            getTimeSeriesStats(db).buffered == 10);
+        closeBaseSQL(db, nullptr);
+        for (const char* name : files) std::remove(name);
+        return success;
+    });
+
+    // Тест 45: Кэш запросов не занимает trace-обработчик приложения, обычный sqlite3_close закрывает после clearStmtCache
+    baseSQLTests.addTest("sqlite3_close - Cached statements leave the trace callback to the application", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        initBaseSQL(&db, ":memory:", &errString);
+        int traced = 0;
+        sqlite3_trace_v2(db, SQLITE_TRACE_STMT, [](unsigned, void* ctx, void*, void*) { ++*static_cast<int*>(ctx); return 0; }, &traced);
+        for (int i = 0; i < 3; i++)
+            Log(db, "testEvent", "obj", "subj", "OK", &errString);
+        size_t cached = getStmtCacheStats(db).size;
+        int busy = sqlite3_close(db);
+        clearStmtCache(db);
+        int rc = sqlite3_close(db);
+        stmtCacheStats after = getStmtCacheStats(db);
+        return cached > 0 && traced >= 3 && busy == SQLITE_BUSY && rc == SQLITE_OK && after.size == 0 && after.hits == 0;
+    });
+
+    // Тест 46: Для базы в памяти фоновая запись лога не запускается, Log остаётся в транзакции вызывающего
+    baseSQLTests.addTest("startLogWriter - In-memory database keeps Log synchronous", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        sqlResult refused;
+        int started = startLogWriter(db, logWriterOptions(), &refused);
+        Log(db, "before", "obj", "subj", "OK", &errString);
+        sqlite3_exec(db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr);
+        for (int i = 0; i < 5; i++)
+            Log(db, "inside", "obj", "subj", "OK", &errString);
+        int inside = getLogCount(db);
+        sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+        bool success = (started == -4 && refused.code == RESULT_UNAVAILABLE && !hasLogWriter(db) && inside == 6 && getLogCount(db) == 1);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 47: Запись длиннее кольцевого буфера пишется в файл целиком, в порядке с остальными
+    baseSQLTests.addTest("textLog - Record larger than the ring buffer is written whole", []() {
+        closeTextLog(nullptr);
+        std::remove("textLogTest");
+        textLogOptions options;
+        options.path = "textLogTest";
+        options.bufferSize = 64;
+        openTextLog(options, nullptr);
+        std::string status(500, 'x');
+        textLog(nullptr, "before", "obj", "subj", "OK");
+        textLog(nullptr, "large", "obj", "subj", status);
+        textLog(nullptr, "after", "obj", "subj", "OK");
+        flushTextLog();
+        textLogStats stats = getTextLogStats();
+        closeTextLog(nullptr);
+        std::ifstream file("textLogTest");
+        std::vector<std::string> lines;
+        for (std::string line; std::getline(file, line);) lines.push_back(line);
+        bool success = (lines.size() == 3 && lines[0].find("\tbefore\t") != std::string::npos &&
+            lines[1].size() > 23 && lines[1].substr(23) == "\tlarge\tobj\tsubj\t" + status &&
+            lines[2].find("\tafter\t") != std::string::npos && stats.records == 3);
+        std::remove("textLogTest");
+        return success;
+    });
+
+    // Тест 48: Изменённые и удалённые между пачками строки не теряются при замене таблицы
+    baseSQLTests.addTest("migrateTable - Rows changed after their batch are copied again", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        sqlite3_exec(db, "CREATE TABLE Accounts (userID TEXT, privilege INTEGER, obsolete TEXT)", nullptr, nullptr, nullptr);
+        sqlite3_exec(db, "INSERT INTO Accounts VALUES('a', 1, 'x'), ('b', 2, 'x'), ('c', 3, 'x'), ('d', 4, 'x'), ('e', 5, 'x')",
+            nullptr, nullptr, nullptr);
+        tableInfo target("Accounts", {column("userID", "TEXT", COLUMN_UNIQUE), column("privilege", "INTEGER")});
+        migrationOptions options;
+        options.batchRows = 2;
+        options.progress = [](const migrationProgress&, void*) { return false; };
+        int first = migrateTable(db, target, options, nullptr);
+        sqlite3_exec(db, "UPDATE Accounts SET privilege = 100 WHERE userID = 'a'; DELETE FROM Accounts WHERE userID = 'b'; "
+            "INSERT INTO Accounts VALUES('f', 6, 'x')", nullptr, nullptr, nullptr);
+        options.progress = nullptr;
+        int second = migrateTable(db, target, options, &errString);
+        std::string rows = pragmaValue(db, "SELECT group_concat(userID || privilege, ',') FROM (SELECT * FROM Accounts ORDER BY userID)");
+        bool success = (first == 1 && second == 0 && rows == "a100,c3,d4,e5,f6" && checkTable(db, target, nullptr) == 0 &&
+            pragmaValue(db, "SELECT COUNT(*) FROM sqlite_master WHERE type = 'trigger'") == "0");
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 49: Неудачная запись состояния не считается выполненной, повтор дописывает значение
+    baseSQLTests.addTest("flushDeviceState - A failed write-back is reported and retried", []() {
+        const char* files[] = {"deviceRetry.db", "deviceRetry.db-wal", "deviceRetry.db-shm"};
+        for (const char* name : files) std::remove(name);
+        sqlite3* db = nullptr;
+        initBaseSQL(&db, "deviceRetry.db", nullptr);
+        initDeviceSQL(db, nullptr);
+        addDevice(db, deviceInfo{"lamp1", "Hall", "lamp", {{"power", "bool"}}}, nullptr);
+        deviceStateOptions options;
+        options.flushIntervalMs = 10000;
+        startDeviceState(db, options, nullptr);
+        sqlite3_exec(db, "DROP TABLE deviceState", nullptr, nullptr, nullptr);
+        setDeviceState(db, "lamp1", "power", "1", nullptr);
+        int failed = flushDeviceState(db);
+        deviceStateStats afterFailure = getDeviceStateStats(db);
+        initDeviceSQL(db, nullptr);
+        int retried = flushDeviceState(db);
+        setDeviceState(db, "lamp1", "power", "0", nullptr);
+        int next = flushDeviceState(db);
+        std::string stored = pragmaValue(db, "SELECT value FROM deviceState WHERE deviceID = 'lamp1' AND capability = 'power'");
+        bool success = (failed == -2 && afterFailure.failed == 1 && afterFailure.dirty == 1 && retried == 0 && next == 0 &&
+            stored == "0" && getDeviceStateStats(db).dirty == 0);
+        closeBaseSQL(db, nullptr);
+        for (const char* name : files) std::remove(name);
+        return success;
+    });
+
+    // Тест 50: Для базы в памяти состояние пишется только вызывающим и не попадает в его транзакцию
+    baseSQLTests.addTest("flushDeviceState - In-memory database writes back on the caller's thread", []() {
+        sqlite3* db = nullptr;
+        initBaseSQL(&db, ":memory:", nullptr);
+        initDeviceSQL(db, nullptr);
+        addDevice(db, deviceInfo{"lamp1", "Hall", "lamp", {{"power", "bool"}, {"brightness", "int"}}}, nullptr);
+        deviceStateOptions options;
+        options.flushIntervalMs = 10;
+        startDeviceState(db, options, nullptr);
+        sqlite3_exec(db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr);
+        setDeviceState(db, "lamp1", "power", "1", nullptr);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        int inTransaction = flushDeviceState(db);
+        std::string during = pragmaValue(db, "SELECT COUNT(*) FROM deviceState");
+        sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+        int flushed = flushDeviceState(db);
+        std::string power = pragmaValue(db, "SELECT value FROM deviceState WHERE capability = 'power'");
+        setDeviceState(db, "lamp1", "brightness", "40", nullptr);
+        int stopped = stopDeviceState(db, nullptr);
+        std::string brightness = pragmaValue(db, "SELECT value FROM deviceState WHERE capability = 'brightness'");
+        bool success = (inTransaction == -3 && during == "0" && flushed == 0 && power == "1" && stopped == 0 && brightness == "40");
+        closeBaseSQL(db, nullptr);
+        return success;
+    });
+
+    // Тест 51: По версии события подписчик находит текущее значение при параллельных изменениях
+    baseSQLTests.addTest("setDeviceState - Event versions order concurrent changes", []() {
+        sqlite3* db = nullptr;
+        initBaseSQL(&db, ":memory:", nullptr);
+        initDeviceSQL(db, nullptr);
+        addDevice(db, deviceInfo{"dimmer1", "Hall", "dimmer", {{"level", "int"}}}, nullptr);
+        eventDispatcher dispatcher;
+        std::mutex seenLock;
+        unsigned long long lastVersion = 0;
+        std::string lastValue;
+        size_t events = 0;
+        dispatcher.subscribe<deviceStateChanged>([&](const deviceStateChanged& change) {
+            std::lock_guard<std::mutex> guard(seenLock);
+            events++;
+            if (change.version > lastVersion) {
+                lastVersion = change.version;
+                lastValue = change.value;
+            }
+        });
+        deviceStateOptions options;
+        options.events = &dispatcher;
+        startDeviceState(db, options, nullptr);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([db, t]() {
+                for (int i = 0; i < 200; i++) setDeviceState(db, "dimmer1", "level", std::to_string(t * 1000 + i), nullptr);
+            });
+        }
+        for (std::thread& thread : threads) thread.join();
+        std::string current;
+        getDeviceState(db, "dimmer1", "level", &current, nullptr);
+        deviceStateStats stats = getDeviceStateStats(db);
+        bool success = (events == stats.updates && lastVersion == stats.updates && lastValue == current);
+        closeBaseSQL(db, nullptr);
+        return success;
+    });
+
+    // Тест 52: Старое показание отклоняется и после записи чанка, и после повторного открытия базы
+    baseSQLTests.addTest("recordReading - Older readings rejected after a flush and a reopen", []() {
+        const char* files[] = {"timeSeriesOrder.db", "timeSeriesOrder.db-wal", "timeSeriesOrder.db-shm"};
+        for (const char* name : files) std::remove(name);
+        sqlite3* db = nullptr;
+        timeSeriesOptions options;
+        options.chunkSize = 4;
+        initBaseSQL(&db, "timeSeriesOrder.db", nullptr);
+        enableTimeSeries(db, options, nullptr);
+        for (long long t = 1000; t < 1004; t++)
+            recordReading(db, "door", t, 1.0, nullptr);
+        long long buffered = getTimeSeriesStats(db).buffered;
+        int afterChunk = recordReading(db, "door", 10, 1.0, nullptr);
+        closeBaseSQL(db, nullptr);
+        initBaseSQL(&db, "timeSeriesOrder.db", nullptr);
+        enableTimeSeries(db, options, nullptr);
+        int afterReopen = recordReading(db, "door", 500, 1.0, nullptr);
+        int newer = recordReading(db, "door", 1003, 2.0, nullptr);
+        int otherSensor = recordReading(db, "window", 10, 1.0, nullptr);
+        std::vector<sensorReading> read;
+        queryReadings(db, "door", 0, 5000, &read, nullptr);
+        bool ordered = read.size() == 5;
+        for (size_t i = 1; ordered && i < read.size(); i++)
+            ordered = read[i - 1].timeMicros <= read[i].timeMicros;
+        bool success = (buffered == 0 && afterChunk == -2 && afterReopen == -2 && newer == 0 && otherSensor == 0 && ordered &&
+            getTimeSeriesStats(db).rejected == 1);
+        closeBaseSQL(db, nullptr);
+        for (const char* name : files) std::remove(name);
+        return success;
+    });
+
+    // Тест 53: Откат сброса оставляет показания в буфере, повторный сброс пишет каждое один раз
+    baseSQLTests.addTest("flushTimeSeries - Rolled back flush keeps the readings buffered", []() {
+        sqlite3* db = nullptr;
+        initBaseSQL(&db, ":memory:", nullptr);
+        enableTimeSeries(db, timeSeriesOptions(), nullptr);
+        for (int s = 0; s < 10; s++)
+            for (long long t = 0; t < 5; t++)
+                recordReading(db, "sensor" + std::to_string(s), 1000 + t, double(s), nullptr);
+        sqlite3_exec(db, "CREATE TRIGGER refuseSensor5 BEFORE INSERT ON sensorChunks WHEN NEW.sensor = 'sensor5' "
+            "BEGIN SELECT RAISE(ABORT, 'refused'); END", nullptr, nullptr, nullptr);
+        int failed = flushTimeSeries(db, nullptr);
+        timeSeriesStats afterFailure = getTimeSeriesStats(db);
+        std::string rowsAfterFailure = pragmaValue(db, "SELECT COUNT(*) FROM sensorChunks");
+        sqlite3_exec(db, "DROP TRIGGER refuseSensor5; BEGIN", nullptr, nullptr, nullptr);
+        int inTransaction = flushTimeSeries(db, nullptr);
+        sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+        int flushed = flushTimeSeries(db, nullptr);
+        bool complete = true;
+        for (int s = 0; s < 10; s++) {
+            std::vector<sensorReading> read;
+            queryReadings(db, "sensor" + std::to_string(s), 0, 2000, &read, nullptr);
+            complete = complete && read.size() == 5;
+        }
+        timeSeriesStats stats = getTimeSeriesStats(db);
+        bool success = (failed == -3 && afterFailure.buffered == 50 && afterFailure.chunks == 0 && rowsAfterFailure == "0" &&
+            inTransaction == -5 && flushed == 0 && complete && stats.buffered == 0 && stats.chunks == 10 &&
+            pragmaValue(db, "SELECT COUNT(*) FROM sensorChunks") == "10");
+        closeBaseSQL(db, nullptr);
+        return success;
+    });
+
+    // Тест 54: Размер корзины хранится в базе: запрос без включения находит чанки, другой размер отклоняется
+    baseSQLTests.addTest("enableTimeSeries - bucketMicros is stored with the chunks", []() {
+        const char* files[] = {"timeSeriesBucket.db", "timeSeriesBucket.db-wal", "timeSeriesBucket.db-shm"};
+        for (const char* name : files) std::remove(name);
+        sqlite3* db = nullptr;
+        timeSeriesOptions minute;
+        minute.chunkSize = 16;
+        minute.bucketMicros = 60LL * 1000000;
+        initBaseSQL(&db, "timeSeriesBucket.db", nullptr);
+        enableTimeSeries(db, minute, nullptr);
+        long long start = 7200LL * 1000000;
+        for (int i = 0; i < 100; i++)
+            recordReading(db, "boiler", start + i * 5000000LL, i, nullptr);
+        closeBaseSQL(db, nullptr);
+        initBaseSQL(&db, "timeSeriesBucket.db", nullptr);
+        std::vector<sensorReading> read;
+        int queried = queryReadings(db, "boiler", start, start + 500 * 1000000LL, &read, nullptr);
+        std::vector<windowStats> windows;
+        int downsampled = downsampleReadings(db, "boiler", start, start + 500 * 1000000LL, 100LL * 1000000, &windows, nullptr);
+        sqlResult refused;
+        int hourly = enableTimeSeries(db, timeSeriesOptions(), &refused);
+        int same = enableTimeSeries(db, minute, nullptr);
+        bool success = (queried == 0 && read.size() == 100 && downsampled == 0 && windows.size() == 5 && windows[0].count == 20 &&
+            hourly == -5 && refused.code == RESULT_CONFLICT && same == 0);
+        closeBaseSQL(db, nullptr);
+        for (const char* name : files) std::remove(name);
+        return success;
+    });
+
+    // Тест 55: Полный чанк внутри транзакции вызывающего не пишется, её откат не теряет показания
+    baseSQLTests.addTest("recordReading - Full chunks wait out a transaction of the caller", []() {
+        sqlite3* db = nullptr;
+        timeSeriesOptions options;
+        options.chunkSize = 4;
+        initBaseSQL(&db, ":memory:", nullptr);
+        enableTimeSeries(db, options, nullptr);
+        sqlite3_exec(db, "BEGIN", nullptr, nullptr, nullptr);
+        for (long long t = 0; t < 4; t++)
+            recordReading(db, "sensor", 1000 + t, double(t), nullptr);
+        std::string rowsInTransaction = pragmaValue(db, "SELECT COUNT(*) FROM sensorChunks");
+        sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+        std::vector<sensorReading> afterRollback;
+        queryReadings(db, "sensor", 0, 2000, &afterRollback, nullptr);
+        timeSeriesStats held = getTimeSeriesStats(db);
+        for (long long t = 4; t < 8; t++)
+            recordReading(db, "sensor", 1000 + t, double(t), nullptr);
+        std::vector<sensorReading> written;
+        queryReadings(db, "sensor", 0, 2000, &written, nullptr);
+        timeSeriesStats stats = getTimeSeriesStats(db);
+        bool success = (rowsInTransaction == "0" && afterRollback.size() == 4 && held.buffered == 4 && held.chunks == 0 &&
+            written.size() == 8 && written[7].timeMicros == 1007 && stats.buffered == 0 && stats.chunks == 2 &&
+            pragmaValue(db, "SELECT COUNT(*) FROM sensorChunks") == "2");
+        closeBaseSQL(db, nullptr);
+        return success;
+    });
+
+    // Тест 56: Удалённое и снова добавленное устройство не получает в базу пустые значения
+    baseSQLTests.addTest("removeDevice - A device added again does not write back stale values", []() {
+        sqlite3* db = nullptr;
+        initBaseSQL(&db, ":memory:", nullptr);
+        initDeviceSQL(db, nullptr);
+        deviceInfo lamp{"lamp1", "Hall", "lamp", {{"power", "bool"}, {"brightness", "int"}}};
+        addDevice(db, lamp, nullptr);
+        startDeviceState(db, deviceStateOptions(), nullptr);
+        setDeviceState(db, "lamp1", "power", "1", nullptr);
+        setDeviceState(db, "lamp1", "brightness", "40", nullptr);
+        int removed = removeDevice(db, "lamp1", nullptr);
+        int added = addDevice(db, lamp, nullptr);
+        size_t dirty = getDeviceStateStats(db).dirty;
+        int flushed = flushDeviceState(db);
+        std::string value;
+        int state = getDeviceState(db, "lamp1", "power", &value, nullptr);
+        bool success = (removed == 0 && added == 0 && dirty == 0 && flushed == 0 && state == 1 &&
+            pragmaValue(db, "SELECT COUNT(*) FROM deviceState") == "0");
+        closeBaseSQL(db, nullptr);
+        return success;
+    });
+
+    // Тест 57: Соединения к одному файлу используют одно хранилище состояния, оно живёт до последнего
+    baseSQLTests.addTest("startDeviceState - One store per database file", []() {
+        const char* files[] = {"deviceShared.db", "deviceShared.db-wal", "deviceShared.db-shm"};
+        for (const char* name : files) std::remove(name);
+        sqlite3 *db = nullptr, *other = nullptr;
+        initBaseSQL(&db, "deviceShared.db", nullptr);
+        initDeviceSQL(db, nullptr);
+        initBaseSQL(&other, "deviceShared.db", nullptr);
+        addDevice(db, deviceInfo{"lamp1", "Hall", "lamp", {{"power", "bool"}}}, nullptr);
+        deviceStateOptions options;
+        options.flushIntervalMs = 10;
+        int first = startDeviceState(db, options, nullptr);
+        sqlResult sharedResult;
+        int second = startDeviceState(other, options, &sharedResult);
+        int again = startDeviceState(other, options, nullptr);
+        setDeviceState(db, "lamp1", "power", "1", nullptr);
+        std::string seen;
+        getDeviceState(other, "lamp1", "power", &seen, nullptr);
+        int flushed = flushDeviceState(other);
+        std::string written = pragmaValue(other, "SELECT value FROM deviceState WHERE capability = 'power'");
+        int detached = stopDeviceState(db, nullptr);
+        int changed = setDeviceState(other, "lamp1", "power", "0", nullptr);
+        closeBaseSQL(other, nullptr);
+        std::string last = pragmaValue(db, "SELECT value FROM deviceState WHERE capability = 'power'");
+        bool success = (first == 0 && second == 0 && std::string(sharedResult.detail ? sharedResult.detail : "") == "SHARED" &&
+            again == -2 && seen == "1" && flushed == 0 && written == "1" && detached == 0 && changed == 0 && last == "0");
+        closeBaseSQL(db, nullptr);
+        for (const char* name : files) std::remove(name);
+        return success;
+    });
+
+    // Тест 58: Кэш запросов ограничен, вытесняется давно не использованный и не занятый запрос
+    baseSQLTests.addTest("prepareCached - Bounded cache evicts the least recently used statement", []() {
+        sqlite3* db = nullptr;
+        sqlite3_open(":memory:", &db);
+        cachedStmt borrowed;
+        prepareCached(db, "SELECT 0", &borrowed);
+        for (int i = 1; i <= 200; i++) {
+            cachedStmt res;
+            prepareCached(db, ("SELECT " + std::to_string(i)).c_str(), &res);
+            res.release();
+            if (i > 100) {
+                prepareCached(db, "SELECT 1", &res); // остаётся самым свежим
+                res.release();
+            }
+        }
+        stmtCacheStats stats = getStmtCacheStats(db);
+        bool stepped = sqlite3_step(borrowed) == SQLITE_ROW && sqlite3_column_int(borrowed, 0) == 0;
+        borrowed.release();
+        cachedStmt recent;
+        prepareCached(db, "SELECT 1", &recent);
+        recent.release();
+        bool success = (stats.size == 128 && stats.evictions == 201 - 128 && stepped && getStmtCacheStats(db).hits == stats.hits + 1);
+        return closeBaseSQL(db, nullptr) == 0 && success;
+    });
+
+    // Тест 59: Повторно копируются только изменённые строки, в том числе когда колонка становится INTEGER PRIMARY KEY
+    baseSQLTests.addTest("migrateTable - Only the changed rows are copied again", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        sqlite3_exec(db, "CREATE TABLE Items (code INTEGER, name TEXT, obsolete TEXT);"
+            "INSERT INTO Items VALUES(10, 'a', 'x'), (20, 'b', 'x'), (30, 'c', 'x'), (40, 'd', 'x'), (50, 'e', 'x'), (60, 'f', 'x')",
+            nullptr, nullptr, nullptr);
+        tableInfo target("Items", {column("code", "INTEGER", COLUMN_PRIMARY_KEY), column("name", "TEXT")});
+        migrationOptions options;
+        options.batchRows = 2;
+        options.progress = [](const migrationProgress& progress, void*) { return progress.batches < 2; };
+        int first = migrateTable(db, target, options, nullptr);
+        // Считаем строки, которые попадают в копию после паузы
+        sqlite3_exec(db, "CREATE TABLE copies (n INTEGER); INSERT INTO copies VALUES(0);"
+            "CREATE TRIGGER countCopies AFTER INSERT ON Items_migrate BEGIN UPDATE copies SET n = n + 1; END", nullptr, nullptr, nullptr);
+        sqlite3_exec(db, "UPDATE Items SET name = 'A' WHERE code = 10; UPDATE Items SET code = 25 WHERE code = 20; "
+            "DELETE FROM Items WHERE code = 30; INSERT INTO Items VALUES(70, 'g', 'x')", nullptr, nullptr, nullptr);
+        options.progress = nullptr;
+        int second = migrateTable(db, target, options, &errString);
+        std::string rows = pragmaValue(db, "SELECT group_concat(code || name, ',') FROM (SELECT * FROM Items ORDER BY code)");
+        std::string copies = pragmaValue(db, "SELECT n FROM copies");
+        bool success = (first == 1 && second == 0 && rows == "10A,25b,40d,50e,60f,70g" && copies == "5" &&
+            pragmaValue(db, "SELECT MAX(rowid) FROM Items") == "70" && checkTable(db, target, nullptr) == 0 &&
+            pragmaValue(db, "SELECT COUNT(*) FROM schemaMigrationRows") == "0");
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 60: После остановки на исходном соединении пачки общего писателя лога следуют настройкам оставшегося
+    baseSQLTests.addTest("stopLogWriter - A shared writer follows a remaining connection", []() {
+        const char* files[] = {"logWriterShared.db", "logWriterShared.db-wal", "logWriterShared.db-shm"};
+        for (const char* name : files) std::remove(name);
+        sqlite3 *db = nullptr, *other = nullptr;
+        initBaseSQL(&db, "logWriterShared.db", nullptr);
+        initBaseSQL(&other, "logWriterShared.db", nullptr);
+        startLogWriter(db, logWriterOptions(), nullptr);
+        shareLogWriter(other, db, nullptr);
+        enableLogPartitions(other, logPartitionOptions(), nullptr);
+        flushLogWriter(other);
+        std::string before = pragmaValue(db, "SELECT COUNT(*) FROM Log");
+        unsigned long long writtenBefore = getLogWriterStats(other).written;
+        int stopped = stopLogWriter(db, nullptr);
+        for (int i = 0; i < 10; i++)
+            Log(other, "testEvent", "obj" + std::to_string(i), "subj", "OK", nullptr);
+        flushLogWriter(other);
+        logWriterStats stats = getLogWriterStats(other);
+        bool success = (stopped == 0 && !hasLogWriter(db) && hasLogWriter(other) && stats.written == writtenBefore + 10 && stats.failed == 0 &&
+            pragmaValue(db, "SELECT COUNT(*) FROM Log") == before && getLogPartitionStats(other).created == 1);
+        closeBaseSQL(other, nullptr);
+        closeBaseSQL(db, nullptr);
+        for (const char* name : files) std::remove(name);
+        return success;
+    });
+
+    // Тест 61: closeConnectionPool закрывает соединение писателя лога вместе с последним читателем
+    baseSQLTests.addTest("closeConnectionPool - The readers' log writer closes with the last reader", []() {
+        const char* files[] = {"poolLogClose.db", "poolLogClose.db-wal", "poolLogClose.db-shm"};
+        for (const char* name : files) std::remove(name);
+        std::shared_ptr<connectionPool> pool;
+        connectionPoolOptions options;
+        options.readers = 2;
+        openConnectionPool("poolLogClose.db", options, &pool, nullptr);
+        pooledConnection reader;
+        checkoutConnection(pool, CONNECTION_READ, &reader, nullptr);
+        Log(reader, "testEvent", "obj", "subj", "OK", nullptr);
+        closeConnectionPool(pool, nullptr);
+        // Выйти из WAL может только единственное соединение к файлу
+        sqlite3* db = nullptr;
+        sqlite3_open("poolLogClose.db", &db);
+        std::string whileReading = pragmaValue(db, "PRAGMA journal_mode = DELETE");
+        reader.release();
+        std::string afterRelease = pragmaValue(db, "PRAGMA journal_mode = DELETE");
+        std::string logged = pragmaValue(db, "SELECT COUNT(*) FROM Log WHERE eventName = 'testEvent'");
+        bool success = (whileReading != "delete" && afterRelease == "delete" && logged == "1");
         sqlite3_close(db);
+        pool.reset();
+        for (const char* name : files) std::remove(name);
+        return success;
+    });
+
+    // Тест 62: повторные initDeviceSQL и enableTimeSeries сверяют свои таблицы одним вызовом checkTables
+    baseSQLTests.addTest("initDeviceSQL - Existing tables are checked together by checkTables", []() {
+        std::remove("test_check_tables_init.db");
+        sqlite3* db = nullptr;
+        initBaseSQL(&db, "test_check_tables_init.db", nullptr);
+        initDeviceSQL(db, nullptr);
+        enableTimeSeries(db, timeSeriesOptions(), nullptr);
+        closeBaseSQL(db, nullptr);
+        db = nullptr;
+        initBaseSQL(&db, "test_check_tables_init.db", nullptr);
+        std::string devices, timeSeries;
+        int again = initDeviceSQL(db, &devices);
+        int enabled = enableTimeSeries(db, timeSeriesOptions(), &timeSeries);
+        bool success = (again == 0 && enabled == 0 &&
+            devices.find("_checkTables-OK_") != std::string::npos && devices.find("_checkTable-") == std::string::npos &&
+            timeSeries.find("_checkTables-OK_") != std::string::npos && timeSeries.find("_checkTable-") == std::string::npos);
+        closeBaseSQL(db, nullptr);
+        std::remove("test_check_tables_init.db");
         return success;
     });
 }
@@ -393,7 +1852,7 @@ void setupTgSQLTests(TestGroup& tgSQLTests) {
         int count = userCount(db, "user1", &errString);
         int directCount = getUserCount(db, "user1");
         bool success = (count == 0 && errString.find("_userCount-OK") != std::string::npos && directCount == 0);
-        sqlite3_close(db);
+        closeBaseSQL(db, &errString);
         return success;
     });
 
@@ -408,7 +1867,7 @@ void setupTgSQLTests(TestGroup& tgSQLTests) {
         int count = userCount(db, "user1", &errString);
         int directCount = getUserCount(db, "user1");
         bool success = (count == 1 && errString.find("_userCount-OK") != std::string::npos && directCount == 1);
-        sqlite3_close(db);
+        closeBaseSQL(db, &errString);
         return success;
     });
 
@@ -423,7 +1882,7 @@ void setupTgSQLTests(TestGroup& tgSQLTests) {
         int privilege = getUserPrivilege(db, "user1", &errString);
         int directPrivilege = getUserPrivilegeDirect(db, "user1");
         bool success = (privilege == 150 && errString.find("_getUserPrivilege-OK") != std::string::npos && directPrivilege == 150);
-        sqlite3_close(db);
+        closeBaseSQL(db, &errString);
         return success;
     });
 
@@ -437,7 +1896,7 @@ void setupTgSQLTests(TestGroup& tgSQLTests) {
         int privilege = getUserPrivilege(db, "user1", &errString);
         int directPrivilege = getUserPrivilegeDirect(db, "user1");
         bool success = (privilege == -1 && errString.find("_getUserPrivilege-FAIL:user not found") != std::string::npos && directPrivilege == -1);
-        sqlite3_close(db);
+        closeBaseSQL(db, &errString);
         return success;
     });
 
@@ -452,7 +1911,7 @@ void setupTgSQLTests(TestGroup& tgSQLTests) {
         int result = addUser(db, "user1", "admin", 100, &errString);
         int count = getUserCount(db, "user1");
         bool success = (result == 0 && errString.find("_addUser-OK") != std::string::npos && count == 1);
-        sqlite3_close(db);
+        closeBaseSQL(db, &errString);
         return success;
     });
 
@@ -467,7 +1926,7 @@ void setupTgSQLTests(TestGroup& tgSQLTests) {
         int result = addUser(db, "user1", "lowPriv", 100, &errString);
         int count = getUserCount(db, "user1");
         bool success = (result == -5 && errString.find("_addUser-FAIL:the user does not have enough privileges") != std::string::npos && count == 0);
-        sqlite3_close(db);
+        closeBaseSQL(db, &errString);
         return success;
     });
 
@@ -483,7 +1942,7 @@ void setupTgSQLTests(TestGroup& tgSQLTests) {
         int result = modUser(db, "user1", "admin", 150, &errString);
         int newPrivilege = getUserPrivilegeDirect(db, "user1");
         bool success = (result == 0 && errString.find("_modUser-OK") != std::string::npos && newPrivilege == 150);
-        sqlite3_close(db);
+        closeBaseSQL(db, &errString);
         return success;
     });
 
@@ -499,7 +1958,7 @@ void setupTgSQLTests(TestGroup& tgSQLTests) {
         int result = modUser(db, "user1", "lowPriv", 150, &errString);
         int privilege = getUserPrivilegeDirect(db, "user1");
         bool success = (result == -6 && errString.find("_modUser-FAIL:the user does not have enough privileges") != std::string::npos && privilege == 100);
-        sqlite3_close(db);
+        closeBaseSQL(db, &errString);
         return success;
     });
 
@@ -515,7 +1974,7 @@ void setupTgSQLTests(TestGroup& tgSQLTests) {
         int result = deleteUser(db, "user1", "admin", &errString);
         int count = getUserCount(db, "user1");
         bool success = (result == 0 && errString.find("_deleteUser-OK") != std::string::npos && count == 0);
-        sqlite3_close(db);
+        closeBaseSQL(db, &errString);
         return success;
     });
 
@@ -531,7 +1990,7 @@ void setupTgSQLTests(TestGroup& tgSQLTests) {
         int result = deleteUser(db, "user1", "lowPriv", &errString);
         int count = getUserCount(db, "user1");
         bool success = (result == -6 && errString.find("_deleteUser-FAIL:the user does not have enough privileges") != std::string::npos && count == 1);
-        sqlite3_close(db);
+        closeBaseSQL(db, &errString);
         return success;
     });
 
@@ -545,7 +2004,582 @@ void setupTgSQLTests(TestGroup& tgSQLTests) {
         int result = initTgSQL(db, &errString);
         bool usersTableExists = tableExists(db, "users");
         bool success = (result == 0 && errString.find("_initTgSQL-OK") != std::string::npos && usersTableExists);
-        sqlite3_close(db);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 12: Пакетный поиск пользователей одним запросом
+    tgSQLTests.addTest("lookupUsers - Existence, duplicates and privilege in one query", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        sqlite3_exec(db, CREATE_USERS_TABLE, nullptr, nullptr, nullptr);
+        insertUser(db, "admin", 200);
+        insertUser(db, "twin", 10);
+        insertUser(db, "twin", 20);
+        std::vector<userLookup> users;
+        int result = lookupUsers(db, {"admin", "missing", "twin"}, &users, &errString);
+        bool success = (result == 0 && users.size() == 3 &&
+            users[0].count == 1 && users[0].privilege == 200 &&
+            users[1].count == 0 && users[1].privilege == -1 &&
+            users[2].count == 2 && getLogCount(db) == 0);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 13: Одиночный поиск пользователя
+    tgSQLTests.addTest("lookupUser - Single user lookup", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        sqlite3_exec(db, CREATE_USERS_TABLE, nullptr, nullptr, nullptr);
+        insertUser(db, "user1", 150);
+        userLookup found, missing;
+        bool success = (lookupUser(db, "user1", &found, &errString) == 0 && found.count == 1 && found.privilege == 150 &&
+            lookupUser(db, "user2", &missing, &errString) == 0 && missing.count == 0);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 14: modUser пишет в лог одну запись вместо цепочки проверок
+    tgSQLTests.addTest("modUser - Single audit record per operation", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        sqlite3_exec(db, CREATE_USERS_TABLE, nullptr, nullptr, nullptr);
+        insertUser(db, "admin", 200);
+        insertUser(db, "user1", 100);
+        int result = modUser(db, "user1", "admin", 120, &errString);
+        bool success = (result == 0 && getLogCount(db) == 1 && getUserPrivilegeDirect(db, "user1") == 120);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 15: initTgSQL переносит старую таблицу users на схему с UNIQUE(userID)
+    tgSQLTests.addTest("initTgSQL - Migrates legacy users table in place", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        sqlite3_exec(db, CREATE_USERS_TABLE, nullptr, nullptr, nullptr);
+        insertUser(db, "admin", 200);
+        insertUser(db, "twin", 50);
+        insertUser(db, "twin", 20);
+        int result = initTgSQL(db, &errString);
+        std::string plan;
+        sqlite3_stmt* stmt;
+        sqlite3_prepare_v2(db, "EXPLAIN QUERY PLAN SELECT privilege FROM users WHERE userID = 'admin'", -1, &stmt, nullptr);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            plan += reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+        }
+        sqlite3_finalize(stmt);
+        bool success = (result == 0 && errString.find("_initTgSQL-OK(WARN):the table has been migrated") != std::string::npos &&
+            checkTable(db, usersInfo, &errString) == 0 && getUserCount(db, "twin") == 1 && getUserPrivilegeDirect(db, "twin") == 20 &&
+            getUserPrivilegeDirect(db, "admin") == 200 && plan.find("USING INDEX") != std::string::npos);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 16: initTgSQL создаёт таблицу users, если её нет
+    tgSQLTests.addTest("initTgSQL - Creates missing users table", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        int result = initTgSQL(db, &errString);
+        bool success = (result == 0 && tableExists(db, "users") && checkTable(db, usersInfo, &errString) == 0);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 17: Кэш привилегий обслуживает повторные запросы и обновляется при записи
+    tgSQLTests.addTest("enablePrivilegeCache - Hits and write-through on modUser/deleteUser", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        sqlite3_exec(db, CREATE_USERS_TABLE, nullptr, nullptr, nullptr);
+        insertUser(db, "admin", 200);
+        insertUser(db, "user1", 100);
+        enablePrivilegeCache(db, 16, &errString);
+        int first = getUserPrivilege(db, "user1", &errString);
+        sqlite3_exec(db, "UPDATE users SET privilege = 1 WHERE userID = 'user1'", nullptr, nullptr, nullptr);
+        int cached = getUserPrivilege(db, "user1", &errString); // изменение в обход TgSQL не видно
+        modUser(db, "user1", "admin", 150, &errString);
+        int updated = getUserPrivilege(db, "user1", &errString);
+        deleteUser(db, "user1", "admin", &errString);
+        int deleted = getUserPrivilege(db, "user1", &errString);
+        privilegeCacheStats stats = getPrivilegeCacheStats(db);
+        bool success = (first == 100 && cached == 100 && updated == 150 && deleted == -1 &&
+            stats.hits == 2 && stats.misses == 2 && errString.find("_getUserPrivilege-OK(CACHED)") != std::string::npos);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 18: Вытеснение давно не использованных записей
+    tgSQLTests.addTest("enablePrivilegeCache - LRU eviction", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        sqlite3_exec(db, CREATE_USERS_TABLE, nullptr, nullptr, nullptr);
+        insertUser(db, "a", 1);
+        insertUser(db, "b", 2);
+        insertUser(db, "c", 3);
+        enablePrivilegeCache(db, 2, &errString);
+        getUserPrivilege(db, "a", &errString);
+        getUserPrivilege(db, "b", &errString);
+        getUserPrivilege(db, "a", &errString); // "b" становится самым старым
+        getUserPrivilege(db, "c", &errString);
+        int hitsBefore = getPrivilegeCacheStats(db).hits;
+        getUserPrivilege(db, "a", &errString);
+        getUserPrivilege(db, "b", &errString);
+        privilegeCacheStats stats = getPrivilegeCacheStats(db);
+        bool success = (hitsBefore == 1 && stats.hits == 2 && stats.evictions == 2 && stats.size == 2 && stats.capacity == 2);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 19: Коды ошибок TgSQL и причина ошибки вложенного вызова
+    tgSQLTests.addTest("sqlResult - TgSQL error codes", []() {
+        sqlite3* db = nullptr;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        sqlResult noTable;
+        int lookupFailed = modUser(db, "user1", "admin", 150, &noTable);
+        sqlite3_exec(db, CREATE_USERS_TABLE, nullptr, nullptr, nullptr);
+        insertUser(db, "admin", 50);
+        insertUser(db, "user1", 100);
+        sqlResult denied;
+        int result = modUser(db, "user1", "admin", 150, &denied);
+        sqlResult missing;
+        getUserPrivilege(db, "ghost", &missing);
+        bool success = (lookupFailed == -2 && noTable.code == RESULT_SQLITE_ERROR && noTable.sqliteRc == SQLITE_ERROR &&
+            std::string(noTable.callee) == "lookupUsers" && noTable.message() == "_modUser-FAIL_ERROR-lookupUsers:-1" &&
+            result == -6 && denied.code == RESULT_NO_PRIVILEGE && missing.code == RESULT_NOT_FOUND &&
+            missing.message() == "_getUserPrivilege-FAIL:user not found");
+        closeBaseSQL(db, nullptr);
+        return success;
+    });
+
+    // Тест 20: Пакетный импорт с отчётом о конфликтах по строкам
+    tgSQLTests.addTest("importUsers - Single transaction with per-row conflicts", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        initTgSQL(db, &errString);
+        insertUser(db, "admin", 200);
+        insertUser(db, "taken", 10);
+        int logBefore = getLogCount(db);
+        std::vector<userRecord> users;
+        for (int i = 0; i < 1000; i++) {
+            users.push_back({"bulk" + std::to_string(i), i % 200});
+        }
+        users[10] = {"taken", 5};
+        users[20] = {"bulk5", 5};
+        users[30] = {"boss", 250};
+        users[40] = {"", 1};
+        std::vector<userImportConflict> conflicts;
+        sqlResult result;
+        int inserted = importUsers(db, users, "admin", &conflicts, &result);
+        bool success = (inserted == 996 && result.code == RESULT_WARN && conflicts.size() == 4 &&
+            conflicts[0].row == 10 && conflicts[0].status == IMPORT_IN_USE &&
+            conflicts[1].row == 20 && conflicts[1].status == IMPORT_IN_USE &&
+            conflicts[2].row == 30 && conflicts[2].status == IMPORT_NO_PRIVILEGE &&
+            conflicts[3].row == 40 && conflicts[3].status == IMPORT_INVALID &&
+            getUserPrivilegeDirect(db, "taken") == 10 && getUserPrivilegeDirect(db, "bulk999") == 999 % 200 &&
+            getLogCount(db) == logBefore + 1);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 21: Импорт от субъекта без привилегий ничего не добавляет
+    tgSQLTests.addTest("importUsers - Subject without privileges", []() {
+        sqlite3* db = nullptr;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        sqlite3_exec(db, CREATE_USERS_TABLE, nullptr, nullptr, nullptr);
+        insertUser(db, "user1", 50);
+        std::vector<userRecord> users = {{"a", 1}, {"b", 2}};
+        sqlResult denied, missing;
+        int result = importUsers(db, users, "user1", nullptr, &denied);
+        int noSubject = importUsers(db, users, "ghost", nullptr, &missing);
+        bool success = (result == -5 && denied.code == RESULT_NO_PRIVILEGE && noSubject == -2 &&
+            missing.code == RESULT_NOT_FOUND && getUserCount(db, "a") == 0 && getUserCount(db, "b") == 0);
+        closeBaseSQL(db, nullptr);
+        return success;
+    });
+
+    // Тест 22: Потоковый экспорт возвращает импортированных пользователей и останавливается по требованию
+    tgSQLTests.addTest("exportUsers - Streams users and stops early", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        initTgSQL(db, &errString);
+        insertUser(db, "admin", 200);
+        std::vector<userRecord> users = {{"u1", 10}, {"u2", 20}, {"u3", 30}};
+        importUsers(db, users, "admin", nullptr, &errString);
+        std::vector<userRecord> exported;
+        int all = exportUsers(db, "admin", [](const userRecord& user, void* context) {
+            static_cast<std::vector<userRecord>*>(context)->push_back(user);
+            return true;
+        }, &exported, &errString);
+        int seen = 0;
+        int first = exportUsers(db, "admin", [](const userRecord&, void* context) {
+            ++*static_cast<int*>(context);
+            return false;
+        }, &seen, &errString);
+        bool success = (all == 4 && exported.size() == 4 && exported[0].userID == "admin" &&
+            exported[3].userID == "u3" && exported[3].privilege == 30 && first == 1 && seen == 1 &&
+            errString.find("_exportUsers-OK") != std::string::npos);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 23: Проверка, запись и лог каждой операции фиксируются одной транзакцией
+    tgSQLTests.addTest("addUser/modUser/deleteUser - One commit per operation", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        sqlite3_exec(db, CREATE_USERS_TABLE, nullptr, nullptr, nullptr);
+        insertUser(db, "admin", 200);
+        insertUser(db, "weak", 10);
+        int commits = 0;
+        sqlite3_commit_hook(db, [](void* counter) {
+            ++*static_cast<int*>(counter);
+            return 0;
+        }, &commits);
+        int added = addUser(db, "user1", "admin", 50, &errString);
+        int modified = modUser(db, "user1", "admin", 60, &errString);
+        int refused = modUser(db, "admin", "weak", 10, &errString);
+        int deleted = deleteUser(db, "user1", "admin", &errString);
+        bool success = (added == 0 && modified == 0 && refused == -6 && deleted == 0 && commits == 4 &&
+            getLogCount(db) == 4 && getUserCount(db, "user1") == 0 && errString.find("_beginTransaction-OK") != std::string::npos);
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 24: Занятая другим соединением база - операция не выполняется и ничего не меняет
+    tgSQLTests.addTest("modUser - Busy database after retries", []() {
+        const char* files[] = {"tgTransactionTest.db", "tgTransactionTest.db-wal", "tgTransactionTest.db-shm"};
+        for (const char* name : files) std::remove(name);
+        sqlite3 *holder = nullptr, *db = nullptr;
+        connectionOptions options;
+        options.busyTimeoutMs = 0;
+        options.busyRetries = 1;
+        options.busyRetryBackoffMs = 1;
+        initBaseSQL(&holder, "tgTransactionTest.db", nullptr);
+        initTgSQL(holder, nullptr);
+        insertUser(holder, "admin", 200);
+        insertUser(holder, "user1", 100);
+        initBaseSQL(&db, "tgTransactionTest.db", options, nullptr);
+        sqlite3_exec(holder, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr);
+        sqlResult busy;
+        int locked = modUser(db, "user1", "admin", 150, &busy);
+        sqlite3_exec(holder, "COMMIT", nullptr, nullptr, nullptr);
+        int unchanged = getUserPrivilegeDirect(db, "user1");
+        int result = modUser(db, "user1", "admin", 150, nullptr);
+        bool success = (locked == -10 && busy.sqliteRc == SQLITE_BUSY && std::string(busy.callee) == "beginTransaction" &&
+            unchanged == 100 && result == 0 && getUserPrivilegeDirect(holder, "user1") == 150);
+        closeBaseSQL(db, nullptr);
+        closeBaseSQL(holder, nullptr);
+        for (const char* name : files) std::remove(name);
+        return success;
+    });
+
+    // Тест 25: Метрики modUser - вызовы, вложенный lookupUsers и время по фазам
+    tgSQLTests.addTest("getSqlMetrics - Calls and phases of modUser", []() {
+        sqlite3* db = nullptr;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        sqlite3_exec(db, CREATE_USERS_TABLE, nullptr, nullptr, nullptr);
+        insertUser(db, "admin", 200);
+        resetSqlMetrics();
+        int added = addUser(db, "user1", "admin", 50, nullptr);
+        int modified = modUser(db, "user1", "admin", 60, nullptr);
+        sqlMetricsSnapshot snapshot;
+        int rc = getSqlMetrics(&snapshot);
+        closeBaseSQL(db, nullptr);
+#if defined SQL_METRICS
+        const sqlFunctionMetrics* modUserMetrics = nullptr;
+        const sqlFunctionMetrics* lookupMetrics = nullptr;
+        for (const sqlFunctionMetrics& function : snapshot.functions)
+        {
+            if (function.name == "modUser") modUserMetrics = &function;
+            if (function.name == "lookupUsers") lookupMetrics = &function;
+        }
+        if (rc != 0 || added != 0 || modified != 0 || modUserMetrics == nullptr || lookupMetrics == nullptr) return false;
+        const sqlPhaseMetrics* phases = modUserMetrics->phases;
+        unsigned long long inPhases = 0;
+        for (int phase = SQL_PHASE_PREPARE; phase < SQL_PHASE_COUNT; phase++)
+        {
+            if (phases[phase].count == 0) return false;
+            inPhases += phases[phase].totalNs;
+        }
+        unsigned long long bucketed = 0;
+        for (unsigned long long count : phases[SQL_PHASE_TOTAL].buckets) bucketed += count;
+        return phases[SQL_PHASE_TOTAL].count == 1 && bucketed == 1 && inPhases <= phases[SQL_PHASE_TOTAL].totalNs &&
+            lookupMetrics->phases[SQL_PHASE_TOTAL].count == 2 && snapshot.threads >= 1;
+#else
+        return rc == -1 && added == 0 && modified == 0 && snapshot.functions.empty();
+#endif
+    });
+
+    // Тест 26: Счётчики завершившегося потока остаются в снимке, дамп в формате Prometheus
+    tgSQLTests.addTest("dumpSqlMetrics - Finished threads and Prometheus text", []() {
+        const char* dumpFile = "sqlMetrics.prom";
+        std::remove(dumpFile);
+        sqlite3* db = nullptr;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        sqlite3_exec(db, CREATE_USERS_TABLE, nullptr, nullptr, nullptr);
+        insertUser(db, "user1", 10);
+        resetSqlMetrics();
+        std::thread worker([db]() {
+            for (int i = 0; i < 3; i++) getUserPrivilege(db, "user1", nullptr);
+        });
+        worker.join();
+        sqlResult result;
+        int rc = dumpSqlMetrics(dumpFile, &result);
+        std::ifstream file(dumpFile);
+        std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        file.close();
+        bool temporaryLeft = std::ifstream(std::string(dumpFile) + ".tmp").good();
+        closeBaseSQL(db, nullptr);
+        std::remove(dumpFile);
+#if defined SQL_METRICS
+        return rc == 0 && result.ok() && !temporaryLeft &&
+            text.find("# TYPE sql_function_seconds histogram") != std::string::npos &&
+            text.find("sql_function_seconds_count{function=\"getUserPrivilege\",phase=\"total\"} 3\n") != std::string::npos &&
+            text.find("sql_function_seconds_bucket{function=\"getUserPrivilege\",phase=\"total\",le=\"+Inf\"} 3\n") != std::string::npos &&
+            text.find("phase=\"log\"") != std::string::npos;
+#else
+        return rc == -1 && result.code == RESULT_UNAVAILABLE && text.empty() && !temporaryLeft;
+#endif
+    });
+
+    // Тест 27: Пороги действий из таблицы permissions, своё действие и набор прав одним вызовом
+    tgSQLTests.addTest("setActionThreshold - Thresholds from the permissions table", []() {
+        sqlite3* db = nullptr;
+        std::string errString;
+        sqlite3_open(":memory:", &db);
+        sqlite3_exec(db, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        int broadcast = registerAction("broadcast", 50);
+        int initialized = initTgSQL(db, &errString);
+        insertUser(db, "admin", 120);
+        insertUser(db, "user1", 60);
+        int rows = 0;
+        sqlite3_exec(db, "SELECT COUNT(*) FROM permissions", [](void* count, int, char** values, char**) {
+            *static_cast<int*>(count) = std::atoi(values[0]);
+            return 0;
+        }, &rows, nullptr);
+        int raised = setActionThreshold(db, ACTION_MOD_USER, 150, &errString);
+        if (fixedThreshold<ACTION_MOD_USER>::value >= 0)
+        {
+            closeBaseSQL(db, nullptr);
+            return raised == -1; // порог задан при сборке и таблицей не меняется
+        }
+        int refused = modUser(db, "user1", "admin", 70, &errString);
+        int added = addUser(db, "user2", "admin", 70, &errString);
+        permissionSet admin = 0, user = 0;
+        int adminRc = getUserPermissions(db, "admin", &admin, &errString);
+        int userRc = getUserPermissions(db, "user1", &user, &errString);
+        permissionSet missing = 1;
+        int missingRc = getUserPermissions(db, "nobody", &missing, nullptr);
+        bool success = (broadcast >= ACTION_BUILTIN_COUNT && registerAction("broadcast", 10) == broadcast &&
+            findAction("broadcast") == broadcast && initialized == 0 && rows >= ACTION_BUILTIN_COUNT + 1 && raised == 0 &&
+            actionThreshold(db, ACTION_MOD_USER) == 150 && refused == -6 && added == 0 && adminRc == 0 && userRc == 0 &&
+            hasPermissions(admin, permissionMask({ACTION_ADD_USER, ACTION_DELETE_USER, broadcast})) &&
+            !hasPermissions(admin, permissionMask({ACTION_MOD_USER})) &&
+            user == permissionMask({broadcast}) && missingRc == -1 && missing == 0 &&
+            evaluatePermissions(db, 200) == admin + permissionMask({ACTION_MOD_USER}));
+        closeBaseSQL(db, &errString);
+        return success;
+    });
+
+    // Тест 28: Набор прав кэшируется по пользователю и пересчитывается после смены привилегии или порога
+    tgSQLTests.addTest("getUserPermissions - Cached per user until privilege or threshold changes", []() {
+        const char* files[] = {"permissionsTest.db", "permissionsTest.db-wal", "permissionsTest.db-shm"};
+        for (const char* name : files) std::remove(name);
+        sqlite3 *db = nullptr, *other = nullptr;
+        initBaseSQL(&db, "permissionsTest.db", nullptr);
+        initTgSQL(db, nullptr);
+        initBaseSQL(&other, "permissionsTest.db", nullptr);
+        initTgSQL(other, nullptr);
+        enablePrivilegeCache(db, 16, nullptr);
+        enablePrivilegeCache(other, 16, nullptr);
+        insertUser(db, "admin", 200);
+        insertUser(db, "user1", 100);
+        permissionSet first = 0, cached = 0, modified = 0, rethresholded = 0;
+        getUserPermissions(db, "user1", &first, nullptr);
+        unsigned long long hits = getPrivilegeCacheStats(db).hits;
+        sqlResult cachedResult;
+        getUserPermissions(db, "user1", &cached, &cachedResult);
+        bool wasCached = getPrivilegeCacheStats(db).hits == hits + 1 && std::string(cachedResult.detail ? cachedResult.detail : "") == "CACHED";
+        modUser(other, "user1", "admin", 40, nullptr);
+        getUserPermissions(db, "user1", &modified, nullptr);
+        permissionSet expected = evaluatePermissions(db, 40);
+        setActionThreshold(other, ACTION_EXPORT_USERS, 30, nullptr);
+        getUserPermissions(db, "user1", &rethresholded, nullptr);
+        bool success = (first == evaluatePermissions(db, 100) && hasPermissions(first, permissionMask({ACTION_ADD_USER, ACTION_EXPORT_USERS})) &&
+            cached == first && wasCached && modified == expected &&
+            !hasPermissions(modified, permissionMask({ACTION_ADD_USER})) && rethresholded == permissionMask({ACTION_EXPORT_USERS}) +
+            (modified & ~permissionMask({ACTION_EXPORT_USERS})) && actionThreshold(db, ACTION_EXPORT_USERS) == 30);
+        closeBaseSQL(other, nullptr);
+        closeBaseSQL(db, nullptr);
+        for (const char* name : files) std::remove(name);
+        return success;
+    });
+
+    // Тест 29: Общий кэш привилегий получает только закоммиченное значение, откат его не портит
+    tgSQLTests.addTest("modUser - Shared privilege cache sees only committed privileges", []() {
+        const char* files[] = {"privilegeCommit.db", "privilegeCommit.db-wal", "privilegeCommit.db-shm"};
+        for (const char* name : files) std::remove(name);
+        sqlite3 *db = nullptr, *other = nullptr;
+        initBaseSQL(&db, "privilegeCommit.db", nullptr);
+        initTgSQL(db, nullptr);
+        initBaseSQL(&other, "privilegeCommit.db", nullptr);
+        enablePrivilegeCache(db, 16, nullptr);
+        enablePrivilegeCache(other, 16, nullptr);
+        insertUser(db, "admin", 200);
+        insertUser(db, "user1", 100);
+        int primed = getUserPrivilege(db, "user1", nullptr);
+        sqlite3_exec(db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr);
+        int modified = modUser(db, "user1", "admin", 40, nullptr);
+        int seenByOther = getUserPrivilege(other, "user1", nullptr);
+        sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+        int afterRollback = getUserPrivilege(db, "user1", nullptr);
+        int committed = modUser(db, "user1", "admin", 50, nullptr);
+        sqlResult cachedResult;
+        int cachedPrivilege = getUserPrivilege(other, "user1", &cachedResult);
+        bool success = (primed == 100 && modified == 0 && seenByOther == 100 && afterRollback == 100 && committed == 0 &&
+            cachedPrivilege == 50 && std::string(cachedResult.detail ? cachedResult.detail : "") == "CACHED");
+        closeBaseSQL(other, nullptr);
+        closeBaseSQL(db, nullptr);
+        for (const char* name : files) std::remove(name);
+        return success;
+    });
+
+    // Тест 30: Вызов на читателе из пула оставляет запись аудита в Log
+    tgSQLTests.addTest("connectionPool - Audit rows of pooled readers land in Log", []() {
+        const char* files[] = {"readerAudit.db", "readerAudit.db-wal", "readerAudit.db-shm"};
+        for (const char* name : files) std::remove(name);
+        std::shared_ptr<connectionPool> pool;
+        connectionPoolOptions options;
+        options.readers = 2;
+        int opened = openConnectionPool("readerAudit.db", options, &pool, nullptr);
+        bool success = false;
+        if (opened == 0) {
+            pooledConnection writer, reader;
+            checkoutConnection(pool, CONNECTION_WRITE, &writer, nullptr);
+            initTgSQL(writer, nullptr);
+            insertUser(writer, "user1", 5);
+            checkoutConnection(pool, CONNECTION_READ, &reader, nullptr);
+            int before = getLogCount(reader);
+            std::string trace;
+            int privilege = getUserPrivilege(reader, "user1", &trace);
+            int flushed = flushLogWriter(reader);
+            std::string audited = pragmaValue(reader, "SELECT COUNT(*) FROM Log WHERE eventName = 'getUserPrivilege' AND object = 'user1'");
+            success = (privilege == 5 && flushed == 0 && getLogCount(reader) == before + 1 && audited == "1" &&
+                trace.find("readonly") == std::string::npos && trace.find("_Log-OK(QUEUED)") != std::string::npos &&
+                sqlite3_exec(reader, "DELETE FROM Log", nullptr, nullptr, nullptr) == SQLITE_READONLY);
+            reader.release();
+            writer.release();
+            closeConnectionPool(pool, nullptr);
+        }
+        pool.reset();
+        for (const char* name : files) std::remove(name);
+        return success;
+    });
+
+    // Тест 31: Пороги берутся из своего соединения при чередовании, после перезагрузки и после закрытия
+    tgSQLTests.addTest("actionThreshold - Per-connection thresholds without a connection data lookup", []() {
+        int relay = registerAction("relay", 50);
+        sqlite3 *first = nullptr, *second = nullptr, *fresh = nullptr;
+        sqlite3_open(":memory:", &first);
+        sqlite3_open(":memory:", &second);
+        sqlite3_exec(first, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        sqlite3_exec(second, CREATE_LOG_TABLE, nullptr, nullptr, nullptr);
+        initTgSQL(first, nullptr);
+        initTgSQL(second, nullptr);
+        setActionThreshold(first, relay, 30, nullptr);
+        setActionThreshold(second, relay, 70, nullptr);
+        bool alternating = true;
+        for (int i = 0; i < 3; i++)
+            alternating = alternating && actionThreshold(first, relay) == 30 && actionThreshold(second, relay) == 70;
+        setActionThreshold(first, relay, 40, nullptr);
+        int reloaded = actionThreshold(first, relay);
+        closeBaseSQL(first, nullptr);
+        sqlite3_open(":memory:", &fresh); // может получить адрес закрытого соединения
+        int unloaded = actionThreshold(fresh, relay);
+        bool success = (alternating && reloaded == 40 && unloaded == 50 && actionThreshold(second, relay) == 70);
+        sqlite3_close(fresh);
+        closeBaseSQL(second, nullptr);
+        return success;
+    });
+
+    // Тест 32: Чтение, обогнанное modUser с другого соединения, не возвращает старую привилегию в кэш
+    tgSQLTests.addTest("getUserPrivilege - A read racing modUser does not cache the old privilege", []() {
+        const char* files[] = {"privilegeRace.db", "privilegeRace.db-wal", "privilegeRace.db-shm"};
+        for (const char* name : files) std::remove(name);
+        sqlite3 *db = nullptr, *other = nullptr;
+        initBaseSQL(&db, "privilegeRace.db", nullptr);
+        initTgSQL(db, nullptr);
+        initBaseSQL(&other, "privilegeRace.db", nullptr);
+        enablePrivilegeCache(db, 16, nullptr);
+        enablePrivilegeCache(other, 16, nullptr);
+        insertUser(db, "admin", 200);
+        insertUser(db, "user1", 100);
+        // Чтение на db: поколение берётся до чтения строки, сохранение в кэш происходит после modUser на other
+        unsigned long long generation = privilegeCacheGeneration(db);
+        int stale = std::stoi(pragmaValue(db, "SELECT privilege FROM users WHERE userID = 'user1'"));
+        int modified = modUser(other, "user1", "admin", 40, nullptr);
+        storeReadPrivilege(db, "user1", stale, generation);
+        sqlResult result;
+        int afterRace = getUserPrivilege(db, "user1", &result);
+        int cached = getUserPrivilege(other, "user1", nullptr);
+        // Без гонки прочитанное значение попадает в кэш
+        invalidatePrivilege(db, "user1");
+        int reread = getUserPrivilege(db, "user1", nullptr);
+        sqlResult rereadResult;
+        getUserPrivilege(other, "user1", &rereadResult);
+        bool success = (stale == 100 && modified == 0 && afterRace == 40 && cached == 40 && reread == 40 &&
+            std::string(rereadResult.detail ? rereadResult.detail : "") == "CACHED");
+        closeBaseSQL(other, nullptr);
+        closeBaseSQL(db, nullptr);
+        for (const char* name : files) std::remove(name);
+        return success;
+    });
+
+    // Тест 33: Набор разрешений, вычисленный до modUser с другого соединения, не попадает в кэш
+    tgSQLTests.addTest("getUserPermissions - A read racing modUser does not cache the old privilege", []() {
+        const char* files[] = {"permissionsRace.db", "permissionsRace.db-wal", "permissionsRace.db-shm"};
+        for (const char* name : files) std::remove(name);
+        sqlite3 *db = nullptr, *other = nullptr;
+        initBaseSQL(&db, "permissionsRace.db", nullptr);
+        initTgSQL(db, nullptr);
+        initBaseSQL(&other, "permissionsRace.db", nullptr);
+        enablePrivilegeCache(db, 16, nullptr);
+        enablePrivilegeCache(other, 16, nullptr);
+        insertUser(db, "admin", 200);
+        insertUser(db, "user1", 100);
+        unsigned long long generation = privilegeCacheGeneration(db);
+        permissionSet stale = evaluatePermissions(db, 100);
+        int modified = modUser(other, "user1", "admin", 40, nullptr);
+        storePermissions(db, "user1", 100, 0, stale, generation);
+        permissionSet afterRace = 0;
+        getUserPermissions(db, "user1", &afterRace, nullptr);
+        int privilege = getUserPrivilege(other, "user1", nullptr);
+        bool success = (modified == 0 && afterRace == evaluatePermissions(db, 40) && afterRace != stale && privilege == 40);
+        closeBaseSQL(other, nullptr);
+        closeBaseSQL(db, nullptr);
+        for (const char* name : files) std::remove(name);
         return success;
     });
 }
@@ -672,6 +2706,196 @@ void setupEventsTests(TestGroup& eventsTests) {
 		bool success = (data1 == 42 && data2 == 99);
 		return success;
 	});
+
+	// Тест 11: Интернирование типов событий даёт стабильные id
+	eventsTests.addTest("internEventType - Stable ids for event type names", []() {
+		eventTypeId first = internEventType("internTestEvent");
+		eventTypeId second = internEventType("internTestEvent");
+		eventTypeId other = internEventType("internOtherEvent");
+		event e("internTestEvent", nullptr);
+		bool success = (first == second && first != other && e.typeId == first &&
+			eventTypeName(first) == "internTestEvent" && findEventType("neverInternedEvent") == NO_EVENT_TYPE);
+		return success;
+	});
+
+	// Тест 12: Dispatch по id типа без построения строки
+	eventsTests.addTest("eventDispatcher - Dispatch by event type id", []() {
+		eventDispatcher dispatcher;
+		dispatcher.registerHandler("idEvent", testHandler);
+		int data = 0;
+		dispatcher.dispatchEvent(internEventType("idEvent"), &data);
+		bool success = (data == 42 && dispatcher.findHandler(internEventType("idEvent")) == 0);
+		return success;
+	});
+
+	// Тест 13: Все подписчики вызываются в порядке приоритета
+	eventsTests.addTest("eventDispatcher - Fan-out to all handlers in priority order", []() {
+		static std::string order;
+		order.clear();
+		eventDispatcher dispatcher;
+		dispatcher.registerHandler("fanOut", [](void*) { order += "low,"; }, -10);
+		dispatcher.registerHandler("fanOut", [](void*) { order += "high,"; }, 10);
+		dispatcher.registerHandler("fanOut", [](void*) { order += "mid1,"; });
+		dispatcher.registerHandler("fanOut", [](void*) { order += "mid2,"; });
+		size_t called = dispatcher.dispatchEvent(event("fanOut", nullptr));
+		bool success = (called == 4 && order == "high,mid1,mid2,low," && dispatcher.findHandler("fanOut") == 1);
+		return success;
+	});
+
+	// Тест 14: Обработчик может остановить распространение события
+	eventsTests.addTest("eventDispatcher - Handler stops propagation", []() {
+		eventDispatcher dispatcher;
+		dispatcher.registerHandler("stopEvent", [](void* data) { *static_cast<int*>(data) += 1; }, 5);
+		dispatcher.registerHandler("stopEvent", [](void* data) -> bool { *static_cast<int*>(data) += 10; return *static_cast<int*>(data) > 5; }, 1);
+		dispatcher.registerHandler("stopEvent", [](void* data) { *static_cast<int*>(data) += 100; }, 0);
+		int stopped = 0;
+		size_t calledStopped = dispatcher.dispatchEvent(event("stopEvent", &stopped));
+		int passed = -10;
+		size_t calledPassed = dispatcher.dispatchEvent(event("stopEvent", &passed));
+		bool success = (stopped == 11 && calledStopped == 2 && passed == 101 && calledPassed == 3);
+		return success;
+	});
+
+	// Тест 15: Асинхронная публикация из нескольких потоков в пул воркеров
+	eventsTests.addTest("eventDispatcher - post() from many threads to worker pool", []() {
+		eventDispatcher dispatcher;
+		dispatcher.registerHandler("asyncEvent", [](void* data) { static_cast<std::atomic<int>*>(data)->fetch_add(1); });
+		dispatcher.registerHandler("asyncEvent", [](void* data) { static_cast<std::atomic<int>*>(data)->fetch_add(1000); }, -1);
+		std::atomic<int> counter(0);
+		bool started = dispatcher.startWorkers(4, 256);
+		eventTypeId type = internEventType("asyncEvent");
+		std::vector<std::thread> producers;
+		for (int p = 0; p < 4; p++) {
+			producers.emplace_back([&]() {
+				for (int i = 0; i < 5000; i++) {
+					while (!dispatcher.post(type, &counter)) {
+						std::this_thread::yield(); // очередь заполнена
+					}
+				}
+			});
+		}
+		for (std::thread& producer : producers) {
+			producer.join();
+		}
+		dispatcher.drain();
+		bool success = (started && counter.load() == 20000 * 1001);
+		dispatcher.shutdown();
+		return success;
+	});
+
+	// Тест 16: Регистрация обработчиков во время диспетчеризации в другом потоке
+	eventsTests.addTest("eventDispatcher - Register handlers while dispatching", []() {
+		eventDispatcher dispatcher;
+		dispatcher.registerHandler("raceEvent", [](void* data) { static_cast<std::atomic<int>*>(data)->fetch_add(1); });
+		std::atomic<int> counter(0);
+		std::atomic<bool> done(false);
+		std::thread dispatching([&]() {
+			while (!done.load()) {
+				dispatcher.dispatchEvent(internEventType("raceEvent"), &counter);
+			}
+		});
+		for (int i = 0; i < 200; i++) {
+			dispatcher.registerHandler("raceEvent" + std::to_string(i), [](void*) {});
+			dispatcher.registerHandler("raceEvent", [](void*) {}, i % 7);
+		}
+		done.store(true);
+		dispatching.join();
+		bool success = (counter.load() > 0 && dispatcher.handlerCount(internEventType("raceEvent")) == 201 && dispatcher.handlers.size() == 401);
+		return success;
+	});
+
+	// Тест 17: post() без воркеров и после shutdown отклоняется
+	eventsTests.addTest("eventDispatcher - post() requires running workers", []() {
+		eventDispatcher dispatcher;
+		dispatcher.registerHandler("testEvent", testHandler);
+		int data = 0;
+		bool beforeStart = dispatcher.post(event("testEvent", &data));
+		dispatcher.startWorkers(2);
+		bool running = dispatcher.post(event("testEvent", &data));
+		dispatcher.shutdown();
+		bool afterShutdown = dispatcher.post(event("testEvent", &data));
+		bool success = (!beforeStart && running && !afterShutdown && data == 42);
+		return success;
+	});
+
+	// Тест 18: Типизированные события и обработчики с захватом состояния
+	eventsTests.addTest("eventDispatcher - subscribe/publish typed payloads", []() {
+		struct moved { int from; int to; };
+		eventDispatcher dispatcher;
+		int calls = 0;
+		int sum = 0;
+		dispatcher.subscribe<moved>([&calls, &sum](const moved& m) { calls++; sum += m.to - m.from; });
+		dispatcher.subscribe<moved>([&calls](const moved& m) { calls++; return m.to < 0; }, 10); // останавливает при to < 0
+		dispatcher.subscribe<int>([&sum](const int& value) { sum += value * 1000; });
+		size_t first = dispatcher.publish(moved{1, 5});
+		size_t stopped = dispatcher.publish(moved{1, -5});
+		dispatcher.publish(2);
+		eventCallback small([&calls, &sum](void*) {});
+		bool success = (first == 2 && stopped == 1 && calls == 3 && sum == 2004 && small.storedInline() &&
+			payloadEventType<moved>() != payloadEventType<int>() && dispatcher.handlerCount(payloadEventType<moved>()) == 2);
+		return success;
+	});
+
+	// Тест 19: Малые данные хранятся внутри eventPayload, большие - в куче
+	eventsTests.addTest("eventPayload - Inline storage, boxing and ownership", []() {
+		struct big { char bytes[256]; };
+		std::shared_ptr<int> owner = std::make_shared<int>(7);
+		eventPayload small = eventPayload::of(owner);
+		eventPayload large = eventPayload::of(big{});
+		eventPayload moved(std::move(small));
+		bool stored = (moved.storedInline() && !large.storedInline() && small.get<std::shared_ptr<int>>() == nullptr &&
+			moved.get<int>() == nullptr && **moved.get<std::shared_ptr<int>>() == 7 && owner.use_count() == 2);
+		moved.reset();
+		int value = 3;
+		eventPayload raw(&value);
+		bool success = (stored && owner.use_count() == 1 && raw.data() == &value && raw.get<int>() == nullptr);
+		return success;
+	});
+
+	// Тест 20: publishAsync передает владение данными очереди и освобождает их после обработки
+	eventsTests.addTest("eventDispatcher - publishAsync owns payloads", []() {
+		struct message { std::string text; std::shared_ptr<int> owner; };
+		eventDispatcher dispatcher;
+		std::atomic<size_t> length(0);
+		dispatcher.subscribe<message>([&length](const message& m) { length.fetch_add(m.text.size()); });
+		std::shared_ptr<int> owner = std::make_shared<int>(0);
+		dispatcher.startWorkers(2, 64);
+		bool posted = true;
+		for (int i = 0; i < 50; i++) {
+			posted = dispatcher.publishAsync(message{"hello", owner}) && posted;
+		}
+		dispatcher.drain();
+		bool success = (posted && length.load() == 250 && owner.use_count() == 1);
+		dispatcher.shutdown();
+		return success;
+	});
+
+	// Тест 21: Каждое принятое post() во время shutdown обрабатывается до его возврата
+	eventsTests.addTest("eventDispatcher - shutdown dispatches posts racing with it", []() {
+		bool success = true;
+		for (int round = 0; round < 20 && success; round++) {
+			eventDispatcher dispatcher;
+			std::atomic<size_t> handled(0), accepted(0);
+			dispatcher.subscribe<int>([&handled](const int&) { handled.fetch_add(1); });
+			dispatcher.startWorkers(2, 16);
+			std::vector<std::thread> posters;
+			for (int t = 0; t < 4; t++) {
+				posters.emplace_back([&dispatcher, &accepted]() {
+					for (int i = 0; i < 2000; i++) {
+						if (dispatcher.publishAsync(i))
+							accepted.fetch_add(1);
+					}
+				});
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+			dispatcher.shutdown();
+			size_t afterShutdown = handled.load();
+			for (std::thread& poster : posters)
+				poster.join();
+			success = afterShutdown == accepted.load() && handled.load() == accepted.load();
+		}
+		return success;
+	});
 }
 
 // Пример использования